@@ -0,0 +1,210 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "render/window.h"
+#include "render/viewport.h"
+#include "render/cubemap.h"
+#include "render/util/stagingpool.h"
+#include "resources/resourcemanager.h"
+#include "node/node.h"
+#include "node/nodeloader.h"
+#include "structure/gltf.h"
+#include "util/mesh.h"
+#include "animation/skeletalrig.h"
+#include "audio/sound.h"
+#include "scripting/script.h"
+#include "util/debug/trace_exception.h"
+#include "util/debug/logger.h"
+
+/**
+ * Headless frame-time benchmark.
+ *
+ * Renders a fixed scene with a fixed camera into offscreen images and reports
+ * the CPU time spent in each stage of Viewport::drawFrame as well as the
+ * recording of the secondary buffers.
+ *
+ * Usage: framebench [frames] [width] [height]
+ **/
+
+#define BENCH_WARMUP_FRAMES 32
+
+static void createResourceLoaders(ResourceManager * resourceManager) {
+
+  resourceManager->addRegistry("Shader", (ResourceRegistry<Resource> *) new ResourceRegistry<Shader>());
+  resourceManager->addRegistry("Texture", (ResourceRegistry<Resource> *) new ResourceRegistry<Texture>());
+  resourceManager->addRegistry("CubeMap", (ResourceRegistry<Resource> *) new ResourceRegistry<CubeMap>());
+  resourceManager->addRegistry("Material", (ResourceRegistry<Resource> *) new ResourceRegistry<Material>());
+  resourceManager->addRegistry("Mesh", (ResourceRegistry<Resource> *) new ResourceRegistry<Mesh>());
+  resourceManager->addRegistry("Node", (ResourceRegistry<Resource> *) new ResourceRegistry<strc::Node>());
+  resourceManager->addRegistry("Sound", (ResourceRegistry<Resource> *) new ResourceRegistry<audio::Sound>());
+  resourceManager->addRegistry("Skin", (ResourceRegistry<Resource> *) new ResourceRegistry<Skin>());
+  resourceManager->addRegistry("Script", (ResourceRegistry<Resource> *) new ResourceRegistry<Script>());
+
+  resourceManager->addLoader("Shader", (ResourceLoader<Resource> *) new ShaderLoader());
+  resourceManager->addLoader("Texture", (ResourceLoader<Resource> *) new TextureLoader());
+  resourceManager->addLoader("CubeMap", (ResourceLoader<Resource> *) new CubeMapLoader());
+  resourceManager->addLoader("Material", (ResourceLoader<Resource> *) new MaterialLoader());
+  resourceManager->addLoader("Texture", (ResourceLoader<Resource> *) new PNGLoader());
+  resourceManager->addLoader("Mesh", (ResourceLoader<Resource> *) new MeshLoader());
+  resourceManager->addLoader("Sound", (ResourceLoader<Resource> *) new audio::SoundLoader());
+
+  strc::Node::registerLoaders();
+  resourceManager->addLoader("Node", (ResourceLoader<Resource> *) new NodeLoader());
+
+  std::shared_ptr<ArchiveLoader> gltfLoader(new GLTFNodeLoader());
+
+  resourceManager->attachArchiveType("glb", gltfLoader);
+
+}
+
+/// Nearest-rank percentile, p in [0, 1]
+static double percentile(std::vector<double> values, double p) {
+
+  if (values.empty())
+    return 0.0;
+
+  std::sort(values.begin(), values.end());
+  size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+
+  return values[index];
+
+}
+
+static void printStage(const char * name, std::vector<double> values) {
+
+  double sum = 0.0;
+  for (double v : values)
+    sum += v;
+
+  double mean = values.empty() ? 0.0 : sum / values.size();
+
+  printf("%-10s mean %9.4f ms   p50 %9.4f ms   p99 %9.4f ms\n", name, mean, percentile(values, 0.5), percentile(values, 0.99));
+
+}
+
+int main(int argc, char ** argv) {
+
+  unsigned int frameCount = 1000;
+  unsigned int width = 1280;
+  unsigned int height = 720;
+
+  if (argc >= 2)
+    frameCount = atoi(argv[1]);
+
+  if (argc >= 4) {
+    width = atoi(argv[2]);
+    height = atoi(argv[3]);
+  }
+
+  std::shared_ptr<Window> window(new Window(width, height, true));
+  ResourceManager * resourceManager = new ResourceManager(window->getState());
+  createResourceLoaders(resourceManager);
+  resourceManager->startLoadingThreads(1);
+
+  LoadingResource ppShader = resourceManager->loadResourceBg(ResourceLocation("Shader", "resources/shaders/pp.shader"));
+  LoadingResource testPPShader = resourceManager->loadResourceBg(ResourceLocation("Shader", "resources/shaders/test_pp.shader"));
+  LoadingResource skyBoxRes = resourceManager->loadResourceBg(ResourceLocation("CubeMap", "resources/textures/test_cubemap/cubemap.conf"));
+
+  ppShader->wait();
+  testPPShader->wait();
+  skyBoxRes->wait();
+
+  std::shared_ptr<PPEffect> testEffect = std::make_shared<PPEffect>(std::dynamic_pointer_cast<Shader>(testPPShader->location));
+  std::shared_ptr<Camera> cam = std::make_shared<Camera>(70.0, 0.001, 1000.0, (float) width / (float) height, glm::vec3(0,-10,0));
+  std::shared_ptr<Texture> skyBox = std::dynamic_pointer_cast<CubeMap>(skyBoxRes->location);
+
+  Viewport * view = new Viewport(window, cam, std::dynamic_pointer_cast<Shader>(ppShader->location), {testEffect}, skyBox);
+  window->setActiveViewport(view);
+
+  LoadingResource sceneRes = resourceManager->loadResourceBg(ResourceLocation("Node", "resources/nodes/test.node"));
+  sceneRes->wait();
+
+  std::shared_ptr<strc::Node> scene = resourceManager->get<strc::Node>(ResourceLocation("Node", "resources/nodes/test.node"));
+  scene->viewportAdd(view, scene);
+
+  view->addLight(glm::vec4(1.0, 1.2, -1.5, 2.0), glm::vec4(20.0, 20.0, 20.0, 0.0));
+
+  view->createSecondaryBuffers();
+
+  std::vector<double> secondaryTimes;
+  std::vector<double> frameTimes;
+
+  secondaryTimes.reserve(frameCount);
+  frameTimes.reserve(frameCount);
+
+  for (unsigned int i = 0; i < frameCount + BENCH_WARMUP_FRAMES; ++i) {
+
+    bool measure = i >= BENCH_WARMUP_FRAMES;
+    if (i == BENCH_WARMUP_FRAMES)
+      view->setCollectTimings(true);
+
+    auto frameStart = std::chrono::high_resolution_clock::now();
+
+    view->manageMemoryTransfer();
+    view->renderIntoSecondary();
+
+    auto secondaryEnd = std::chrono::high_resolution_clock::now();
+
+    view->drawFrame();
+
+    auto frameEnd = std::chrono::high_resolution_clock::now();
+
+    if (measure) {
+      secondaryTimes.push_back(std::chrono::duration<double, std::chrono::milliseconds::period>(secondaryEnd - frameStart).count());
+      frameTimes.push_back(std::chrono::duration<double, std::chrono::milliseconds::period>(frameEnd - frameStart).count());
+    }
+
+  }
+
+  vkDeviceWaitIdle(window->getState().device);
+
+  const std::vector<Viewport::FrameTimings> & timings = view->getFrameTimings();
+
+  std::vector<double> prepare, fenceWait, acquire, record, uniform, submit, present, savedBinds, uploaded;
+  for (const Viewport::FrameTimings & t : timings) {
+    savedBinds.push_back(t.savedBinds);
+    uploaded.push_back(t.uploadedBytes);
+    prepare.push_back(t.prepare);
+    fenceWait.push_back(t.fenceWait);
+    acquire.push_back(t.acquire);
+    record.push_back(t.record);
+    uniform.push_back(t.uniform);
+    submit.push_back(t.submit);
+    present.push_back(t.present);
+  }
+
+  printf("Frames: %u (%ux%u, %u warmup frames)\n", frameCount, width, height, BENCH_WARMUP_FRAMES);
+  printStage("secondary", secondaryTimes);
+  printStage("prepare", prepare);
+  printStage("fence wait", fenceWait);
+  printStage("acquire", acquire);
+  printStage("record", record);
+  printStage("uniform", uniform);
+  printStage("submit", submit);
+  printStage("present", present);
+  printStage("frame", frameTimes);
+
+  double savedSum = 0.0;
+  for (double v : savedBinds)
+    savedSum += v;
+
+  printf("Pipelines: %zu (%u acquires shared an existing one)\n", view->getPipelineRegistry()->getPipelineCount(), view->getPipelineRegistry()->getSharedCount());
+  printf("Saved binds per frame: %.1f\n", savedBinds.empty() ? 0.0 : savedSum / savedBinds.size());
+
+  double uploadedSum = 0.0;
+  for (double v : uploaded)
+    uploadedSum += v;
+
+  vkutil::StagingPool::Statistics stagingStats = window->getState().stagingPool->getStatistics();
+  printf("Staging bytes per frame: %.1f\n", uploaded.empty() ? 0.0 : uploadedSum / uploaded.size());
+  printf("Staging pool: %llu bytes high water mark, %u buffers created, %u reused\n", (unsigned long long) stagingStats.highWaterMark, stagingStats.createdBuffers, stagingStats.reusedBuffers);
+
+  return 0;
+
+}
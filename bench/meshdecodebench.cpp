@@ -0,0 +1,235 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "structure/gltf.h"
+#include "util/mesh.h"
+#include "util/debug/trace_exception.h"
+
+/**
+ * Mesh decode throughput benchmark.
+ *
+ * Writes a grid mesh of gridSize x gridSize vertices with 32 bit indices
+ * into a glb file and measures decoding it with gltfLoadMeshFile, as well as
+ * narrowing the indices and interleaving the vertices for upload.
+ *
+ * Usage: meshdecodebench [gridSize] [runs] [file]
+ **/
+
+#define BENCH_GLB_CHUNK_JSON 0x4E4F534A
+#define BENCH_GLB_CHUNK_BIN 0x004E4942
+
+static void appendData(std::vector<uint8_t> & bin, const void * data, size_t length) {
+
+  const uint8_t * bytes = (const uint8_t *) data;
+  bin.insert(bin.end(), bytes, bytes + length);
+
+}
+
+static std::string accessorJSON(int view, size_t count, int componentType, const char * type) {
+
+  return std::string("{\"bufferView\":").append(std::to_string(view))
+    .append(",\"count\":").append(std::to_string(count))
+    .append(",\"componentType\":").append(std::to_string(componentType))
+    .append(",\"type\":\"").append(type).append("\"}");
+
+}
+
+static std::string viewJSON(size_t offset, size_t length) {
+
+  return std::string("{\"buffer\":0,\"byteOffset\":").append(std::to_string(offset))
+    .append(",\"byteLength\":").append(std::to_string(length)).append("}");
+
+}
+
+/// Writes a flat grid in the xz plane, two triangles per cell.
+static size_t writeGridGLB(std::string fname, uint32_t gridSize) {
+
+  size_t vertexCount = (size_t) gridSize * gridSize;
+  size_t indexCount = (size_t) (gridSize - 1) * (gridSize - 1) * 6;
+
+  std::vector<float> positions(vertexCount * 3);
+  std::vector<float> normals(vertexCount * 3);
+  std::vector<float> tangents(vertexCount * 4);
+  std::vector<float> uvs(vertexCount * 2);
+  std::vector<uint32_t> indices;
+  indices.reserve(indexCount);
+
+  for (uint32_t z = 0; z < gridSize; ++z) {
+    for (uint32_t x = 0; x < gridSize; ++x) {
+
+      size_t i = (size_t) z * gridSize + x;
+
+      positions[i*3] = x;
+      positions[i*3+1] = 0;
+      positions[i*3+2] = z;
+
+      normals[i*3] = 0;
+      normals[i*3+1] = 1;
+      normals[i*3+2] = 0;
+
+      tangents[i*4] = 1;
+      tangents[i*4+1] = 0;
+      tangents[i*4+2] = 0;
+      tangents[i*4+3] = 1;
+
+      uvs[i*2] = (float) x / gridSize;
+      uvs[i*2+1] = (float) z / gridSize;
+
+    }
+  }
+
+  for (uint32_t z = 0; z + 1 < gridSize; ++z) {
+    for (uint32_t x = 0; x + 1 < gridSize; ++x) {
+
+      uint32_t i0 = z * gridSize + x;
+      uint32_t i1 = i0 + 1;
+      uint32_t i2 = i0 + gridSize;
+      uint32_t i3 = i2 + 1;
+
+      indices.insert(indices.end(), {i0, i2, i1, i1, i2, i3});
+
+    }
+  }
+
+  std::vector<uint8_t> bin;
+  std::vector<size_t> offsets;
+
+  offsets.push_back(bin.size());
+  appendData(bin, positions.data(), positions.size() * sizeof(float));
+  offsets.push_back(bin.size());
+  appendData(bin, normals.data(), normals.size() * sizeof(float));
+  offsets.push_back(bin.size());
+  appendData(bin, tangents.data(), tangents.size() * sizeof(float));
+  offsets.push_back(bin.size());
+  appendData(bin, uvs.data(), uvs.size() * sizeof(float));
+  offsets.push_back(bin.size());
+  appendData(bin, indices.data(), indices.size() * sizeof(uint32_t));
+  offsets.push_back(bin.size());
+
+  while (bin.size() % 4)
+    bin.push_back(0);
+
+  std::string json = std::string("{\"asset\":{\"version\":\"2.0\",\"generator\":\"meshdecodebench\"},")
+    .append("\"scene\":0,\"scenes\":[{\"name\":\"grid\",\"nodes\":[0]}],")
+    .append("\"nodes\":[{\"name\":\"grid\",\"mesh\":0}],")
+    .append("\"meshes\":[{\"name\":\"grid\",\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TANGENT\":2,\"TEXCOORD_0\":3},\"indices\":4}]}],")
+    .append("\"accessors\":[")
+    .append(accessorJSON(0, vertexCount, 5126, "VEC3")).append(",")
+    .append(accessorJSON(1, vertexCount, 5126, "VEC3")).append(",")
+    .append(accessorJSON(2, vertexCount, 5126, "VEC4")).append(",")
+    .append(accessorJSON(3, vertexCount, 5126, "VEC2")).append(",")
+    .append(accessorJSON(4, indexCount, 5125, "SCALAR")).append("],")
+    .append("\"bufferViews\":[");
+
+  for (unsigned int i = 0; i + 1 < offsets.size(); ++i) {
+    if (i)
+      json.append(",");
+    json.append(viewJSON(offsets[i], offsets[i+1] - offsets[i]));
+  }
+
+  json.append("],\"buffers\":[{\"byteLength\":").append(std::to_string(bin.size())).append("}]}");
+
+  while (json.size() % 4)
+    json.push_back(' ');
+
+  uint32_t header[3] = {0x46546C67, 2, (uint32_t) (12 + 8 + json.size() + 8 + bin.size())};
+  uint32_t jsonChunk[2] = {(uint32_t) json.size(), BENCH_GLB_CHUNK_JSON};
+  uint32_t binChunk[2] = {(uint32_t) bin.size(), BENCH_GLB_CHUNK_BIN};
+
+  FILE * file = fopen(fname.c_str(), "wb");
+  if (!file)
+    throw dbg::trace_exception(std::string("Unable to write ").append(fname));
+
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(jsonChunk, sizeof(jsonChunk), 1, file);
+  fwrite(json.data(), 1, json.size(), file);
+  fwrite(binChunk, sizeof(binChunk), 1, file);
+  fwrite(bin.data(), 1, bin.size(), file);
+  fclose(file);
+
+  return header[2];
+
+}
+
+static double millisSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void printStage(const char * name, std::vector<double> values, double work, const char * unit) {
+
+  std::sort(values.begin(), values.end());
+  double median = values[values.size() / 2];
+
+  printf("%-12s median %10.3f ms   %10.2f M%s/s\n", name, median, work / (median * 1000.0), unit);
+
+}
+
+int main(int argc, char ** argv) {
+
+  uint32_t gridSize = 1500;
+  unsigned int runs = 5;
+  std::string fname = "/tmp/meshdecodebench.glb";
+
+  if (argc >= 2)
+    gridSize = atoi(argv[1]);
+
+  if (argc >= 3)
+    runs = atoi(argv[2]);
+
+  if (argc >= 4)
+    fname = argv[3];
+
+  if (gridSize < 2 || !runs) {
+    fprintf(stderr, "Usage: meshdecodebench [gridSize >= 2] [runs > 0] [file]\n");
+    return 1;
+  }
+
+  size_t fileSize = writeGridGLB(fname, gridSize);
+  size_t triangleCount = (size_t) (gridSize - 1) * (gridSize - 1) * 2;
+
+  std::vector<double> decodeTimes, indexTimes, interleaveTimes;
+  uint32_t indexSize = 0;
+  uint32_t indexCount = 0;
+
+  std::vector<InterleaveElement> elements(4);
+  elements[0] = {"POSITION", 0};
+  elements[1] = {"NORMAL", 12};
+  elements[2] = {"TANGENT", 24};
+  elements[3] = {"TEXCOORD_0", 40};
+  uint32_t stride = 48;
+
+  for (unsigned int i = 0; i < runs; ++i) {
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::shared_ptr<Mesh> mesh = gltfLoadMeshFile(fname, 0);
+    decodeTimes.push_back(millisSince(start));
+
+    start = std::chrono::high_resolution_clock::now();
+    std::vector<uint8_t> indexData = mesh->getCompactIndices(&indexSize, &indexCount);
+    indexTimes.push_back(millisSince(start));
+
+    start = std::chrono::high_resolution_clock::now();
+    std::vector<uint8_t> vertexData = mesh->getInterleavedData(elements, stride);
+    interleaveTimes.push_back(millisSince(start));
+
+  }
+
+  printf("Grid: %u x %u vertices, %zu triangles, %.1f MB glb, %u runs\n", gridSize, gridSize, triangleCount, fileSize / (1024.0 * 1024.0), runs);
+  printStage("decode", decodeTimes, triangleCount, "tri");
+  printStage("decode", decodeTimes, fileSize, "B");
+  printStage("indices", indexTimes, indexCount, "idx");
+  printStage("interleave", interleaveTimes, (double) gridSize * gridSize, "vtx");
+  printf("Index size: %u bytes for %u indices\n", indexSize, indexCount);
+
+  remove(fname.c_str());
+
+  return 0;
+
+}
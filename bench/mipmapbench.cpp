@@ -0,0 +1,100 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util/image/mipmap.h"
+
+/**
+ * Mip chain generation benchmark.
+ *
+ * Builds the mip chain of a size x size RGBA image with layers layers (6
+ * for a cube map) with every filter and color space, as done on the loading
+ * threads before a texture is uploaded.
+ *
+ * Usage: mipmapbench [size] [runs] [layers]
+ **/
+
+static double millisSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void printStage(const char * name, std::vector<double> values, double pixels) {
+
+  std::sort(values.begin(), values.end());
+  double median = values[values.size() / 2];
+
+  printf("%-14s median %10.3f ms   %10.2f MPixel/s\n", name, median, pixels / (median * 1000.0));
+
+}
+
+int main(int argc, char ** argv) {
+
+  uint32_t size = 2048;
+  unsigned int runs = 5;
+  uint32_t layers = 1;
+
+  if (argc >= 2)
+    size = atoi(argv[1]);
+
+  if (argc >= 3)
+    runs = atoi(argv[2]);
+
+  if (argc >= 4)
+    layers = atoi(argv[3]);
+
+  if (!size || !runs || !layers) {
+    fprintf(stderr, "Usage: mipmapbench [size > 0] [runs > 0] [layers > 0]\n");
+    return 1;
+  }
+
+  std::vector<uint8_t> image((size_t) size * size * 4 * layers);
+
+  srand(1);
+  for (size_t i = 0; i < image.size(); ++i)
+    image[i] = ((i / 4) % size + rand() % 16) & 0xff;
+
+  struct {
+    const char * name;
+    mip_filter filter;
+    mip_color_space colorSpace;
+  } stages[4] = {
+    {"box linear", MIP_FILTER_BOX, MIP_COLOR_SPACE_LINEAR},
+    {"box sRGB", MIP_FILTER_BOX, MIP_COLOR_SPACE_SRGB},
+    {"kaiser linear", MIP_FILTER_KAISER, MIP_COLOR_SPACE_LINEAR},
+    {"kaiser sRGB", MIP_FILTER_KAISER, MIP_COLOR_SPACE_SRGB},
+  };
+
+  double pixels = (double) size * size * layers;
+  size_t chainSize = 0;
+  uint32_t levelCount = 0;
+
+  printf("Image: %u x %u, %u layers, %u runs\n", size, size, layers, runs);
+
+  for (unsigned int s = 0; s < 4; ++s) {
+
+    std::vector<double> times;
+
+    for (unsigned int i = 0; i < runs; ++i) {
+
+      auto start = std::chrono::high_resolution_clock::now();
+      MipChain chain = mipGenerateChain(image.data(), size, size, layers, stages[s].filter, stages[s].colorSpace);
+      times.push_back(millisSince(start));
+
+      chainSize = chain.data.size();
+      levelCount = chain.levels.size();
+
+    }
+
+    printStage(stages[s].name, times, pixels);
+
+  }
+
+  printf("Chain: %u levels, %.1f MB\n", levelCount, chainSize / (1024.0 * 1024.0));
+
+  return 0;
+
+}
@@ -0,0 +1,306 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "util/image/png.h"
+
+/**
+ * PNG decode throughput benchmark.
+ *
+ * Encodes a size x size RGB or RGBA image, using all five scanline filters,
+ * and compares the previous decoder, which inflated the whole image at once,
+ * unfiltered it byte by byte and expanded it to RGBA in a second pass, with
+ * the row based decoder reading from memory and from a file.
+ *
+ * Usage: pngdecodebench [size] [runs] [channels] [file]
+ **/
+
+static void appendBE32(std::vector<uint8_t> & out, uint32_t value) {
+
+  out.push_back(value >> 24);
+  out.push_back(value >> 16);
+  out.push_back(value >> 8);
+  out.push_back(value);
+
+}
+
+static void appendChunk(std::vector<uint8_t> & out, const char * type, const uint8_t * data, size_t length) {
+
+  appendBE32(out, length);
+
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data, data + length);
+
+  appendBE32(out, crc32(0, out.data() + start, length + 4));
+
+}
+
+static uint8_t paethPredict(int a, int b, int c) {
+
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) return a;
+  else if (pb <= pc) return b;
+  return c;
+
+}
+
+/// Smooth gradients with some noise, so the filters have something to predict.
+static std::vector<uint8_t> encodeImage(uint32_t size, uint32_t channels) {
+
+  size_t rowBytes = (size_t) size * channels;
+  std::vector<uint8_t> filtered;
+  filtered.reserve((rowBytes + 1) * size);
+
+  std::vector<uint8_t> prior(rowBytes, 0);
+  std::vector<uint8_t> row(rowBytes);
+
+  srand(1);
+
+  for (uint32_t i = 0; i < size; ++i) {
+
+    for (uint32_t j = 0; j < size; ++j) {
+      for (uint32_t c = 0; c < channels; ++c)
+        row[j * channels + c] = (i * (c + 1) + j * (3 - c) + rand() % 8) & 0xff;
+    }
+
+    uint8_t filter = i % 5;
+    filtered.push_back(filter);
+
+    for (size_t k = 0; k < rowBytes; ++k) {
+
+      int a = k >= channels ? row[k - channels] : 0;
+      int b = prior[k];
+      int c = k >= channels ? prior[k - channels] : 0;
+
+      int prediction = 0;
+      switch (filter) {
+        case 1: prediction = a; break;
+        case 2: prediction = b; break;
+        case 3: prediction = (a + b) / 2; break;
+        case 4: prediction = paethPredict(a, b, c); break;
+      }
+
+      filtered.push_back(row[k] - prediction);
+
+    }
+
+    prior = row;
+
+  }
+
+  uLongf compressedSize = compressBound(filtered.size());
+  std::vector<uint8_t> compressed(compressedSize);
+  compress2(compressed.data(), &compressedSize, filtered.data(), filtered.size(), 6);
+
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
+  std::vector<uint8_t> png(signature, signature + 8);
+
+  std::vector<uint8_t> header;
+  appendBE32(header, size);
+  appendBE32(header, size);
+  header.insert(header.end(), {8, (uint8_t) (channels == 4 ? 6 : 2), 0, 0, 0});
+  appendChunk(png, "IHDR", header.data(), header.size());
+
+  /// Encoders usually split the image data into chunks of a few kilobytes.
+  for (size_t offset = 0; offset < compressedSize; offset += 8192)
+    appendChunk(png, "IDAT", compressed.data() + offset, std::min((size_t) 8192, compressedSize - offset));
+
+  appendChunk(png, "IEND", nullptr, 0);
+
+  return png;
+
+}
+
+/// The decoding steps of the previous pngLoadImageDataMemory and gltfLoadPackedImage.
+static std::vector<uint8_t> legacyDecode(const std::vector<uint8_t> & png, uint32_t width, uint32_t height, uint32_t chanelCount) {
+
+  std::vector<uint8_t> iData;
+  size_t offset = 33;
+
+  while (offset + 8 <= png.size()) {
+
+    uint32_t chunkSize = __builtin_bswap32(*((uint32_t *) (png.data() + offset)));
+
+    if (!memcmp(png.data() + offset + 4, "IDAT", 4)) {
+      iData.resize(iData.size() + chunkSize);
+      memcpy(iData.data() + iData.size() - chunkSize, png.data() + offset + 8, chunkSize);
+    }
+
+    offset += chunkSize + 12;
+
+  }
+
+  uint32_t outDataSize = chanelCount * (width + 1) * height;
+  std::vector<uint8_t> inflatedData(outDataSize);
+
+  z_stream infstream = {};
+  infstream.avail_in = iData.size();
+  infstream.next_in = iData.data();
+  infstream.avail_out = outDataSize;
+  infstream.next_out = inflatedData.data();
+
+  inflateInit(&infstream);
+  inflate(&infstream, Z_NO_FLUSH);
+  inflateEnd(&infstream);
+
+  auto inflateIndex = [&] (unsigned int i, unsigned int j, unsigned int c) {return (i * width + j) * chanelCount + c + i + 1;};
+  auto imageIndex = [&] (unsigned int i, unsigned int j, unsigned int c) {return (i * width + j) * chanelCount + c;};
+
+  std::vector<uint8_t> imageData(chanelCount * width * height);
+
+  for (unsigned int i = 0; i < height; ++i) {
+
+    uint8_t filterType = inflatedData[(i * width) * chanelCount + i];
+
+    for (unsigned int j = 0; j < width; ++j) {
+      for (unsigned int c = 0; c < chanelCount; ++c) {
+
+        uint8_t val = inflatedData[inflateIndex(i, j, c)];
+        uint8_t a = j >= 1 ? imageData[imageIndex(i, j - 1, c)] : 0;
+        uint8_t b = i >= 1 ? imageData[imageIndex(i - 1, j, c)] : 0;
+        uint8_t d = i >= 1 && j >= 1 ? imageData[imageIndex(i - 1, j - 1, c)] : 0;
+
+        switch (filterType) {
+          case 1: val += a; break;
+          case 2: val += b; break;
+          case 3: val += (a + b) / 2; break;
+          case 4: val += paethPredict(a, b, d); break;
+        }
+
+        imageData[imageIndex(i, j, c)] = val;
+
+      }
+    }
+
+  }
+
+  std::vector<uint8_t> fData(width * height * 4);
+
+  for (unsigned int i = 0; i < height; ++i) {
+    for (unsigned int j = 0; j < width; ++j) {
+      for (unsigned int c = 0; c < chanelCount; ++c)
+        fData[(i * width + j) * 4 + c] = imageData[(i * width + j) * chanelCount + c];
+
+      if (chanelCount < 4)
+        fData[(i * width + j) * 4 + 3] = 255;
+    }
+  }
+
+  return fData;
+
+}
+
+static double millisSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static double printStage(const char * name, std::vector<double> values, double pixels) {
+
+  std::sort(values.begin(), values.end());
+  double median = values[values.size() / 2];
+
+  printf("%-10s median %10.3f ms   %10.2f MPixel/s\n", name, median, pixels / (median * 1000.0));
+
+  return median;
+
+}
+
+int main(int argc, char ** argv) {
+
+  uint32_t size = 2048;
+  unsigned int runs = 5;
+  uint32_t channels = 4;
+  std::string fname = "/tmp/pngdecodebench.png";
+
+  if (argc >= 2)
+    size = atoi(argv[1]);
+
+  if (argc >= 3)
+    runs = atoi(argv[2]);
+
+  if (argc >= 4)
+    channels = atoi(argv[3]);
+
+  if (argc >= 5)
+    fname = argv[4];
+
+  if (!size || !runs || (channels != 3 && channels != 4)) {
+    fprintf(stderr, "Usage: pngdecodebench [size > 0] [runs > 0] [channels 3|4] [file]\n");
+    return 1;
+  }
+
+  std::vector<uint8_t> png = encodeImage(size, channels);
+
+  FILE * file = fopen(fname.c_str(), "wb");
+  if (!file) {
+    fprintf(stderr, "Unable to write %s\n", fname.c_str());
+    return 1;
+  }
+
+  fwrite(png.data(), 1, png.size(), file);
+  fclose(file);
+
+  std::vector<double> legacyTimes, memoryTimes, fileTimes;
+  std::vector<uint8_t> legacy, memory(size * size * 4), fromFile(size * size * 4);
+
+  for (unsigned int i = 0; i < runs; ++i) {
+
+    auto start = std::chrono::high_resolution_clock::now();
+    legacy = legacyDecode(png, size, size, channels);
+    legacyTimes.push_back(millisSince(start));
+
+    start = std::chrono::high_resolution_clock::now();
+    int result = pngDecodeRGBAMemory(png.data(), png.size(), memory.data(), size * 4);
+    memoryTimes.push_back(millisSince(start));
+
+    if (result != PNG_OK) {
+      fprintf(stderr, "Decoding failed: %s\n", pngGetErrorString(result));
+      return 1;
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    FILE * file = fopen(fname.c_str(), "rb");
+    png_image_info_t info;
+    result = pngReadHeader(file, &info);
+    if (result == PNG_OK)
+      result = pngDecodeRGBA(file, &info, fromFile.data(), size * 4);
+    fclose(file);
+    fileTimes.push_back(millisSince(start));
+
+    if (result != PNG_OK) {
+      fprintf(stderr, "Decoding failed: %s\n", pngGetErrorString(result));
+      return 1;
+    }
+
+  }
+
+  double pixels = (double) size * size;
+
+  printf("Image: %u x %u, %u channels, %.1f MB png, %u runs\n", size, size, channels, png.size() / (1024.0 * 1024.0), runs);
+  double legacyTime = printStage("legacy", legacyTimes, pixels);
+  double memoryTime = printStage("memory", memoryTimes, pixels);
+  printStage("file", fileTimes, pixels);
+  printf("Speedup: %.2fx\n", legacyTime / memoryTime);
+
+  remove(fname.c_str());
+
+  if (legacy != memory || memory != fromFile) {
+    fprintf(stderr, "Decoded images differ\n");
+    return 1;
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,211 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util/mesh.h"
+#include "util/mesh/transformkernels.h"
+
+/**
+ * Mesh transform benchmark.
+ *
+ * Transforms a mesh of vertexCount vertices with positions, normals and
+ * 4 component tangents. Compares the old per vertex path through
+ * Math::Matrix * Math::Vector with Mesh::withTransform on a shared mesh
+ * (copy) and on a uniquely owned one (in place), and times the position
+ * kernel for every instruction set the CPU supports.
+ *
+ * Usage: transformbench [vertexCount] [runs]
+ **/
+
+using namespace Math;
+
+static std::shared_ptr<Mesh> createMesh(size_t vertexCount) {
+
+  VertexAttributeSet attributes;
+
+  attributes[ATTRIBUTE_SLOT_POSITION] = VertexAttribute(ATTRIBUTE_F32_VEC3, vertexCount);
+  attributes[ATTRIBUTE_SLOT_NORMAL] = VertexAttribute(ATTRIBUTE_F32_VEC3, vertexCount);
+  attributes[ATTRIBUTE_SLOT_TANGENT] = VertexAttribute(ATTRIBUTE_F32_VEC4, vertexCount);
+  attributes[ATTRIBUTE_SLOT_TEXCOORD_0] = VertexAttribute(ATTRIBUTE_F32_VEC2, vertexCount);
+
+  float * pos = attributes[ATTRIBUTE_SLOT_POSITION].as<float>();
+  float * normal = attributes[ATTRIBUTE_SLOT_NORMAL].as<float>();
+  float * tangent = attributes[ATTRIBUTE_SLOT_TANGENT].as<float>();
+  float * uv = attributes[ATTRIBUTE_SLOT_TEXCOORD_0].as<float>();
+
+  for (size_t i = 0; i < vertexCount; ++i) {
+
+    pos[i*3] = (float) (i % 1024);
+    pos[i*3+1] = (float) (i / 1024);
+    pos[i*3+2] = 0;
+
+    normal[i*3] = 0;
+    normal[i*3+1] = 0;
+    normal[i*3+2] = 1;
+
+    tangent[i*4] = 1;
+    tangent[i*4+1] = 0;
+    tangent[i*4+2] = 0;
+    tangent[i*4+3] = 1;
+
+    uv[i*2] = 0;
+    uv[i*2+1] = 0;
+
+  }
+
+  return std::shared_ptr<Mesh>(new Mesh(attributes, std::vector<uint32_t>()));
+
+}
+
+/// The transform as it was done before the batched kernels, one Vector at a time into a copy.
+static std::shared_ptr<Mesh> legacyTransform(std::shared_ptr<Mesh> mesh, Matrix<4,4,float> m) {
+
+  VertexAttributeSet attributes;
+  attributes[ATTRIBUTE_SLOT_POSITION] = mesh->getAttribute(ATTRIBUTE_SLOT_POSITION);
+  attributes[ATTRIBUTE_SLOT_NORMAL] = mesh->getAttribute(ATTRIBUTE_SLOT_NORMAL);
+  attributes[ATTRIBUTE_SLOT_TANGENT] = mesh->getAttribute(ATTRIBUTE_SLOT_TANGENT);
+  attributes[ATTRIBUTE_SLOT_TEXCOORD_0] = mesh->getAttribute(ATTRIBUTE_SLOT_TEXCOORD_0);
+  attributes[ATTRIBUTE_SLOT_MATERIAL_INDEX] = mesh->getAttribute(ATTRIBUTE_SLOT_MATERIAL_INDEX);
+
+  VertexAttribute & positions = attributes[ATTRIBUTE_SLOT_POSITION];
+  VertexAttribute & normals = attributes[ATTRIBUTE_SLOT_NORMAL];
+  VertexAttribute & tangents = attributes[ATTRIBUTE_SLOT_TANGENT];
+
+  for (size_t i = 0; i < positions.count; ++i) {
+
+    Vector<3, float> pos = positions.getVector<3>(i);
+    Vector<3, float> nor = normals.getVector<3>(i);
+    Vector<4, float> tan = tangents.getVector<4>(i);
+
+    Vector<4, float> p = m * Vector<4, float>(pos[0], pos[1], pos[2], 1);
+    Vector<4, float> n = m * Vector<4, float>(nor[0], nor[1], nor[2], 0);
+    Vector<4, float> t = m * Vector<4, float>(tan[0], tan[1], tan[2], 0);
+
+    positions.setVector<3>(i, Vector<3, float>(p) / p[3]);
+    normals.setVector<3>(i, Vector<3, float>(n));
+    tangents.setVector<4>(i, Vector<4, float>(t[0], t[1], t[2], tan[3]));
+
+  }
+
+  return std::shared_ptr<Mesh>(new Mesh(attributes, mesh->getIndices()));
+
+}
+
+static double millisSince(std::chrono::high_resolution_clock::time_point start) {
+  return std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void printStage(const char * name, std::vector<double> values, double vertexCount) {
+
+  std::sort(values.begin(), values.end());
+  double median = values[values.size() / 2];
+
+  printf("%-16s median %10.3f ms   %10.2f Mvtx/s\n", name, median, vertexCount / (median * 1000.0));
+
+}
+
+int main(int argc, char ** argv) {
+
+  size_t vertexCount = 1 << 20;
+  unsigned int runs = 9;
+
+  if (argc >= 2)
+    vertexCount = atol(argv[1]);
+
+  if (argc >= 3)
+    runs = atoi(argv[2]);
+
+  if (!vertexCount || !runs) {
+    fprintf(stderr, "Usage: transformbench [vertexCount > 0] [runs > 0]\n");
+    return 1;
+  }
+
+  /// The z-up conversion gltfLoadMesh applies, with a translation so the affine part is exercised.
+  float matrixData[16] = {
+			  1, 0, 0, 3,
+			  0, 0, -1, 2,
+			  0, 1, 0, 1,
+			  0, 0, 0, 1
+  };
+  Matrix<4, 4, float> m(matrixData);
+
+  std::shared_ptr<Mesh> source = createMesh(vertexCount);
+
+  std::vector<double> legacyTimes, copyTimes, inPlaceTimes;
+
+  for (unsigned int i = 0; i < runs; ++i) {
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::shared_ptr<Mesh> legacy = legacyTransform(source, m);
+    legacyTimes.push_back(millisSince(start));
+
+    /// source keeps a reference, so this has to copy.
+    start = std::chrono::high_resolution_clock::now();
+    std::shared_ptr<Mesh> copied = m * source;
+    copyTimes.push_back(millisSince(start));
+
+    std::shared_ptr<Mesh> owned = createMesh(vertexCount);
+    start = std::chrono::high_resolution_clock::now();
+    owned = m * std::move(owned);
+    inPlaceTimes.push_back(millisSince(start));
+
+    if (!i) {
+
+      const float * a = legacy->getAttribute(ATTRIBUTE_SLOT_POSITION).as<float>();
+      const float * b = copied->getAttribute(ATTRIBUTE_SLOT_POSITION).as<float>();
+
+      for (size_t j = 0; j < vertexCount * 3; ++j) {
+	if (fabs(a[j] - b[j]) > 1e-5 * (1 + fabs(a[j]))) {
+	  fprintf(stderr, "Mismatch at component %zu: %f != %f\n", j, a[j], b[j]);
+	  return 1;
+	}
+      }
+
+    }
+
+  }
+
+  printf("Mesh: %zu vertices, %u runs, best kernel %s\n", vertexCount, runs, getTransformKernelName(getBestTransformKernel()));
+  printStage("legacy", legacyTimes, vertexCount);
+  printStage("withTransform", copyTimes, vertexCount);
+  printStage("in place", inPlaceTimes, vertexCount);
+
+  /// The kernels take the matrix column major.
+  float columns[16];
+  for (unsigned int i = 0; i < 4; ++i)
+    for (unsigned int j = 0; j < 4; ++j)
+      columns[i * 4 + j] = matrixData[j * 4 + i];
+
+  std::vector<float> positions(source->getAttribute(ATTRIBUTE_SLOT_POSITION).data.size() / sizeof(float));
+
+  for (TransformKernel kernel : {TRANSFORM_KERNEL_SCALAR, TRANSFORM_KERNEL_SSE, TRANSFORM_KERNEL_AVX}) {
+
+    if (!isTransformKernelSupported(kernel))
+      continue;
+
+    std::vector<double> times;
+
+    for (unsigned int i = 0; i < runs; ++i) {
+
+      memcpy(positions.data(), source->getAttribute(ATTRIBUTE_SLOT_POSITION).as<float>(), positions.size() * sizeof(float));
+
+      auto start = std::chrono::high_resolution_clock::now();
+      transformPoints(columns, positions.data(), vertexCount, kernel);
+      times.push_back(millisSince(start));
+
+    }
+
+    printStage((std::string("points ") + getTransformKernelName(kernel)).c_str(), times, vertexCount);
+
+  }
+
+  return 0;
+
+}
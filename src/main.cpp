@@ -105,6 +105,7 @@ void createResourceLoaders(ResourceManager * resourceManager) {
   resourceManager->addRegistry("Script", (ResourceRegistry<Resource> *) new ResourceRegistry<Script>());
 
   resourceManager->addLoader("Shader", (ResourceLoader<Resource> *) new ShaderLoader());
+  resourceManager->addLoader("Texture", (ResourceLoader<Resource> *) new CompressedTextureLoader());
   resourceManager->addLoader("Texture", (ResourceLoader<Resource> *) new TextureLoader());
   resourceManager->addLoader("CubeMap", (ResourceLoader<Resource> *) new CubeMapLoader());
   resourceManager->addLoader("Material", (ResourceLoader<Resource> *) new MaterialLoader());
@@ -171,6 +172,9 @@ int main(int argc, char ** argv) {
 
   unsigned int tmp = 0;
 
+  /// Texture memory in MB, 0 leaves it to the memory budget of the device.
+  VkDeviceSize textureBudget = 0;
+
   if (argc >= 3) {
 
     width = atoi(argv[1]);
@@ -178,15 +182,19 @@ int main(int argc, char ** argv) {
 
   }
 
+  if (argc >= 4)
+    textureBudget = (VkDeviceSize) atoi(argv[3]) << 20;
+
   /*std::future<std::shared_ptr<Mesh>> futureMesh = generateBackground(noiseFunc,
 								     Math::Vector<3, float>(0,0,0),
 								     Math::Vector<3, float>(64.0f,64.0f,64.0f),
 								     0.5, 128);*/
 
   std::shared_ptr<Window> window(new Window(width, height));
+  window->enableTextureStreaming(textureBudget);
   ResourceManager * resourceManager = new ResourceManager(window->getState());
   createResourceLoaders(resourceManager);
-  resourceManager->startLoadingThreads(1);
+  resourceManager->startLoadingThreads(std::thread::hardware_concurrency());
 
   //std::shared_ptr<Texture> skyBox = testCubeMapLoading(window->getState(), resourceManager);
 
@@ -225,6 +233,9 @@ int main(int argc, char ** argv) {
   node->wait();
   node3->wait();
 
+  /// Shows which resources held up the level, open in chrome://tracing.
+  resourceManager->writeTrace("resource_trace.json");
+
   std::shared_ptr<World> world(new World());
 
   std::shared_ptr<strc::Node> boxNode = resourceManager->get<strc::Node>(ResourceLocation("Node", "resources/nodes/test.node", "FallingBox"));
@@ -6,6 +6,8 @@
 
 #include "nodeloader.h"
 
+#include "util/meshcache.h"
+
 using namespace Math;
 using namespace strc;
 
@@ -58,9 +60,38 @@ std::shared_ptr<Model> MeshNode::buildModel(vkutil::VulkanState & state) {
   for (const InputDescription & idesc : elements) {
     std::cout << idesc.attributeName << " at " << idesc.location << std::endl;
     }*/
+
+  uint64_t layout = MeshCache::layoutHash(elements);
+
+  if (std::shared_ptr<BakedMesh> baked = MeshCache::find(mesh->getCacheKey(), layout)) {
+    this->model = std::shared_ptr<Model>(new Model(state, baked));
+    return model;
+  }
+
+  this->mesh = Mesh::resolve(mesh);
   
   std::vector<InterleaveElement> iData = mesh->compactStorage(elements, &stride);
 
+  if (!mesh->getCacheKey().empty()) {
+
+    std::vector<VertexAttributeType> types(iData.size());
+    for (unsigned int i = 0; i < iData.size(); ++i)
+      types[i] = mesh->getAttributeType(iData[i].attributeName);
+
+    uint32_t indexSize;
+    uint32_t indexCount;
+    std::vector<uint8_t> indexData = mesh->getCompactIndices(&indexSize, &indexCount);
+
+    MeshCache::store(mesh->getCacheKey(), layout, iData, types, stride, mesh->getVertexCount(), mesh->getInterleavedData(iData, stride), indexData, indexSize, indexCount);
+
+    /// Reading the entry back is cheaper than interleaving the mesh a second time.
+    if (std::shared_ptr<BakedMesh> baked = MeshCache::find(mesh->getCacheKey(), layout)) {
+      this->model = std::shared_ptr<Model>(new Model(state, baked));
+      return model;
+    }
+
+  }
+
   this->model = std::shared_ptr<Model>(new Model(state, mesh, iData, stride));
 
   return model;
@@ -124,6 +124,9 @@ namespace physutil {
 
   void transferMeshDataToBullet(std::shared_ptr<Mesh> mesh, btTriangleMesh * btMesh) {
 
+    /// Meshes with a baked version are only decoded on demand.
+    mesh = Mesh::resolve(mesh);
+
     std::vector<uint32_t> indices = mesh->getIndices();
     const VertexAttribute & positions = mesh->getAttribute("POSITION");
 
@@ -133,9 +136,9 @@ namespace physutil {
       uint32_t i1 = indices[i+1];
       uint32_t i2 = indices[i+2];
       
-      Math::Vector<3, float> p0 = positions.value[i0].vec3;
-      Math::Vector<3, float> p1 = positions.value[i1].vec3;
-      Math::Vector<3, float> p2 = positions.value[i2].vec3;
+      Math::Vector<3, float> p0 = positions.getVector<3>(i0);
+      Math::Vector<3, float> p1 = positions.getVector<3>(i1);
+      Math::Vector<3, float> p2 = positions.getVector<3>(i2);
 
       btMesh->addTriangle(btVector3(p0(0), p0(1), p0(2)),
 			  btVector3(p1(0), p1(1), p1(2)),
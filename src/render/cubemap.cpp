@@ -2,7 +2,7 @@
 
 #include <configloading.h>
 
-CubeMap::CubeMap(vkutil::VulkanState & state, std::vector<uint8_t> data, int width, int height, int depth) : Texture(state, data, width, height, depth, VK_IMAGE_VIEW_TYPE_CUBE, 6, VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT) {
+CubeMap::CubeMap(vkutil::VulkanState & state, const MipChain & chain) : Texture(state, chain, VK_IMAGE_VIEW_TYPE_CUBE, VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT) {
 
 }
 
@@ -12,57 +12,63 @@ CubeMap::~CubeMap() {
 
 #include "util/image/png.h"
 
-std::vector<uint8_t> loadPNGasVector(std::string fname, uint32_t * width, uint32_t * height) {
+static FILE * openPNG(std::string fname, png_image_info_t * info) {
 
-  FILE * file = fopen(fname.c_str(), "r");
-  uint32_t chanelCount;
-  uint8_t * data = pngLoadImageData(file, width, height, &chanelCount);
-  fclose(file);
+  FILE * file = fopen(fname.c_str(), "rb");
+  if (!file)
+    throw dbg::trace_exception(std::string("Unable to open ").append(fname));
+
+  int result = pngReadHeader(file, info);
+
+  if (result != PNG_OK) {
+    fclose(file);
+    throw dbg::trace_exception(std::string("Unable to load PNG ").append(fname).append(": ").append(pngGetErrorString(result)));
+  }
+
+  return file;
+
+}
+
+/// Decodes one face straight into its layer of the cube map data.
+static void decodeFace(std::string fname, uint8_t * layer, uint32_t width, uint32_t height) {
+
+  png_image_info_t info;
+  FILE * file = openPNG(fname, &info);
 
-  std::vector<uint8_t> res((*width) * (*height) *4);
-  if (chanelCount >= 4) {
-    for (uint32_t i = 0; i < (*width) * (*height) * 4; ++i) {
-      res[i] = data[i];
-    }
-  } else {
-    for (uint32_t i = 0; i < (*width) * *(height); ++i) {
-      res[i*4] = data[i*3];
-      res[i*4+1] = data[i*3+1];
-      res[i*4+2] = data[i*3+2];
-      res[i*4+3] = 255;
-    }
+  if (info.width != width || info.height != height) {
+    fclose(file);
+    throw dbg::trace_exception(std::string("Cube map face ").append(fname).append(" has a different size"));
   }
 
-  free(data);
+  int result = pngDecodeRGBA(file, &info, layer, (size_t) width * 4);
+  fclose(file);
+
+  if (result != PNG_OK)
+    throw dbg::trace_exception(std::string("Unable to load PNG ").append(fname).append(": ").append(pngGetErrorString(result)));
 
-  return res;
-  
 }
 
 class CubeMapUploader : public ResourceUploader<Texture> {
 
 public:
 
-  CubeMapUploader(std::vector<uint8_t> data, int width, int height, int depth) :
-    data(data), width(width), height(height), depth(depth) {
+  CubeMapUploader(std::shared_ptr<PendingImage> image) : image(image) {
 
   }
-  
+
   bool uploadReady() {
-    return true;
+    return image->isDone();
   }
 
   std::shared_ptr<Texture> uploadResource(vkutil::VulkanState & state, ResourceManager * manager) {
-    return std::make_shared<CubeMap>(state, data, width, height, depth);
+    image->checkError();
+    return std::make_shared<CubeMap>(state, image->chain);
   }
 
 private:
 
-  int width;
-  int height;
-  int depth;
-  std::vector<uint8_t> data;
-  
+  std::shared_ptr<PendingImage> image;
+
 };
 
 std::shared_ptr<ResourceUploader<Texture>> CubeMapLoader::loadResource(std::string filename) {
@@ -70,27 +76,37 @@ std::shared_ptr<ResourceUploader<Texture>> CubeMapLoader::loadResource(std::stri
   using namespace config;
   std::shared_ptr<NodeCompound> root = config::parseFile(filename);
 
-  uint32_t width, height;
+  /// Layer order of vulkan cube maps.
+  static const char * faceNames[6] = {"pos_x", "neg_x", "pos_z", "neg_z", "pos_y", "neg_y"};
+
+  std::vector<std::string> faces(6);
+  for (unsigned int i = 0; i < 6; ++i)
+    faces[i] = std::string(root->getNode<char>(faceNames[i])->getRawData());
 
-  std::vector<uint8_t> front = loadPNGasVector(std::string(root->getNode<char>("pos_y")->getRawData()), &width, &height);
-  std::vector<uint8_t> back  = loadPNGasVector(std::string(root->getNode<char>("neg_y")->getRawData()), &width, &height);
+  /// Sky boxes are colors, their mips are filtered in linear light.
+  std::shared_ptr<PendingImage> image = std::make_shared<PendingImage>(6, 6, MIP_COLOR_SPACE_SRGB);
 
-  std::vector<uint8_t> up    = loadPNGasVector(std::string(root->getNode<char>("pos_z")->getRawData()), &width, &height);
-  std::vector<uint8_t> down  = loadPNGasVector(std::string(root->getNode<char>("neg_z")->getRawData()), &width, &height);
+  /// Only the header of the first face is read here, the data is allocated for all faces at once.
+  png_image_info_t info;
+  fclose(openPNG(faces[0], &info));
 
-  std::vector<uint8_t> right = loadPNGasVector(std::string(root->getNode<char>("pos_x")->getRawData()), &width, &height);
-  std::vector<uint8_t> left  = loadPNGasVector(std::string(root->getNode<char>("neg_x")->getRawData()), &width, &height);
+  image->width = info.width;
+  image->height = info.height;
 
-  std::vector<uint8_t> data;
-  data.insert(data.end(), right.begin(), right.end());
-  data.insert(data.end(), left.begin(), left.end());
+  size_t faceSize = (size_t) info.width * info.height * 4;
+  image->data.resize(faceSize * 6);
 
-  data.insert(data.end(), up.begin(), up.end());
-  data.insert(data.end(), down.begin(), down.end());
+  for (unsigned int i = 0; i < 6; ++i) {
+
+    uint8_t * layer = image->data.data() + faceSize * i;
+    std::string fname = faces[i];
+
+    submitDecode([image, fname, layer] () {
+      image->decodePart([&] () {decodeFace(fname, layer, image->width, image->height);});
+    });
+
+  }
 
-  data.insert(data.end(), front.begin(), front.end());
-  data.insert(data.end(), back.begin(), back.end());
+  return std::make_shared<CubeMapUploader>(image);
 
-  return std::make_shared<CubeMapUploader>(data, width, height, 1);
-  
 }
@@ -8,7 +8,7 @@
 class CubeMap : public Texture {
 
 public:
-  CubeMap(vkutil::VulkanState & state, std::vector<uint8_t> data, int width, int height, int depth);
+  CubeMap(vkutil::VulkanState & state, const MipChain & chain);
   virtual ~CubeMap();
   
 };
@@ -5,6 +5,7 @@
 
 #include "storagebuffer.h"
 #include "render/util/vkutil.h"
+#include "memorytransferhandler.h"
 
 
 template <typename T> class DynamicBuffer : public StorageBuffer
@@ -15,6 +16,7 @@ template <typename T> class DynamicBuffer : public StorageBuffer
             bufferSize = sizeof(T) * data.size();
 
             this->usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            this->stagingSlot = 0;
 
             lout << "Creating staging buffer" << std::endl;
             createStagingBuffer();
@@ -23,6 +25,18 @@ template <typename T> class DynamicBuffer : public StorageBuffer
 
         }
 
+        /// Creates the buffer for elementCount elements without uploading anything.
+        DynamicBuffer(const vkutil::VulkanState & state, size_t elementCount, VkBufferUsageFlags usage) : StorageBuffer(state, sizeof(T) * elementCount, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+
+            bufferSize = sizeof(T) * elementCount;
+
+            this->usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            this->stagingSlot = 0;
+
+            createStagingBuffer();
+
+        }
+
         virtual ~DynamicBuffer() {
 
             destroyStagingBuffer();
@@ -31,39 +45,96 @@ template <typename T> class DynamicBuffer : public StorageBuffer
 
         void fill(const vkutil::VulkanState & state, std::vector<T> & data) {
 
-            void * tmp;
-            vmaMapMemory(state.vmaAllocator, stagingBufferMemory, &tmp);
-            memcpy(tmp, data.data(), bufferSize);
-            //vmaFlushAllocation(allocator, stagingBufferMemory, 0, bufferSize);
-            vkutil::copyBuffer(stagingBuffer, buffer, bufferSize, state.transferCommandPool, state.device, state.transferQueue);
-            vmaUnmapMemory(state.vmaAllocator, stagingBufferMemory);
+            memcpy(staging.data, data.data(), bufferSize);
+            vkutil::copyBuffer(staging.buffer, buffer, bufferSize, state.transferCommandPool, state.device, state.transferQueue);
+            state.stagingPool->countUpload(bufferSize);
 
         }
 
+        /**
+        Records the upload of data into cmdBuffer. Every call uses the next
+        slot of the staging buffer, so batches still being executed are not
+        overwritten; call at most once per transfer batch.
+        **/
         void fill(std::vector<T> & data, VkCommandBuffer & cmdBuffer) {
 
-            void * tmp;
-            vmaMapMemory(state.vmaAllocator, stagingBufferMemory, &tmp);
-            memcpy(tmp, data.data(), bufferSize);
+            VkDeviceSize offset = nextStagingSlot();
+
+            memcpy((uint8_t *) staging.data + offset, data.data(), bufferSize);
 
             VkBufferCopy copyRegion = {};
-            copyRegion.srcOffset = 0;
+            copyRegion.srcOffset = offset;
             copyRegion.dstOffset = 0;
             copyRegion.size = bufferSize;
 
-            vkCmdCopyBuffer(cmdBuffer, stagingBuffer, buffer, 1, &copyRegion);
+            vkCmdCopyBuffer(cmdBuffer, staging.buffer, buffer, 1, &copyRegion);
+            state.stagingPool->countUpload(bufferSize);
+
+        }
+
+        /// Records the upload of a single element into cmdBuffer, same rules as fill.
+        void updateElement(uint32_t index, T * newData, VkCommandBuffer & cmdBuffer) {
+
+            VkDeviceSize offset = nextStagingSlot() + index * sizeof(T);
+
+            memcpy((uint8_t *) staging.data + offset, newData, sizeof(T));
+
+            VkBufferCopy copyRegion = {};
+            copyRegion.srcOffset = offset;
+            copyRegion.dstOffset = index * sizeof(T);
+            copyRegion.size = sizeof(T);
+
+            vkCmdCopyBuffer(cmdBuffer, staging.buffer, buffer, 1, &copyRegion);
+            state.stagingPool->countUpload(sizeof(T));
+
+        }
+
+        /**
+        Gives the staging buffer back to the pool once fence is signalled,
+        fence belongs to the last batch reading from it. No uploads can be
+        recorded afterwards.
+        **/
+        void releaseStaging(VkFence fence) {
 
-            vmaUnmapMemory(state.vmaAllocator, stagingBufferMemory);
+            state.stagingPool->release(staging, fence);
 
         }
 
-        void updateElement(uint32_t index, T * newData) {
+        /// Range of elements, in elements, not bytes.
+        struct Range {
+
+            uint32_t first;
+            uint32_t count;
+
+        };
+
+        /// Records the upload of the given ranges of data into cmdBuffer as a single copy, same rules as fill.
+        void fillRanges(const std::vector<T> & data, const std::vector<Range> & ranges, VkCommandBuffer & cmdBuffer) {
+
+            if (ranges.empty())
+                return;
+
+            VkDeviceSize slotOffset = nextStagingSlot();
+            VkDeviceSize uploadSize = 0;
+            std::vector<VkBufferCopy> regions(ranges.size());
+
+            for (unsigned int i = 0; i < ranges.size(); ++i) {
+
+                VkDeviceSize offset = ranges[i].first * sizeof(T);
+                VkDeviceSize size = ranges[i].count * sizeof(T);
+
+                memcpy((uint8_t *) staging.data + slotOffset + offset, data.data() + ranges[i].first, size);
+
+                regions[i].srcOffset = slotOffset + offset;
+                regions[i].dstOffset = offset;
+                regions[i].size = size;
 
-            void * tmp;
-            vmaMapMemory(state.vmaAllocator, stagingBufferMemory, &tmp);
-            memcpy(((T *)tmp) + index, newData, sizeof(T));
-            vkutil::copyBuffer(stagingBuffer, buffer, bufferSize, state.transferCommandPool, state.device, state.transferQueue);
-            vmaUnmapMemory(state.vmaAllocator, stagingBufferMemory);
+                uploadSize += size;
+
+            }
+
+            vkCmdCopyBuffer(cmdBuffer, staging.buffer, buffer, regions.size(), regions.data());
+            state.stagingPool->countUpload(uploadSize);
 
         }
 
@@ -89,16 +160,22 @@ template <typename T> class DynamicBuffer : public StorageBuffer
     private:
 
 
-        VkBuffer stagingBuffer;
-        VmaAllocation stagingBufferMemory;
         VkDeviceSize bufferSize;
 
         VkBufferUsageFlags usage;
+        uint32_t stagingSlot;
+
+        VkDeviceSize nextStagingSlot() {
+
+            stagingSlot = (stagingSlot + 1) % MAX_TRANSFERS_IN_FLIGHT;
+            return stagingSlot * bufferSize;
+
+        }
 
 
         void destroyStagingBuffer() {
 
-            vmaDestroyBuffer(state.vmaAllocator, stagingBuffer, stagingBufferMemory);
+            state.stagingPool->release(staging);
 
         }
 
@@ -110,18 +187,8 @@ template <typename T> class DynamicBuffer : public StorageBuffer
 
         void createStagingBuffer() {
 
-            VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-            stBufferCreateInfo.size = bufferSize;
-            stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-            stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-            VmaAllocationCreateInfo stAllocCreateInfo = {};
-            stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-            stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-            VmaAllocationInfo stagingBufferAllocInfo = {};
-
-            vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
+            /// One slot for every transfer batch that can be in flight.
+            staging = state.stagingPool->acquire(bufferSize * MAX_TRANSFERS_IN_FLIGHT);
 
         }
 
@@ -3,6 +3,7 @@
 
 #include "storagebuffer.h"
 #include "render/util/vkutil.h"
+#include "util/debug/trace_exception.h"
 #include <type_traits>
 
 #include <vector>
@@ -16,36 +17,26 @@ template <typename T = uint16_t> class IndexBuffer : public StorageBuffer {
 
         }
 
-        IndexBuffer(const vkutil::VulkanState & state, const std::vector<T> & indices, uint32_t indexSizeBytes) :
-         StorageBuffer(state, indexSizeBytes * indices.size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+        IndexBuffer(const vkutil::VulkanState & state, const std::vector<T> & indices, uint32_t indexSizeBytes) : IndexBuffer(state, indices.data(), indices.size(), indexSizeBytes) {
 
-            bufferSize = indices.size();
-            this->indexSizeBytes = indexSizeBytes;
-
-            VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-            stBufferCreateInfo.size = bufferSize;
-            stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-            stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-            VmaAllocationCreateInfo stAllocCreateInfo = {};
-            stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-            stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-            VmaAllocationInfo stagingBufferAllocInfo = {};
+        }
 
-            vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
+        /**
+         * Copies count elements of T from indices, which may point into a mapped file.
+         * The data holds indices of indexSizeBytes each, which may differ from sizeof(T)
+         * for byte buffers.
+         **/
+        IndexBuffer(const vkutil::VulkanState & state, const T * indices, size_t count, uint32_t indexSizeBytes) :
+         StorageBuffer(state, sizeof(T) * count, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
 
-            void * data;
-            //vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+            if (indexSizeBytes != sizeof(uint16_t) && indexSizeBytes != sizeof(uint32_t))
+                throw dbg::trace_exception(std::string("Unsupported index size ").append(std::to_string(indexSizeBytes)));
 
-	    //std::cout << "BufferSize (bytes): " << bufferSize << " elements: " << indices.size() << std::endl;
-            vmaMapMemory(state.vmaAllocator, stagingBufferMemory, &data);
-            memcpy(stagingBufferAllocInfo.pMappedData, indices.data(), bufferSize);
-            vmaUnmapMemory(state.vmaAllocator, stagingBufferMemory);
+            bufferSize = sizeof(T) * count;
+            this->indexSizeBytes = indexSizeBytes;
 
-            //vkUnmapMemory(device, stagingBufferMemory);
-            /*vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);*/
+            staging = state.stagingPool->acquire(bufferSize);
+            memcpy(staging.data, indices, bufferSize);
 
         }
         virtual ~IndexBuffer() {
@@ -54,14 +45,23 @@ template <typename T = uint16_t> class IndexBuffer : public StorageBuffer {
 
         void bindForRender(VkCommandBuffer & cmdBuffer) {
 
-            vkCmdBindIndexBuffer(cmdBuffer, buffer, 0, (VkIndexType) (indexSizeBytes / 4));
+            vkCmdBindIndexBuffer(cmdBuffer, buffer, 0, getIndexType());
+
+        }
+
+        VkIndexType getIndexType() {
+            return (indexSizeBytes == sizeof(uint32_t)) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16;
+        }
 
+        uint32_t getIndexCount() {
+            return bufferSize / indexSizeBytes;
         }
 
         void upload(const VkDevice & device, const VkCommandPool & commandPool, const vkutil::Queue & q) {
 
-            vkutil::copyBuffer(stagingBuffer, buffer, bufferSize, commandPool, device, q);
-            vmaDestroyBuffer(state.vmaAllocator, stagingBuffer, stagingBufferMemory);
+            vkutil::copyBuffer(staging.buffer, buffer, bufferSize, commandPool, device, q);
+            state.stagingPool->countUpload(bufferSize);
+            state.stagingPool->release(staging);
 
         }
 
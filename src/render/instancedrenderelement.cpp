@@ -1,22 +1,45 @@
 #include "instancedrenderelement.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "util/vk_trace_exception.h"
+#include "render/viewport.h"
+
 Transform<float> nullTransform;
 
 InstancedRenderElement::InstancedRenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> material, int scSize) : RenderElement(view, model, material, scSize, nullTransform, true) {
 
-  instanceTransforms = std::vector<glm::mat4>(1);
-  instances = std::unordered_map<uint32_t, InstanceInfo>(1);
-  transforms = std::vector<Transform<float>>(1);
+  bufferCapacity = INSTANCED_ELEMENT_INITIAL_CAPACITY;
 
-  transforms[0] = Transform<float>();
+  instanceTransforms = std::vector<glm::mat4>(bufferCapacity);
+  transforms = std::vector<Transform<float>>(bufferCapacity);
+  slotOwners = std::vector<uint32_t>(bufferCapacity, INVALID_SLOT);
+  slotDirty = std::vector<bool>(bufferCapacity, false);
 
+  /// Slot 0 holds the initial identity instance with id 0.
+  transforms[0] = Transform<float>();
   instanceTransforms[0] = toGLMMatrix(getTransformationMatrix(transforms[0]));
+  instanceSlots.push_back(0);
+  slotOwners[0] = 0;
 
   instanceCount = 1;
+  lastToken = 0;
+
+  grownBuffer = nullptr;
+  lastTransferFence = VK_NULL_HANDLE;
 
   lout << "Creating DynamicBuffer" << std::endl;
 
   this->instanceBuffer = new DynamicBuffer<glm::mat4>(state, instanceTransforms, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+
+  /// The initial instance was uploaded by the constructor of the buffer.
+  drawnCount = instanceCount;
+
+  drawCommandBuffer = VK_NULL_HANDLE;
+  drawCommandCount = 0;
+
   lout << "Creating uniform buffers" << std::endl;
   this->createUniformBuffers(scSize, this->binds);
 
@@ -29,126 +52,301 @@ InstancedRenderElement::InstancedRenderElement(Viewport * view, std::shared_ptr<
 
 }
 
+InstancedRenderElement::~InstancedRenderElement() {
+
+  /// A running batch may still read the staging memory.
+  instanceBuffer->releaseStaging(lastTransferFence);
+  if (grownBuffer)
+    grownBuffer->releaseStaging(lastTransferFence);
+
+  delete instanceBuffer;
+  delete grownBuffer;
+
+  destroyDrawCommands();
+
+  for (DynamicBuffer<glm::mat4> * b : retiredBuffers)
+    delete b;
+
+}
+
+float InstancedRenderElement::getViewDistance(const Math::Vector<3, float> & position) {
+
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
+  float closest = std::numeric_limits<float>::max();
+
+  for (uint32_t slot = 0; slot < instanceCount; ++slot) {
+
+    float dx = transforms[slot].position[0] - position[0];
+    float dy = transforms[slot].position[1] - position[1];
+    float dz = transforms[slot].position[2] - position[2];
+
+    closest = std::min(closest, dx * dx + dy * dy + dz * dz);
+
+  }
+
+  return std::sqrt(closest);
+
+}
+
+void InstancedRenderElement::createDrawCommands(uint32_t slotCount) {
+
+  VkBufferCreateInfo bufferInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  bufferInfo.size = sizeof(VkDrawIndexedIndirectCommand) * slotCount;
+  bufferInfo.usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCreateInfo = {};
+  allocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  allocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo allocInfo = {};
+
+  if (VkResult res = vmaCreateBuffer(state.vmaAllocator, &bufferInfo, &allocCreateInfo, &drawCommandBuffer, &drawCommandMemory, &allocInfo))
+    throw vkutil::vk_trace_exception("Unable to create draw command buffer", res);
+
+  drawCommands = (VkDrawIndexedIndirectCommand *) allocInfo.pMappedData;
+  drawCommandCount = slotCount;
+
+  for (uint32_t i = 0; i < slotCount; ++i) {
+    drawCommands[i].indexCount = model->getIndexCount();
+    drawCommands[i].instanceCount = drawnCount;
+    drawCommands[i].firstIndex = 0;
+    drawCommands[i].vertexOffset = 0;
+    drawCommands[i].firstInstance = 0;
+  }
+
+  vmaFlushAllocation(state.vmaAllocator, drawCommandMemory, 0, VK_WHOLE_SIZE);
+
+}
+
+void InstancedRenderElement::destroyDrawCommands() {
+
+  if (drawCommandBuffer != VK_NULL_HANDLE)
+    vmaDestroyBuffer(state.vmaAllocator, drawCommandBuffer, drawCommandMemory);
+
+  drawCommandBuffer = VK_NULL_HANDLE;
+  drawCommandCount = 0;
+
+}
+
+void InstancedRenderElement::createUniformBuffers(int scSize, std::vector<Shader::Binding> & bindings) {
+
+  RenderElement::createUniformBuffers(scSize, bindings);
+
+  /// The swapchain is idle when the uniforms are recreated, so no recorded buffer is executed.
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
+  uint32_t slotCount = scSize * VIEWPORT_SECONDARY_SETS_PER_IMAGE;
+
+  if (drawCommandCount != slotCount) {
+    destroyDrawCommands();
+    createDrawCommands(slotCount);
+  }
+
+}
+
 void InstancedRenderElement::constructBuffers(int scSize) {
 
+  /// The instance buffer is created by the constructor already.
   RenderElement::constructBuffers(scSize);
-  this->instanceBuffer = new DynamicBuffer<glm::mat4>(state, instanceTransforms, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
 
 }
 
 void InstancedRenderElement::markBufferDirty() {
-  this->instanceBufferDirty = true;
-  this->handler.signalTransfer(this);
+  this->lastToken = this->handler.signalTransfer(this);
+}
+
+void InstancedRenderElement::markSlotDirty(uint32_t slot) {
+
+  if (slotDirty[slot])
+    return;
+
+  slotDirty[slot] = true;
+  dirtySlots.push_back(slot);
+
+}
+
+void InstancedRenderElement::grow() {
+
+  uint32_t capacity = instanceTransforms.size() * 2;
+
+  instanceTransforms.resize(capacity);
+  transforms.resize(capacity);
+  slotOwners.resize(capacity, INVALID_SLOT);
+  slotDirty.resize(capacity, false);
+
+  /// A grown buffer that never got drawn may still be the target of a running transfer.
+  if (grownBuffer) {
+    grownBuffer->releaseStaging(lastTransferFence);
+    retiredBuffers.push_back(grownBuffer);
+  }
+
+  grownBuffer = new DynamicBuffer<glm::mat4>(state, (size_t) capacity, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+
 }
 
 RenderElement::Instance InstancedRenderElement::addInstance(Transform<float> & trans) {
-  uint32_t index = this->transforms.size();
 
-  transforms.push_back(trans);
-  instanceTransforms.push_back(toGLMMatrix(getTransformationMatrix(trans)));
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
 
-  instances[index] = (InstanceInfo){index, index};
-  this->markBufferDirty();
+  if (instanceCount == instanceTransforms.size())
+    grow();
+
+  uint32_t id;
+  if (freeIds.empty()) {
+    id = instanceSlots.size();
+    instanceSlots.push_back(INVALID_SLOT);
+  } else {
+    id = freeIds.back();
+    freeIds.pop_back();
+  }
+
+  uint32_t slot = instanceCount++;
+
+  instanceSlots[id] = slot;
+  slotOwners[slot] = id;
+  transforms[slot] = trans;
+  instanceTransforms[slot] = toGLMMatrix(getTransformationMatrix(trans));
 
-  this->instanceBuffer->recreate(instanceTransforms);
+  markSlotDirty(slot);
+  this->markBufferDirty();
 
-  instanceCount++;
-  this->instanceCountUpdated = true;
+  return (Instance) {id};
 
-  return (Instance) {index};
 }
 
 void InstancedRenderElement::updateInstance(Instance &instance, Transform<float> &trans) {
 
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
   //Check for existance of instance.
-  if (this->instances.find(instance.id) == instances.end())
+  if (instance.id >= instanceSlots.size() || instanceSlots[instance.id] == INVALID_SLOT)
     return;
 
-  InstanceInfo info = this->instances[instance.id];
-
-  transformBufferMutex.lock();
-
-  this->transforms[info.pos] = trans;
-  this->instanceTransforms[info.pos] = toGLMMatrix(getTransformationMatrix(trans));
+  uint32_t slot = instanceSlots[instance.id];
 
-  transformBufferMutex.unlock();
+  this->transforms[slot] = trans;
+  this->instanceTransforms[slot] = toGLMMatrix(getTransformationMatrix(trans));
 
+  markSlotDirty(slot);
   this->markBufferDirty();
 
 }
 
 void InstancedRenderElement::deleteInstance(Instance &instance) {
 
-  transformBufferMutex.lock();
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
 
-  ///No instances left
-  if (!transforms.size()) {
+  if (instance.id >= instanceSlots.size() || instanceSlots[instance.id] == INVALID_SLOT)
     return;
-  }
 
-  //Info of instance to remove
-  InstanceInfo info = this->instances[instance.id];
-  uint32_t lastPos = instanceCount - 1;
+  uint32_t slot = instanceSlots[instance.id];
+  uint32_t lastSlot = instanceCount - 1;
 
-  //remove instance from map
-  this->instances.erase(this->instances.find(instance.id));
+  /// Moving the last instance into the freed slot keeps the slots packed.
+  if (slot != lastSlot) {
 
-  //getting info for last element
-  InstanceInfo * lastInfo;
-  for (auto it : instances) {
+    uint32_t lastId = slotOwners[lastSlot];
 
-    if (it.second.pos == lastPos) {
-      lastInfo = &it.second;
-      break;
-    }
+    transforms[slot] = transforms[lastSlot];
+    instanceTransforms[slot] = instanceTransforms[lastSlot];
+    slotOwners[slot] = lastId;
+    instanceSlots[lastId] = slot;
+
+    markSlotDirty(slot);
 
   }
 
-  //Moving last element to override deleted one.
-  transforms[info.pos] = transforms[lastPos];
-  instanceTransforms[info.pos] = instanceTransforms[lastPos];
-  lastInfo->pos = info.pos;
+  slotOwners[lastSlot] = INVALID_SLOT;
+  instanceSlots[instance.id] = INVALID_SLOT;
+  freeIds.push_back(instance.id);
+
+  instanceCount--;
 
-  //this->instanceBuffer->recreate(this->instanceTransforms);
   this->markBufferDirty();
 
-  instanceCount--;
-  //this->instanceCountUpdated = true;
-  transformBufferMutex.unlock();
+}
+
+std::vector<DynamicBuffer<glm::mat4>::Range> InstancedRenderElement::takeDirtyRanges(uint32_t limit) {
+
+  std::sort(dirtySlots.begin(), dirtySlots.end());
+
+  std::vector<DynamicBuffer<glm::mat4>::Range> ranges;
+
+  for (uint32_t slot : dirtySlots) {
+
+    slotDirty[slot] = false;
+
+    if (slot >= limit)
+      continue;
+
+    if (!ranges.empty() && ranges.back().first + ranges.back().count == slot)
+      ranges.back().count++;
+    else
+      ranges.push_back((DynamicBuffer<glm::mat4>::Range) {slot, 1});
+
+  }
+
+  dirtySlots.clear();
+
+  return ranges;
 
 }
 
 void InstancedRenderElement::recordTransfer(VkCommandBuffer &cmdBuffer) {
 
-  //lout << "Recording instance-transfer " << instanceTransforms.size() << std::endl;
-  transformBufferMutex.lock();
-  this->instanceBuffer->fill(instanceTransforms, cmdBuffer);
-  transformBufferMutex.unlock();
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
+  lastTransferFence = handler.getRecordingFence();
+
+  /// The drawn buffer only gets the slots it has room for.
+  std::vector<DynamicBuffer<glm::mat4>::Range> ranges = takeDirtyRanges(bufferCapacity);
+  this->instanceBuffer->fillRanges(instanceTransforms, ranges, cmdBuffer);
+
+  /// The grown buffer holds no data yet, so it gets all slots until it is drawn.
+  if (grownBuffer) {
+    std::vector<DynamicBuffer<glm::mat4>::Range> all = {{0, instanceCount}};
+    grownBuffer->fillRanges(instanceTransforms, all, cmdBuffer);
+  }
+
+  /// The counts are drawn once this batch has been executed, see advanceDrawState.
+  pendingCounts.push_back({lastToken, std::min(instanceCount, bufferCapacity), grownBuffer, grownBuffer ? instanceCount : 0});
 
 }
 
-void InstancedRenderElement::updateUniformBuffer(UniformBufferObject & obj,  uint32_t imageIndex) {
+void InstancedRenderElement::advanceDrawState() {
 
-  void * data;
-  vmaMapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex], &data);
-  memcpy(data, &obj, sizeof(UniformBufferObject));
-  vmaUnmapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex]);
+  while (!pendingCounts.empty() && handler.isTransferComplete(pendingCounts.front().token)) {
 
-  if (this->instanceCountUpdated) {
+    PendingCount & pending = pendingCounts.front();
 
-    this->instanceCountUpdated = false;
+    /// The grown buffer has arrived with all instances, drawing switches over.
+    if (pending.grownBuffer && pending.grownBuffer == grownBuffer) {
 
-  }
-  if (this->instanceBufferDirty) {
+      /// Frames in flight may still read the old buffer, so it is only deleted with the element.
+      instanceBuffer->releaseStaging(lastTransferFence);
+      retiredBuffers.push_back(instanceBuffer);
+
+      instanceBuffer = grownBuffer;
+      bufferCapacity = instanceTransforms.size();
+      grownBuffer = nullptr;
+
+    }
 
-    this->instanceBufferDirty = false;
+    drawnCount = pending.grownBuffer == instanceBuffer ? pending.grownCount : pending.count;
+    pendingCounts.pop_front();
 
   }
 
 }
 
-bool InstancedRenderElement::needsDrawCmdUpdate() {
-  return instanceCountUpdated;
+void InstancedRenderElement::updateUniformBuffer(UniformBufferObject & obj,  uint32_t imageIndex) {
+
+  /// The new count is picked up by the next recording of the secondary buffers.
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+  advanceDrawState();
+
 }
 
 void InstancedRenderElement::renderShaderless(VkCommandBuffer & buffer, uint32_t frameIndex) {
@@ -163,17 +361,19 @@ void InstancedRenderElement::renderShaderless(VkCommandBuffer & buffer, uint32_t
 
   //vkCmdPushConstants(buffer, shader->getPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
 
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
   model->bindForRender(buffer);
   VkDeviceSize offsets[] = {0};
   vkCmdBindVertexBuffers(buffer, 1, 1, &instanceBuffer->getBuffer(), offsets);
-  vkCmdDrawIndexed(buffer, model->getIndexCount(), instanceCount, 0, 0, 0);
+  vkCmdDrawIndexed(buffer, model->getIndexCount(), drawnCount, 0, 0, 0);
 }
 
-void InstancedRenderElement::render(VkCommandBuffer & buffer, uint32_t frameIndex) {
+void InstancedRenderElement::render(VkCommandBuffer & buffer, uint32_t frameIndex, vkutil::BindState & bindState) {
 
   //lout << "Pipeline (Instanced) " << pipeline << std::endl;
-  vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-  vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[frameIndex], 0, nullptr);
+  bindState.bindPipeline(buffer, pipeline);
+  bindState.bindDescriptorSet(buffer, pipelineLayout, descriptorSets[frameIndex]);
 
   //lout << "InstancedRenderElement::render" << std::endl;
 
@@ -183,9 +383,16 @@ void InstancedRenderElement::render(VkCommandBuffer & buffer, uint32_t frameInde
 
   //vkCmdPushConstants(buffer, shader->getPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
 
-  model->bindForRender(buffer);
+  std::lock_guard<std::mutex> guard(transformBufferMutex);
+
+  model->bindForRender(buffer, bindState);
+
+  /// The count and the buffer are taken together, so the draw never reads past the bound buffer.
+  uint32_t slot = bindState.recordingSlot;
+  drawCommands[slot].instanceCount = drawnCount;
+  vmaFlushAllocation(state.vmaAllocator, drawCommandMemory, slot * sizeof(VkDrawIndexedIndirectCommand), sizeof(VkDrawIndexedIndirectCommand));
+
   VkDeviceSize offsets[] = {0};
   vkCmdBindVertexBuffers(buffer, 1, 1, &instanceBuffer->getBuffer(), offsets);
-  vkCmdDrawIndexed(buffer, model->getIndexCount(), instanceCount, 0, 0, 0);
+  vkCmdDrawIndexedIndirect(buffer, drawCommandBuffer, slot * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
 }
-
@@ -2,54 +2,110 @@
 #define INSTANCED_RENDER_ELEMENT_H
 
 #include <mutex>
-#include <unordered_map>
+#include <deque>
 #include <memory>
 #include <vector>
 #include "renderelement.h"
 
+/// Number of instance slots allocated up front, the buffer doubles when it is full.
+#define INSTANCED_ELEMENT_INITIAL_CAPACITY 16
+
 class InstancedRenderElement : public RenderElement {
 
  public:
 
   InstancedRenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, int scSize);
+  virtual ~InstancedRenderElement();
 
   Instance addInstance(Transform<float> & pos) override;
   void updateInstance(Instance & instance, Transform<float> & newPos) override;
   void deleteInstance(Instance & instance) override;
 
   void recordTransfer(VkCommandBuffer & buffer) override;
-  bool needsDrawCmdUpdate() override;
   void renderShaderless(VkCommandBuffer & buffer, uint32_t frameIndex) override;
-  void render(VkCommandBuffer & buffer, uint32_t frameIndex) override;
+  void render(VkCommandBuffer & buffer, uint32_t frameIndex, vkutil::BindState & bindState) override;
 
+  void createUniformBuffers(int scSize, std::vector<Shader::Binding> & bindings) override;
   void updateUniformBuffer(UniformBufferObject & obj, uint32_t frameIndex) override;
 
   void constructBuffers(int scSize) override;
 
- protected:
+  float getViewDistance(const Math::Vector<3, float> & position) override;
 
-  bool instanceBufferDirty;
-  bool instanceCountUpdated;
+ protected:
 
   void markBufferDirty() override;
 
  private:
 
-  struct InstanceInfo {
+  void markSlotDirty(uint32_t slot);
+  void grow();
+  void advanceDrawState();
+  void createDrawCommands(uint32_t slotCount);
+  void destroyDrawCommands();
+  std::vector<DynamicBuffer<glm::mat4>::Range> takeDirtyRanges(uint32_t limit);
 
-    uint32_t id;
-    uint32_t pos;
+  /// Slots are packed densely, so a single draw covers all instances.
+  DynamicBuffer<glm::mat4> * instanceBuffer;
+  uint32_t bufferCapacity;
 
-  };
+  /// Larger buffer waiting for its first upload, drawing switches over once it has arrived.
+  DynamicBuffer<glm::mat4> * grownBuffer;
 
-  DynamicBuffer<glm::mat4> * instanceBuffer;
+  /// Buffers replaced by growing, frames in flight may still use them.
+  std::vector<DynamicBuffer<glm::mat4> *> retiredBuffers;
+
+  /// CPU copy of the slots, the size is the capacity of the newest buffer.
   std::vector<glm::mat4> instanceTransforms;
-  std::unordered_map<uint32_t, InstanceInfo> instances;
   std::vector<Transform<float>> transforms;
+
+  /// Slot of every instance id, INVALID_SLOT for deleted ids.
+  std::vector<uint32_t> instanceSlots;
+  /// Instance id stored in every slot.
+  std::vector<uint32_t> slotOwners;
+  std::vector<uint32_t> freeIds;
+
+  std::vector<uint32_t> dirtySlots;
+  std::vector<bool> slotDirty;
+
   uint32_t instanceCount;
+  MemoryTransferHandler::TransferToken lastToken;
+  /// Fence of the last transfer batch this element was recorded into, retired buffers give back their staging memory with it.
+  VkFence lastTransferFence;
+
+  /**
+   * Instance counts of the recorded transfer batches. A count is only drawn
+   * once its batch has been executed, so it never covers a slot whose data
+   * has not arrived yet.
+   **/
+  struct PendingCount {
+
+    MemoryTransferHandler::TransferToken token;
+    uint32_t count;
+    /// Grown buffer filled by the batch, and the count it holds.
+    DynamicBuffer<glm::mat4> * grownBuffer;
+    uint32_t grownCount;
+
+  };
+
+  std::deque<PendingCount> pendingCounts;
+  uint32_t drawnCount;
+
+  /**
+   * One draw command per recording slot of the viewport in host visible
+   * memory. The command is written when the secondary buffers of the slot
+   * are recorded, together with the instance buffer they bind, so every
+   * execution of those buffers draws a count the bound buffer holds. A slot
+   * is only recorded again once no frame executes its buffers.
+   **/
+  VkBuffer drawCommandBuffer;
+  VmaAllocation drawCommandMemory;
+  VkDrawIndexedIndirectCommand * drawCommands;
+  uint32_t drawCommandCount;
 
   std::mutex transformBufferMutex;
 
+  static constexpr uint32_t INVALID_SLOT = UINT32_MAX;
 
 };
 
@@ -20,21 +20,60 @@ bool LambdaTransferer::reusable() {
 
 MemoryTransferHandler::MemoryTransferHandler() {
 
+    this->signalledToken = 0;
+    this->completedToken = 0;
+    this->recordingFence = VK_NULL_HANDLE;
+
 }
 
 MemoryTransferHandler::~MemoryTransferHandler() {
 
 }
 
-void MemoryTransferHandler::signalTransfer(MemoryTransferer * obj) {
-    this->transfers.push(obj);
+MemoryTransferHandler::TransferToken MemoryTransferHandler::signalTransfer(MemoryTransferer * obj) {
+
+    std::lock_guard<std::mutex> guard(transferLock);
+
+    /// The queued transfer will pick up the newest data when it is recorded.
+    if (queuedTransfers.insert(obj).second)
+        this->transfers.push(obj);
+
+    return ++signalledToken;
+
 }
 
 bool MemoryTransferHandler::hasPendingTransfer() {
+    std::lock_guard<std::mutex> guard(transferLock);
     return !this->transfers.empty();
 }
 
-void MemoryTransferHandler::recordTransfer(VkCommandBuffer & buffer) {
+bool MemoryTransferHandler::isTransferComplete(TransferToken token) {
+    return token <= completedToken;
+}
+
+void MemoryTransferHandler::markTransfersComplete(TransferToken token) {
+
+    if (token > completedToken)
+        completedToken = token;
+
+}
+
+VkFence MemoryTransferHandler::getRecordingFence() {
+    return recordingFence;
+}
+
+MemoryTransferHandler::TransferToken MemoryTransferHandler::recordTransfer(VkCommandBuffer & buffer, VkFence fence) {
+
+    /// Take the queued transfers, so transferers may signal again while being recorded.
+    std::queue<MemoryTransferer *> recording;
+    TransferToken token;
+
+    {
+        std::lock_guard<std::mutex> guard(transferLock);
+        std::swap(recording, transfers);
+        queuedTransfers.clear();
+        token = signalledToken;
+    }
 
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -43,10 +82,12 @@ void MemoryTransferHandler::recordTransfer(VkCommandBuffer & buffer) {
 
     vkBeginCommandBuffer(buffer, &beginInfo);
 
-    while (!this->transfers.empty()) {
+    recordingFence = fence;
 
-        MemoryTransferer * trans = transfers.front();
-        transfers.pop();
+    while (!recording.empty()) {
+
+        MemoryTransferer * trans = recording.front();
+        recording.pop();
 
         trans->recordTransfer(buffer);
 
@@ -57,4 +98,6 @@ void MemoryTransferHandler::recordTransfer(VkCommandBuffer & buffer) {
 
     vkEndCommandBuffer(buffer);
 
+    return token;
+
 }
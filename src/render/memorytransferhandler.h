@@ -3,8 +3,14 @@
 
 #include <queue>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <unordered_set>
 #include <vulkan/vulkan.h>
 
+/// Number of transfer batches that can be executed by the device at the same time.
+#define MAX_TRANSFERS_IN_FLIGHT 3
+
 class MemoryTransferHandler;
 
 class MemoryTransferer {
@@ -46,23 +52,50 @@ class LambdaTransferer : public MemoryTransferer {
 
 };
 
+/**
+Collects the transfers of all MemoryTransferers, so they can be recorded
+into a single batch. Every signalled transfer gets a token that can be
+used to check whether its data has arrived on the device.
+**/
 class MemoryTransferHandler
 {
     public:
+
+        typedef uint64_t TransferToken;
+
         MemoryTransferHandler();
         virtual ~MemoryTransferHandler();
 
-        void signalTransfer(MemoryTransferer * obj);
+        /**
+        Queues the transfer of obj, may be called from any thread.
+        A transferer that is already queued is only recorded once.
+        **/
+        TransferToken signalTransfer(MemoryTransferer * obj);
 
         bool hasPendingTransfer();
+        bool isTransferComplete(TransferToken token);
 
-        void recordTransfer(VkCommandBuffer & buffer);
+        /// Records all queued transfers and returns the token of the last one, fence is signalled once the batch has been executed.
+        TransferToken recordTransfer(VkCommandBuffer & buffer, VkFence fence);
+
+        /// Fence of the batch being recorded, only valid inside of MemoryTransferer::recordTransfer.
+        VkFence getRecordingFence();
+
+        /// Called once the batch containing the transfers up to token has been executed.
+        void markTransfersComplete(TransferToken token);
 
     protected:
 
     private:
 
+        std::mutex transferLock;
         std::queue<MemoryTransferer *> transfers;
+        std::unordered_set<MemoryTransferer *> queuedTransfers;
+
+        TransferToken signalledToken;
+        std::atomic<TransferToken> completedToken;
+
+        VkFence recordingFence;
 
 };
 
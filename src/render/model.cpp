@@ -2,6 +2,7 @@
 
 #include "util/mesh.h"
 #include "util/meshhelper.h"
+#include "util/meshcache.h"
 
 #include <ply.hpp>
 #include <iostream>
@@ -24,18 +25,17 @@ std::vector<VkVertexInputBindingDescription> Model::Vertex::getBindingDescriptio
 
 }
 
-std::vector<VkVertexInputAttributeDescription> createInputAttributeDescriptions(std::vector<InterleaveElement> elements, std::shared_ptr<Mesh> mesh, bool isStatic=false) {
+std::vector<VkVertexInputAttributeDescription> createInputAttributeDescriptions(std::vector<InterleaveElement> elements, const std::vector<VertexAttributeType> & types, bool isStatic=false) {
 
     std::vector<VkVertexInputAttributeDescription> descriptions(isStatic ? elements.size()+4 : elements.size()); // +4 for instance transform matrix data
 
     for (unsigned int i = 0; i < elements.size(); ++i) {
 
-        InterleaveElement elem = elements[i];
         descriptions[i].binding = 0;
         descriptions[i].location = i;
         descriptions[i].offset = elements[i].offset;
 
-        switch (mesh->getAttributeType(elem.attributeName)) {
+        switch (types[i]) {
 
             case ATTRIBUTE_F32_SCALAR:
                 descriptions[i].format = VK_FORMAT_R32_SFLOAT;
@@ -124,6 +124,17 @@ std::vector<VkVertexInputAttributeDescription> createInputAttributeDescriptions(
 
 }
 
+std::vector<VkVertexInputAttributeDescription> createInputAttributeDescriptions(std::vector<InterleaveElement> elements, std::shared_ptr<Mesh> mesh, bool isStatic=false) {
+
+    std::vector<VertexAttributeType> types(elements.size());
+
+    for (unsigned int i = 0; i < elements.size(); ++i)
+        types[i] = mesh->getAttributeType(elements[i].attributeName);
+
+    return createInputAttributeDescriptions(elements, types, isStatic);
+
+}
+
 std::vector<VkVertexInputBindingDescription> createInputBindingDescriptions(size_t stride, bool isStatic=false) {
 
     VkVertexInputBindingDescription description = {};
@@ -315,6 +326,22 @@ Model::Model(const vkutil::VulkanState & state, std::shared_ptr<Mesh> mesh, std:
 
 }
 
+Model::Model(const vkutil::VulkanState & state, std::shared_ptr<BakedMesh> mesh) : Resource("Model") {
+
+    this->attributeDescriptions = createInputAttributeDescriptions(mesh->getElements(), mesh->getTypes(), false);
+    this->bindingDescription = createInputBindingDescriptions(mesh->getStride(), false);
+
+    /// The buffers copy straight from the mapped cache file into staging memory.
+    this->vBuffer = new VertexBuffer<uint8_t>(state, mesh->getVertexData(), mesh->getVertexDataSize(), 0);
+    this->iBuffer = new IndexBuffer<uint8_t>(state, mesh->getIndexData(), mesh->getIndexDataSize(), mesh->getIndexSize());
+
+    this->vCount = mesh->getVertexCount();
+    this->iCount = mesh->getIndexCount();
+
+    status = STATUS_UNDEFINED;
+
+}
+
 Model::~Model() {
 
   //lout << "Deleting model" << std::endl;
@@ -331,6 +358,21 @@ void Model::bindForRender(VkCommandBuffer & cmdBuffer) {
 
 }
 
+void Model::bindForRender(VkCommandBuffer & cmdBuffer, vkutil::BindState & bindState) {
+
+    bindState.bindVertexBuffer(cmdBuffer, vBuffer->getBuffer());
+    bindState.bindIndexBuffer(cmdBuffer, iBuffer->getBuffer(), iBuffer->getIndexType());
+
+}
+
+VkBuffer Model::getVertexBuffer() {
+    return vBuffer->getBuffer();
+}
+
+VkBuffer Model::getIndexBuffer() {
+    return iBuffer->getBuffer();
+}
+
 int Model::getIndexCount() {
     return iCount;
 }
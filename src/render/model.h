@@ -11,6 +11,7 @@
 #include "resources/resourceloader.h"
 
 class Mesh;
+class BakedMesh;
 struct InterleaveElement;
 
 class Model : public Resource {
@@ -39,13 +40,19 @@ public:
   Model(const vkutil::VulkanState & state, std::shared_ptr<Mesh> mesh);
   Model(const vkutil::VulkanState & state, std::shared_ptr<Mesh> mesh, std::vector<InterleaveElement> elements, size_t elementSize);
   Model(const vkutil::VulkanState & state, std::shared_ptr<Mesh> mesh, std::vector<InterleaveElement> elements, size_t elementSize, bool isStatic);
+  Model(const vkutil::VulkanState & state, std::shared_ptr<BakedMesh> mesh);
   virtual ~Model();
 
   void uploadToGPU(const VkDevice & device, const VkCommandPool & commandPool, const vkutil::Queue & q);
 
   void bindForRender(VkCommandBuffer & cmdBuffer);
+  /// Only binds the buffers that are not already bound according to bindState.
+  void bindForRender(VkCommandBuffer & cmdBuffer, vkutil::BindState & bindState);
   int getIndexCount();
 
+  VkBuffer getVertexBuffer();
+  VkBuffer getIndexBuffer();
+
   virtual std::vector<VkVertexInputBindingDescription> getBindingDescription();
   virtual std::vector<VkVertexInputAttributeDescription> getAttributeDescriptions();
 
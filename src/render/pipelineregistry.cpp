@@ -0,0 +1,178 @@
+#include "pipelineregistry.h"
+
+#include "util/debug/trace_exception.h"
+
+PipelineRegistry::PipelineRegistry(const vkutil::VulkanState & state) : state(state) {
+
+  this->sharedCount = 0;
+
+}
+
+PipelineRegistry::~PipelineRegistry() {
+
+  clear();
+
+}
+
+template <typename T> static void appendValue(std::string & str, const T & value) {
+  str.append((const char *) &value, sizeof(T));
+}
+
+std::string PipelineRegistry::serializeKey(const Key & key) {
+
+  /// Every member is appended on its own, so padding bytes never end up in the key.
+  std::string str;
+
+  appendValue(str, key.modules.size());
+  for (VkShaderModule module : key.modules)
+    appendValue(str, module);
+
+  appendValue(str, key.vertexInput.binding.size());
+  for (const VkVertexInputBindingDescription & b : key.vertexInput.binding) {
+    appendValue(str, b.binding);
+    appendValue(str, b.stride);
+    appendValue(str, b.inputRate);
+  }
+
+  appendValue(str, key.vertexInput.attributes.size());
+  for (const VkVertexInputAttributeDescription & a : key.vertexInput.attributes) {
+    appendValue(str, a.location);
+    appendValue(str, a.binding);
+    appendValue(str, a.format);
+    appendValue(str, a.offset);
+  }
+
+  appendValue(str, key.descriptorBindings.size());
+  for (const VkDescriptorSetLayoutBinding & b : key.descriptorBindings) {
+    appendValue(str, b.binding);
+    appendValue(str, b.descriptorType);
+    appendValue(str, b.descriptorCount);
+    appendValue(str, b.stageFlags);
+    appendValue(str, b.pImmutableSamplers);
+  }
+
+  appendValue(str, key.renderPass);
+  appendValue(str, key.subpass);
+  appendValue(str, key.extent.width);
+  appendValue(str, key.extent.height);
+
+  return str;
+
+}
+
+VkPipeline PipelineRegistry::acquire(const Key & key, VkPipelineLayout & layout, std::function<VkPipeline(VkPipelineLayout &)> create) {
+
+  std::string keyStr = serializeKey(key);
+
+  std::unique_lock<std::mutex> guard(lock);
+
+  auto it = entries.find(keyStr);
+  while (it != entries.end() && !it->second.ready) {
+    created.wait(guard);
+    it = entries.find(keyStr);
+  }
+
+  if (it != entries.end()) {
+
+    it->second.refCount++;
+    sharedCount++;
+
+    layout = it->second.layout;
+    return it->second.pipeline;
+
+  }
+
+  /// Placeholder so other acquires of the key wait instead of compiling the same pipeline.
+  entries[keyStr] = {VK_NULL_HANDLE, VK_NULL_HANDLE, 0, false};
+
+  guard.unlock();
+
+  VkPipelineLayout newLayout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+
+  try {
+    pipeline = create(newLayout);
+  } catch (...) {
+    guard.lock();
+    entries.erase(keyStr);
+    created.notify_all();
+    throw;
+  }
+
+  guard.lock();
+
+  if (pipeline == VK_NULL_HANDLE) {
+    entries.erase(keyStr);
+    created.notify_all();
+    throw dbg::trace_exception("Pipeline creation for registry failed");
+  }
+
+  Entry & entry = entries[keyStr];
+  entry.pipeline = pipeline;
+  entry.layout = newLayout;
+  entry.refCount = 1;
+  entry.ready = true;
+
+  keysByPipeline[pipeline] = keyStr;
+
+  created.notify_all();
+
+  layout = newLayout;
+  return pipeline;
+
+}
+
+void PipelineRegistry::release(VkPipeline pipeline) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  /// Pipelines from before the last clear() are already gone.
+  auto keyIt = keysByPipeline.find(pipeline);
+  if (keyIt == keysByPipeline.end())
+    return;
+
+  auto it = entries.find(keyIt->second);
+  if (--it->second.refCount)
+    return;
+
+  vkDestroyPipeline(state.device, it->second.pipeline, nullptr);
+  vkDestroyPipelineLayout(state.device, it->second.layout, nullptr);
+
+  entries.erase(it);
+  keysByPipeline.erase(keyIt);
+
+}
+
+void PipelineRegistry::clear() {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  /// Pipelines that are still being created are kept, their creators publish them afterwards.
+  for (auto it = entries.begin(); it != entries.end();) {
+
+    if (!it->second.ready) {
+      ++it;
+      continue;
+    }
+
+    vkDestroyPipeline(state.device, it->second.pipeline, nullptr);
+    vkDestroyPipelineLayout(state.device, it->second.layout, nullptr);
+
+    it = entries.erase(it);
+
+  }
+
+  keysByPipeline.clear();
+
+}
+
+size_t PipelineRegistry::getPipelineCount() {
+
+  std::lock_guard<std::mutex> guard(lock);
+  return entries.size();
+
+}
+
+uint32_t PipelineRegistry::getSharedCount() {
+  return sharedCount;
+}
@@ -0,0 +1,82 @@
+#ifndef PIPELINEREGISTRY_H
+#define PIPELINEREGISTRY_H
+
+#include <vulkan/vulkan.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "render/util/vkutil.h"
+
+/**
+ * Shares graphics pipelines between render elements that would otherwise
+ * create identical ones. Pipelines are keyed by shader modules, vertex input,
+ * descriptor set layout bindings, render pass, subpass and extent, and are
+ * destroyed once the last user releases them.
+ **/
+class PipelineRegistry {
+
+public:
+
+  struct Key {
+
+    std::vector<VkShaderModule> modules;
+    vkutil::VertexInputDescriptions vertexInput;
+    /// Layouts with identical bindings are compatible, so the contents are compared, not the handle.
+    std::vector<VkDescriptorSetLayoutBinding> descriptorBindings;
+    VkRenderPass renderPass;
+    uint32_t subpass;
+    VkExtent2D extent;
+
+  };
+
+  PipelineRegistry(const vkutil::VulkanState & state);
+  virtual ~PipelineRegistry();
+
+  /**
+   * Returns the pipeline for key, create is only called if there is none yet.
+   * create runs without holding the registry lock, other acquires of the
+   * same key wait for it to finish.
+   **/
+  VkPipeline acquire(const Key & key, VkPipelineLayout & layout, std::function<VkPipeline(VkPipelineLayout &)> create);
+  void release(VkPipeline pipeline);
+
+  /// Destroys all pipelines, the users have to acquire new ones (e.g. after recreating the swapchain).
+  void clear();
+
+  size_t getPipelineCount();
+  uint32_t getSharedCount();
+
+private:
+
+  struct Entry {
+
+    VkPipeline pipeline;
+    VkPipelineLayout layout;
+    uint32_t refCount;
+
+    /// False while the pipeline is still being created.
+    bool ready;
+
+  };
+
+  static std::string serializeKey(const Key & key);
+
+  const vkutil::VulkanState & state;
+
+  std::mutex lock;
+  /// Notified whenever a pending entry is published or dropped.
+  std::condition_variable created;
+  std::map<std::string, Entry> entries;
+  std::unordered_map<VkPipeline, std::string> keysByPipeline;
+
+  /// Number of acquires that did not have to create a pipeline.
+  uint32_t sharedCount;
+
+};
+
+#endif // PIPELINEREGISTRY_H
@@ -289,7 +289,6 @@ void PPEffect::setupPipeline(const vkutil::VulkanState & state, const vkutil::Sw
   pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
   pipelineInfo.basePipelineIndex = -1;
 
-  if (VkResult res = vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline))
-    throw vkutil::vk_trace_exception("Unable to create pipeline", res);
+  pipeline = vkutil::createGraphicsPipeline(state, pipelineInfo);
   
 }
@@ -2,6 +2,8 @@
 
 #include "storagebuffer.h"
 
+#include <cmath>
+
 #define GLM_FORCE_RADIANS
 #define GLM_ENABLE_EXPERIMENTAL
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
@@ -15,6 +17,9 @@
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Shader> shader, std::vector<std::shared_ptr<Texture>> texture, int scSize, Transform<float> & initTransform) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   std::vector<Shader::Binding> binds;
 
   Shader::Binding uniformBufferBinding;
@@ -36,6 +41,7 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
   this->model = model;
   this->shader = shader;
   this->texture = texture;
+  this->pipeline = VK_NULL_HANDLE;
 
   std::array<float, 3> rAxis = {0.0, 0.0, 1.0};
 
@@ -45,6 +51,9 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, int scSize, Transform<float> & initTransform) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   std::vector<Shader::Binding> binds;
 
   Shader::Binding uniformBufferBinding;
@@ -73,12 +82,17 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
   model->uploadToGPU(state.device, state.transferCommandPool, state.transferQueue);
 
   descSetLayout = mat->prepareDescriptors(this->binds);
-  pipeline = mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout);
+  pipeline = acquirePipeline(view->getRenderpass(), view->getSwapchainExtent(), [&] (VkPipelineLayout & layout) {
+    return mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout);
+  });
 
 }
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, int scSize, Transform<float> & initTransform, bool useStaticShader) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   std::vector<Shader::Binding> binds;
 
   Shader::Binding uniformBufferBinding;
@@ -114,16 +128,20 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
   model->uploadToGPU(state.device, state.transferCommandPool, state.transferQueue);
 
   descSetLayout = mat->prepareDescriptors(this->binds);
-  if (!useStaticShader) {
-    pipeline = mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout);
-  } else {
-    pipeline = mat->setupStaticPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout);
-  }
+  pipeline = acquirePipeline(view->getRenderpass(), view->getSwapchainExtent(), [&] (VkPipelineLayout & layout) {
+    if (!useStaticShader)
+      return mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout);
+    else
+      return mat->setupStaticPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout);
+  });
 
 }
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, int scSize, Transform<float> & initTransform, MaterialUsecase matUse) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   std::vector<Shader::Binding> binds;
 
   Shader::Binding uniformBufferBinding;
@@ -153,13 +171,18 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
 
   descSetLayout = mat->prepareDescriptors(this->binds, matUse);
  
-  pipeline = mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout, matUse);
+  pipeline = acquirePipeline(view->getRenderpass(), view->getSwapchainExtent(), [&] (VkPipelineLayout & layout) {
+    return mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout, matUse);
+  });
 
 
 }
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, int scSize, Transform<float> & initTransform, std::vector<Shader::Binding> binds) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   this->binds = binds;
 
   this->model = model;
@@ -169,13 +192,18 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
   model->uploadToGPU(state.device, state.transferCommandPool, state.transferQueue);
 
   descSetLayout = mat->prepareDescriptors(this->binds);
-  pipeline = mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout);
+  pipeline = acquirePipeline(view->getRenderpass(), view->getSwapchainExtent(), [&] (VkPipelineLayout & layout) {
+    return mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout);
+  });
 
 
 }
 
 RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> mat, Transform<float> & initTransform, std::vector<Shader::Binding> binds, MaterialUsecase matUse) : state(view->getState()), MemoryTransferer(*view) {
 
+  pipelineRegistry = view->getPipelineRegistry();
+  uniformArena = view->getUniformArena();
+
   this->binds = binds;
 
   this->model = model;
@@ -185,7 +213,9 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
   model->uploadToGPU(state.device, state.transferCommandPool, state.transferQueue);
 
   descSetLayout = mat->prepareDescriptors(this->binds);
-  pipeline = mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), pipelineLayout, matUse);
+  pipeline = acquirePipeline(view->getRenderpass(), view->getSwapchainExtent(), [&] (VkPipelineLayout & layout) {
+    return mat->setupPipeline(state, view->getRenderpass(), view->getSwapchainExtent(), descSetLayout, model.get(), layout, matUse);
+  });
 
 
 }
@@ -193,6 +223,25 @@ RenderElement::RenderElement(Viewport * view, std::shared_ptr<Model> model, std:
 RenderElement::~RenderElement() {
 
   vkDestroyDescriptorPool(state.device, descPool, nullptr);
+  pipelineRegistry->release(pipeline);
+
+}
+
+VkPipeline RenderElement::acquirePipeline(VkRenderPass renderPass, VkExtent2D extent, std::function<VkPipeline(VkPipelineLayout &)> create) {
+
+  PipelineRegistry::Key key;
+
+  for (vkutil::ShaderInputDescription & desc : shader->getShaderInputDescriptions())
+    key.modules.push_back(desc.module);
+
+  key.vertexInput.binding = model->getBindingDescription();
+  key.vertexInput.attributes = model->getAttributeDescriptions();
+  key.descriptorBindings = shader->getVkBindings(binds);
+  key.renderPass = renderPass;
+  key.subpass = 0;
+  key.extent = extent;
+
+  return pipelineRegistry->acquire(key, pipelineLayout, create);
 
 }
 
@@ -248,29 +297,8 @@ void RenderElement::deleteInstance(Instance & instance) {
 
 void RenderElement::createUniformBuffers(int swapChainSize, std::vector<Shader::Binding> & bindings) {
 
-  VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-
-  uniformBuffers.resize(swapChainSize);
-  uniformBuffersMemory.resize(swapChainSize);
-
-  for (int i = 0; i < swapChainSize; ++i) {
-
-    VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stBufferCreateInfo.size = bufferSize;
-    stBufferCreateInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VmaAllocationCreateInfo stAllocCreateInfo = {};
-    stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VmaAllocationInfo stagingBufferAllocInfo = {};
-
-    vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &uniformBuffers[i], &uniformBuffersMemory[i], &stagingBufferAllocInfo);
-
-  }
-
-  bindings[0].uniformBuffers = uniformBuffers;
+  /// The UniformBufferObject is the same for all elements, it lives in the shared slot of the arena.
+  uniformArena->setupBinding(bindings[0].uniformBuffers, bindings[0].uniformOffsets, uniformArena->getShared());
 
 }
 
@@ -280,7 +308,10 @@ void RenderElement::recreateResources(VkRenderPass & renderPass, int scSize, con
   descs.attributes = this->model->getAttributeDescriptions();
   descs.binding = this->model->getBindingDescription();
 
-  pipeline = shader->setupGraphicsPipeline(descs, renderPass, state, descSetLayout, swapchain.extent, pipelineLayout);
+  /// The registry was cleared with the old swapchain, so this never releases the old pipeline.
+  pipeline = acquirePipeline(renderPass, swapchain.extent, [&] (VkPipelineLayout & layout) {
+    return shader->setupGraphicsPipeline(descs, renderPass, state, descSetLayout, swapchain.extent, layout);
+  });
 
   descPool = shader->setupDescriptorPool(scSize, binds);
   createUniformBuffers(scSize, this->binds);
@@ -288,13 +319,29 @@ void RenderElement::recreateResources(VkRenderPass & renderPass, int scSize, con
 
 }
 
-void RenderElement::destroyUniformBuffers(const vkutil::SwapChain & swapchain) {
+const std::vector<std::shared_ptr<Texture>> & RenderElement::getTextures() {
+  return texture;
+}
 
-  for (int i = 0; i < swapchain.images.size(); ++i) {
+void RenderElement::updateTextureDescriptors() {
 
-    vmaDestroyBuffer(state.vmaAllocator, uniformBuffers[i], uniformBuffersMemory[i]);
+  shader->writeDescriptorSets(descriptorSets, binds, texture);
 
-  }
+}
+
+float RenderElement::getViewDistance(const Math::Vector<3, float> & position) {
+
+  float dx = transform.position[0] - position[0];
+  float dy = transform.position[1] - position[1];
+  float dz = transform.position[2] - position[2];
+
+  return std::sqrt(dx * dx + dy * dy + dz * dz);
+
+}
+
+void RenderElement::destroyUniformBuffers(const vkutil::SwapChain & swapchain) {
+
+  /// The uniform memory is owned by the arena of the viewport.
 
 }
 
@@ -310,10 +357,7 @@ bool RenderElement::reusable() {
 
 void RenderElement::updateUniformBuffer(UniformBufferObject & obj,  uint32_t imageIndex) {
 
-  void * data;
-  vmaMapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex], &data);
-  memcpy(data, &obj, sizeof(UniformBufferObject));
-  vmaUnmapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex]);
+  /// obj has already been written to the shared slot by the viewport.
 
 }
 
@@ -325,18 +369,36 @@ Shader * RenderElement::getShader() {
   return this->shader.get();
 }
 
+VkPipeline RenderElement::getPipeline() {
+  return this->pipeline;
+}
+
+VkDescriptorSetLayout RenderElement::getDescriptorSetLayout() {
+  return this->descSetLayout;
+}
+
+Model * RenderElement::getModel() {
+  return this->model.get();
+}
+
 void RenderElement::render(VkCommandBuffer & cmdBuffer, uint32_t frameIndex) {
 
+  vkutil::BindState bindState;
+  render(cmdBuffer, frameIndex, bindState);
+
+}
+
+void RenderElement::render(VkCommandBuffer & cmdBuffer, uint32_t frameIndex, vkutil::BindState & bindState) {
+
   //lout << "Pipeline " << pipeline << std::endl;
-  vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-  vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[frameIndex], 0, nullptr);
+  bindState.bindPipeline(cmdBuffer, pipeline);
+  bindState.bindDescriptorSet(cmdBuffer, pipelineLayout, descriptorSets[frameIndex]);
 
   glm::mat4 data = toGLMMatrix(getTransformationMatrix(transform));
 
-  vkCmdPushConstants(cmdBuffer, shader->getPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
+  vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
 
-  model->bindForRender(cmdBuffer);
-  VkDeviceSize offsets[] = {0};
+  model->bindForRender(cmdBuffer, bindState);
   //vkCmdBindVertexBuffers(cmdBuffer, 1, 1, &instanceBuffer->getBuffer(), offsets);
 
   vkCmdDrawIndexed(cmdBuffer, model->getIndexCount(), 1, 0, 0, 0);
@@ -351,7 +413,7 @@ void RenderElement::renderShaderless(VkCommandBuffer & buffer, uint32_t frameInd
 
   glm::mat4 data = toGLMMatrix(getTransformationMatrix(transform));
 
-  vkCmdPushConstants(buffer, shader->getPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
+  vkCmdPushConstants(buffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, 16 * sizeof(float), &data);
 
   model->bindForRender(buffer);
   VkDeviceSize offsets[] = {0};
@@ -364,10 +426,6 @@ std::vector<VkDescriptorSet> & RenderElement::getDescriptorSets() {
   return this->descriptorSets;
 }
 
-std::vector<VmaAllocation> & RenderElement::getMemories() {
-  return this->uniformBuffersMemory;
-}
-
 RenderElement * RenderElement::buildRenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> material, Transform<float> & initTransform) {
 
   RenderElement * rElem = new RenderElement(view, model, material, view->getSwapchainSize(), initTransform);
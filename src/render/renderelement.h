@@ -5,6 +5,7 @@
 #include <vector>
 #include <unordered_map>
 #include <mutex>
+#include <functional>
 
 #include "model.h"
 #include "texture.h"
@@ -13,6 +14,8 @@
 #include <mathutils/quaternion.h>
 #include "memorytransferhandler.h"
 #include "material.h"
+#include "pipelineregistry.h"
+#include "uniformarena.h"
 
 #include "util/transform.h"
 
@@ -48,7 +51,9 @@ public:
 
   glm::mat4 getTransformationMatrixGLM(Transform<float> & instance);
 
-  virtual void render(VkCommandBuffer & cmdBuffer, uint32_t frameIndex);
+  void render(VkCommandBuffer & cmdBuffer, uint32_t frameIndex);
+  /// Records the draw, skipping every bind that is already present in bindState.
+  virtual void render(VkCommandBuffer & cmdBuffer, uint32_t frameIndex, vkutil::BindState & bindState);
   virtual void renderShaderless(VkCommandBuffer & buffer, uint32_t frameIndex);
 
   virtual Instance addInstance(Transform<float> & trans);
@@ -63,7 +68,13 @@ public:
   virtual void updateUniformBuffer(UniformBufferObject & obj, uint32_t frameIndex);
 
   std::vector<VkDescriptorSet> & getDescriptorSets();
-  std::vector<VmaAllocation> & getMemories();
+
+  const std::vector<std::shared_ptr<Texture>> & getTextures();
+  /// Rewrites the descriptor sets after the images of the textures changed, no frame may be using them.
+  void updateTextureDescriptors();
+
+  /// Distance of the closest instance to position, used to pick the resident texture levels.
+  virtual float getViewDistance(const Math::Vector<3, float> & position);
 
   virtual bool needsDrawCmdUpdate();
 
@@ -72,6 +83,11 @@ public:
 
   Shader * getShader();
 
+  /// Used to sort the draws by the state they need.
+  VkPipeline getPipeline();
+  VkDescriptorSetLayout getDescriptorSetLayout();
+  Model * getModel();
+
   virtual void constructBuffers(int scSize);
 
   static RenderElement * buildRenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Material> material, Transform<float> & initTransform);
@@ -85,8 +101,7 @@ protected:
 
   VkDescriptorSetLayout descSetLayout;
   std::vector<VkDescriptorSet> descriptorSets;
-  std::vector<VkBuffer> uniformBuffers;
-  std::vector<VmaAllocation> uniformBuffersMemory;
+  std::shared_ptr<UniformArena> uniformArena;
 
   std::vector<Shader::Binding> binds;
   Transform<float> transform;
@@ -101,6 +116,10 @@ protected:
   VkPipeline pipeline;
   VkPipelineLayout pipelineLayout;
 
+  /// pipeline and pipelineLayout are owned by the registry and shared with other elements.
+  std::shared_ptr<PipelineRegistry> pipelineRegistry;
+  VkPipeline acquirePipeline(VkRenderPass renderPass, VkExtent2D extent, std::function<VkPipeline(VkPipelineLayout &)> create);
+
 private:
 
   RenderElement(Viewport * view, std::shared_ptr<Model> model, std::shared_ptr<Shader> shader, std::vector<std::shared_ptr<Texture>> texture, int scSize, Transform<float> & initTransform);
@@ -11,7 +11,10 @@ RenderElementAnim::RenderElementAnim(Viewport * view, std::shared_ptr<Model> mod
 }
 
 RenderElementAnim::~RenderElementAnim() {
-  //dtor
+
+  if (animationUniform.size)
+    uniformArena->release(animationUniform);
+
 }
 
 std::vector<Shader::Binding> RenderElementAnim::getShaderBindings(std::shared_ptr<Material> material, std::shared_ptr<Skin> skin) {
@@ -32,63 +35,26 @@ std::vector<Shader::Binding> RenderElementAnim::getShaderBindings(std::shared_pt
 
 void RenderElementAnim::createUniformBuffers(int swapChainSize, std::vector<Shader::Binding> & bindings) {
 
-  VkDeviceSize bufferSize = sizeof(UniformBufferObject);
   VkDeviceSize animationSize = this->skin->getDataSize();
 
-  lout << "animationSize " << animationSize << " bufferSize " << bufferSize << std::endl;
-
-  uniformBuffers.resize(swapChainSize);
-  uniformBuffersMemory.resize(swapChainSize);
-
-  animationBuffers.resize(swapChainSize);
-  animationBuffersMemory.resize(swapChainSize);
-
-  for (int i = 0; i < swapChainSize; ++i) {
-
-    VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stBufferCreateInfo.size = bufferSize;
-    stBufferCreateInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VmaAllocationCreateInfo stAllocCreateInfo = {};
-    stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VmaAllocationInfo stagingBufferAllocInfo = {};
+  lout << "animationSize " << animationSize << std::endl;
 
-    vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &uniformBuffers[i], &uniformBuffersMemory[i], &stagingBufferAllocInfo);
+  RenderElement::createUniformBuffers(swapChainSize, bindings);
 
-    VkBufferCreateInfo stAnimBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stAnimBufferCreateInfo.size = animationSize;
-    stAnimBufferCreateInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    stAnimBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  /// The bone data gets its own slot in the arena of the viewport.
+  animationUniform = uniformArena->allocate(animationSize);
 
-    VmaAllocationCreateInfo stAnimAllocCreateInfo = {};
-    stAnimAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stAnimAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VmaAllocationInfo stagingAnimBufferAllocInfo = {};
-
-    vmaCreateBuffer(state.vmaAllocator, &stAnimBufferCreateInfo, &stAnimAllocCreateInfo, &animationBuffers[i], &animationBuffersMemory[i], &stagingAnimBufferAllocInfo);
-
-  }
-
-  bindings[0].uniformBuffers = uniformBuffers;
   lout << "Setting animation Buffer" << std::endl;
-  bindings[bindings.size()-1].uniformBuffers = animationBuffers;
+  uniformArena->setupBinding(bindings[bindings.size()-1].uniformBuffers, bindings[bindings.size()-1].uniformOffsets, animationUniform);
 
 }
 
 void RenderElementAnim::destroyUniformBuffers(const vkutil::SwapChain & swapchain) {
 
-  for (int i = 0; i < swapchain.images.size(); ++i) {
+  if (animationUniform.size)
+    uniformArena->release(animationUniform);
 
-    vmaDestroyBuffer(state.vmaAllocator, uniformBuffers[i], uniformBuffersMemory[i]);
-    vmaDestroyBuffer(state.vmaAllocator, animationBuffers[i], animationBuffersMemory[i]);
-
-  }
-
-  /// TODO: Destroy animation data buffers.
+  animationUniform = {0, 0};
 
 }
 
@@ -98,15 +64,6 @@ void RenderElementAnim::setSkin(std::shared_ptr<Skin> skin) {
 
 void RenderElementAnim::updateUniformBuffer(UniformBufferObject & obj, uint32_t imageIndex) {
 
-  void * data;
-  vmaMapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex], &data);
-  memcpy(data, &obj, sizeof(UniformBufferObject));
-  vmaUnmapMemory(state.vmaAllocator, uniformBuffersMemory[imageIndex]);
-
-  vmaMapMemory(state.vmaAllocator, animationBuffersMemory[imageIndex], &data);
-  this->skin->writeTransformDataToBuffer((float *) data);
-  vmaUnmapMemory(state.vmaAllocator, animationBuffersMemory[imageIndex]);
-
-  std::cout << "Updates RenderElementAnim" << std::endl;
+  this->skin->writeTransformDataToBuffer((float *) uniformArena->getData(imageIndex, animationUniform));
 
 }
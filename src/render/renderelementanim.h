@@ -21,8 +21,8 @@ protected:
   
 private:
   
-  std::vector<VkBuffer> animationBuffers;
-  std::vector<VmaAllocation> animationBuffersMemory;
+  /// size is 0 while the element has no slot.
+  UniformArena::Allocation animationUniform = {0, 0};
   
   std::vector<Shader::Binding> getShaderBindings(std::shared_ptr<Material> material, std::shared_ptr<Skin> skin);
   std::shared_ptr<Skin> skin;
@@ -273,9 +273,17 @@ std::vector<VkDescriptorSet> Shader::createDescriptorSets(VkDescriptorPool & des
   if (VkResult r = vkAllocateDescriptorSets(device, &allocInfo, descSets.data()))
     throw vkutil::vk_trace_exception("Unable to allocate descriptor sets", r);
 
+  writeDescriptorSets(descSets, binds, tex);
+
+  return descSets;
+
+}
+
+void Shader::writeDescriptorSets(std::vector<VkDescriptorSet> & descSets, std::vector<Binding> & binds, std::vector<std::shared_ptr<Texture>> & tex) {
+
   std::vector<VkDescriptorBufferInfo> bufferInfos(binds.size());
 
-  for (int i = 0; i < scSize; ++i) {
+  for (unsigned int i = 0; i < descSets.size(); ++i) {
 
     std::vector<VkWriteDescriptorSet> descriptorWrites(binds.size());
     std::vector<VkDescriptorImageInfo> imageInfos(textureSlots);
@@ -323,7 +331,7 @@ std::vector<VkDescriptorSet> Shader::createDescriptorSets(VkDescriptorPool & des
 	throw dbg::trace_exception("Trying to use NULL-buffer as uniform buffer");
 
       bufferInfos[j].buffer = binds[j].uniformBuffers[i];
-      bufferInfos[j].offset = 0;
+      bufferInfos[j].offset = binds[j].uniformOffsets.size() ? binds[j].uniformOffsets[i] : 0;
       bufferInfos[j].range = binds[j].elementSize;
 
 
@@ -343,8 +351,6 @@ std::vector<VkDescriptorSet> Shader::createDescriptorSets(VkDescriptorPool & des
 
   }
 
-  return descSets;
-
 }
 
 VkPipeline & Shader::getPipeline() {
@@ -34,6 +34,8 @@ public:
     // the value specified in the resource file.
 
     std::vector<VkBuffer> uniformBuffers;
+    /// Offset into uniformBuffers for every frame, 0 if empty.
+    std::vector<VkDeviceSize> uniformOffsets;
     size_t elementSize;
 
   };
@@ -53,6 +55,8 @@ public:
 
   VkDescriptorPool setupDescriptorPool(int scSize, std::vector<Binding> & binds);
   std::vector<VkDescriptorSet> createDescriptorSets(VkDescriptorPool & descPool, const VkDescriptorSetLayout & descLayout, std::vector<Binding> & binds, std::vector<std::shared_ptr<Texture>>& tex, int scSize);
+  /// Writes the buffers and the current views of the textures into already allocated sets.
+  void writeDescriptorSets(std::vector<VkDescriptorSet> & descSets, std::vector<Binding> & binds, std::vector<std::shared_ptr<Texture>> & tex);
   VkPipeline & getPipeline();
   VkPipelineLayout & getPipelineLayout();
 
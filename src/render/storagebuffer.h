@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.h>
 
 #include "render/util/vkutil.h"
+#include "render/util/stagingpool.h"
 
 class StorageBuffer
 {
@@ -30,8 +31,7 @@ class StorageBuffer
         const vkutil::VulkanState & state;
 
         VkDeviceSize bufferSize;
-        VkBuffer stagingBuffer;
-        VmaAllocation stagingBufferMemory;
+        vkutil::StagingBuffer staging;
 
     private:
 
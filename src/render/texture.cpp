@@ -3,10 +3,13 @@
 #include <string.h>
 #include <limits>
 #include "util/vkutil.h"
+#include "util/stagingpool.h"
 #include "storagebuffer.h"
+#include "texturestreamer.h"
 
 #include <tga.h>
 #include <cmath>
+#include <sys/stat.h>
 
 #include <iostream>
 
@@ -22,32 +25,20 @@ Texture::Texture(vkutil::VulkanState & state, const std::vector<float> & data, i
     format = VK_FORMAT_R32G32B32A32_SFLOAT;
     layout = VK_IMAGE_LAYOUT_UNDEFINED;
     layerCount = 1;
+    residentLevel = 0;
+    streamer = nullptr;
 
     VkDeviceSize imageSize = sizeof(float) * data.size();
-    VkBuffer stagingBuffer;
-    VmaAllocation stagingBufferMemory;
-
-    VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stBufferCreateInfo.size = imageSize;
-    stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VmaAllocationCreateInfo stAllocCreateInfo = {};
-    stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VmaAllocationInfo stagingBufferAllocInfo = {};
-
-    vmaCreateBuffer(allocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
-
-    memcpy(stagingBufferAllocInfo.pMappedData, data.data(), imageSize);
+    StagingBuffer staging = state.stagingPool->acquire(imageSize);
+    memcpy(staging.data, data.data(), imageSize);
 
     mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
 
     vkutil::createImage(allocator, device, width, height, depth, mipLevels, format, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory);
 
     this->transitionLayout(state, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copyBufferToImage(state, stagingBuffer, image, width, height, depth, 1);
+    copyBufferToImage(state, staging.buffer, image, width, height, depth, 1);
+    state.stagingPool->countUpload(imageSize);
     //this->transitionLayout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
     lout << "Generating mipmaps" << std::endl;
@@ -57,7 +48,7 @@ Texture::Texture(vkutil::VulkanState & state, const std::vector<float> & data, i
     this->transitionLayout(state, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     this->layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-    vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferMemory);
+    state.stagingPool->release(staging);
     /*vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingMemory, nullptr);*/
 
@@ -67,63 +58,89 @@ Texture::Texture(vkutil::VulkanState & state, const std::vector<float> & data, i
 
 }
 
-Texture::Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data, int width, int height, int depth) : Texture(state, data, width, height, depth, VK_IMAGE_VIEW_TYPE_2D, 1, 0) {
+Texture::Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data, int width, int height, int depth) : Texture(state, mipGenerateChain(data.data(), width, height)) {
+
 
+}
+
+Texture::Texture(vkutil::VulkanState & state, const MipChain & chain) : Texture(state, chain, VK_IMAGE_VIEW_TYPE_2D, 0) {
 
 }
 
-Texture::Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data, int width, int height, int depth, VkImageViewType viewType, int layerCount, VkImageCreateFlags flags) : Resource("Texture"), allocator(state.vmaAllocator), device(state.device) {
+Texture::Texture(vkutil::VulkanState & state, const MipChain & chain, VkImageViewType viewType, VkImageCreateFlags flags) : Resource("Texture"), allocator(state.vmaAllocator), device(state.device) {
 
-    //format = VK_FORMAT_R32G32B32A32_SFLOAT;
     format = VK_FORMAT_R8G8B8A8_UNORM;
-    layout = VK_IMAGE_LAYOUT_UNDEFINED;
-    this->layerCount = layerCount;
+    layerCount = chain.layerCount;
+    mipLevels = chain.levels.size();
+    residentLevel = 0;
+    streamer = nullptr;
 
-    VkDeviceSize imageSize = sizeof(uint8_t) * data.size();
-    VkBuffer stagingBuffer;
-    VmaAllocation stagingBufferMemory;
+    /// Every level holds all layers, so one region per level copies the whole chain.
+    std::vector<VkBufferImageCopy> regions(mipLevels);
 
-    VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stBufferCreateInfo.size = imageSize;
-    stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    for (int i = 0; i < mipLevels; ++i) {
 
-    VmaAllocationCreateInfo stAllocCreateInfo = {};
-    stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        regions[i] = {};
+        regions[i].bufferOffset = chain.levels[i].offset;
+        regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        regions[i].imageSubresource.mipLevel = i;
+        regions[i].imageSubresource.baseArrayLayer = 0;
+        regions[i].imageSubresource.layerCount = layerCount;
+        regions[i].imageExtent = {chain.levels[i].width, chain.levels[i].height, 1};
 
-    VmaAllocationInfo stagingBufferAllocInfo = {};
+    }
 
-    vmaCreateBuffer(allocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
+    uploadLevels(state, chain.data.data(), chain.data.size(), regions, chain.levels[0].width, chain.levels[0].height, viewType, flags);
 
-    memcpy(stagingBufferAllocInfo.pMappedData, data.data(), imageSize);
+}
 
-    mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+Texture::Texture(vkutil::VulkanState & state, std::shared_ptr<CompressedImage> compressed) : Texture(state, std::make_shared<CompressedLevelSource>(state, compressed)) {
 
-    lout << "Creating Image" << std::endl;
+}
 
-    vkutil::createImage(allocator, device, width, height, depth, mipLevels, format, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, flags, layerCount);
+Texture::Texture(vkutil::VulkanState & state, std::shared_ptr<TextureLevelSource> source) : Resource("Texture"), allocator(state.vmaAllocator), device(state.device) {
 
-    lout << "Trasitioning Layout" << std::endl;
+    format = source->getFormat();
+    layerCount = 1;
+    mipLevels = source->getLevels().size();
 
-    //state.graphicsQueueMutex.lock();
-    this->transitionLayout(state, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copyBufferToImage(state, stagingBuffer, image, width, height, depth, layerCount);
-    //this->transitionLayout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    /// Streamed textures start with the tail, the streamer brings in the levels the viewport asks for.
+    streamer = state.textureStreamer;
+    residentLevel = streamer ? TextureStreamer::getTailLevel(*source) : 0;
 
-    lout << "Generating mipmaps" << std::endl;
-    //state.graphicsQueueMutex.lock();
-    generateMipmaps(width, height, state.loadingCommandPool, device, state.graphicsQueue);
-    //state.graphicsQueueMutex.unlock();
-    lout << "done" << std::endl;
-    //state.graphicsQueueMutex.unlock();
+    /// Textures no larger than the tail have nothing to stream.
+    if (!residentLevel)
+        streamer = nullptr;
 
-    //this->transitionLayout(state, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    this->layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    uploadLevels(state, state.loadingCommandPool, *source, residentLevel, image, memory, view);
+    layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-    vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferMemory);
-    /*vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingMemory, nullptr);*/
+    /// The sampler covers all levels, views of fewer levels are clamped by the image.
+    this->sampler = createSampler(state, mipLevels);
+
+    if (streamer) {
+        levelSource = source;
+        streamer->registerTexture(this);
+    }
+
+}
+
+void Texture::uploadLevels(vkutil::VulkanState & state, const uint8_t * data, VkDeviceSize size, const std::vector<VkBufferImageCopy> & regions, uint32_t width, uint32_t height, VkImageViewType viewType, VkImageCreateFlags flags) {
+
+    layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    StagingBuffer staging = state.stagingPool->acquire(size);
+    memcpy(staging.data, data, size);
+
+    vkutil::createImage(allocator, device, width, height, 1, mipLevels, format, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory, flags, layerCount);
+
+    /// All levels are complete, so there is no mipmap generation on the graphics queue.
+    this->transitionLayout(state, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    copyBufferToImage(state, staging.buffer, image, regions);
+    state.stagingPool->countUpload(size);
+    this->transitionLayout(state, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    state.stagingPool->release(staging);
 
     view = vkutil::createImageView(device, image, format, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels, viewType, layerCount);
 
@@ -133,6 +150,9 @@ Texture::Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data,
 
 Texture::~Texture() {
 
+    if (streamer)
+        streamer->unregisterTexture(this);
+
     vkDestroyImageView(device, view, nullptr);
     /*vkDestroyImage(device, image, nullptr);
     vkFreeMemory(device, memory, nullptr);*/
@@ -213,6 +233,31 @@ VkSampler & Texture::getSampler() {
     return sampler;
 }
 
+uint32_t Texture::getResidentLevel() {
+    return residentLevel;
+}
+
+uint32_t Texture::getLevelCount() {
+    return mipLevels;
+}
+
+std::shared_ptr<TextureLevelSource> Texture::getLevelSource() {
+    return levelSource;
+}
+
+void Texture::swapResidentLevels(VkImage & newImage, VmaAllocation & newMemory, VkImageView & newView, uint32_t & firstLevel) {
+
+    std::swap(image, newImage);
+    std::swap(memory, newMemory);
+    std::swap(view, newView);
+    std::swap(residentLevel, firstLevel);
+
+}
+
+void Texture::detachStreamer() {
+    streamer = nullptr;
+}
+
 void Texture::copyBufferToImage(VulkanState & state, VkBuffer & buffer, VkImage & image, uint32_t width, uint32_t height, uint32_t depth, uint32_t layerCount) {
 
     VkCommandBuffer commandBuffer = vkutil::beginSingleCommand(state.transferCommandPool, state.device);
@@ -236,6 +281,16 @@ void Texture::copyBufferToImage(VulkanState & state, VkBuffer & buffer, VkImage
 
 }
 
+void Texture::copyBufferToImage(VulkanState & state, VkBuffer & buffer, VkImage & image, const std::vector<VkBufferImageCopy> & regions) {
+
+    VkCommandBuffer commandBuffer = vkutil::beginSingleCommand(state.transferCommandPool, state.device);
+
+    vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(), regions.data());
+
+    vkutil::endSingleCommand(commandBuffer, state.transferCommandPool, state.device, state.transferQueue);
+
+}
+
 void Texture::transitionLayout(VulkanState & state, VkImageLayout newLayout) {
 
 
@@ -356,6 +411,82 @@ VkSampler Texture::createSampler(const VulkanState & state, int mipLevels) {
 
 }
 
+bool Texture::isFormatSupported(const VulkanState & state, VkFormat format) {
+
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(state.physicalDevice, format, &properties);
+
+    return properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+
+}
+
+void Texture::uploadLevels(VulkanState & state, const VkCommandPool & commandPool, const TextureLevelSource & source, uint32_t firstLevel, VkImage & image, VmaAllocation & memory, VkImageView & view) {
+
+    const std::vector<texture_level_t> & levels = source.getLevels();
+    uint32_t levelCount = levels.size() - firstLevel;
+
+    StagingBuffer staging = state.stagingPool->acquire(source.getSize(firstLevel));
+    std::vector<VkBufferImageCopy> regions(levelCount);
+    VkDeviceSize offset = 0;
+
+    for (uint32_t i = 0; i < levelCount; ++i) {
+
+        const texture_level_t & level = levels[firstLevel + i];
+        memcpy((uint8_t *) staging.data + offset, source.getData() + level.offset, level.size);
+
+        regions[i] = {};
+        regions[i].bufferOffset = offset;
+        regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        regions[i].imageSubresource.mipLevel = i;
+        regions[i].imageSubresource.baseArrayLayer = 0;
+        regions[i].imageSubresource.layerCount = 1;
+        regions[i].imageExtent = {level.width, level.height, 1};
+
+        offset += level.size;
+
+    }
+
+    vkutil::createImage(state.vmaAllocator, state.device, levels[firstLevel].width, levels[firstLevel].height, 1, levelCount, source.getFormat(), VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory);
+
+    /// Both transitions and the copy go into a single submission.
+    VkCommandBuffer commandBuffer = vkutil::beginSingleCommand(commandPool, state.device);
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkCmdCopyBufferToImage(commandBuffer, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(), regions.data());
+    state.stagingPool->countUpload(offset);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkutil::endSingleCommand(commandBuffer, commandPool, state.device, state.loadingGraphicsQueue);
+
+    state.stagingPool->release(staging);
+
+    view = vkutil::createImageView(state.device, image, source.getFormat(), VK_IMAGE_ASPECT_COLOR_BIT, levelCount);
+
+}
+
 void Texture::transitionImageLayout(VulkanState & state, VkImage & image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, int mipLevels) {
 
     VkCommandBuffer commandBuffer = vkutil::beginSingleCommand(state);
@@ -423,6 +554,110 @@ void Texture::transitionImageLayout(VulkanState & state, VkImage & image, VkForm
 
 }
 
+TextureLevelSource::TextureLevelSource() : format(VK_FORMAT_UNDEFINED), data(nullptr) {
+
+}
+
+TextureLevelSource::~TextureLevelSource() {
+
+}
+
+VkFormat TextureLevelSource::getFormat() const {
+    return format;
+}
+
+uint32_t TextureLevelSource::getWidth() const {
+    return levels[0].width;
+}
+
+uint32_t TextureLevelSource::getHeight() const {
+    return levels[0].height;
+}
+
+const std::vector<texture_level_t> & TextureLevelSource::getLevels() const {
+    return levels;
+}
+
+const uint8_t * TextureLevelSource::getData() const {
+    return data;
+}
+
+VkDeviceSize TextureLevelSource::getSize(uint32_t firstLevel) const {
+
+    VkDeviceSize size = 0;
+
+    for (uint32_t i = firstLevel; i < levels.size(); ++i)
+        size += levels[i].size;
+
+    return size;
+
+}
+
+MipChainLevelSource::MipChainLevelSource(MipChain chain) : chain(std::move(chain)) {
+
+    format = VK_FORMAT_R8G8B8A8_UNORM;
+    levels.resize(this->chain.levels.size());
+
+    for (unsigned int i = 0; i < levels.size(); ++i) {
+
+        const mip_level_t & mip = this->chain.levels[i];
+
+        levels[i].offset = mip.offset;
+        levels[i].size = (VkDeviceSize) mip.width * mip.height * 4;
+        levels[i].width = mip.width;
+        levels[i].height = mip.height;
+
+    }
+
+    data = this->chain.data.data();
+
+}
+
+CompressedLevelSource::CompressedLevelSource(const vkutil::VulkanState & state, std::shared_ptr<CompressedImage> image) : image(image) {
+
+    switch (image->getFormat()) {
+        case BCN_FORMAT_BC1: format = VK_FORMAT_BC1_RGBA_UNORM_BLOCK; break;
+        case BCN_FORMAT_BC3: format = VK_FORMAT_BC3_UNORM_BLOCK; break;
+        case BCN_FORMAT_BC5: format = VK_FORMAT_BC5_UNORM_BLOCK; break;
+    }
+
+    const std::vector<compressed_image_level_t> & compressedLevels = image->getLevels();
+    levels.resize(compressedLevels.size());
+
+    for (unsigned int i = 0; i < levels.size(); ++i) {
+        levels[i].offset = compressedLevels[i].offset;
+        levels[i].size = compressedLevels[i].size;
+        levels[i].width = compressedLevels[i].width;
+        levels[i].height = compressedLevels[i].height;
+    }
+
+    data = image->getData();
+
+    if (Texture::isFormatSupported(state, format))
+        return;
+
+    lout << "Device can't sample format " << format << ", decoding compressed texture" << std::endl;
+
+    format = VK_FORMAT_R8G8B8A8_UNORM;
+    VkDeviceSize size = 0;
+
+    for (texture_level_t & level : levels) {
+        level.offset = size;
+        level.size = (VkDeviceSize) level.width * level.height * 4;
+        size += level.size;
+    }
+
+    decoded.resize(size);
+
+    for (unsigned int i = 0; i < levels.size(); ++i)
+        bcnDecode(image->getFormat(), data + compressedLevels[i].offset, levels[i].width, levels[i].height, decoded.data() + levels[i].offset);
+
+    /// The mapped file is only needed while the blocks are in use.
+    data = decoded.data();
+    this->image = nullptr;
+
+}
+
 std::vector<float> convertTgaDataToFloat(uint8_t * data, int width, int height) {
 
     std::vector<float> dest(width * height * 4);
@@ -456,19 +691,59 @@ TextureLoader::TextureLoader() {
 
 std::shared_ptr<ResourceUploader<Texture>> TextureLoader::loadResource(std::string fname) {
 
-    if (fname.substr(fname.length() - 3).compare("tga")) {
-        throw std::exception();
+    if (fname.length() < 3 || fname.substr(fname.length() - 3).compare("tga")) {
+        throw res::wrong_file_exception("Not a tga file");
     }
 
     TGA_FILE * tgaImage = tgaOpen(fname.c_str());
     int width, height;
     tgaGetSize(tgaImage, &width, &height);
     uint8_t * rawData = tgaGetColorDataRGBA(tgaImage);
-    std::vector<float> imageData = convertTgaDataToFloat(rawData, width, height);
+    MipChain chain = mipGenerateChain(rawData, width, height);
     free(rawData);
     tgaClose(tgaImage);
 
-    return std::shared_ptr<ResourceUploader<Texture>>(new TextureUploader<float>(imageData, width, height, 1));
+    /// 8 bit per channel like the source, instead of a quarter of the bandwidth spent on float texels.
+    return std::shared_ptr<ResourceUploader<Texture>>(new MipChainTextureUploader(std::move(chain)));
+
+}
+
+void PendingImage::decodePart(std::function<void()> decode) {
+
+    try {
+        decode();
+    } catch (std::exception & e) {
+        std::lock_guard<std::mutex> guard(errorMutex);
+        if (error.empty())
+            error = e.what();
+    }
+
+    if (--remaining)
+        return;
+
+    /// The last part builds the mip chain, still on the loading threads.
+    try {
+
+        if (error.empty()) {
+            chain = mipGenerateChain(data.data(), width, height, layerCount, MIP_FILTER_BOX, colorSpace);
+            std::vector<uint8_t>().swap(data);
+        }
+
+    } catch (std::exception & e) {
+        std::lock_guard<std::mutex> guard(errorMutex);
+        error = e.what();
+    }
+
+    done = true;
+
+}
+
+void PendingImage::checkError() {
+
+    std::lock_guard<std::mutex> guard(errorMutex);
+
+    if (!error.empty())
+        throw dbg::trace_exception(error);
 
 }
 
@@ -481,49 +756,66 @@ PNGLoader::PNGLoader() {
 std::shared_ptr<ResourceUploader<Texture>> PNGLoader::loadResource(std::string fname) {
 
     FILE * file = fopen(fname.c_str(), "rb");
+    if (!file)
+        throw dbg::trace_exception(std::string("Unable to open ").append(fname));
+
+    png_image_info_t info;
+    int result = pngReadHeader(file, &info);
 
-    uint32_t width, height, chanelCount;
-    uint8_t * data = pngLoadImageData(file, &width, &height, &chanelCount);
+    std::vector<uint8_t> data;
 
-    if (!data)
-        throw dbg::trace_exception("Unable to load PNG");
+    if (result == PNG_OK) {
+        data.resize((size_t) info.width * info.height * 4);
+        result = pngDecodeRGBA(file, &info, data.data(), (size_t) info.width * 4);
+    }
 
     fclose(file);
 
-    /*std::vector<float> fData(width * height * 4);
+    if (result != PNG_OK)
+        throw dbg::trace_exception(std::string("Unable to load PNG ").append(fname).append(": ").append(pngGetErrorString(result)));
 
-    for (unsigned int i = 0; i < height; ++i) {
-        for (unsigned int j = 0; j < width; ++j) {
-            for (unsigned int c = 0; c < chanelCount; ++c) {
-                fData[(i * width + j) * 4 + c] = (float) data[(i * width + j) * chanelCount + c] / 255.0;
-            }
+    return std::shared_ptr<ResourceUploader<Texture>>(new MipChainTextureUploader(mipGenerateChain(data.data(), info.width, info.height)));
 
-            if (chanelCount < 4) {
-                fData[(i * width + j) * 4 + 3] = 1.0;
-            }
+}
 
-        }
-        //fData[i] = (float) data[i] / 255.0;
-    }*/
+CompressedTextureLoader::CompressedTextureLoader() {
 
-    std::vector<uint8_t> fData(width * height * 4);
+}
 
-    for (unsigned int i = 0; i < height; ++i) {
-        for (unsigned int j = 0; j < width; ++j) {
-            for (unsigned int c = 0; c < chanelCount; ++c) {
-                fData[(i * width + j) * 4 + c] = data[(i * width + j) * chanelCount + c];
-            }
+std::shared_ptr<ResourceUploader<Texture>> CompressedTextureLoader::loadResource(std::string fname) {
 
-            if (chanelCount < 4) {
-                fData[(i * width + j) * 4 + 3] = 255;
-            }
+    std::string extension = COMPRESSED_IMAGE_EXTENSION;
+    /// Source images are only loaded from the compressed file next to them.
+    bool lookForSidecar = fname.length() < extension.length() || fname.compare(fname.length() - extension.length(), extension.length(), extension);
+
+    std::string compressedName = fname;
+
+    if (lookForSidecar) {
+
+        compressedName.append(extension);
+
+        struct stat sourceInfo, compressedInfo;
+
+        if (stat(compressedName.c_str(), &compressedInfo) || (!stat(fname.c_str(), &sourceInfo) && sourceInfo.st_mtime > compressedInfo.st_mtime))
+            throw res::wrong_file_exception(std::string("No compressed texture for ").append(fname));
 
-        }
-        //fData[i] = (float) data[i] / 255.0;
     }
 
-    free(data);
+    std::shared_ptr<CompressedImage> image;
+
+    try {
+        image = std::make_shared<CompressedImage>(compressedName);
+    } catch (std::exception & e) {
+
+        if (!lookForSidecar)
+            throw;
+
+        /// A broken bake falls back to the source image.
+        lerr << "Ignoring compressed texture " << compressedName << ": " << e.what() << std::endl;
+        throw res::wrong_file_exception(std::string("Broken compressed texture for ").append(fname));
+
+    }
 
-    return std::shared_ptr<ResourceUploader<Texture>>(new TextureUploader<uint8_t>(fData, width, height, 1));
+    return std::shared_ptr<ResourceUploader<Texture>>(new CompressedTextureUploader(image));
 
 }
@@ -3,19 +3,98 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <functional>
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
 
 #include "render/util/vkutil.h"
+#include "util/image/compressedimage.h"
+#include "util/image/mipmap.h"
 
 #include "resources/resourceuploader.h"
 #include "resources/resourceloader.h"
 
+class TextureStreamer;
+
+/// Position of one mip level in the data of a TextureLevelSource.
+struct texture_level_t {
+
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  uint32_t width;
+  uint32_t height;
+
+};
+
+/**
+ * CPU copy of every mip level of a 2D texture, in the format the device
+ * samples. Streamed textures keep their source to upload other levels.
+ **/
+class TextureLevelSource {
+
+public:
+
+  virtual ~TextureLevelSource();
+
+  VkFormat getFormat() const;
+  uint32_t getWidth() const;
+  uint32_t getHeight() const;
+
+  const std::vector<texture_level_t> & getLevels() const;
+  const uint8_t * getData() const;
+
+  /// Bytes of the levels from firstLevel down to 1x1.
+  VkDeviceSize getSize(uint32_t firstLevel) const;
+
+protected:
+
+  TextureLevelSource();
+
+  VkFormat format;
+  std::vector<texture_level_t> levels;
+  const uint8_t * data;
+
+};
+
+class MipChainLevelSource : public TextureLevelSource {
+
+public:
+
+  MipChainLevelSource(MipChain chain);
+
+private:
+
+  MipChain chain;
+
+};
+
+/// Keeps the mapped file, images are decoded to RGBA if the device can't sample the format.
+class CompressedLevelSource : public TextureLevelSource {
+
+public:
+
+  CompressedLevelSource(const vkutil::VulkanState & state, std::shared_ptr<CompressedImage> image);
+
+private:
+
+  std::shared_ptr<CompressedImage> image;
+  std::vector<uint8_t> decoded;
+
+};
+
 class Texture : public Resource
 {
 public:
   Texture(vkutil::VulkanState & state, const std::vector<float> & data, int width, int height, int depth);
   Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data, int width, int height, int depth);
+  /// Uploads a mip chain built on the loading threads, all levels in one copy.
+  Texture(vkutil::VulkanState & state, const MipChain & chain);
+  /// Uploads the whole mip chain, images are decoded to RGBA if the device can't sample the format.
+  Texture(vkutil::VulkanState & state, std::shared_ptr<CompressedImage> image);
+  /// With a texture streamer only the mip tail is uploaded and the source is kept for the streamer.
+  Texture(vkutil::VulkanState & state, std::shared_ptr<TextureLevelSource> source);
   virtual ~Texture();
 
   void transitionLayout(vkutil::VulkanState & state, VkImageLayout layout);
@@ -25,17 +104,31 @@ public:
 
   VkSampler & getSampler();
 
+  /// Most detailed level on the device, the view starts at this level.
+  uint32_t getResidentLevel();
+  uint32_t getLevelCount();
+  /// NULL if the texture is not streamed.
+  std::shared_ptr<TextureLevelSource> getLevelSource();
+
+  /// Exchanges the image with one holding the levels from firstLevel, the old one is returned in the arguments.
+  void swapResidentLevels(VkImage & image, VmaAllocation & memory, VkImageView & view, uint32_t & firstLevel);
+  void detachStreamer();
+
   static Texture * createTexture(vkutil::VulkanState & state, std::string fname);
 
   static void createImage(vkutil::VulkanState & state, int width, int height, int depth, int mipLevels, VkFormat format, VkImageUsageFlags usage, VkMemoryPropertyFlagBits memProps, VkImage & image, VmaAllocation & memory);
   static void copyBufferToImage(vkutil::VulkanState & state, VkBuffer & buffer, VkImage & image, uint32_t width, uint32_t height, uint32_t depth, uint32_t layerCount);
+  static void copyBufferToImage(vkutil::VulkanState & state, VkBuffer & buffer, VkImage & image, const std::vector<VkBufferImageCopy> & regions);
   static VkImageView createImageView(const vkutil::VulkanState & state, VkImage & image, VkFormat format, VkImageAspectFlags aspect, int mipLevels);
   static VkSampler createSampler(const vkutil::VulkanState & state, int mipLevels);
   static void transitionImageLayout(vkutil::VulkanState & state, VkImage & image, VkFormat format, VkImageLayout layout, VkImageLayout newLayout, int mipLevels);
+  static bool isFormatSupported(const vkutil::VulkanState & state, VkFormat format);
+  /// Creates an image with the levels of source from firstLevel on and fills it with a single submission.
+  static void uploadLevels(vkutil::VulkanState & state, const VkCommandPool & commandPool, const TextureLevelSource & source, uint32_t firstLevel, VkImage & image, VmaAllocation & memory, VkImageView & view);
 
 protected:
 
-  Texture(vkutil::VulkanState & state, const std::vector<uint8_t> & data, int width, int height, int depth, VkImageViewType type, int layerCount, VkImageCreateFlags flags);
+  Texture(vkutil::VulkanState & state, const MipChain & chain, VkImageViewType type, VkImageCreateFlags flags);
 
   VkImage image;
   VmaAllocation memory;
@@ -47,6 +140,10 @@ protected:
   VkSampler sampler;
   int layerCount;
 
+  uint32_t residentLevel;
+  std::shared_ptr<TextureLevelSource> levelSource;
+  TextureStreamer * streamer;
+
 private:
 
   const VkDevice & device;
@@ -54,6 +151,9 @@ private:
 
   void generateMipmaps(int width, int height, const VkCommandPool & commandPool, const VkDevice & device, const vkutil::Queue & q);
 
+  /// Creates the image with format, mipLevels and layerCount and fills all levels from data with one copy.
+  void uploadLevels(vkutil::VulkanState & state, const uint8_t * data, VkDeviceSize size, const std::vector<VkBufferImageCopy> & regions, uint32_t width, uint32_t height, VkImageViewType viewType, VkImageCreateFlags flags);
+
 };
 
 template <typename T> class TextureUploader : public ResourceUploader<Texture> {
@@ -61,7 +161,7 @@ template <typename T> class TextureUploader : public ResourceUploader<Texture> {
 public:
   TextureUploader(std::vector<T> data, int width, int height, int depth) {
 
-    this->data = data;
+    this->data = std::move(data);
     this->width = width;
     this->height = height;
     this->depth = depth;
@@ -85,6 +185,113 @@ private:
 
 };
 
+class MipChainTextureUploader : public ResourceUploader<Texture> {
+
+public:
+  MipChainTextureUploader(MipChain chain) : chain(std::move(chain)) {
+
+  }
+
+  bool uploadReady() {
+    return true;
+  }
+
+  std::shared_ptr<Texture> uploadResource(vkutil::VulkanState & state, ResourceManager * manager) {
+    return std::shared_ptr<Texture>(new Texture(state, std::make_shared<MipChainLevelSource>(std::move(chain))));
+  }
+
+private:
+
+  MipChain chain;
+
+};
+
+/**
+ * RGBA image decoded by jobs on the loading threads, every part (like a face
+ * of a cube map) can be decoded by its own job into its layer of data. The
+ * job finishing the last part builds the mip chain, uploaders wait until
+ * that is done.
+ **/
+struct PendingImage {
+
+  PendingImage(unsigned int partCount, uint32_t layerCount = 1, mip_color_space colorSpace = MIP_COLOR_SPACE_LINEAR) :
+    width(0), height(0), remaining(partCount), done(false), layerCount(layerCount), colorSpace(colorSpace) {
+
+  }
+
+  /// Decoded layers, released once the mip chain is built.
+  std::vector<uint8_t> data;
+  uint32_t width;
+  uint32_t height;
+
+  MipChain chain;
+
+  bool isDone() {
+    return done;
+  }
+
+  /// Runs decode and marks one part as done, errors are kept for checkError.
+  void decodePart(std::function<void()> decode);
+
+  /// Throws the first error of any part.
+  void checkError();
+
+private:
+
+  std::atomic<unsigned int> remaining;
+  std::atomic<bool> done;
+
+  uint32_t layerCount;
+  mip_color_space colorSpace;
+
+  std::mutex errorMutex;
+  std::string error;
+
+};
+
+class PendingTextureUploader : public ResourceUploader<Texture> {
+
+public:
+  PendingTextureUploader(std::shared_ptr<PendingImage> image) : image(image) {
+
+  }
+
+  bool uploadReady() {
+    return image->isDone();
+  }
+
+  std::shared_ptr<Texture> uploadResource(vkutil::VulkanState & state, ResourceManager * manager) {
+    image->checkError();
+    return std::shared_ptr<Texture>(new Texture(state, std::make_shared<MipChainLevelSource>(std::move(image->chain))));
+  }
+
+private:
+
+  std::shared_ptr<PendingImage> image;
+
+};
+
+class CompressedTextureUploader : public ResourceUploader<Texture> {
+
+public:
+  CompressedTextureUploader(std::shared_ptr<CompressedImage> image) : image(image) {
+
+  }
+
+  bool uploadReady() {
+    return true;
+  }
+
+  std::shared_ptr<Texture> uploadResource(vkutil::VulkanState & state, ResourceManager * manager) {
+    return std::shared_ptr<Texture>(new Texture(state, image));
+  }
+
+private:
+
+  std::shared_ptr<CompressedImage> image;
+
+};
+
 class TextureLoader : public ResourceLoader<Texture> {
 
 public:
@@ -103,4 +310,17 @@ public:
 
 };
 
+/**
+ * Loads .btex files, and for any other texture the compressed file baked
+ * next to it (fname + ".btex") if that is newer than the source. Otherwise
+ * the texture is left to the next loader.
+ **/
+class CompressedTextureLoader : public TextureLoader {
+
+public:
+  CompressedTextureLoader();
+  std::shared_ptr<ResourceUploader<Texture>> loadResource(std::string fname);
+
+};
+
 #endif // TEXTURE_H
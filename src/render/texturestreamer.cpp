@@ -0,0 +1,368 @@
+#include "texturestreamer.h"
+
+#include <queue>
+#include <algorithm>
+
+#include "texture.h"
+#include "util/debug/logger.h"
+
+TextureStreamer::TextureStreamer(vkutil::VulkanState & state, VkDeviceSize budget) : state(state) {
+
+  this->budget = budget;
+  this->automaticBudget = 0;
+  this->framesSinceBudgetQuery = 0;
+  this->buildCount = 0;
+  this->nextId = 0;
+  this->promotions = 0;
+  this->demotions = 0;
+
+  commandPool = vkutil::createGraphicsCommandPool(state.physicalDevice, state.device, state.surface);
+
+  /// A single thread, so the command pool is never used concurrently.
+  jobs = new JobSystem(1);
+
+}
+
+TextureStreamer::~TextureStreamer() {
+
+  /// Finishes the builds that are still running.
+  delete jobs;
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  /// The device is idle when the streamer is destroyed.
+  for (CompletedBuild & build : completedBuilds)
+    destroyBuild(build);
+
+  for (RetiredImage & retired : retiredImages)
+    destroyBuild(retired.build);
+
+  for (auto & entry : textures)
+    entry.second.texture->detachStreamer();
+
+  vkDestroyCommandPool(state.device, commandPool, nullptr);
+
+}
+
+void TextureStreamer::registerTexture(Texture * texture) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  StreamedTexture & streamed = textures[texture];
+  streamed.id = nextId++;
+  streamed.texture = texture;
+  streamed.source = texture->getLevelSource();
+  streamed.tailLevel = getTailLevel(*streamed.source);
+  streamed.pixelsPerUnit = 0;
+  streamed.building = false;
+
+}
+
+void TextureStreamer::unregisterTexture(Texture * texture) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  /// Builds still running for the texture are destroyed once they complete.
+  textures.erase(texture);
+
+}
+
+void TextureStreamer::request(Texture * texture, float pixelsPerUnit) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto it = textures.find(texture);
+  if (it != textures.end())
+    it->second.pixelsPerUnit = std::max(it->second.pixelsPerUnit, pixelsPerUnit);
+
+}
+
+void TextureStreamer::update() {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  struct Candidate {
+
+    StreamedTexture * texture;
+    uint32_t wanted;
+    uint32_t target;
+
+  };
+
+  std::vector<Candidate> candidates;
+  candidates.reserve(textures.size());
+
+  VkDeviceSize residentBytes = 0;
+  VkDeviceSize usedBytes = 0;
+
+  /// The tails are always resident, all other levels compete for the budget.
+  for (auto & entry : textures) {
+
+    StreamedTexture & streamed = entry.second;
+
+    residentBytes += streamed.source->getSize(streamed.texture->getResidentLevel());
+    usedBytes += streamed.source->getSize(streamed.tailLevel);
+
+    candidates.push_back({&streamed, getWantedLevel(streamed), streamed.tailLevel});
+
+  }
+
+  VkDeviceSize limit = getBudget(residentBytes);
+
+  /// Pixels on screen per texel of the next level, the most magnified level is promoted first.
+  auto magnification = [] (const Candidate & c) -> float {
+    const texture_level_t & level = c.texture->source->getLevels()[c.target - 1];
+    return c.texture->pixelsPerUnit * TEXTURE_STREAMER_TEXTURE_EXTENT / std::max(level.width, level.height);
+  };
+
+  std::priority_queue<std::pair<float, size_t>> queue;
+
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (candidates[i].wanted < candidates[i].target)
+      queue.push({magnification(candidates[i]), i});
+  }
+
+  while (!queue.empty()) {
+
+    size_t index = queue.top().second;
+    Candidate & c = candidates[index];
+    queue.pop();
+
+    VkDeviceSize cost = c.texture->source->getLevels()[c.target - 1].size;
+
+    /// Smaller levels of other textures may still fit.
+    if (usedBytes + cost > limit)
+      continue;
+
+    usedBytes += cost;
+    c.target--;
+
+    if (c.wanted < c.target)
+      queue.push({magnification(c), index});
+
+  }
+
+  std::vector<Candidate *> demoted;
+  std::vector<Candidate *> promoted;
+
+  for (Candidate & c : candidates) {
+
+    uint32_t resident = c.texture->texture->getResidentLevel();
+
+    if (c.texture->building || c.target == resident)
+      continue;
+
+    if (c.target < resident) {
+      promoted.push_back(&c);
+      continue;
+    }
+
+    /// A single level too many is only dropped when memory is short, so textures at the border of two levels don't flip.
+    if (residentBytes > limit || c.target > resident + 1)
+      demoted.push_back(&c);
+
+  }
+
+  std::sort(promoted.begin(), promoted.end(), [] (Candidate * a, Candidate * b) {
+    return a->texture->pixelsPerUnit > b->texture->pixelsPerUnit;
+  });
+
+  /// Demotions first, they free memory for the promotions.
+  for (Candidate * c : demoted) {
+    if (buildCount >= TEXTURE_STREAMER_MAX_BUILDS)
+      break;
+    startBuild(*c->texture, c->target);
+  }
+
+  for (Candidate * c : promoted) {
+    if (buildCount >= TEXTURE_STREAMER_MAX_BUILDS)
+      break;
+    startBuild(*c->texture, c->target);
+  }
+
+  for (auto & entry : textures)
+    entry.second.pixelsPerUnit = 0;
+
+}
+
+bool TextureStreamer::hasCompletedBuilds() {
+
+  std::lock_guard<std::mutex> guard(lock);
+  return !completedBuilds.empty();
+
+}
+
+std::vector<Texture *> TextureStreamer::applyCompletedBuilds(uint64_t frame) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  std::vector<Texture *> changed;
+
+  for (CompletedBuild & build : completedBuilds) {
+
+    buildCount--;
+
+    auto it = textures.find(build.texture);
+
+    /// The texture was destroyed while its build was running.
+    if (it == textures.end() || it->second.id != build.id) {
+      destroyBuild(build);
+      continue;
+    }
+
+    it->second.building = false;
+
+    if (build.image == VK_NULL_HANDLE)
+      continue;
+
+    /// Afterwards the build holds the old image.
+    build.texture->swapResidentLevels(build.image, build.memory, build.view, build.firstLevel);
+    retiredImages.push_back({build, frame});
+
+    changed.push_back(build.texture);
+
+  }
+
+  completedBuilds.clear();
+
+  return changed;
+
+}
+
+void TextureStreamer::releaseRetiredImages(uint64_t completedFrame) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  for (unsigned int i = 0; i < retiredImages.size();) {
+
+    if (retiredImages[i].frame > completedFrame) {
+      ++i;
+      continue;
+    }
+
+    destroyBuild(retiredImages[i].build);
+
+    retiredImages[i] = retiredImages.back();
+    retiredImages.pop_back();
+
+  }
+
+}
+
+void TextureStreamer::setBudget(VkDeviceSize budget) {
+
+  std::lock_guard<std::mutex> guard(lock);
+  this->budget = budget;
+  this->framesSinceBudgetQuery = 0;
+
+}
+
+TextureStreamer::Statistics TextureStreamer::getStatistics() {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  Statistics stats = {};
+  stats.budget = budget ? budget : automaticBudget;
+  stats.textureCount = textures.size();
+  stats.promotions = promotions;
+  stats.demotions = demotions;
+
+  for (auto & entry : textures)
+    stats.residentBytes += entry.second.source->getSize(entry.second.texture->getResidentLevel());
+
+  return stats;
+
+}
+
+uint32_t TextureStreamer::getTailLevel(const TextureLevelSource & source) {
+
+  const std::vector<texture_level_t> & levels = source.getLevels();
+  uint32_t level = 0;
+
+  while (level + 1 < levels.size() && std::max(levels[level].width, levels[level].height) > TEXTURE_STREAMER_TAIL_SIZE)
+    level++;
+
+  return level;
+
+}
+
+uint32_t TextureStreamer::getWantedLevel(const StreamedTexture & texture) {
+
+  if (texture.pixelsPerUnit <= 0)
+    return texture.tailLevel;
+
+  const std::vector<texture_level_t> & levels = texture.source->getLevels();
+  float pixels = texture.pixelsPerUnit * TEXTURE_STREAMER_TEXTURE_EXTENT;
+
+  /// The smallest level that is not magnified on screen.
+  uint32_t level = texture.tailLevel;
+  while (level > 0 && std::max(levels[level].width, levels[level].height) < pixels)
+    level--;
+
+  return level;
+
+}
+
+VkDeviceSize TextureStreamer::getBudget(VkDeviceSize residentBytes) {
+
+  if (budget)
+    return budget;
+
+  if (framesSinceBudgetQuery++ % TEXTURE_STREAMER_BUDGET_INTERVAL == 0) {
+
+    vkutil::MemoryBudget memory = vkutil::queryMemoryBudget(state);
+
+    /// Everything on the device that is not a streamed texture stays where it is.
+    VkDeviceSize others = memory.usage > residentBytes ? memory.usage - residentBytes : 0;
+    VkDeviceSize available = memory.budget * TEXTURE_STREAMER_BUDGET_FRACTION;
+
+    automaticBudget = available > others ? available - others : 0;
+
+  }
+
+  return automaticBudget;
+
+}
+
+void TextureStreamer::startBuild(StreamedTexture & texture, uint32_t firstLevel) {
+
+  if (firstLevel < texture.texture->getResidentLevel())
+    promotions++;
+  else
+    demotions++;
+
+  texture.building = true;
+  buildCount++;
+
+  uint64_t id = texture.id;
+  Texture * target = texture.texture;
+  std::shared_ptr<TextureLevelSource> source = texture.source;
+
+  jobs->submit([this, id, target, source, firstLevel] () {
+
+    CompletedBuild build = {id, target, VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, firstLevel};
+
+    try {
+      Texture::uploadLevels(state, commandPool, *source, firstLevel, build.image, build.memory, build.view);
+    } catch (std::exception & e) {
+      lerr << "Unable to stream texture levels: " << e.what() << std::endl;
+      destroyBuild(build);
+      build.image = VK_NULL_HANDLE;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    completedBuilds.push_back(build);
+
+  });
+
+}
+
+void TextureStreamer::destroyBuild(CompletedBuild & build) {
+
+  if (build.view != VK_NULL_HANDLE)
+    vkDestroyImageView(state.device, build.view, nullptr);
+
+  if (build.image != VK_NULL_HANDLE)
+    vmaDestroyImage(state.vmaAllocator, build.image, build.memory);
+
+}
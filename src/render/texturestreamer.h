@@ -0,0 +1,146 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include "render/util/vkutil.h"
+#include "util/jobsystem.h"
+
+class Texture;
+class TextureLevelSource;
+
+/// Levels at most this large are always resident.
+#define TEXTURE_STREAMER_TAIL_SIZE 64
+/// Images built at the same time, each one holds its staging memory until it is done.
+#define TEXTURE_STREAMER_MAX_BUILDS 4
+/// World units covered by one repetition of a texture, used to estimate the texels on screen.
+#define TEXTURE_STREAMER_TEXTURE_EXTENT 2.0f
+/// Share of the device local budget all allocations may fill, the only headroom the automatic budget keeps.
+#define TEXTURE_STREAMER_BUDGET_FRACTION 0.8
+/// Frames between two budget queries.
+#define TEXTURE_STREAMER_BUDGET_INTERVAL 60
+
+/**
+ * Keeps the mip levels of streamed textures on the device that the last
+ * frame asked for, as far as the budget allows.
+ *
+ * Every frame the viewport reports how many pixels a world unit covers at
+ * each texture (request). update picks the resident levels by promoting
+ * the texture whose next level is magnified the most, until the budget is
+ * used up. Textures that need fewer levels than they have are demoted.
+ * The images with the new levels are built on a streaming thread and
+ * swapped in by applyCompletedBuilds. The old images are destroyed by
+ * releaseRetiredImages once the frames that may use them have finished.
+ **/
+class TextureStreamer {
+
+public:
+
+  struct Statistics {
+
+    VkDeviceSize budget;
+    VkDeviceSize residentBytes;
+    uint32_t textureCount;
+    uint32_t promotions;
+    uint32_t demotions;
+
+  };
+
+  /// budget = 0 uses the free part of the device local memory.
+  TextureStreamer(vkutil::VulkanState & state, VkDeviceSize budget = 0);
+  virtual ~TextureStreamer();
+
+  void registerTexture(Texture * texture);
+  void unregisterTexture(Texture * texture);
+
+  /// pixelsPerUnit is the size of a world unit on screen at one use of the texture, the largest request of a frame counts.
+  void request(Texture * texture, float pixelsPerUnit);
+
+  /// Chooses the levels for the requests since the last update and starts building the images that change.
+  void update();
+
+  bool hasCompletedBuilds();
+  /**
+   * Swaps the built images into their textures. The old images are retired
+   * with frame, the last frame that has been submitted with them.
+   * Returns the textures with new images, their descriptors have to be
+   * written again.
+   **/
+  std::vector<Texture *> applyCompletedBuilds(uint64_t frame);
+  /// Destroys the images retired with a frame up to completedFrame, the device has finished those frames.
+  void releaseRetiredImages(uint64_t completedFrame);
+
+  void setBudget(VkDeviceSize budget);
+  Statistics getStatistics();
+
+  /// First level no larger than TEXTURE_STREAMER_TAIL_SIZE.
+  static uint32_t getTailLevel(const TextureLevelSource & source);
+
+private:
+
+  struct StreamedTexture {
+
+    uint64_t id;
+    Texture * texture;
+    std::shared_ptr<TextureLevelSource> source;
+    uint32_t tailLevel;
+
+    /// Largest request since the last update, 0 if the texture was not used.
+    float pixelsPerUnit;
+    bool building;
+
+  };
+
+  struct CompletedBuild {
+
+    uint64_t id;
+    Texture * texture;
+    VkImage image;
+    VmaAllocation memory;
+    VkImageView view;
+    uint32_t firstLevel;
+
+  };
+
+  struct RetiredImage {
+
+    CompletedBuild build;
+    uint64_t frame;
+
+  };
+
+  /// Level the requests of a texture would show, ignoring the budget.
+  static uint32_t getWantedLevel(const StreamedTexture & texture);
+
+  VkDeviceSize getBudget(VkDeviceSize residentBytes);
+  void startBuild(StreamedTexture & texture, uint32_t firstLevel);
+  void destroyBuild(CompletedBuild & build);
+
+  vkutil::VulkanState & state;
+
+  /// Only used by the streaming thread.
+  VkCommandPool commandPool;
+  JobSystem * jobs;
+
+  std::mutex lock;
+  std::unordered_map<Texture *, StreamedTexture> textures;
+  std::vector<CompletedBuild> completedBuilds;
+  std::vector<RetiredImage> retiredImages;
+  unsigned int buildCount;
+  uint64_t nextId;
+
+  VkDeviceSize budget;
+  VkDeviceSize automaticBudget;
+  unsigned int framesSinceBudgetQuery;
+
+  uint32_t promotions;
+  uint32_t demotions;
+
+};
+
+#endif // TEXTURESTREAMER_H
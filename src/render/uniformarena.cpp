@@ -0,0 +1,210 @@
+#include "uniformarena.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "util/debug/trace_exception.h"
+#include "util/vk_trace_exception.h"
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+UniformArena::UniformArena(const vkutil::VulkanState & state, uint32_t frameCount, VkDeviceSize frameSize, VkDeviceSize sharedSize) : state(state) {
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.physicalDevice, &props);
+
+  /// nonCoherentAtomSize keeps the per frame flushes inside of their region.
+  this->alignment = std::max(props.limits.minUniformBufferOffsetAlignment, props.limits.nonCoherentAtomSize);
+  this->frameCount = frameCount;
+  this->frameSize = alignUp(frameSize, alignment);
+
+  this->shared.offset = 0;
+  this->shared.size = sharedSize;
+  this->head = alignUp(sharedSize, alignment);
+  this->submittedFrame = 0;
+
+  createBuffer();
+
+}
+
+UniformArena::~UniformArena() {
+
+  destroyBuffer();
+
+}
+
+void UniformArena::createBuffer() {
+
+  VkBufferCreateInfo bufferInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  bufferInfo.size = frameSize * frameCount;
+  bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCreateInfo = {};
+  allocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  allocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo allocInfo = {};
+
+  if (VkResult res = vmaCreateBuffer(state.vmaAllocator, &bufferInfo, &allocCreateInfo, &buffer, &memory, &allocInfo))
+    throw vkutil::vk_trace_exception("Unable to create uniform arena", res);
+
+  mappedData = (uint8_t *) allocInfo.pMappedData;
+
+}
+
+void UniformArena::destroyBuffer() {
+
+  vmaDestroyBuffer(state.vmaAllocator, buffer, memory);
+
+}
+
+UniformArena::Allocation UniformArena::allocate(VkDeviceSize size) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  VkDeviceSize alignedSize = alignUp(size, alignment);
+
+  Allocation alloc;
+  alloc.size = size;
+
+  /// First fit in the released slots, the rest of the slot stays free.
+  for (auto it = freeSlots.begin(); it != freeSlots.end(); ++it) {
+
+    if (it->second < alignedSize)
+      continue;
+
+    alloc.offset = it->first;
+
+    if (it->second > alignedSize)
+      freeSlots[it->first + alignedSize] = it->second - alignedSize;
+
+    freeSlots.erase(it);
+
+    return alloc;
+
+  }
+
+  if (head + size > frameSize)
+    throw dbg::trace_exception(std::string("Uniform arena is full, unable to allocate ").append(std::to_string(size)).append(" bytes"));
+
+  alloc.offset = head;
+
+  head = alignUp(head + size, alignment);
+
+  return alloc;
+
+}
+
+void UniformArena::release(const Allocation & alloc) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  retiredSlots.push_back({alloc, submittedFrame});
+
+}
+
+void UniformArena::submitFrame(uint64_t frame) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  submittedFrame = frame;
+
+}
+
+void UniformArena::releaseRetiredSlots(uint64_t completedFrame) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto it = retiredSlots.begin();
+
+  while (it != retiredSlots.end()) {
+
+    if (it->frame <= completedFrame) {
+      freeSlot(it->alloc);
+      it = retiredSlots.erase(it);
+    } else {
+      ++it;
+    }
+
+  }
+
+}
+
+void UniformArena::freeSlot(const Allocation & alloc) {
+
+  VkDeviceSize offset = alloc.offset;
+  VkDeviceSize size = alignUp(alloc.size, alignment);
+
+  auto next = freeSlots.find(offset + size);
+  if (next != freeSlots.end()) {
+    size += next->second;
+    freeSlots.erase(next);
+  }
+
+  auto it = freeSlots.lower_bound(offset);
+  if (it != freeSlots.begin()) {
+
+    auto prev = std::prev(it);
+
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      freeSlots.erase(prev);
+    }
+
+  }
+
+  /// A free slot at the end moves the head back instead.
+  if (offset + size >= head)
+    head = offset;
+  else
+    freeSlots[offset] = size;
+
+}
+
+void UniformArena::reset(uint32_t frameCount) {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  head = alignUp(shared.size, alignment);
+  freeSlots.clear();
+  retiredSlots.clear();
+
+  if (frameCount != this->frameCount) {
+    destroyBuffer();
+    this->frameCount = frameCount;
+    createBuffer();
+  }
+
+}
+
+const UniformArena::Allocation & UniformArena::getShared() {
+  return shared;
+}
+
+void * UniformArena::getData(uint32_t frameIndex, const Allocation & alloc) {
+  return mappedData + frameIndex * frameSize + alloc.offset;
+}
+
+VkBuffer UniformArena::getBuffer() {
+  return buffer;
+}
+
+void UniformArena::setupBinding(std::vector<VkBuffer> & buffers, std::vector<VkDeviceSize> & offsets, const Allocation & alloc) {
+
+  buffers = std::vector<VkBuffer>(frameCount, buffer);
+  offsets.resize(frameCount);
+
+  for (uint32_t i = 0; i < frameCount; ++i)
+    offsets[i] = i * frameSize + alloc.offset;
+
+}
+
+void UniformArena::flush(uint32_t frameIndex) {
+
+  vmaFlushAllocation(state.vmaAllocator, memory, frameIndex * frameSize, frameSize);
+
+}
@@ -0,0 +1,90 @@
+#ifndef UNIFORMARENA_H
+#define UNIFORMARENA_H
+
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include "render/util/vkutil.h"
+
+/**
+ * One persistently mapped uniform buffer holding a region per frame.
+ * Every region has the same layout: the shared data (camera matrices) at
+ * the start, followed by the per-element slots. Slots are bump-allocated,
+ * released slots go to a free list and are reused first.
+ **/
+class UniformArena {
+
+public:
+
+  /// Offset and size of a slot inside of a frame region.
+  struct Allocation {
+
+    VkDeviceSize offset;
+    VkDeviceSize size;
+
+  };
+
+  UniformArena(const vkutil::VulkanState & state, uint32_t frameCount, VkDeviceSize frameSize, VkDeviceSize sharedSize);
+  virtual ~UniformArena();
+
+  /// Reserves a slot in every frame region.
+  Allocation allocate(VkDeviceSize size);
+  /// Gives a slot back once the frames submitted so far have finished, see releaseRetiredSlots.
+  void release(const Allocation & alloc);
+  /// Slots released from now on may still be used by this frame.
+  void submitFrame(uint64_t frame);
+  /// Frees the released slots of all frames up to the completed one.
+  void releaseRetiredSlots(uint64_t completedFrame);
+  /// Drops all slots except the shared one, the buffer is recreated for the new frame count.
+  void reset(uint32_t frameCount);
+
+  const Allocation & getShared();
+
+  void * getData(uint32_t frameIndex, const Allocation & alloc);
+  VkBuffer getBuffer();
+
+  /// Fills the uniform buffers and offsets of a binding with the slot of every frame.
+  void setupBinding(std::vector<VkBuffer> & buffers, std::vector<VkDeviceSize> & offsets, const Allocation & alloc);
+
+  /// Makes the writes of the frame visible to the device, if the memory is not coherent.
+  void flush(uint32_t frameIndex);
+
+private:
+
+  /// A released slot and the last frame that may still use it.
+  struct RetiredSlot {
+
+    Allocation alloc;
+    uint64_t frame;
+
+  };
+
+  void createBuffer();
+  void destroyBuffer();
+  void freeSlot(const Allocation & alloc);
+
+  const vkutil::VulkanState & state;
+
+  VkBuffer buffer;
+  VmaAllocation memory;
+  uint8_t * mappedData;
+
+  uint32_t frameCount;
+  VkDeviceSize frameSize;
+  VkDeviceSize alignment;
+
+  Allocation shared;
+  VkDeviceSize head;
+  /// Released slots below head by offset, neighbouring slots are merged.
+  std::map<VkDeviceSize, VkDeviceSize> freeSlots;
+  std::vector<RetiredSlot> retiredSlots;
+  uint64_t submittedFrame;
+  std::mutex lock;
+
+};
+
+#endif // UNIFORMARENA_H
@@ -0,0 +1,193 @@
+#include "stagingpool.h"
+
+#include <algorithm>
+
+#include "vk_trace_exception.h"
+
+using namespace vkutil;
+
+StagingPool::StagingPool(const VkDevice & device, const VmaAllocator & allocator) {
+
+  this->device = device;
+  this->allocator = allocator;
+
+  this->uploadedBytes = 0;
+  this->inUseBytes = 0;
+  this->highWaterMark = 0;
+  this->cachedBytes = 0;
+  this->createdBuffers = 0;
+  this->reusedBuffers = 0;
+
+}
+
+StagingPool::~StagingPool() {
+
+  /// Pending buffers may still be read by the device.
+  for (PendingBuffer & p : pendingBuffers) {
+    vkWaitForFences(device, 1, &p.fence, VK_TRUE, UINT64_MAX);
+    vmaDestroyBuffer(allocator, p.buffer.buffer, p.buffer.memory);
+  }
+
+  for (std::vector<StagingBuffer> & buffers : freeBuffers)
+    for (StagingBuffer & b : buffers)
+      vmaDestroyBuffer(allocator, b.buffer, b.memory);
+
+}
+
+unsigned int StagingPool::getSizeClass(VkDeviceSize size) {
+
+  unsigned int sizeClass = 0;
+  VkDeviceSize classSize = STAGING_POOL_MIN_SIZE;
+
+  while (classSize < size) {
+    classSize <<= 1;
+    sizeClass++;
+  }
+
+  return sizeClass;
+
+}
+
+StagingBuffer StagingPool::acquire(VkDeviceSize size) {
+
+  unsigned int sizeClass = getSizeClass(size);
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+
+    collectPending();
+
+    StagingBuffer buffer;
+    bool found = false;
+
+    if (sizeClass < freeBuffers.size() && !freeBuffers[sizeClass].empty()) {
+
+      buffer = freeBuffers[sizeClass].back();
+      freeBuffers[sizeClass].pop_back();
+
+      cachedBytes -= buffer.size;
+      reusedBuffers++;
+      found = true;
+
+    }
+
+    inUseBytes += (VkDeviceSize) STAGING_POOL_MIN_SIZE << sizeClass;
+    highWaterMark = std::max(highWaterMark, inUseBytes);
+
+    if (found)
+      return buffer;
+
+  }
+
+  /// Creating the buffer does not need the lock.
+  StagingBuffer buffer;
+  buffer.size = (VkDeviceSize) STAGING_POOL_MIN_SIZE << sizeClass;
+
+  VkBufferCreateInfo bufferInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  bufferInfo.size = buffer.size;
+  bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCreateInfo = {};
+  allocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+  allocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VmaAllocationInfo allocInfo = {};
+
+  if (VkResult res = vmaCreateBuffer(allocator, &bufferInfo, &allocCreateInfo, &buffer.buffer, &buffer.memory, &allocInfo)) {
+    std::lock_guard<std::mutex> guard(lock);
+    inUseBytes -= buffer.size;
+    throw vk_trace_exception("Unable to create staging buffer", res);
+  }
+
+  buffer.data = allocInfo.pMappedData;
+
+  std::lock_guard<std::mutex> guard(lock);
+  createdBuffers++;
+
+  return buffer;
+
+}
+
+void StagingPool::release(StagingBuffer & buffer, VkFence fence) {
+
+  if (buffer.buffer == VK_NULL_HANDLE)
+    return;
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  inUseBytes -= buffer.size;
+
+  if (fence != VK_NULL_HANDLE) {
+
+    PendingBuffer p;
+    p.buffer = buffer;
+    p.fence = fence;
+
+    pendingBuffers.push_back(p);
+
+  } else {
+    recycle(buffer);
+  }
+
+  buffer = StagingBuffer();
+
+}
+
+void StagingPool::collectPending() {
+
+  for (unsigned int i = 0; i < pendingBuffers.size();) {
+
+    if (vkGetFenceStatus(device, pendingBuffers[i].fence) != VK_SUCCESS) {
+      ++i;
+      continue;
+    }
+
+    recycle(pendingBuffers[i].buffer);
+
+    pendingBuffers[i] = pendingBuffers.back();
+    pendingBuffers.pop_back();
+
+  }
+
+}
+
+void StagingPool::recycle(StagingBuffer & buffer) {
+
+  if (cachedBytes + buffer.size > STAGING_POOL_MAX_CACHED_BYTES) {
+    vmaDestroyBuffer(allocator, buffer.buffer, buffer.memory);
+    return;
+  }
+
+  unsigned int sizeClass = getSizeClass(buffer.size);
+  if (sizeClass >= freeBuffers.size())
+    freeBuffers.resize(sizeClass + 1);
+
+  freeBuffers[sizeClass].push_back(buffer);
+  cachedBytes += buffer.size;
+
+}
+
+StagingPool::Statistics StagingPool::getStatistics() {
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  Statistics stats;
+  stats.uploadedBytes = uploadedBytes;
+  stats.inUseBytes = inUseBytes;
+  stats.highWaterMark = highWaterMark;
+  stats.cachedBytes = cachedBytes;
+  stats.createdBuffers = createdBuffers;
+  stats.reusedBuffers = reusedBuffers;
+
+  return stats;
+
+}
+
+void StagingPool::countUpload(VkDeviceSize size) {
+  uploadedBytes += size;
+}
+
+uint64_t StagingPool::takeUploadedBytes() {
+  return uploadedBytes.exchange(0);
+}
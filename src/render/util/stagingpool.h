@@ -0,0 +1,95 @@
+#ifndef STAGINGPOOL_H
+#define STAGINGPOOL_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+/// Smallest size class of the staging pool.
+#define STAGING_POOL_MIN_SIZE (64 << 10)
+/// Free staging memory kept for reuse, buffers beyond this are destroyed on release.
+#define STAGING_POOL_MAX_CACHED_BYTES (128 << 20)
+
+namespace vkutil {
+
+  struct StagingBuffer {
+
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VmaAllocation memory = VK_NULL_HANDLE;
+    /// Persistently mapped and host coherent, no need to map/unmap or flush.
+    void * data = nullptr;
+    /// Size of the size class, may be larger than requested.
+    VkDeviceSize size = 0;
+
+  };
+
+  /**
+   * Pool of persistently mapped staging buffers in power of two size
+   * classes. Released buffers are kept for reuse, optionally only after
+   * the fence of the submission reading them has been signalled.
+   **/
+  class StagingPool {
+
+  public:
+
+    struct Statistics {
+
+      /// Bytes copied to the device since the last call to takeUploadedBytes.
+      uint64_t uploadedBytes;
+      VkDeviceSize inUseBytes;
+      VkDeviceSize highWaterMark;
+      VkDeviceSize cachedBytes;
+      uint32_t createdBuffers;
+      uint32_t reusedBuffers;
+
+    };
+
+    StagingPool(const VkDevice & device, const VmaAllocator & allocator);
+    virtual ~StagingPool();
+
+    StagingBuffer acquire(VkDeviceSize size);
+    /// The buffer is reused once fence is signalled, VK_NULL_HANDLE if the device is done with it.
+    void release(StagingBuffer & buffer, VkFence fence = VK_NULL_HANDLE);
+
+    /// Called by the uploaders for every copy they record out of a staging buffer.
+    void countUpload(VkDeviceSize size);
+
+    Statistics getStatistics();
+    uint64_t takeUploadedBytes();
+
+  private:
+
+    struct PendingBuffer {
+
+      StagingBuffer buffer;
+      VkFence fence;
+
+    };
+
+    static unsigned int getSizeClass(VkDeviceSize size);
+
+    void collectPending();
+    void recycle(StagingBuffer & buffer);
+
+    VkDevice device;
+    VmaAllocator allocator;
+
+    std::mutex lock;
+    std::vector<std::vector<StagingBuffer>> freeBuffers;
+    std::vector<PendingBuffer> pendingBuffers;
+
+    std::atomic<uint64_t> uploadedBytes;
+    VkDeviceSize inUseBytes;
+    VkDeviceSize highWaterMark;
+    VkDeviceSize cachedBytes;
+    uint32_t createdBuffers;
+    uint32_t reusedBuffers;
+
+  };
+
+}
+
+#endif // STAGINGPOOL_H
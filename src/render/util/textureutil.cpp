@@ -1,8 +1,10 @@
 #include "render/util/vkutil.h"
+#include "render/util/stagingpool.h"
 
 #include "vk_trace_exception.h"
 
 #include "util/debug/trace_exception.h"
+#include "util/image/mipmap.h"
 #include <string.h>
 #include <algorithm>
 #include <cmath>
@@ -27,31 +29,22 @@ CubemapCreateData vkutil::createCubemap(VulkanState & state, std::vector<uint8_t
   if (rawData.size() != (width * height * channelCount * 6))
     throw dbg::trace_exception("Cubemap data does not match image size and channel count.");
 
+  if (channelCount != 4)
+    throw dbg::trace_exception("Cubemap data has to be RGBA.");
+
+
+  /// The faces are colors, so their mips are averaged in linear light.
+  MipChain chain = mipGenerateChain(rawData.data(), width, height, 6, MIP_FILTER_BOX, MIP_COLOR_SPACE_SRGB);
 
   /// Precompute some usefull values
-  VkDeviceSize imageSize = sizeof(uint8_t) * rawData.size();
-  //uint32_t mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
-  uint32_t mipLevels = 1;
+  VkDeviceSize imageSize = sizeof(uint8_t) * chain.data.size();
+  uint32_t mipLevels = chain.levels.size();
   VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
 
 
   /// Create and fill a staging buffer for more efficient transfer.
-  VkBuffer stagingBuffer;
-  VmaAllocation stagingBufferMemory;
-  
-  VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-  stBufferCreateInfo.size = imageSize;
-  stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  
-  VmaAllocationCreateInfo stAllocCreateInfo = {};
-  stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-  stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-  
-  VmaAllocationInfo stagingBufferAllocInfo = {};
-  
-  vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
-  memcpy(stagingBufferAllocInfo.pMappedData, rawData.data(), imageSize);
+  StagingBuffer staging = state.stagingPool->acquire(imageSize);
+  memcpy(staging.data, chain.data.data(), imageSize);
 
 
   /// Create the image
@@ -89,24 +82,26 @@ CubemapCreateData vkutil::createCubemap(VulkanState & state, std::vector<uint8_t
   /// Copy image from buffer to image memory
   VkCommandBuffer commandBuffer = vkutil::beginSingleCommand(state.transferCommandPool, state.device);
   
-  std::vector<VkBufferImageCopy> regions(6);
-  for (unsigned int i = 0; i < 6; ++i) {
+  /// Each level stores its faces one after another, so one region copies all layers of a level.
+  std::vector<VkBufferImageCopy> regions(mipLevels);
+  for (unsigned int i = 0; i < mipLevels; ++i) {
     VkBufferImageCopy region = {};
-    region.bufferOffset = 0;
+    region.bufferOffset = chain.levels[i].offset;
     region.bufferImageHeight = 0;
     region.bufferRowLength = 0;
   
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.mipLevel = i;
     region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
+    region.imageSubresource.layerCount = 6;
 
-    region.imageExtent = {width, height, 1};
+    region.imageExtent = {chain.levels[i].width, chain.levels[i].height, 1};
     region.imageOffset = {0, 0, 0};
     regions[i] = region;
   }
 
-  vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(), regions.data());
+  vkCmdCopyBufferToImage(commandBuffer, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(), regions.data());
+  state.stagingPool->countUpload(imageSize);
   
   vkutil::endSingleCommand(commandBuffer, state.transferCommandPool, state.device, state.transferQueue);
 
@@ -158,7 +153,7 @@ CubemapCreateData vkutil::createCubemap(VulkanState & state, std::vector<uint8_t
   
 
   /// Cleanup the mess
-  vmaDestroyBuffer(state.vmaAllocator, stagingBuffer, stagingBufferMemory);
+  state.stagingPool->release(staging);
 
   CubemapCreateData retData;
   retData.image = image;
@@ -131,7 +131,7 @@ bool checkValidationLayerSupport(std::vector<const char *> validationLayers) {
 
 }
 
-VkInstance vkutil::createInstance(std::vector<const char *> validationLayers) {
+VkInstance vkutil::createInstance(std::vector<const char *> validationLayers, bool headless) {
 
   if (validationLayers.size() && !checkValidationLayerSupport(validationLayers))
     throw dbg::trace_exception("Validation layers not found but requested!");
@@ -148,13 +148,21 @@ VkInstance vkutil::createInstance(std::vector<const char *> validationLayers) {
   createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
   createInfo.pApplicationInfo = &appInfo;
 
-  uint32_t glfwExtensionCount = 0;
-  const char ** glfwExtensions;
-  glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-  std::vector<const char *> requiredExtensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+  /// Headless instances have no surface, so glfw does not need to be initialized.
+  std::vector<const char *> requiredExtensions;
+  if (!headless) {
+    uint32_t glfwExtensionCount = 0;
+    const char ** glfwExtensions;
+    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    requiredExtensions = std::vector<const char *>(glfwExtensions, glfwExtensions + glfwExtensionCount);
+  }
   if (validationLayers.size()) {
     requiredExtensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
   }
+  /// Needed to query VK_EXT_memory_budget on a Vulkan 1.0 instance.
+  if (checkInstanceExtensionSupport(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+    requiredExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+  }
   createInfo.enabledExtensionCount = requiredExtensions.size();
   createInfo.ppEnabledExtensionNames = requiredExtensions.data();
 
@@ -184,7 +192,7 @@ VkInstance vkutil::createInstance(std::vector<const char *> validationLayers) {
 
   }
 
-  return instance;
+  return instance;
 
 }
 
@@ -223,8 +231,12 @@ vkutil::QueueFamilyIndices vkutil::findQueueFamilies(const VkPhysicalDevice & de
       indices.transferFamily = i;
     }
 
+    /// Without a surface (headless rendering) nothing is presented, the graphics queue is used instead.
     VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+    if (surface != VK_NULL_HANDLE)
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+    else
+      presentSupport = p.queueFlags & VK_QUEUE_GRAPHICS_BIT;
     if (p.queueCount > 0 && presentSupport)
       indices.presentFamily = i;
 
@@ -279,6 +291,23 @@ bool vkutil::checkDeviceExtensionSupport(VkPhysicalDevice pdevice, const std::ve
 
 }
 
+bool vkutil::checkInstanceExtensionSupport(const char * extension) {
+
+  uint32_t extensionCount = 0;
+  vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+
+  std::vector<VkExtensionProperties> properties(extensionCount);
+  vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, properties.data());
+
+  for (const auto & e : properties) {
+    if (!strcmp(e.extensionName, extension))
+      return true;
+  }
+
+  return false;
+
+}
+
 VkPhysicalDevice vkutil::pickPhysicalDevice(VkInstance instance, std::function<bool(VkPhysicalDevice &)> isDeviceSuitable) {
 
   uint32_t deviceCount;
@@ -370,6 +399,59 @@ VmaAllocator vkutil::createAllocator(VkDevice & device, VkPhysicalDevice & physi
 
 }
 
+vkutil::MemoryBudget vkutil::queryMemoryBudget(const VulkanState & state) {
+
+  MemoryBudget result = {0, 0};
+
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  std::vector<VkDeviceSize> heapBudget, heapUsage;
+
+  auto getMemoryProperties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR) vkGetInstanceProcAddr(state.instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+
+  if (state.memoryBudget && getMemoryProperties2) {
+
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {};
+    budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+    VkPhysicalDeviceMemoryProperties2 properties = {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    properties.pNext = &budgetProperties;
+
+    getMemoryProperties2(state.physicalDevice, &properties);
+
+    memoryProperties = properties.memoryProperties;
+    heapBudget.assign(budgetProperties.heapBudget, budgetProperties.heapBudget + memoryProperties.memoryHeapCount);
+    heapUsage.assign(budgetProperties.heapUsage, budgetProperties.heapUsage + memoryProperties.memoryHeapCount);
+
+  } else {
+
+    /// Without the extension the allocations of other processes are unknown.
+    vkGetPhysicalDeviceMemoryProperties(state.physicalDevice, &memoryProperties);
+
+    VmaStats stats;
+    vmaCalculateStats(state.vmaAllocator, &stats);
+
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i) {
+      heapBudget.push_back(memoryProperties.memoryHeaps[i].size);
+      heapUsage.push_back(stats.memoryHeap[i].usedBytes + stats.memoryHeap[i].unusedBytes);
+    }
+
+  }
+
+  for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i) {
+
+    if (!(memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+      continue;
+
+    result.budget += heapBudget[i];
+    result.usage += heapUsage[i];
+
+  }
+
+  return result;
+
+}
+
 VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR> & formats) {
 
   if (formats.size() == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
@@ -799,6 +881,49 @@ void Queue::setMutex(std::mutex & mutex) {
   m = &mutex;
 }
 
+void BindState::bindPipeline(VkCommandBuffer buffer, VkPipeline pipeline) {
+
+  if (this->pipeline == pipeline) {
+    savedBinds++;
+    return;
+  }
+
+  vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+  this->pipeline = pipeline;
+
+}
+
+void BindState::bindDescriptorSet(VkCommandBuffer buffer, VkPipelineLayout layout, VkDescriptorSet set) {
+
+  vkCmdBindDescriptorSets(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &set, 0, nullptr);
+
+}
+
+void BindState::bindVertexBuffer(VkCommandBuffer buffer, VkBuffer vBuffer) {
+
+  if (this->vertexBuffer == vBuffer) {
+    savedBinds++;
+    return;
+  }
+
+  VkDeviceSize offsets[] = {0};
+  vkCmdBindVertexBuffers(buffer, 0, 1, &vBuffer, offsets);
+  this->vertexBuffer = vBuffer;
+
+}
+
+void BindState::bindIndexBuffer(VkCommandBuffer buffer, VkBuffer iBuffer, VkIndexType indexType) {
+
+  if (this->indexBuffer == iBuffer) {
+    savedBinds++;
+    return;
+  }
+
+  vkCmdBindIndexBuffer(buffer, iBuffer, 0, indexType);
+  this->indexBuffer = iBuffer;
+
+}
+
 void vkutil::copyBuffer(VkBuffer & src, VkBuffer & dst, VkDeviceSize & size, const VkCommandPool & commandPool, const VkDevice & device, const vkutil::Queue & q) {
 
   VkCommandBuffer commandBuffer = beginSingleCommand(commandPool, device);
@@ -984,15 +1109,160 @@ VkPipeline vkutil::createGraphicsPipeline(const VulkanState & state, const VkRen
   pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
   pipelineInfo.basePipelineIndex = -1;
 
+  return createGraphicsPipeline(state, pipelineInfo);
+
+}
+
+VkPipeline vkutil::createGraphicsPipeline(const VulkanState & state, const VkGraphicsPipelineCreateInfo & pipelineInfo) {
+
   VkPipeline graphicsPipeline;
 
-  if (VkResult r = vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline))
+  if (!state.pipelineCache) {
+
+    if (VkResult r = vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline))
+      throw vkutil::vk_trace_exception("Unable to create pipeline", r);
+
+    return graphicsPipeline;
+
+  }
+
+  PipelineCache * cache = state.pipelineCache;
+
+  if (!state.pipelineCreationFeedback) {
+
+    if (VkResult r = vkCreateGraphicsPipelines(state.device, cache->cache, 1, &pipelineInfo, nullptr, &graphicsPipeline))
+      throw vkutil::vk_trace_exception("Unable to create pipeline", r);
+
+    cache->unknown++;
+    return graphicsPipeline;
+
+  }
+
+  VkPipelineCreationFeedbackEXT pipelineFeedback = {};
+  std::vector<VkPipelineCreationFeedbackEXT> stageFeedback(pipelineInfo.stageCount);
+
+  VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo = {};
+  feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+  feedbackInfo.pNext = pipelineInfo.pNext;
+  feedbackInfo.pPipelineCreationFeedback = &pipelineFeedback;
+  feedbackInfo.pipelineStageCreationFeedbackCount = stageFeedback.size();
+  feedbackInfo.pPipelineStageCreationFeedbacks = stageFeedback.data();
+
+  VkGraphicsPipelineCreateInfo info = pipelineInfo;
+  info.pNext = &feedbackInfo;
+
+  if (VkResult r = vkCreateGraphicsPipelines(state.device, cache->cache, 1, &info, nullptr, &graphicsPipeline))
     throw vkutil::vk_trace_exception("Unable to create pipeline", r);
 
+  if (!(pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT))
+    cache->unknown++;
+  else if (pipelineFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT)
+    cache->hits++;
+  else
+    cache->misses++;
+
   return graphicsPipeline;
 
 }
 
+/// Checks the header written by vkGetPipelineCacheData against the current device.
+static bool isPipelineCacheCompatible(const std::vector<uint8_t> & data, const VkPhysicalDeviceProperties & props) {
+
+  if (data.size() < 16 + VK_UUID_SIZE)
+    return false;
+
+  uint32_t header[4];
+  memcpy(header, data.data(), sizeof(header));
+
+  if (header[0] < 16 + VK_UUID_SIZE || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+    return false;
+
+  if (header[2] != props.vendorID || header[3] != props.deviceID)
+    return false;
+
+  return !memcmp(data.data() + 16, props.pipelineCacheUUID, VK_UUID_SIZE);
+
+}
+
+PipelineCache * vkutil::createPipelineCache(const VkPhysicalDevice & physicalDevice, const VkDevice & device, const std::string & fname) {
+
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+  std::vector<uint8_t> data;
+
+  std::ifstream file(fname, std::ios::ate | std::ios::binary);
+  if (file.is_open()) {
+
+    data.resize(file.tellg());
+    file.seekg(0);
+    file.read((char *) data.data(), data.size());
+    file.close();
+
+    if (!isPipelineCacheCompatible(data, props)) {
+      lout << "Discarding pipeline cache " << fname << ", it was created for a different device or driver" << std::endl;
+      data.clear();
+    }
+
+  }
+
+  VkPipelineCacheCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  createInfo.initialDataSize = data.size();
+  createInfo.pInitialData = data.size() ? data.data() : nullptr;
+
+  PipelineCache * cache = new PipelineCache();
+
+  if (VkResult r = vkCreatePipelineCache(device, &createInfo, nullptr, &cache->cache)) {
+    delete cache;
+    throw vkutil::vk_trace_exception("Unable to create pipeline cache", r);
+  }
+
+  lout << "Loaded pipeline cache " << fname << " (" << data.size() << " bytes)" << std::endl;
+
+  return cache;
+
+}
+
+void vkutil::savePipelineCache(const VkDevice & device, PipelineCache * cache, const std::string & fname) {
+
+  /// Called while the window is destroyed, a cache that can not be saved is only reported.
+  size_t size = 0;
+  if (VkResult r = vkGetPipelineCacheData(device, cache->cache, &size, nullptr)) {
+    lerr << "Unable to query pipeline cache size (" << r << ")" << std::endl;
+    return;
+  }
+
+  std::vector<uint8_t> data(size);
+  if (VkResult r = vkGetPipelineCacheData(device, cache->cache, &size, data.data())) {
+    lerr << "Unable to read pipeline cache (" << r << ")" << std::endl;
+    return;
+  }
+
+  /// Write to a temporary file first, so an interrupted write does not leave a broken cache behind.
+  std::string tmpName = std::string(fname).append(".tmp");
+
+  std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    lerr << "Unable to write pipeline cache " << fname << std::endl;
+    return;
+  }
+
+  file.write((const char *) data.data(), size);
+  file.close();
+
+  if (rename(tmpName.c_str(), fname.c_str()))
+    lerr << "Unable to write pipeline cache " << fname << std::endl;
+
+}
+
+void vkutil::destroyPipelineCache(const VkDevice & device, PipelineCache * cache) {
+
+  vkDestroyPipelineCache(device, cache->cache, nullptr);
+  delete cache;
+
+}
+
 VkPipeline vkutil::createComputePipeline(const VulkanState & state) {
 
   VkPipelineLayoutCreateInfo layoutInfo = {};
@@ -5,6 +5,8 @@
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <string>
 
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
@@ -13,6 +15,7 @@
 #include "util/debug/logger.h"
 
 class Window;
+class TextureStreamer;
 
 namespace vkutil {
 
@@ -53,6 +56,29 @@ namespace vkutil {
     std::vector<VkVertexInputAttributeDescription> attributes;
   };
 
+  /**
+   * Keeps track of what is bound to a command buffer while recording draws,
+   * so binds that would not change any state can be skipped.
+   **/
+  struct BindState {
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkBuffer vertexBuffer = VK_NULL_HANDLE;
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+
+    /// Number of binds that were skipped because the state was already bound.
+    uint32_t savedBinds = 0;
+    /// Slot of the secondary buffer set being recorded, elements keep state the recording reads at draw time there.
+    uint32_t recordingSlot = 0;
+
+    void bindPipeline(VkCommandBuffer buffer, VkPipeline pipeline);
+    /// Never skipped, every render element owns its descriptor sets so consecutive draws don't share one.
+    void bindDescriptorSet(VkCommandBuffer buffer, VkPipelineLayout layout, VkDescriptorSet set);
+    void bindVertexBuffer(VkCommandBuffer buffer, VkBuffer vBuffer);
+    void bindIndexBuffer(VkCommandBuffer buffer, VkBuffer iBuffer, VkIndexType indexType);
+
+  };
+
   struct ShaderInputDescription {
     VkShaderModule module;
     VkShaderStageFlagBits usage;
@@ -79,13 +105,37 @@ namespace vkutil {
 
   };
   
+  class StagingPool;
+
+  /**
+   * Pipeline cache shared by all pipelines of a device.
+   * Hits and misses are reported by VK_EXT_pipeline_creation_feedback,
+   * pipelines created without it count as unknown.
+   * The VkPipelineCache is synchronized by the driver, pipelines are
+   * created concurrently.
+   **/
+  struct PipelineCache {
+
+    VkPipelineCache cache = VK_NULL_HANDLE;
+
+    std::atomic<uint32_t> hits{0};
+    std::atomic<uint32_t> misses{0};
+    std::atomic<uint32_t> unknown{0};
+
+  };
+
   struct VulkanState {
     
     VulkanState() :
       presentQueue(presentQueueMutex),
       graphicsQueue(graphicsQueueMutex),
       loadingGraphicsQueue(loadingGraphicsQueueMutex),
-      transferQueue(graphicsQueueMutex)
+      transferQueue(graphicsQueueMutex),
+      pipelineCache(nullptr),
+      stagingPool(nullptr),
+      textureStreamer(nullptr),
+      memoryBudget(false),
+      pipelineCreationFeedback(false)
     {
       
     }
@@ -103,8 +153,17 @@ namespace vkutil {
     VkCommandPool graphicsCommandPool;
     VkCommandPool loadingCommandPool;
     VkCommandPool transferCommandPool;
+    PipelineCache * pipelineCache;
+    StagingPool * stagingPool;
+    /// Textures only keep their mip tail resident when this is set.
+    TextureStreamer * textureStreamer;
     Window * window;
 
+    /// VK_EXT_memory_budget is enabled on the device.
+    bool memoryBudget;
+    /// VK_EXT_pipeline_creation_feedback is enabled on the device.
+    bool pipelineCreationFeedback;
+
     std::mutex graphicsQueueMutex;
     std::mutex transferQueueMutex;
     std::mutex loadingGraphicsQueueMutex;
@@ -112,16 +171,25 @@ namespace vkutil {
     
   };
   
+  /// Device local memory the process may use and is using, summed over all device local heaps.
+  struct MemoryBudget {
+
+    VkDeviceSize budget;
+    VkDeviceSize usage;
+
+  };
+
   GLFWwindow * createWindow(unsigned int width, unsigned int height, void * userData);
   void destroyWindow(GLFWwindow * window);
   
   void setupDebugMessenger(const VkInstance & instance, bool validationLayers);
   
-  VkInstance createInstance(std::vector<const char *> validationLayers);
+  VkInstance createInstance(std::vector<const char *> validationLayers, bool headless = false);
   VkSurfaceKHR createSurface(VkInstance instance, GLFWwindow * window);
   
   QueueFamilyIndices findQueueFamilies(const VkPhysicalDevice & device, const VkSurfaceKHR & surface);
   bool checkDeviceExtensionSupport(VkPhysicalDevice pdevice, const std::vector<const char*> deviceExtensions);
+  bool checkInstanceExtensionSupport(const char * extension);
   SwapChainSupportDetails querySwapChainSupport(const VkPhysicalDevice & device, const VkSurfaceKHR & surface);
   
   VkPhysicalDevice pickPhysicalDevice(VkInstance instance, std::function<bool(VkPhysicalDevice &)> isDeviceSuitable);
@@ -129,6 +197,9 @@ namespace vkutil {
   VkDevice createLogicalDevice(VkPhysicalDevice & pDevice, VkSurfaceKHR & surface, VkQueue * gQueue, VkQueue * pQueue, VkQueue * tQueue, VkQueue * lgQueue, const std::vector<const char*> deviceExtensions);
   
   VmaAllocator createAllocator(VkDevice & device, VkPhysicalDevice & pDevice);
+
+  /// Uses VK_EXT_memory_budget when enabled, otherwise the heap sizes and the usage of the allocator. No headroom is subtracted.
+  MemoryBudget queryMemoryBudget(const VulkanState & state);
   
   SwapChain createSwapchain(const VulkanState & state);
   SwapChain createSwapchain(const VkPhysicalDevice & physicalDevice, const VkDevice & device, const VkSurfaceKHR & surface, GLFWwindow * window);
@@ -153,6 +224,13 @@ namespace vkutil {
   void copyBuffer(VkBuffer & src, VkBuffer & dst, VkDeviceSize & size, const VkCommandPool & commandPool, const VkDevice & device, const Queue & q);
   VkDescriptorSetLayout createDescriptorSetLayout(std::vector<VkDescriptorSetLayoutBinding> & bindings, const VkDevice & device);
   VkPipeline createGraphicsPipeline(const VulkanState & state, const VkRenderPass & renderPass, const std::vector<ShaderInputDescription> & shaders, const VertexInputDescriptions & descs, const VkDescriptorSetLayout & descriptorSetLayout, VkPipelineLayout & retLayout, VkExtent2D swapChainExtent, uint32_t subpassId);
+  /// Creates the pipeline through the pipeline cache of the state.
+  VkPipeline createGraphicsPipeline(const VulkanState & state, const VkGraphicsPipelineCreateInfo & pipelineInfo);
+
+  /// Loads the cache from fname, data written for a different device or driver is discarded.
+  PipelineCache * createPipelineCache(const VkPhysicalDevice & physicalDevice, const VkDevice & device, const std::string & fname);
+  void savePipelineCache(const VkDevice & device, PipelineCache * cache, const std::string & fname);
+  void destroyPipelineCache(const VkDevice & device, PipelineCache * cache);
 
 
   VkPipeline createComputePipeline(const VulkanState & state);
@@ -12,27 +12,17 @@ public:
 
   }
   
-  VertexBuffer(const vkutil::VulkanState & state, const std::vector<T> & data, VkBufferUsageFlags extraUses) : StorageBuffer(state, sizeof(T) * data.size(), extraUses | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
-    
-    bufferSize = sizeof(T) * data.size();
-
-    VkBufferCreateInfo stBufferCreateInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-    stBufferCreateInfo.size = bufferSize;
-    stBufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    stBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VmaAllocationCreateInfo stAllocCreateInfo = {};
-    stAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-    stAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  VertexBuffer(const vkutil::VulkanState & state, const std::vector<T> & data, VkBufferUsageFlags extraUses) : VertexBuffer(state, data.data(), data.size(), extraUses) {
 
-    VmaAllocationInfo stagingBufferAllocInfo = {};
+  }
 
-    vmaCreateBuffer(state.vmaAllocator, &stBufferCreateInfo, &stAllocCreateInfo, &stagingBuffer, &stagingBufferMemory, &stagingBufferAllocInfo);
+  /// Copies count elements from data, which may point into a mapped file.
+  VertexBuffer(const vkutil::VulkanState & state, const T * data, size_t count, VkBufferUsageFlags extraUses) : StorageBuffer(state, sizeof(T) * count, extraUses | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+    
+    bufferSize = sizeof(T) * count;
 
-    void * tmp;
-    vmaMapMemory(state.vmaAllocator, stagingBufferMemory, &tmp);
-    memcpy(stagingBufferAllocInfo.pMappedData, data.data(), bufferSize);
-    vmaUnmapMemory(state.vmaAllocator, stagingBufferMemory);
+    staging = state.stagingPool->acquire(bufferSize);
+    memcpy(staging.data, data, bufferSize);
 
   }
   virtual ~VertexBuffer(){
@@ -48,8 +38,9 @@ public:
 
   void upload(const VkDevice & device, const VkCommandPool & commandPool, const vkutil::Queue & q) {
 
-    vkutil::copyBuffer(stagingBuffer, buffer, bufferSize, commandPool, device, q);
-    vmaDestroyBuffer(state.vmaAllocator, stagingBuffer, stagingBufferMemory);
+    vkutil::copyBuffer(staging.buffer, buffer, bufferSize, commandPool, device, q);
+    state.stagingPool->countUpload(bufferSize);
+    state.stagingPool->release(staging);
 
   }
 
@@ -2,12 +2,18 @@
 
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <unordered_set>
+#include <cmath>
+#include <string.h>
 
 #define MAX_FRAMES_IN_FLIGHT 3
 
 #include "util/debug/trace_exception.h"
 #include "util/debug/logger.h"
 #include "util/vk_trace_exception.h"
+#include "util/stagingpool.h"
+#include "texturestreamer.h"
 
 struct Viewport::CameraData {
 
@@ -35,6 +41,10 @@ std::vector<uint16_t> viewModelIndices = {
 Viewport::Viewport(std::shared_ptr<Window> window, std::shared_ptr<Camera> camera, std::shared_ptr<Shader> defferedShader, std::vector<std::shared_ptr<PPEffect>> effects, std::shared_ptr<Texture> sb) : state(window->getState()) {
 
   bufferManager = nullptr;
+  recordingPool = nullptr;
+  pipelineRegistry = std::make_shared<PipelineRegistry>(state);
+  drawOrderDirty = true;
+  executedSavedBinds = 0;
   this->skyBox = sb;
   this->skyBox->transitionLayout(state, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
@@ -45,16 +55,20 @@ Viewport::Viewport(std::shared_ptr<Window> window, std::shared_ptr<Camera> camer
   this->framebufferResized = false;
 
   this->frameIndex = 0;
+  this->submittedFrames = 0;
   this->framebufferResized = false;
 
+  this->window = window.get();
+  this->headless = window->isHeadless();
+
+  this->collectTimings = false;
+  this->lastFrameTimings = {};
+
   lout << "Creating swapchain" << std::endl;
 
-  vkutil::SwapChain tmpChain = vkutil::createSwapchain(window->getPhysicalDevice(), state.device, window->getSurface(), window->getGlfwWindow());
+  createSwapchainImages();
 
-  swapchain.chain = tmpChain.chain;
-  swapchain.extent = tmpChain.extent;
-  swapchain.format = tmpChain.format;
-  swapchain.images = tmpChain.images;
+  uniformArena = std::make_shared<UniformArena>(state, swapchain.images.size(), VIEWPORT_UNIFORM_ARENA_SIZE, sizeof(UniformBufferObject));
 
   lout << "setting up render pass" << std::endl;
 
@@ -66,8 +80,6 @@ Viewport::Viewport(std::shared_ptr<Window> window, std::shared_ptr<Camera> camer
   depthImageView = vkutil::createImageView(state.device, depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1, VK_IMAGE_VIEW_TYPE_2D, 1);
   vkutil::transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1, state.graphicsCommandPool, state.device, state.graphicsQueue);
 
-  swapchain.imageViews = vkutil::createSwapchainImageViews(swapchain.images, swapchain.format, state.device);
-
   createDefferedDescriptorSetLayout();
   createDefferedObjects();
   setupPostProcessingPipeline();
@@ -111,7 +123,11 @@ Viewport::~Viewport() {
   for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
     vkWaitForFences(state.device, 1, &inFlightFences[i], VK_TRUE, std::numeric_limits<uint64_t>::max());
 
+  for (TransferBatch & batch : transferBatches)
+    vkWaitForFences(state.device, 1, &batch.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+
   if (bufferManager) delete bufferManager;
+  if (recordingPool) delete recordingPool;
 
 }
 
@@ -120,6 +136,7 @@ void Viewport::createSyncObjects() {
   imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
   renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
   inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+  fenceFrames.resize(MAX_FRAMES_IN_FLIGHT, 0);
 
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -145,20 +162,34 @@ void Viewport::createSyncObjects() {
 
 void Viewport::createTransferCommandBuffer() {
 
+  std::vector<VkCommandBuffer> buffers(MAX_TRANSFERS_IN_FLIGHT);
+
   VkCommandBufferAllocateInfo allocInfo = {};
   allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocInfo.commandPool = state.transferCommandPool;
   allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandBufferCount = 1;
+  allocInfo.commandBufferCount = buffers.size();
 
-  if (vkAllocateCommandBuffers(state.device, &allocInfo, &transferCmdBuffer) != VK_SUCCESS)
+  if (vkAllocateCommandBuffers(state.device, &allocInfo, buffers.data()) != VK_SUCCESS)
     throw dbg::trace_exception("Unable to allocate command buffer");
 
   VkFenceCreateInfo fenceInfo = {};
   fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-  vkCreateFence(state.device, &fenceInfo, nullptr, &transferFence);
+  transferBatches.resize(MAX_TRANSFERS_IN_FLIGHT);
+  transferBatchIndex = 0;
+
+  for (unsigned int i = 0; i < transferBatches.size(); ++i) {
+
+    transferBatches[i].buffer = buffers[i];
+    transferBatches[i].lastToken = 0;
+    transferBatches[i].inFlight = false;
+
+    if (vkCreateFence(state.device, &fenceInfo, nullptr, &transferBatches[i].fence) != VK_SUCCESS)
+      throw dbg::trace_exception("Unable to create fence");
+
+  }
 
 }
 
@@ -187,32 +218,137 @@ void Viewport::prepareRenderElements() {
 
 }
 
+void Viewport::updateTextureStreaming() {
+
+  TextureStreamer * streamer = state.textureStreamer;
+
+  if (!streamer)
+    return;
+
+  Math::Vector<3, float> cameraPosition = camera->getPosition();
+
+  /// Pixels covered by one world unit at distance 1.
+  float projectionScale = swapchain.extent.height * std::fabs(camera->getProjection()[1][1]) * 0.5f;
+
+  for (std::shared_ptr<RenderElement> & element : renderElements) {
+
+    const std::vector<std::shared_ptr<Texture>> & textures = element->getTextures();
+
+    if (textures.empty())
+      continue;
+
+    float pixelsPerUnit = projectionScale / std::max(element->getViewDistance(cameraPosition), 0.001f);
+
+    for (const std::shared_ptr<Texture> & texture : textures)
+      streamer->request(texture.get(), pixelsPerUnit);
+
+  }
+
+  streamer->update();
+
+}
+
+void Viewport::applyTextureStreaming(uint32_t releaseFrameIndex) {
+
+  TextureStreamer * streamer = state.textureStreamer;
+
+  if (!streamer)
+    return;
+
+  /// Frames finish in submission order, so every frame up to the one of the release fence is done.
+  streamer->releaseRetiredImages(fenceFrames[releaseFrameIndex]);
+
+  if (!streamer->hasCompletedBuilds())
+    return;
+
+  /// Frames up to the last submitted one may still use the old images.
+  std::vector<Texture *> changed = streamer->applyCompletedBuilds(submittedFrames);
+  std::unordered_set<Texture *> changedTextures(changed.begin(), changed.end());
+
+  /**
+   * Every frame waits for the one before it, so after the release fence no
+   * frame binding these descriptor sets is pending. Updating them invalidates
+   * the recorded secondary buffers though, so those are recorded again before
+   * the next frame executes any.
+   **/
+  std::lock_guard<std::mutex> guard(recordingMutex);
+
+  for (std::shared_ptr<RenderElement> & element : renderElements) {
+
+    for (const std::shared_ptr<Texture> & texture : element->getTextures()) {
+
+      if (changedTextures.count(texture.get())) {
+        element->updateTextureDescriptors();
+        break;
+      }
+
+    }
+
+  }
+
+  if (bufferManager)
+    bufferManager->invalidateRecordings();
+
+}
+
 void Viewport::manageMemoryTransfer() {
 
   if (this->framebufferResized) {
     return;
   }
 
+  retireTransferBatches();
+
   if (this->hasPendingTransfer()) {
 
-    //lout << "Waiting for transfer fences" << std::endl;
-    vkWaitForFences(state.device, 1, &transferFence, VK_TRUE, std::numeric_limits<uint64_t>::max());
-    vkResetFences(state.device, 1, &transferFence);
+    TransferBatch & batch = transferBatches[transferBatchIndex];
+
+    /// All batches are still executing, the transfers stay queued for the next call.
+    if (batch.inFlight)
+      return;
+
+    vkResetFences(state.device, 1, &batch.fence);
 
-    lout << "Recording transfer" << std::endl;
-    this->recordTransfer(transferCmdBuffer);
+    //lout << "Recording transfer" << std::endl;
+    batch.lastToken = this->recordTransfer(batch.buffer, batch.fence);
 
     VkSubmitInfo transferSubmit = {};
     transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     transferSubmit.commandBufferCount = 1;
-    transferSubmit.pCommandBuffers = &transferCmdBuffer;
+    transferSubmit.pCommandBuffers = &batch.buffer;
     transferSubmit.signalSemaphoreCount = 0;
     transferSubmit.waitSemaphoreCount = 0;
 
     state.transferQueue.lock();
-    vkQueueSubmit(state.transferQueue.q, 1, &transferSubmit, transferFence);
+    VkResult res = vkQueueSubmit(state.transferQueue.q, 1, &transferSubmit, batch.fence);
     state.transferQueue.unlock();
 
+    if (res)
+      throw vkutil::vk_trace_exception("Unable to submit transfer", res);
+
+    batch.inFlight = true;
+    transferBatchIndex = (transferBatchIndex + 1) % transferBatches.size();
+
+  }
+
+}
+
+void Viewport::retireTransferBatches() {
+
+  /// Batches are retired in submission order, so the completed token never skips a running batch.
+  for (unsigned int i = 0; i < transferBatches.size(); ++i) {
+
+    TransferBatch & batch = transferBatches[(transferBatchIndex + i) % transferBatches.size()];
+
+    if (!batch.inFlight)
+      continue;
+
+    if (vkGetFenceStatus(state.device, batch.fence) != VK_SUCCESS)
+      break;
+
+    batch.inFlight = false;
+    markTransfersComplete(batch.lastToken);
+
   }
 
 }
@@ -221,9 +357,25 @@ void Viewport::drawFrame(bool updateElements) {
 
   static auto startRenderTime = std::chrono::high_resolution_clock::now();
 
+  auto frameStart = std::chrono::high_resolution_clock::now();
+  auto stageStart = frameStart;
+  FrameTimings timings = {};
+
+  /// Returns the time since the last call in ms, used to time the individual stages.
+  auto lap = [&stageStart] () -> double {
+    auto now = std::chrono::high_resolution_clock::now();
+    double duration = std::chrono::duration<double, std::chrono::milliseconds::period>(now - stageStart).count();
+    stageStart = now;
+    return duration;
+  };
+
   if (updateElements)
     prepareRenderElements();
 
+  updateTextureStreaming();
+
+  timings.prepare = lap();
+
   /// Keep this like this, this computes the mathematical modulo, no negative results.
   /// This will always keep the frame order correct.
   int32_t releaseFrameIndex = ((frameIndex - 1) + MAX_FRAMES_IN_FLIGHT) % MAX_FRAMES_IN_FLIGHT;
@@ -231,6 +383,12 @@ void Viewport::drawFrame(bool updateElements) {
   //std::cout << "Waiting for frame " << releaseFrameIndex << " to be finished" << std::endl;
   vkWaitForFences(state.device, 1, &inFlightFences[releaseFrameIndex], VK_TRUE, std::numeric_limits<uint64_t>::max());
 
+  timings.fenceWait = lap();
+
+  /// Frames finish in submission order, so every frame up to the one of the release fence is done.
+  uniformArena->releaseRetiredSlots(fenceFrames[releaseFrameIndex]);
+  applyTextureStreaming(releaseFrameIndex);
+
   if (bufferManager) {
     //std::cout << "Releasing buffer for frameIndex " << releaseFrameIndex << std::endl;
     bufferManager->releaseRenderBuffer(releaseFrameIndex);
@@ -239,12 +397,28 @@ void Viewport::drawFrame(bool updateElements) {
     //bufferManager->printAttachedBuffers();
     //lout << std::endl;
     //}
+
+    /// Streaming updated descriptor sets the recorded buffers bind, so this frame gets a new recording.
+    if (bufferManager->hasOutdatedRecording())
+      renderIntoSecondary();
   }
   
   //vkDeviceWaitIdle(state.device);
 
+  /// The work after the fence belongs to the preparation, acquire only times the swapchain.
+  timings.prepare += lap();
+
   uint32_t imageIndex = 0;
-  VkResult result = vkAcquireNextImageKHR(state.device, swapchain.chain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex);
+  VkResult result = VK_SUCCESS;
+
+  if (!headless) {
+    result = vkAcquireNextImageKHR(state.device, swapchain.chain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex);
+  } else {
+    /// There is one offscreen image per frame in flight.
+    imageIndex = frameIndex;
+  }
+
+  timings.acquire = lap();
 
   //std::cout << "imageIndex " << imageIndex << "  " << commandBuffers.size() << std::endl;
   if (imageIndex >= commandBuffers.size()) {
@@ -261,6 +435,10 @@ void Viewport::drawFrame(bool updateElements) {
   
   recordSingleBuffer(commandBuffers[imageIndex], imageIndex);
 
+  timings.record = lap();
+  timings.savedBinds = executedSavedBinds;
+  timings.uploadedBytes = state.stagingPool->takeUploadedBytes();
+
   //std::cout << "Recording done " << std::endl;
 
   switch(result) {
@@ -282,18 +460,20 @@ void Viewport::drawFrame(bool updateElements) {
 
   updateUniformBuffer(imageIndex);
 
+  timings.uniform = lap();
+
   VkSubmitInfo submitInfo = {};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
   VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[frameIndex]};
   VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submitInfo.waitSemaphoreCount = 1;
+  submitInfo.waitSemaphoreCount = headless ? 0 : 1;
   submitInfo.pWaitSemaphores = waitSemaphores;
   submitInfo.pWaitDstStageMask = waitStages;
   submitInfo.commandBufferCount = 1;
   submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
 
   VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[frameIndex]};
-  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.signalSemaphoreCount = headless ? 0 : 1;
   submitInfo.pSignalSemaphores = signalSemaphores;
 
   vkResetFences(state.device, 1, &inFlightFences[frameIndex]);
@@ -303,23 +483,39 @@ void Viewport::drawFrame(bool updateElements) {
     throw vkutil::vk_trace_exception("Unable to submit command buffer", res);
   state.graphicsQueue.unlock();
 
-  VkPresentInfoKHR presentInfo = {};
-  presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-  presentInfo.waitSemaphoreCount = 1;
-  presentInfo.pWaitSemaphores = signalSemaphores;
-  VkSwapchainKHR swapChains[] = {swapchain.chain};
-  presentInfo.swapchainCount = 1;
-  presentInfo.pSwapchains = swapChains;
-  presentInfo.pImageIndices = &imageIndex;
-  presentInfo.pResults = nullptr;
+  fenceFrames[frameIndex] = ++submittedFrames;
+  uniformArena->submitFrame(submittedFrames);
 
-  state.graphicsQueue.lock();
-  vkQueuePresentKHR(state.presentQueue.q, &presentInfo);
-  state.graphicsQueue.unlock();
+  timings.submit = lap();
+
+  if (!headless) {
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = signalSemaphores;
+    VkSwapchainKHR swapChains[] = {swapchain.chain};
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = swapChains;
+    presentInfo.pImageIndices = &imageIndex;
+    presentInfo.pResults = nullptr;
+
+    state.graphicsQueue.lock();
+    vkQueuePresentKHR(state.presentQueue.q, &presentInfo);
+    state.graphicsQueue.unlock();
+
+  }
+
+  timings.present = lap();
+  timings.total = std::chrono::duration<double, std::chrono::milliseconds::period>(stageStart - frameStart).count();
+
+  lastFrameTimings = timings;
+  if (collectTimings)
+    frameTimings.push_back(timings);
 
   frameIndex = (frameIndex + 1) % MAX_FRAMES_IN_FLIGHT;
 
-  if (!frameIndex) {
+  if (!frameIndex && !collectTimings) {
     double duration = std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startRenderTime).count();
     lout << "Frame time: " << duration << "ms => fps: " << (1000.0 / duration) << std::endl;
   }
@@ -328,6 +524,30 @@ void Viewport::drawFrame(bool updateElements) {
 
 }
 
+void Viewport::setCollectTimings(bool collect) {
+  this->collectTimings = collect;
+}
+
+const std::vector<Viewport::FrameTimings> & Viewport::getFrameTimings() {
+  return frameTimings;
+}
+
+const Viewport::FrameTimings & Viewport::getLastFrameTimings() {
+  return lastFrameTimings;
+}
+
+void Viewport::clearFrameTimings() {
+  frameTimings.clear();
+}
+
+bool Viewport::isHeadless() {
+  return headless;
+}
+
+uint32_t Viewport::getSavedBinds() {
+  return executedSavedBinds;
+}
+
 std::shared_ptr<Camera> Viewport::getCamera() {
   return camera;
 }
@@ -347,12 +567,17 @@ void Viewport::updateUniformBuffer(uint32_t imageIndex) {
   ubo.view = this->camera->getView();
   ubo.proj = this->camera->getProjection();
 
+  /// The camera data is shared by all elements, so it is only written once.
+  memcpy(uniformArena->getData(imageIndex, uniformArena->getShared()), &ubo, sizeof(UniformBufferObject));
+
   for (unsigned int i = 0; i < renderElements.size(); ++i) {
 
     renderElements[i]->updateUniformBuffer(ubo, imageIndex);
 
   }
 
+  uniformArena->flush(imageIndex);
+
   void * data;
   if (isLightDataModified(imageIndex)) {
     LightData * lData;
@@ -376,6 +601,36 @@ void Viewport::updateUniformBuffer(uint32_t imageIndex) {
 }
 
 
+void Viewport::createSwapchainImages() {
+
+  if (!headless) {
+
+    vkutil::SwapChain tmpChain = vkutil::createSwapchain(state.physicalDevice, state.device, state.surface, state.glfwWindow);
+
+    swapchain.chain = tmpChain.chain;
+    swapchain.extent = tmpChain.extent;
+    swapchain.format = tmpChain.format;
+    swapchain.images = tmpChain.images;
+
+  } else {
+
+    /// Offscreen images take the place of the swapchain, one for every frame in flight.
+    swapchain.chain = VK_NULL_HANDLE;
+    swapchain.extent = window->getExtent();
+    swapchain.format = VK_FORMAT_B8G8R8A8_UNORM;
+    swapchain.images.resize(MAX_FRAMES_IN_FLIGHT);
+    swapchain.imageMemories.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (unsigned int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+      vkutil::createImage(state.vmaAllocator, state.device, swapchain.extent.width, swapchain.extent.height, 1, 1, swapchain.format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapchain.images[i], swapchain.imageMemories[i]);
+    }
+
+  }
+
+  swapchain.imageViews = vkutil::createSwapchainImageViews(swapchain.images, swapchain.format, state.device);
+
+}
+
 void Viewport::setupRenderPass() {
 
   VkAttachmentDescription colorAttachment = {};
@@ -386,7 +641,8 @@ void Viewport::setupRenderPass() {
   colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  /// There is no presentation in headless mode, keep the image ready for readback instead.
+  colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
   VkAttachmentDescription gAttachment = {};
   gAttachment.format = VK_FORMAT_R16G16B16A16_SFLOAT;
@@ -653,8 +909,17 @@ void Viewport::destroyDefferedObjects() {
 
 }
 
+std::shared_ptr<PipelineRegistry> Viewport::getPipelineRegistry() {
+  return pipelineRegistry;
+}
+
+std::shared_ptr<UniformArena> Viewport::getUniformArena() {
+  return uniformArena;
+}
+
 void Viewport::addRenderElement(std::shared_ptr<RenderElement> rElem) {
   this->renderElements.push_back(rElem);
+  this->drawOrderDirty = true;
 
   if (this->renderElementsByShader.find(rElem->getShader()) == renderElementsByShader.end()) {
     renderElementsByShader[rElem->getShader()] = std::vector<std::shared_ptr<RenderElement>>(1);
@@ -845,8 +1110,7 @@ void Viewport::setupPostProcessingPipeline() {
   pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
   pipelineInfo.basePipelineIndex = -1;
 
-  if (vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &defferedPipeline) != VK_SUCCESS)
-    throw dbg::trace_exception("Unable to create pipeline");
+  defferedPipeline = vkutil::createGraphicsPipeline(state, pipelineInfo);
 
 }
 
@@ -1098,6 +1362,9 @@ void Viewport::destroySwapChain() {
 
   lout << "PP Objects destroyed" << std::endl;
 
+  /// The pipelines depend on the renderpass and extent, the elements acquire new ones in recreateSwapChain.
+  pipelineRegistry->clear();
+
   for (auto framebuffer : swapchain.framebuffers) {
     vkDestroyFramebuffer(state.device, framebuffer, nullptr);
   }
@@ -1119,8 +1386,11 @@ void Viewport::destroySwapChain() {
     vkDestroyImageView(state.device, v, nullptr);
   }
 
-  for (const VkImage & i : swapchain.images) {
-    vkDestroyImage(state.device, i, nullptr);
+  for (unsigned int i = 0; i < swapchain.images.size(); ++i) {
+    if (headless)
+      vmaDestroyImage(state.vmaAllocator, swapchain.images[i], swapchain.imageMemories[i]);
+    else
+      vkDestroyImage(state.device, swapchain.images[i], nullptr);
   }
 
   lout << "Destroyed images" << std::endl;
@@ -1141,12 +1411,7 @@ void Viewport::recreateSwapChain() {
 
   //state.graphicsQueueMutex.lock();
 
-  vkutil::SwapChain tmpChain = vkutil::createSwapchain(state.physicalDevice, state.device, state.surface, state.glfwWindow);
-  this->swapchain.chain = tmpChain.chain;
-  this->swapchain.extent = tmpChain.extent;
-  this->swapchain.format = tmpChain.format;
-  this->swapchain.images = tmpChain.images;
-  this->swapchain.imageViews = vkutil::createSwapchainImageViews(swapchain.images, swapchain.format, state.device);
+  this->createSwapchainImages();
 
   this->setupRenderPass();
 
@@ -1165,9 +1430,14 @@ void Viewport::recreateSwapChain() {
 
   lout << "Done creating Framebuffers" << std::endl;
 
+  /// The elements allocate their uniform slots again in recreateResources.
+  uniformArena->reset(swapchain.images.size());
+
   for (unsigned int i = 0; i < renderElements.size(); ++i) {
     renderElements[i]->recreateResources(renderPass, swapchain.imageViews.size(), swapchain);
   }
+  /// The pipelines have changed, so the draw order has to be rebuilt.
+  drawOrderDirty = true;
 
   this->setupPostProcessingPipeline();
   this->createDefferedDescriptorPool();
@@ -1237,11 +1507,13 @@ void Viewport::recordSingleBuffer(VkCommandBuffer & buffer, unsigned int frameIn
 
 
   if (bufferManager) {
-    VkCommandBuffer secBuffer = bufferManager->getBufferForRender(frameIndex);
+    ThreadedBufferManager::BufferElement * secBuffers = bufferManager->getBufferForRender(frameIndex);
     //lout << "Submitting buffer " << secBuffer << " to " << buffer << " : " << frameIndex << std::endl;
     //bufferManager->printAttachedBuffers();
-    if (secBuffer)
-      vkCmdExecuteCommands(buffer, 1, &secBuffer);
+    if (secBuffers) {
+      vkCmdExecuteCommands(buffer, secBuffers->buffers.size(), secBuffers->buffers.data());
+      executedSavedBinds = secBuffers->savedBinds;
+    }
   }
 
   vkCmdNextSubpass(buffer, VK_SUBPASS_CONTENTS_INLINE);
@@ -1313,11 +1585,15 @@ void Viewport::updateLight(uint32_t index, glm::vec4 pos, glm::vec4 color) {
 
 }
 
-void Viewport::createSecondaryBuffers() {
+void Viewport::createSecondaryBuffers(unsigned int workerCount) {
 
-  uint32_t bufferCount = swapchain.framebuffers.size() * 3;
+  if (!workerCount)
+    workerCount = std::max(std::thread::hardware_concurrency(), 1u);
 
-  this->bufferManager = new ThreadedBufferManager(bufferCount, swapchain.framebuffers.size(), state);
+  uint32_t bufferCount = swapchain.framebuffers.size() * VIEWPORT_SECONDARY_SETS_PER_IMAGE;
+
+  this->recordingPool = new RecordingThreadPool(workerCount);
+  this->bufferManager = new ThreadedBufferManager(bufferCount, swapchain.framebuffers.size(), workerCount, state);
 
 }
 
@@ -1327,9 +1603,69 @@ void Viewport::renderIntoSecondary() {
 
   ThreadedBufferManager::BufferElement * bufferElem = bufferManager->getBufferForRecording();
 
-  //lout << "Buffer " << bufferElem->buffer << " " << bufferElem->usageCount << std::endl;
+  /// Descriptor sets are only updated between recordings, the generation tells which updates this one sees.
+  std::unique_lock<std::mutex> recordingLock(recordingMutex);
+  bufferElem->generation = bufferManager->getGeneration();
+
+  if (drawOrderDirty || drawOrder.size() != renderElements.size())
+    sortDrawOrder();
+
+  /// Every worker records a contiguous slice of the sorted elements into its own buffer.
+  size_t elementCount = drawOrder.size();
+  size_t workerCount = bufferElem->buffers.size();
+  std::vector<vkutil::BindState> bindStates(workerCount);
+
+  for (vkutil::BindState & bindState : bindStates)
+    bindState.recordingSlot = bufferElem->slot;
+
+  recordingPool->run([&] (unsigned int worker) {
+
+    size_t begin = (elementCount * worker) / workerCount;
+    size_t end = (elementCount * (worker + 1)) / workerCount;
+
+    recordSecondaryRange(bufferElem->buffers[worker], begin, end, bindStates[worker]);
+
+  });
+
+  recordingLock.unlock();
+
+  bufferElem->savedBinds = 0;
+  for (vkutil::BindState & bindState : bindStates)
+    bufferElem->savedBinds += bindState.savedBinds;
+
+  // std::cout << "Submitting " << buffer << std::endl;
+  /// Submit the resulting buffer as the current state
+  bufferManager->setActiveBuffer(bufferElem);
+
+}
+
+void Viewport::sortDrawOrder() {
 
-  VkCommandBuffer buffer = bufferElem->buffer;
+  drawOrder.resize(renderElements.size());
+  for (unsigned int i = 0; i < renderElements.size(); ++i)
+    drawOrder[i] = renderElements[i].get();
+
+  /// Elements sharing a pipeline end up next to each other, so most binds can be skipped while recording.
+  std::stable_sort(drawOrder.begin(), drawOrder.end(), [] (RenderElement * a, RenderElement * b) {
+
+    if (a->getPipeline() != b->getPipeline())
+      return std::less<VkPipeline>()(a->getPipeline(), b->getPipeline());
+
+    if (a->getDescriptorSetLayout() != b->getDescriptorSetLayout())
+      return std::less<VkDescriptorSetLayout>()(a->getDescriptorSetLayout(), b->getDescriptorSetLayout());
+
+    if (a->getModel()->getVertexBuffer() != b->getModel()->getVertexBuffer())
+      return std::less<VkBuffer>()(a->getModel()->getVertexBuffer(), b->getModel()->getVertexBuffer());
+
+    return std::less<VkBuffer>()(a->getModel()->getIndexBuffer(), b->getModel()->getIndexBuffer());
+
+  });
+
+  drawOrderDirty = false;
+
+}
+
+void Viewport::recordSecondaryRange(VkCommandBuffer buffer, size_t begin, size_t end, vkutil::BindState & bindState) {
 
   /// Reset the buffer
   vkResetCommandBuffer(buffer, 0);
@@ -1348,75 +1684,161 @@ void Viewport::renderIntoSecondary() {
   if (vkBeginCommandBuffer(buffer, &beginInfo) != VK_SUCCESS)
     throw dbg::trace_exception("Unable to start recording to command buffer");
 
-  /// Record the rendering commands
-  /*for (auto it : renderElementsByShader) {
+  /// Record the rendering commands in draw order, binds already present in the buffer are skipped.
+  for (size_t i = begin; i < end; ++i) {
+    drawOrder[i]->render(buffer, frameIndex, bindState);
+  }
+
+  //std::cout << "Ending buffer " << buffer << std::endl;
+  if (VkResult res = vkEndCommandBuffer(buffer))
+    throw vkutil::vk_trace_exception("Unable to end command buffer", res);
+
+}
 
-    vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, it.first->getPipeline());
-    vkCmdPushConstants(buffer, it.first->getPipelineLayout(), VK_SHADER_STAGE_VERTEX_BIT, 0, 32 * sizeof(float), &ubo);
+RecordingThreadPool::RecordingThreadPool(unsigned int threadCount) {
 
-    for (std::shared_ptr<RenderElement> relem : it.second) {
+  this->threadCount = threadCount ? threadCount : 1;
+  this->generation = 0;
+  this->pending = 0;
+  this->running = true;
 
-    relem->renderShaderless(buffer, frameIndex);
+  /// Worker 0 is the thread calling run()
+  for (unsigned int i = 1; i < this->threadCount; ++i) {
+    threads.push_back(std::thread(&RecordingThreadPool::workerLoop, this, i));
+  }
 
-    }
+}
 
-    }*/
+RecordingThreadPool::~RecordingThreadPool() {
 
-  for (std::shared_ptr<RenderElement> relem : renderElements) {
-    relem->render(buffer, frameIndex);
+  {
+    std::unique_lock<std::mutex> ulock(lock);
+    running = false;
   }
+  startVar.notify_all();
 
-  //std::cout << "Ending buffer " << buffer << std::endl;
-  if (VkResult res = vkEndCommandBuffer(buffer))
-    throw vkutil::vk_trace_exception("Unable to end command buffer", res);
+  for (std::thread & t : threads) {
+    t.join();
+  }
 
-  // std::cout << "Submitting " << buffer << std::endl;
-  /// Submit the resulting buffer as the current state
-  bufferManager->setActiveBuffer(bufferElem);
+}
+
+unsigned int RecordingThreadPool::getThreadCount() {
+  return threadCount;
+}
+
+void RecordingThreadPool::run(std::function<void(unsigned int)> func) {
+
+  {
+    std::unique_lock<std::mutex> ulock(lock);
+    task = func;
+    pending = threads.size();
+    error = nullptr;
+    generation++;
+  }
+  startVar.notify_all();
+
+  std::exception_ptr ownError = nullptr;
+  try {
+    func(0);
+  } catch (...) {
+    ownError = std::current_exception();
+  }
+
+  std::unique_lock<std::mutex> ulock(lock);
+  doneVar.wait(ulock, [this] { return pending == 0; });
 
+  if (ownError)
+    std::rethrow_exception(ownError);
+  if (error)
+    std::rethrow_exception(error);
 
 }
 
-ThreadedBufferManager::ThreadedBufferManager() {
+void RecordingThreadPool::workerLoop(unsigned int index) {
+
+  uint64_t lastGeneration = 0;
+
+  while (true) {
+
+    std::function<void(unsigned int)> func;
+
+    {
+      std::unique_lock<std::mutex> ulock(lock);
+      startVar.wait(ulock, [&] { return !running || generation != lastGeneration; });
+
+      if (!running)
+	return;
+
+      lastGeneration = generation;
+      func = task;
+    }
+
+    std::exception_ptr taskError = nullptr;
+    try {
+      func(index);
+    } catch (...) {
+      taskError = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> ulock(lock);
+    if (taskError)
+      error = taskError;
+    if (!--pending)
+      doneVar.notify_all();
+
+  }
 
 }
 
-ThreadedBufferManager::ThreadedBufferManager(unsigned int bufferCount, unsigned int frameCount, vkutil::VulkanState & state) {
+ThreadedBufferManager::ThreadedBufferManager() {
 
-  bufferPool = vkutil::createSecondaryCommandPool(state.physicalDevice, state.device, state.surface);
+}
 
-  VkCommandBufferAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocInfo.commandBufferCount = bufferCount;
-  allocInfo.commandPool = bufferPool;
-  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+ThreadedBufferManager::ThreadedBufferManager(unsigned int bufferCount, unsigned int frameCount, unsigned int workerCount, vkutil::VulkanState & state) {
 
-  std::vector<VkCommandBuffer> commandBuffers(bufferCount);
   buffers.resize(bufferCount);
+  bufferPools.resize(workerCount);
+
+  for (unsigned int i = 0; i < bufferCount; ++i) {
+    buffers[i].usageCount = 0;
+    buffers[i].savedBinds = 0;
+    buffers[i].slot = i;
+    buffers[i].generation = 0;
+    buffers[i].buffers.resize(workerCount);
+  }
 
-  if (VkResult res = vkAllocateCommandBuffers(state.device, &allocInfo, commandBuffers.data()))
-    throw vkutil::vk_trace_exception("Failed to allocate command buffers", res);
+  /// Command pools are not thread safe, so every worker gets its own pool.
+  for (unsigned int w = 0; w < workerCount; ++w) {
 
-  useableBuffers = std::queue<BufferElement *>();
+    bufferPools[w] = vkutil::createSecondaryCommandPool(state.physicalDevice, state.device, state.surface);
 
-  uint32_t i = 0;
-  for (VkCommandBuffer buffer : commandBuffers) {
-    lout << "Queueing " << buffer << std::endl;
-    //useableBuffers.push(buffer);
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandBufferCount = bufferCount;
+    allocInfo.commandPool = bufferPools[w];
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
 
-    BufferElement elem;
-    elem.buffer = buffer;
-    elem.usageCount = 0;
-    buffers[i] = elem;
+    std::vector<VkCommandBuffer> commandBuffers(bufferCount);
 
-    useableBuffers.push(&buffers[i]);
+    if (VkResult res = vkAllocateCommandBuffers(state.device, &allocInfo, commandBuffers.data()))
+      throw vkutil::vk_trace_exception("Failed to allocate command buffers", res);
+
+    for (unsigned int i = 0; i < bufferCount; ++i) {
+      buffers[i].buffers[w] = commandBuffers[i];
+    }
+
+  }
 
-    i++;
+  useableBuffers = std::queue<BufferElement *>();
 
+  for (unsigned int i = 0; i < bufferCount; ++i) {
+    useableBuffers.push(&buffers[i]);
   }
 
   activeBuffer = nullptr;
   nextBuffer = nullptr;
+  generation = 0;
 
   attachedBuffers.resize(frameCount);
   for (unsigned int i = 0; i < frameCount; ++i) {
@@ -1425,7 +1847,7 @@ ThreadedBufferManager::ThreadedBufferManager(unsigned int bufferCount, unsigned
 
 }
 
-VkCommandBuffer ThreadedBufferManager::getBufferForRender(uint32_t frameIndex) {
+ThreadedBufferManager::BufferElement * ThreadedBufferManager::getBufferForRender(uint32_t frameIndex) {
 
   std::unique_lock<std::mutex> ulock(lock);
 
@@ -1435,7 +1857,7 @@ VkCommandBuffer ThreadedBufferManager::getBufferForRender(uint32_t frameIndex) {
       activeBuffer = nextBuffer;
       //return nextBuffer->buffer;
     } else {
-      return VK_NULL_HANDLE;
+      return nullptr;
     }
   }
 
@@ -1460,7 +1882,7 @@ VkCommandBuffer ThreadedBufferManager::getBufferForRender(uint32_t frameIndex) {
   }
   //lout << "Getting buffer for render " << frameIndex << " " << this->activeBuffer->buffer << std::endl;
   
-  return this->activeBuffer->buffer;
+  return this->activeBuffer;
 }
 
 void ThreadedBufferManager::releaseRenderBuffer(uint32_t frameIndex, bool internal) {
@@ -1486,7 +1908,7 @@ void ThreadedBufferManager::releaseRenderBuffer(uint32_t frameIndex, bool intern
 
   buffer->usageCount--;
 
-  if (!buffer->usageCount && activeBuffer->buffer != buffer->buffer) {
+  if (!buffer->usageCount && activeBuffer != buffer) {
     pushBufferToUseable(buffer);
     //lout << "Released " << buffer->buffer << " : " << buffer->usageCount << " frameIndex " << frameIndex << " queue: " << useableBuffers.size() << " active: "<< activeBuffer->buffer  << std::endl;
   }
@@ -1512,7 +1934,7 @@ ThreadedBufferManager::BufferElement * ThreadedBufferManager::getBufferForRecord
     //var.wait(ulock);
     //lout << "Attached Buffers: " << attachedBuffers.size() << std::endl;
     for (BufferElement & e : buffers) {
-      lout << "Buffer " << e.buffer << " : " << e.usageCount << std::endl;
+      lout << "Buffer " << e.buffers[0] << " : " << e.usageCount << std::endl;
     }
 
     throw dbg::trace_exception("Empty buffer queue for recording");
@@ -1535,6 +1957,12 @@ ThreadedBufferManager::BufferElement * ThreadedBufferManager::getBufferForRecord
 void ThreadedBufferManager::setActiveBuffer(BufferElement * buffer) {
 
   std::unique_lock<std::mutex> ulock(lock);
+
+  /// Recorded before the last invalidation, a newer recording may already be set.
+  if (buffer->generation != generation) {
+    pushBufferToUseable(buffer);
+    return;
+  }
   
   if (nextBuffer && nextBuffer->usageCount == 0 && nextBuffer != activeBuffer) {
     pushBufferToUseable(nextBuffer);
@@ -1544,6 +1972,27 @@ void ThreadedBufferManager::setActiveBuffer(BufferElement * buffer) {
 
 }
 
+uint64_t ThreadedBufferManager::getGeneration() {
+
+  std::unique_lock<std::mutex> ulock(lock);
+  return generation;
+
+}
+
+void ThreadedBufferManager::invalidateRecordings() {
+
+  std::unique_lock<std::mutex> ulock(lock);
+  generation++;
+
+}
+
+bool ThreadedBufferManager::hasOutdatedRecording() {
+
+  std::unique_lock<std::mutex> ulock(lock);
+  return nextBuffer && nextBuffer->generation != generation;
+
+}
+
 void ThreadedBufferManager::pushBufferToUseable(BufferElement * buffer) {
 
   if (buffer->usageCount)
@@ -1562,7 +2011,7 @@ void ThreadedBufferManager::printAttachedBuffers() {
 
     lout << "[" << i << "]: ";
     if (attachedBuffers[i])
-      lout << attachedBuffers[i]->buffer << " " << attachedBuffers[i]->usageCount << std::endl;
+      lout << attachedBuffers[i]->buffers[0] << " " << attachedBuffers[i]->usageCount << std::endl;
     else
       lout << "NULL" << std::endl;
     
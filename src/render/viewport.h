@@ -2,6 +2,9 @@
 #define VIEWPORT_H
 
 #include <memory>
+#include <thread>
+#include <functional>
+#include <exception>
 
 #include <glm/glm.hpp>
 
@@ -11,8 +14,51 @@
 #include "renderelement.h"
 #include "camera.h"
 #include "render/postprocessing.h"
+#include "pipelineregistry.h"
+#include "uniformarena.h"
 
 #define VIEWPORT_MAX_LIGHT_COUNT 128
+/// Size of the uniform data of all render elements for a single frame.
+#define VIEWPORT_UNIFORM_ARENA_SIZE (1 << 20)
+
+/// Secondary buffer sets per swapchain image, the recording slots of the elements are sized by it.
+#define VIEWPORT_SECONDARY_SETS_PER_IMAGE 3
+
+/**
+ * Small pool of threads that all run the same task, used to record
+ * secondary command buffers in parallel. The calling thread takes part
+ * as worker 0.
+ **/
+class RecordingThreadPool {
+
+public:
+
+  RecordingThreadPool(unsigned int threadCount);
+  virtual ~RecordingThreadPool();
+
+  /// Runs func(workerIndex) on every worker and returns once all of them are done.
+  void run(std::function<void(unsigned int)> func);
+
+  unsigned int getThreadCount();
+
+private:
+
+  void workerLoop(unsigned int index);
+
+  unsigned int threadCount;
+  std::vector<std::thread> threads;
+
+  std::mutex lock;
+  std::condition_variable startVar;
+  std::condition_variable doneVar;
+
+  std::function<void(unsigned int)> task;
+  uint64_t generation;
+  unsigned int pending;
+  bool running;
+  std::exception_ptr error;
+
+};
 
 class ThreadedBufferManager {
 
@@ -21,23 +67,35 @@ public:
   struct BufferElement {
 
     uint32_t usageCount;
-    VkCommandBuffer buffer;
+    /// One secondary buffer per recording worker, each one from the worker's own pool.
+    std::vector<VkCommandBuffer> buffers;
+    /// Binds skipped while recording these buffers.
+    uint32_t savedBinds;
+    /// Index of the set, passed to the elements as recording slot.
+    uint32_t slot;
+    /// Descriptor generation the set was recorded against.
+    uint64_t generation;
 
   };
 
   ThreadedBufferManager();
-  ThreadedBufferManager(unsigned int bufferCount, unsigned int frameCount, vkutil::VulkanState & state);
+  ThreadedBufferManager(unsigned int bufferCount, unsigned int frameCount, unsigned int workerCount, vkutil::VulkanState & state);
 
   /// returns the active buffer
-  VkCommandBuffer getBufferForRender(uint32_t frameIndex);
+  BufferElement * getBufferForRender(uint32_t frameIndex);
   /// releases the active buffer back to the queue
   void releaseRenderBuffer(uint32_t frameIndex, bool internal=false);
 
   /// returns a buffer that can be recorded to
   BufferElement * getBufferForRecording();
-  /// sets the next buffer to use.
+  /// sets the next buffer to use, outdated recordings go straight back to the queue.
   void setActiveBuffer(BufferElement * buffer);
 
+  uint64_t getGeneration();
+  /// Descriptor sets bound by the recorded buffers were updated, so none of them may be executed again.
+  void invalidateRecordings();
+  bool hasOutdatedRecording();
+
   void printAttachedBuffers();
 
 private:
@@ -47,7 +105,7 @@ private:
   std::mutex lock;
   std::condition_variable var;
 
-  VkCommandPool bufferPool;
+  std::vector<VkCommandPool> bufferPools;
   std::vector<BufferElement> buffers;
   std::vector<BufferElement *> attachedBuffers;
 
@@ -55,6 +113,8 @@ private:
   BufferElement * activeBuffer;
   BufferElement * nextBuffer;
 
+  uint64_t generation;
+
 };
 
 class Viewport : public MemoryTransferHandler {
@@ -72,8 +132,40 @@ public:
 
   struct CameraData;
 
+  /// CPU time in milliseconds spent in each stage of drawFrame.
+  struct FrameTimings {
+
+    /// Element updates and texture streaming, on the CPU.
+    double prepare;
+    /// Waiting for the previous frame to finish on the device.
+    double fenceWait;
+    double acquire;
+    double record;
+    double uniform;
+    double submit;
+    double present;
+    double total;
+
+    /// Binds skipped in the secondary buffers executed by this frame.
+    uint32_t savedBinds;
+    /// Bytes copied out of staging buffers since the previous frame.
+    uint64_t uploadedBytes;
+
+  };
+
   void drawFrame(bool updateElements = true);
 
+  /// When enabled, the timings of every drawn frame are kept for later evaluation.
+  void setCollectTimings(bool collect);
+  const std::vector<FrameTimings> & getFrameTimings();
+  const FrameTimings & getLastFrameTimings();
+  void clearFrameTimings();
+
+  bool isHeadless();
+
+  /// Binds skipped in the secondary buffers executed by the last frame.
+  uint32_t getSavedBinds();
+
   vkutil::VulkanState & getState();
   const VkRenderPass & getRenderpass();
   const VkExtent2D & getSwapchainExtent();
@@ -81,12 +173,18 @@ public:
 
   void addRenderElement(std::shared_ptr<RenderElement> rElem);
 
+  /// Pipelines of the render elements, shared between elements with the same state.
+  std::shared_ptr<PipelineRegistry> getPipelineRegistry();
+  /// Uniform data of the render elements, the shared slot holds the UniformBufferObject.
+  std::shared_ptr<UniformArena> getUniformArena();
+
   uint32_t addLight(glm::vec4 pos, glm::vec4 color);
   void updateLight(uint32_t index, glm::vec4 pos, glm::vec4 color);
 
   void manageMemoryTransfer();
 
-  void createSecondaryBuffers();
+  /// workerCount = 0 uses one recording worker per hardware thread.
+  void createSecondaryBuffers(unsigned int workerCount = 0);
   void renderIntoSecondary();
 
   std::shared_ptr<Camera> getCamera();
@@ -104,6 +202,7 @@ protected:
   void setupPostProcessingPipeline();
   void setupFramebuffers();
 
+  void createSwapchainImages();
   void destroySwapChain();
   void recreateSwapChain();
 
@@ -114,10 +213,17 @@ protected:
   void createTransferCommandBuffer();
 
   void prepareRenderElements();
+  /// Reports the texture use of this frame to the texture streamer and starts the builds it chooses.
+  void updateTextureStreaming();
+  /// Swaps in the streamed images that are done, needs the release fence of the frame to have been waited for.
+  void applyTextureStreaming(uint32_t releaseFrameIndex);
 
   void updateUniformBuffer(uint32_t frameIndex);
 
   void recordSingleBuffer(VkCommandBuffer & buffer, unsigned int frameIndex);
+  void recordSecondaryRange(VkCommandBuffer buffer, size_t begin, size_t end, vkutil::BindState & bindState);
+
+  void sortDrawOrder();
 
 private:
 
@@ -125,6 +231,8 @@ private:
 
     std::vector<VkFramebuffer> framebuffers;
     std::vector<VkImageView> imageViews;
+    /// only used for offscreen images in headless mode
+    std::vector<VmaAllocation> imageMemories;
 
 
   } swapchain;
@@ -135,6 +243,7 @@ private:
   bool framebufferResized;
 
   Window * window;
+  bool headless;
   VkRenderPass renderPass;
 
   VkImage depthImage;
@@ -173,13 +282,29 @@ private:
   std::vector<VkImageView> ppImageViews;
 
   std::vector<VkCommandBuffer> commandBuffers;
-  VkCommandBuffer transferCmdBuffer;
+
+  /// Transfer submissions, used round robin so a new batch never has to wait for the previous one.
+  struct TransferBatch {
+
+    VkCommandBuffer buffer;
+    VkFence fence;
+    TransferToken lastToken;
+    bool inFlight;
+
+  };
+
+  std::vector<TransferBatch> transferBatches;
+  unsigned int transferBatchIndex;
+
+  void retireTransferBatches();
 
   std::vector<VkSemaphore> imageAvailableSemaphores;
   std::vector<VkSemaphore> renderFinishedSemaphores;
   int frameIndex;
   std::vector<VkFence> inFlightFences;
-  VkFence transferFence;
+  /// Frames submitted so far, and the number of the last frame submitted with every fence.
+  uint64_t submittedFrames;
+  std::vector<uint64_t> fenceFrames;
 
   std::shared_ptr<Model> ppBufferModel;
 
@@ -192,15 +317,30 @@ private:
   std::vector<std::shared_ptr<RenderElement>> renderElements;
   std::unordered_map<Shader *, std::vector<std::shared_ptr<RenderElement>>> renderElementsByShader;
 
+  /// renderElements sorted by pipeline, descriptor set layout and buffers.
+  std::vector<RenderElement *> drawOrder;
+  bool drawOrderDirty;
+  /// Held while secondary buffers are recorded, descriptor sets bound by them are only updated under it.
+  std::mutex recordingMutex;
+  uint32_t executedSavedBinds;
+
   std::queue<SwapchainInfo> destroyableSwapchains;
 
   bool isLightDataModified(uint32_t imageIndex);
   void markLightDataCorrect(uint32_t imageIndex);
 
   ThreadedBufferManager * bufferManager;
+  RecordingThreadPool * recordingPool;
+
+  std::shared_ptr<PipelineRegistry> pipelineRegistry;
+  std::shared_ptr<UniformArena> uniformArena;
 
   std::shared_ptr<Texture> skyBox;
 
+  bool collectTimings;
+  FrameTimings lastFrameTimings;
+  std::vector<FrameTimings> frameTimings;
+
 };
 
 #endif // VIEWPORT_H
@@ -1,16 +1,21 @@
 #include "window.h"
 
 #include "util/vkutil.h"
+#include "util/stagingpool.h"
 
 #include <GLFW/glfw3.h>
 #include <iostream>
 
 #include "viewport.h"
+#include "texturestreamer.h"
 
 const std::vector<const char*> deviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+const std::vector<const char*> headlessDeviceExtensions = {
+};
+
 #if DEBUG
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
@@ -33,6 +38,11 @@ bool isDeviceSuitable(VkPhysicalDevice & device, VkSurfaceKHR & surface) {
     vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
 
     vkutil::QueueFamilyIndices indices = vkutil::findQueueFamilies(device, surface);
+
+    /// Headless devices only need a graphics queue, there is no swapchain to check.
+    if (surface == VK_NULL_HANDLE)
+        return indices.isComplete() && supportedFeatures.samplerAnisotropy;
+
     bool extensions = vkutil::checkDeviceExtensionSupport(device, deviceExtensions);
 
     bool swapChainOK = false;
@@ -45,24 +55,33 @@ bool isDeviceSuitable(VkPhysicalDevice & device, VkSurfaceKHR & surface) {
     return indices.isComplete() && extensions && swapChainOK && supportedFeatures.samplerAnisotropy;
 }
 
-Window::Window(unsigned int width, unsigned int height) {
+Window::Window(unsigned int width, unsigned int height, bool headless) {
 
     this->oldMouseX = 0;
     this->oldMouseY = 0;
+    this->view = nullptr;
+
+    this->headless = headless;
+    this->extent = {width, height};
 
-    state.glfwWindow = vkutil::createWindow(width, height, this);
     state.window = this;
 
-    glfwSetKeyCallback(state.glfwWindow, glfw_inputs::onKeyboard);
-    glfwSetMouseButtonCallback(state.glfwWindow, glfw_inputs::onMouseButton);
-    glfwSetCursorPosCallback(state.glfwWindow, glfw_inputs::onMouseMotion);
-    glfwSetScrollCallback(state.glfwWindow, glfw_inputs::onScroll);
+    if (!headless) {
+        state.glfwWindow = vkutil::createWindow(width, height, this);
+
+        glfwSetKeyCallback(state.glfwWindow, glfw_inputs::onKeyboard);
+        glfwSetMouseButtonCallback(state.glfwWindow, glfw_inputs::onMouseButton);
+        glfwSetCursorPosCallback(state.glfwWindow, glfw_inputs::onMouseMotion);
+        glfwSetScrollCallback(state.glfwWindow, glfw_inputs::onScroll);
+    } else {
+        state.glfwWindow = nullptr;
+    }
 
     //std::vector<const char *> validationLayers(0);
-    state.instance = vkutil::createInstance(validationLayers);
+    state.instance = vkutil::createInstance(validationLayers, headless);
     vkutil::setupDebugMessenger(state.instance, validationLayers.size());
 
-    state.surface = vkutil::createSurface(state.instance, state.glfwWindow);
+    state.surface = headless ? VK_NULL_HANDLE : vkutil::createSurface(state.instance, state.glfwWindow);
     state.physicalDevice = vkutil::pickPhysicalDevice(state.instance, [&] (VkPhysicalDevice & d) -> bool {
         return isDeviceSuitable(d, state.surface);
     });
@@ -72,7 +91,22 @@ Window::Window(unsigned int width, unsigned int height) {
     VkQueue transferQueue;
     VkQueue loadingGraphicsQueue;
 
-    state.device = vkutil::createLogicalDevice(state.physicalDevice, state.surface, &graphicsQueue, &presentQueue, &transferQueue, &loadingGraphicsQueue, deviceExtensions);
+    std::vector<const char *> extensions = headless ? headlessDeviceExtensions : deviceExtensions;
+
+    /// The budget lets texture streaming account for the memory of other processes.
+    state.memoryBudget = vkutil::checkInstanceExtensionSupport(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)
+        && vkutil::checkDeviceExtensionSupport(state.physicalDevice, {VK_EXT_MEMORY_BUDGET_EXTENSION_NAME});
+
+    if (state.memoryBudget)
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    /// Tells pipeline cache hits from misses, without it they are reported as unknown.
+    state.pipelineCreationFeedback = vkutil::checkDeviceExtensionSupport(state.physicalDevice, {VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME});
+
+    if (state.pipelineCreationFeedback)
+        extensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+
+    state.device = vkutil::createLogicalDevice(state.physicalDevice, state.surface, &graphicsQueue, &presentQueue, &transferQueue, &loadingGraphicsQueue, extensions);
 
     state.graphicsQueue.q = graphicsQueue;
     state.presentQueue.q = presentQueue;
@@ -89,10 +123,35 @@ Window::Window(unsigned int width, unsigned int height) {
     state.loadingCommandPool = vkutil::createGraphicsCommandPool(state.physicalDevice, state.device, state.surface);
     state.transferCommandPool = vkutil::createTransferCommandPool(state.physicalDevice, state.device, state.surface);
 
+    state.pipelineCache = vkutil::createPipelineCache(state.physicalDevice, state.device, WINDOW_PIPELINE_CACHE_FILE);
+    state.stagingPool = new vkutil::StagingPool(state.device, state.vmaAllocator);
+
 }
 
 Window::~Window() {
 
+    /// The streamer and the staging pool free memory the device may still be using.
+    vkDeviceWaitIdle(state.device);
+
+    if (state.textureStreamer) {
+        TextureStreamer::Statistics streamingStats = state.textureStreamer->getStatistics();
+        lout << "Texture streaming promotions: " << streamingStats.promotions << " demotions: " << streamingStats.demotions << " resident: " << streamingStats.residentBytes << " bytes" << std::endl;
+        delete state.textureStreamer;
+        state.textureStreamer = nullptr;
+    }
+
+    /// Keep the compiled pipelines for the next start.
+    lout << "Pipeline cache hits: " << state.pipelineCache->hits << " misses: " << state.pipelineCache->misses << " unknown: " << state.pipelineCache->unknown << std::endl;
+    vkutil::savePipelineCache(state.device, state.pipelineCache, WINDOW_PIPELINE_CACHE_FILE);
+    vkutil::destroyPipelineCache(state.device, state.pipelineCache);
+    state.pipelineCache = nullptr;
+
+    vkutil::StagingPool::Statistics stagingStats = state.stagingPool->getStatistics();
+    lout << "Staging pool high water mark: " << stagingStats.highWaterMark << " bytes, buffers created: " << stagingStats.createdBuffers << " reused: " << stagingStats.reusedBuffers << std::endl;
+
+    delete state.stagingPool;
+    state.stagingPool = nullptr;
+
     /*vmaDestroyAllocator(state.vmaAllocator);
 
     vkutil::destroyWindow(state.glfwWindow);*/
@@ -131,6 +190,14 @@ GLFWwindow * Window::getGlfwWindow() {
     return state.glfwWindow;
 }
 
+bool Window::isHeadless() {
+    return headless;
+}
+
+VkExtent2D Window::getExtent() {
+    return extent;
+}
+
 VkCommandPool & Window::getCommandPool() {
     return state.graphicsCommandPool;
 }
@@ -139,6 +206,15 @@ vkutil::VulkanState & Window::getState() {
     return state;
 }
 
+void Window::enableTextureStreaming(VkDeviceSize budget) {
+
+    if (state.textureStreamer)
+        state.textureStreamer->setBudget(budget);
+    else
+        state.textureStreamer = new TextureStreamer(state, budget);
+
+}
+
 void Window::setActiveViewport(Viewport * view) {
     this->view = view;
 }
@@ -205,10 +281,12 @@ void Window::addInputHandler(std::shared_ptr<InputHandler> handler) {
 }
 
 void Window::hideCursor() {
+    if (headless) return;
     glfwSetInputMode(state.glfwWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 }
 
 void Window::unhideCursor() {
+    if (headless) return;
     glfwSetInputMode(state.glfwWindow, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
 }
 
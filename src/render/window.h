@@ -10,13 +10,16 @@
 #include "render/util/vkutil.h"
 #include "inputs/inputhandler.h"
 
+#define WINDOW_PIPELINE_CACHE_FILE "pipeline.cache"
+
 class Viewport;
 class Camera;
 
 class Window
 {
     public:
-        Window(unsigned int width, unsigned int height);
+        /// A headless window has no glfw window or surface, rendering happens offscreen.
+        Window(unsigned int width, unsigned int height, bool headless = false);
         virtual ~Window();
 
         VkPhysicalDevice & getPhysicalDevice();
@@ -29,8 +32,18 @@ class Window
         VkCommandPool & getCommandPool();
         GLFWwindow * getGlfwWindow();
 
+        bool isHeadless();
+        VkExtent2D getExtent();
+
         vkutil::VulkanState & getState();
 
+        /**
+         * Textures loaded afterwards only keep their mip tail resident, the
+         * active viewport streams in the levels it needs. A budget of 0 uses
+         * the free device local memory.
+         **/
+        void enableTextureStreaming(VkDeviceSize budget = 0);
+
         void addInputHandler(std::shared_ptr<InputHandler> handler);
 
         void onKeyboard(int key, int scancode, int action, int mods);
@@ -57,6 +70,8 @@ class Window
 
         Viewport * view;
 
+        bool headless;
+        VkExtent2D extent;
 
 };
 
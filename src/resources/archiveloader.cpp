@@ -29,3 +29,7 @@ LoadingResource ArchiveLoader::createResource(ResourceLocation location, std::sh
 LoadingResource ArchiveLoader::uploadResource(LoadingResource resource) {
   return scheduleSubresourceUpload(manager, resource);
 }
+
+void ArchiveLoader::submitDecode(std::function<void()> decode) {
+  scheduleDecode(manager, decode);
+}
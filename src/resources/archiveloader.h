@@ -34,6 +34,7 @@ class ArchiveLoader {
   LoadingResource loadDependency(ResourceLocation location);
   LoadingResource createResource(ResourceLocation location, std::shared_ptr<void> resource);
   LoadingResource uploadResource(LoadingResource res);
+  void submitDecode(std::function<void()> decode);
 
  private:
   ResourceManager * manager;
@@ -4,6 +4,9 @@
 #include <memory>
 #include <string>
 #include <future>
+#include <vector>
+#include <functional>
+#include <atomic>
 
 #include "resourceuploader.h"
 #include "util/debug/trace_exception.h"
@@ -22,10 +25,10 @@ struct LoadingStatus {
 
 struct FutureResource {
 
-  FutureResource() : name("", "") {
+  FutureResource() : name("", ""), depth(0), jobIsUpload(false) {
   }
 
-  FutureResource(ResourceLocation rl) : name(rl) {};
+  FutureResource(ResourceLocation rl) : name(rl), depth(0), jobIsUpload(false) {};
 
   ResourceLocation name;
   bool isPresent;
@@ -42,6 +45,20 @@ struct FutureResource {
 
   LoadingStatus status;
 
+  /// Dependency graph, filled while the loader of this resource requests other resources.
+  std::vector<std::shared_ptr<FutureResource>> dependencies;
+  std::vector<std::weak_ptr<FutureResource>> dependents;
+  /// Longest chain of dependents up to a requested root, deeper resources are on a longer path to it.
+  uint32_t depth;
+
+  /**
+   * Set by the first copy of the load or upload job of this resource that
+   * starts. A job waiting in the job system is submitted again when the
+   * depth of the resource is raised, the copy that runs first does the work.
+   **/
+  std::shared_ptr<std::atomic<bool>> jobClaim;
+  bool jobIsUpload;
+
 };
 
 typedef std::shared_ptr<FutureResource> LoadingResource;
@@ -50,6 +67,7 @@ LoadingResource scheduleResourceLoad(ResourceManager * manager, ResourceLocation
 LoadingResource createSubresource(const ResourceLocation & location, std::shared_ptr<void> uploader);
 LoadingResource scheduleSubresourceUpload(ResourceManager * manager, LoadingResource res);
 LoadingResource scheduleSubresourceUpload(ResourceManager * manager, ResourceLocation location, std::shared_ptr<void> uploader);
+void scheduleDecode(ResourceManager * manager, std::function<void()> decode);
 
 namespace res {
 
@@ -104,6 +122,10 @@ template <typename T, typename std::enable_if<std::is_base_of<Resource, T>::valu
             return scheduleSubresourceUpload(resourceManager, location, uploader);
         }
 
+        void submitDecode(std::function<void()> decode) {
+            scheduleDecode(resourceManager, decode);
+        }
+
     private:
 
 };
@@ -1,6 +1,8 @@
 #include "resourcemanager.h"
 
 #include <iostream>
+#include <fstream>
+#include <algorithm>
 
 #include "../render/model.h"
 #include "../render/shader.h"
@@ -10,7 +12,8 @@
 
 ResourceManager::ResourceManager(vkutil::VulkanState & state) : vulkanState(state) {
 
-  
+  this->jobSystem = nullptr;
+  this->traceStart = std::chrono::steady_clock::now();
 
 }
 
@@ -65,7 +68,8 @@ bool ResourceManager::isLoaded(ResourceLocation location) {
 
 void ResourceManager::submitUpload(LoadingResource resource) {
 
-  this->rescheduleUpload(resource);
+  this->addDependency(resource);
+  this->scheduleUpload(resource);
 
 }
 
@@ -107,200 +111,373 @@ void ResourceManager::attachArchiveType(std::string fileEnding, std::shared_ptr<
   loader->setCurrentManager(this);
 }
 
-#define dbg_log (lout << "[ " << __FILE__ << " : " << __PRETTY_FUNCTION__ << " ] ")
+void ResourceManager::submitJob(JobSystem::Job job, unsigned int priority) {
 
-void ResourceManager::threadLoadingFunction(ResourceManager * resourceManager) {
+  std::lock_guard<std::mutex> guard(jobSystemMutex);
 
-  try {
+  if (!jobSystem) {
+    deferredJobs.push_back(std::make_pair(job, priority));
+    return;
+  }
 
-    while (resourceManager->keepThreadsRunning) {
+  jobSystem->submit(job, priority);
 
-      //lout << "Getting new Resource to load" << std::endl;
-      LoadingResource fres = resourceManager->getNextResource();
-      if (!fres->isPresent) continue;
+}
 
-      if (resourceManager->isLoaded(fres->name)) {
+/// Resource whose loader or uploader runs on this thread, dependencies it requests are attached to it.
+static thread_local const LoadingResource * currentResource = nullptr;
 
-        lout << "Skipping loading of " << fres->name << " is already loaded" << std::endl;
+void ResourceManager::scheduleLoad(LoadingResource res) {
+  scheduleJob(res, false, std::make_shared<std::atomic<bool>>(false));
+}
 
-        fres->location = resourceManager->get<Resource>(fres->name);
-        fres->status.isLoaded = true;
-        fres->status.isUploaded = true;
-        fres->status.isUseable = true;
-	fres->cond.notify_all();
-        //fres->prom.set_value();
-	//fres->fut.
+void ResourceManager::scheduleUpload(LoadingResource res) {
+  scheduleJob(res, true, std::make_shared<std::atomic<bool>>(false));
+}
 
-        continue;
+void ResourceManager::scheduleJob(LoadingResource res, bool upload, std::shared_ptr<std::atomic<bool>> claim) {
 
-      }
+  unsigned int priority;
 
-      if (resourceManager->isResourceInPipeline(fres)){
+  {
+    std::lock_guard<std::mutex> guard(graphMutex);
+    res->jobClaim = claim;
+    res->jobIsUpload = upload;
+    priority = res->depth;
+  }
 
-        /// Reschedule loading for later checks.
-        //lout << "Reschedule of " << fres->name << std::endl;
-        resourceManager->rescheduleLoad(fres);
-        continue;
+  submitJob([this, res, upload, claim] () {
 
-      }
+    /// An earlier copy with a lower priority may still be queued.
+    if (claim->exchange(true))
+      return;
 
-      lout << "Loading " << fres->name << std::endl;
+    if (upload)
+      uploadJob(res);
+    else
+      loadJob(res);
 
-      resourceManager->markResourceInPipeline(fres);
+  }, priority);
 
-      if (!resourceManager->tryArchiveLoad(fres)) {
+}
 
-	std::shared_ptr<ResourceUploader<Resource>> uploader = resourceManager->loadResource<Resource>(fres->name);
-	if (!uploader)
-	  throw dbg::trace_exception(std::string("No Correct loader for ").append(fres->name.filename));
-	fres->uploader = uploader;
+void ResourceManager::submitDecode(std::function<void()> decode) {
 
-	lout << fres->name << " : " << uploader << std::endl;
+  /// Decoding is traced as part of the resource whose loader requested it.
+  LoadingResource parent = currentResource ? *currentResource : nullptr;
 
-      }
+  submitJob([this, parent, decode] () {
+
+    uint64_t start = traceTime();
+
+    try {
+      decode();
+    } catch (std::exception & e) {
+      lerr << "Exception while decoding" << std::endl;
+      lerr << e.what() << std::endl;
+    }
+
+    if (parent)
+      addTraceEvent(parent, "decode", start);
+
+    wakeWaitingUploads({});
+
+  }, parent ? parent->depth : 0);
 
-      fres->status.isLoaded = true;
+}
+
+void ResourceManager::addDependency(LoadingResource dependency) {
+
+  if (!currentResource || currentResource->get() == dependency.get())
+    return;
+
+  LoadingResource parent = *currentResource;
+
+  std::vector<LoadingResource> raised;
+
+  {
+    std::lock_guard<std::mutex> guard(graphMutex);
 
-      resourceManager->rescheduleUpload(fres);
+    parent->dependencies.push_back(dependency);
+    dependency->dependents.push_back(parent);
 
+    std::vector<FutureResource *> path = {parent.get()};
+    raiseDepth(dependency, parent->depth + 1, raised, path);
+  }
 
+  /// Jobs that have not started yet are queued again with their new priority.
+  for (LoadingResource & res : raised) {
 
-      lout << "Loading Done " << fres->name << std::endl;
+    std::shared_ptr<std::atomic<bool>> claim;
+    bool upload;
 
+    {
+      std::lock_guard<std::mutex> guard(graphMutex);
+      claim = res->jobClaim;
+      upload = res->jobIsUpload;
     }
-  } catch (std::exception & e) {
 
-    lerr << "Exception while loading" << std::endl;
-    lerr << e.what() << std::endl;
-    exit(1);
+    if (claim && !*claim)
+      scheduleJob(res, upload, claim);
 
   }
 
 }
 
-void ResourceManager::rescheduleUpload(LoadingResource res) {
+void ResourceManager::raiseDepth(LoadingResource res, uint32_t depth, std::vector<LoadingResource> & raised, std::vector<FutureResource *> & path) {
 
-  //uploadingQueueMutex.lock();
-  {
-    std::lock_guard<std::mutex> guard(uploadingQueueMutex);
-    uploadingQueue.push(res);
+  if (res->depth >= depth)
+    return;
+
+  /// A resource depending on itself would be raised forever.
+  if (std::find(path.begin(), path.end(), res.get()) != path.end())
+    return;
+
+  /// Priorities above the highest job level would not change the order.
+  bool reprioritize = std::min(res->depth, (uint32_t) JOB_PRIORITY_LEVELS - 1) < std::min(depth, (uint32_t) JOB_PRIORITY_LEVELS - 1);
+
+  res->depth = depth;
+  if (reprioritize)
+    raised.push_back(res);
+
+  path.push_back(res.get());
+
+  for (LoadingResource & dep : res->dependencies)
+    raiseDepth(dep, depth + 1, raised, path);
+
+  path.pop_back();
+
+}
+
+bool ResourceManager::hasPendingDependency(LoadingResource res) {
+
+  std::lock_guard<std::mutex> guard(graphMutex);
+
+  for (LoadingResource & dep : res->dependencies) {
+    std::lock_guard<std::mutex> depGuard(dep->mut);
+    if (!dep->status.isUseable)
+      return true;
   }
 
-  uploadingCV.notify_one();
+  return false;
+
+}
+
+bool ResourceManager::completeFromRegistry(LoadingResource fres) {
+
+  if (!isLoaded(fres->name))
+    return false;
+
+  fres->location = get<Resource>(fres->name);
+  fres->status.isLoaded = true;
+  fres->status.isUploaded = true;
+  markUseable(fres);
+
+  return true;
 
 }
 
-void ResourceManager::rescheduleLoad(LoadingResource res) {
+void ResourceManager::markUseable(LoadingResource fres) {
 
   {
-    std::lock_guard<std::mutex> guard(loadingQueueMutex);
-    loadingQueue.push(res);
+    std::lock_guard<std::mutex> guard(fres->mut);
+    fres->status.isUseable = true;
   }
-  loadingCV.notify_one();
+
+  fres->cond.notify_all();
+
+  std::vector<LoadingResource> dependents;
+  {
+    std::lock_guard<std::mutex> guard(graphMutex);
+    for (std::weak_ptr<FutureResource> & d : fres->dependents)
+      if (LoadingResource dependent = d.lock())
+        dependents.push_back(dependent);
+  }
+
+  wakeWaitingUploads(dependents);
 
 }
 
-void ResourceManager::threadUploadingFunction(ResourceManager * resourceManager) {
+bool ResourceManager::parkUpload(LoadingResource res, uint64_t since) {
 
-  while (resourceManager->keepThreadsRunning) {
+  /// Checked under the lock, so a dependency finishing right now can not miss this upload.
+  std::lock_guard<std::mutex> guard(waitingUploadsMutex);
 
-    std::shared_ptr<FutureResource> fres = resourceManager->getNextUploadingResource();
-    if (!fres || !fres->isPresent) continue;
+  ResourceUploader<Resource> * uploader = (ResourceUploader<Resource> *) res->uploader.get();
+  if (uploader->uploadReady())
+    return false;
 
-    if (resourceManager->isLoaded(fres->name)) {
+  WaitingUpload waiting = {res, since};
 
-      fres->location = resourceManager->get<Resource>(fres->name);
-      fres->status.isLoaded = true;
-      fres->status.isUploaded = true;
-      fres->status.isUseable = true;
-      fres->cond.notify_all();
-      fres->location->setLocation(fres->name);
-      //fres->prom.set_value();
+  if (hasPendingDependency(res))
+    trackedUploads[res.get()] = waiting;
+  else
+    untrackedUploads[res.get()] = waiting;
 
-      continue;
+  return true;
 
-    }
+}
 
-    if (!fres->status.isLoaded)
-      throw dbg::trace_exception("Non-loaded element in uploading queue");
+void ResourceManager::wakeWaitingUploads(const std::vector<LoadingResource> & candidates) {
 
-    if (!(fres->uploader))
-      throw dbg::trace_exception(std::string("Missing uploader for future resource ").append(fres->name.type).append(" / ").append(fres->name.filename));
+  std::vector<WaitingUpload> ready;
 
-    ResourceUploader<Resource>* tmpUploader = (ResourceUploader<Resource> *) fres->uploader.get();
+  {
+    std::lock_guard<std::mutex> guard(waitingUploadsMutex);
 
-    if (!tmpUploader->uploadReady()) {
+    for (const LoadingResource & res : candidates) {
 
-      resourceManager->rescheduleUpload(fres);
-      continue;
+      auto it = trackedUploads.find(res.get());
+      if (it == trackedUploads.end())
+        continue;
 
-    }
+      ResourceUploader<Resource> * uploader = (ResourceUploader<Resource> *) res->uploader.get();
 
-    lout << "Uploading " << fres->name << std::endl;
+      if (uploader->uploadReady()) {
+        ready.push_back(it->second);
+        trackedUploads.erase(it);
+      } else if (!hasPendingDependency(res)) {
+        /// Every dependency in the graph is done, so it waits for something else.
+        untrackedUploads[res.get()] = it->second;
+        trackedUploads.erase(it);
+      }
 
-    std::shared_ptr<Resource> tmpResource = tmpUploader->uploadResource(resourceManager->vulkanState, resourceManager);
-    if (!tmpResource) {
-      lerr << "Resource " << fres->name << " is empty pointer" << std::endl;
-      throw dbg::trace_exception("Null pointer for uploaded resource");
     }
-    fres->location = resourceManager->registerResource(fres->name, tmpResource);
 
-    fres->status.isUploaded = true;
-    fres->status.isUseable  = true;
-    fres->cond.notify_all();
-    fres->location->setLocation(fres->name);
-    //fres->prom.set_value();
+    for (auto it = untrackedUploads.begin(); it != untrackedUploads.end();) {
 
-    resourceManager->unmarkResourceInPipeline(fres);
+      ResourceUploader<Resource> * uploader = (ResourceUploader<Resource> *) it->second.res->uploader.get();
 
+      if (!uploader->uploadReady()) {
+        ++it;
+        continue;
+      }
+
+      ready.push_back(it->second);
+      it = untrackedUploads.erase(it);
+
+    }
+  }
+
+  for (WaitingUpload & w : ready) {
+    addTraceEvent(w.res, "wait", w.since);
+    scheduleUpload(w.res);
   }
 
 }
 
-LoadingResource ResourceManager::getNextResource() {
+void ResourceManager::loadJob(LoadingResource fres) {
+
+  try {
+
+    if (!fres->isPresent) return;
+
+    if (completeFromRegistry(fres)) {
+      lout << "Skipping loading of " << fres->name << " is already loaded" << std::endl;
+      return;
+    }
+
+    /// Another job is loading the same resource and completes this one as well.
+    if (!markResourceInPipeline(fres))
+      return;
+
+    lout << "Loading " << fres->name << std::endl;
+
+    uint64_t start = traceTime();
+    currentResource = &fres;
 
-  std::shared_ptr<FutureResource> resource;
+    if (!tryArchiveLoad(fres)) {
 
-  std::unique_lock<std::mutex> lock(loadingQueueMutex);
+      std::shared_ptr<ResourceUploader<Resource>> uploader = loadResource<Resource>(fres->name);
+      if (!uploader)
+        throw dbg::trace_exception(std::string("No Correct loader for ").append(fres->name.filename));
+      fres->uploader = uploader;
+
+      lout << fres->name << " : " << uploader << std::endl;
+
+    }
 
-  loadingCV.wait(lock, [&] {return !loadingQueue.empty() || !keepThreadsRunning;});
+    currentResource = nullptr;
+    addTraceEvent(fres, "load", start);
 
-  /*if (loadingQueue.empty()) {
+    fres->status.isLoaded = true;
 
+    scheduleUpload(fres);
 
-    resource = std::shared_ptr<FutureResource>(new FutureResource());
+    lout << "Loading Done " << fres->name << std::endl;
 
-    resource->isPresent = false;
-    return resource;
-    }*/
+  } catch (std::exception & e) {
 
-  resource = loadingQueue.front();
-  loadingQueue.pop();
+    lerr << "Exception while loading" << std::endl;
+    lerr << e.what() << std::endl;
+    exit(1);
 
-  return resource;
+  }
 
 }
 
-LoadingResource ResourceManager::getNextUploadingResource() {
+void ResourceManager::uploadJob(LoadingResource fres) {
+
+  try {
+
+    if (!fres || !fres->isPresent) return;
+
+    if (completeFromRegistry(fres)) {
+      fres->location->setLocation(fres->name);
+      return;
+    }
+
+    if (!fres->status.isLoaded)
+      throw dbg::trace_exception("Non-loaded element in uploading queue");
+
+    if (!(fres->uploader))
+      throw dbg::trace_exception(std::string("Missing uploader for future resource ").append(fres->name.type).append(" / ").append(fres->name.filename));
+
+    ResourceUploader<Resource>* tmpUploader = (ResourceUploader<Resource> *) fres->uploader.get();
 
-  std::shared_ptr<FutureResource> resource;
+    if (parkUpload(fres, traceTime()))
+      return;
 
-  std::unique_lock<std::mutex> lock(uploadingQueueMutex);
+    lout << "Uploading " << fres->name << std::endl;
 
-  uploadingCV.wait(lock, [&] {return !uploadingQueue.empty() || !keepThreadsRunning;});
+    std::shared_ptr<Resource> tmpResource;
+    {
+      std::lock_guard<std::mutex> guard(uploadMutex);
 
-  /*if (uploadingQueue.empty()) {
+      uint64_t start = traceTime();
+      currentResource = &fres;
 
-    resource = std::shared_ptr<FutureResource>(new FutureResource());
-    resource->isPresent = false;
-    return resource;
-    }*/
+      tmpResource = tmpUploader->uploadResource(vulkanState, this);
 
-  resource = uploadingQueue.front();
-  uploadingQueue.pop();
+      currentResource = nullptr;
+      addTraceEvent(fres, "upload", start);
+    }
 
+    if (!tmpResource) {
+      lerr << "Resource " << fres->name << " is empty pointer" << std::endl;
+      throw dbg::trace_exception("Null pointer for uploaded resource");
+    }
+    fres->location = registerResource(fres->name, tmpResource);
 
-  return resource;
+    fres->status.isUploaded = true;
+    fres->location->setLocation(fres->name);
+    markUseable(fres);
+
+    for (LoadingResource & waiting : unmarkResourceInPipeline(fres)) {
+      waiting->location = fres->location;
+      waiting->uploader = fres->uploader;
+      waiting->status.isLoaded = true;
+      waiting->status.isUploaded = true;
+      markUseable(waiting);
+    }
+
+  } catch (std::exception & e) {
+
+    lerr << "Exception while uploading" << std::endl;
+    lerr << e.what() << std::endl;
+    exit(1);
+
+  }
 
 }
 
@@ -316,11 +493,8 @@ LoadingResource ResourceManager::loadResourceBg(ResourceLocation location) {
   res->status = status;
   //res->fut = std::shared_future<void>(res->prom.get_future());
 
-  {
-    std::lock_guard<std::mutex> guard(loadingQueueMutex);
-    loadingQueue.push(res);
-  }
-  loadingCV.notify_one();
+  addDependency(res);
+  scheduleLoad(res);
 
   return res;
 
@@ -328,21 +502,14 @@ LoadingResource ResourceManager::loadResourceBg(ResourceLocation location) {
 
 void ResourceManager::startLoadingThreads(unsigned int threadCount) {
 
-  this->keepThreadsRunning = true;
-
-  for (unsigned int i = 0; i < threadCount; ++i) {
-
-    std::thread * th = new std::thread(threadLoadingFunction, this);
-    this->loadingThreads.push_back(th);
-
-  }
+  std::lock_guard<std::mutex> guard(jobSystemMutex);
 
-  for (unsigned int i = 0; i < threadCount; ++i) {
+  this->jobSystem = new JobSystem(threadCount);
 
-    std::thread * th = new std::thread(threadUploadingFunction, this);
-    this->loadingThreads.push_back(th);
+  for (auto & job : deferredJobs)
+    jobSystem->submit(job.first, job.second);
 
-  }
+  deferredJobs.clear();
 
 }
 
@@ -359,43 +526,131 @@ void ResourceManager::printSummary() {
 
 void ResourceManager::joinLoadingThreads() {
 
-  this->keepThreadsRunning = false;
+  JobSystem * jobs;
 
-  lout << "Notifying conditions" << std::endl;
-  
-  loadingCV.notify_all();
-  uploadingCV.notify_all();
+  {
+    std::lock_guard<std::mutex> guard(jobSystemMutex);
+    jobs = this->jobSystem;
+    this->jobSystem = nullptr;
+  }
+
+  if (!jobs)
+    return;
 
-  lout << "Joining Threads" << std::endl;
+  lout << "Joining Threads, " << jobs->getStolenCount() << " jobs were stolen" << std::endl;
+
+  jobs->stop();
+  delete jobs;
+
+  size_t waiting = trackedUploads.size() + untrackedUploads.size();
+  if (waiting)
+    lerr << waiting << " uploads are still waiting for their dependencies" << std::endl;
+
+}
+
+uint64_t ResourceManager::traceTime() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
 
-  for (std::thread * th : loadingThreads) {
-    lout << th << std::endl;
-    th->join();
+void ResourceManager::addTraceEvent(LoadingResource res, const char * category, uint64_t start) {
+
+  TraceEvent event;
+  event.name = res->name.type + ":" + std::string(res->name);
+  event.category = category;
+  event.start = start;
+  event.duration = traceTime() - start;
+  event.thread = JobSystem::getCurrentWorker() + 1;
+
+  {
+    std::lock_guard<std::mutex> guard(graphMutex);
+    event.depth = res->depth;
+    event.dependencyCount = res->dependencies.size();
+  }
+
+  std::lock_guard<std::mutex> guard(traceMutex);
+  traceEvents.push_back(event);
+
+}
+
+static std::string escapeJSON(const std::string & str) {
+
+  std::string res;
+
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      res.push_back('\\');
+      res.push_back(c);
+    } else if ((unsigned char) c < 0x20) {
+      res.push_back(' ');
+    } else {
+      res.push_back(c);
+    }
   }
 
+  return res;
+
 }
 
-void ResourceManager::markResourceInPipeline(LoadingResource res) {
-  pipelineInfoMutex.lock();
-  this->pipelineInfo[res->name.type].insert(this->pipelineInfo[res->name.type].begin(), res->name);
-  pipelineInfoMutex.unlock();
+void ResourceManager::writeTrace(std::string fname) {
+
+  std::ofstream out(fname);
+  if (!out)
+    throw dbg::trace_exception(std::string("Unable to write resource trace ").append(fname));
+
+  std::lock_guard<std::mutex> guard(traceMutex);
+
+  /// Thread 0 is any thread outside of the job system.
+  out << "{\"traceEvents\":[" << std::endl;
+
+  for (unsigned int i = 0; i < traceEvents.size(); ++i) {
+
+    const TraceEvent & e = traceEvents[i];
+
+    out << "{\"name\":\"" << escapeJSON(e.name) << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\""
+        << ",\"ts\":" << e.start << ",\"dur\":" << e.duration << ",\"pid\":1,\"tid\":" << e.thread
+        << ",\"args\":{\"depth\":" << e.depth << ",\"dependencies\":" << e.dependencyCount << "}}";
+
+    if (i + 1 < traceEvents.size())
+      out << ",";
+    out << std::endl;
+
+  }
+
+  out << "]}" << std::endl;
+
 }
 
-void ResourceManager::unmarkResourceInPipeline(LoadingResource res) {
-  pipelineInfoMutex.lock();
-  this->pipelineInfo[res->name.type].erase(res->name);
-  pipelineInfoMutex.unlock();
+bool ResourceManager::markResourceInPipeline(LoadingResource res) {
+
+  std::lock_guard<std::mutex> guard(pipelineInfoMutex);
+
+  auto & inPipeline = this->pipelineInfo[res->name.type];
+  auto it = inPipeline.find(res->name);
+
+  if (it != inPipeline.end()) {
+    it->second.push_back(res);
+    return false;
+  }
+
+  inPipeline[res->name] = {};
+  return true;
+
 }
 
-bool ResourceManager::isResourceInPipeline(LoadingResource res) {
+std::vector<LoadingResource> ResourceManager::unmarkResourceInPipeline(LoadingResource res) {
+
+  std::lock_guard<std::mutex> guard(pipelineInfoMutex);
 
-  pipelineInfoMutex.lock();
+  auto & inPipeline = this->pipelineInfo[res->name.type];
+  auto it = inPipeline.find(res->name);
 
-  auto it = this->pipelineInfo[res->name.type].find(res->name);
+  if (it == inPipeline.end())
+    return {};
 
-  pipelineInfoMutex.unlock();
+  std::vector<LoadingResource> waiting = it->second;
+  inPipeline.erase(it);
 
-  return it != this->pipelineInfo[res->name.type].end();
+  return waiting;
 
 }
 
@@ -409,6 +664,10 @@ LoadingResource scheduleResourceLoad(ResourceManager * manager, ResourceLocation
   return manager->loadResourceBg(location);
 }
 
+void scheduleDecode(ResourceManager * manager, std::function<void()> decode) {
+  manager->submitDecode(decode);
+}
+
 LoadingResource createSubresource(const ResourceLocation & location, std::shared_ptr<void> uploader) {
 
   LoadingResource res(new FutureResource(location));
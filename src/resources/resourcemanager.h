@@ -3,13 +3,15 @@
 
 #include <mutex>
 #include <thread>
-#include <queue>
-#include <unordered_set>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
 
 #include "resource.h"
 #include "resourceloader.h"
 #include "resourceregistry.h"
 #include "resources/archiveloader.h"
+#include "util/jobsystem.h"
 
 class ResourceManager {
 
@@ -60,8 +62,18 @@ public:
 
   void submitUpload(LoadingResource resource);
 
+  /**
+   * Runs decode on the loading threads. Uploaders waiting for its result
+   * should return false from uploadReady until it is done, they are checked
+   * again as soon as it finishes.
+   **/
+  void submitDecode(std::function<void()> decode);
+
   void printSummary();
 
+  /// Writes the load, wait and upload spans of every resource as Chrome trace JSON (chrome://tracing).
+  void writeTrace(std::string fname);
+
   /// Tries to load location as an archive, returns true if possible
   bool tryArchiveLoad(LoadingResource fres);
   void attachArchiveType(std::string fileEnding, std::shared_ptr<ArchiveLoader> loader);
@@ -73,34 +85,84 @@ private:
   std::unordered_map<std::string, ResourceRegistry<Resource> *> registries;
   std::unordered_map<std::string, std::shared_ptr<ArchiveLoader>> archiveLoader;
 
-  std::mutex loadingQueueMutex;
-  std::condition_variable loadingCV;
-  std::queue<LoadingResource> loadingQueue;
+  JobSystem * jobSystem;
+  /// Jobs submitted before startLoadingThreads.
+  std::vector<std::pair<JobSystem::Job, unsigned int>> deferredJobs;
+  std::mutex jobSystemMutex;
 
-  std::mutex uploadingQueueMutex;
-  std::condition_variable uploadingCV;
-  std::queue<LoadingResource> uploadingQueue;
+  struct WaitingUpload {
 
-  std::mutex pipelineInfoMutex;
-  std::unordered_map<std::string, std::unordered_set<ResourceLocation>> pipelineInfo;
+    LoadingResource res;
+    uint64_t since;
+
+  };
 
-  std::vector<std::thread *> loadingThreads;
+  /**
+   * Uploads whose uploader is not ready yet. Tracked uploads still have a
+   * dependency in the graph that is not useable and are checked again when
+   * one of their dependencies becomes useable. Untracked uploads wait for
+   * something outside of the graph and are checked on every completion.
+   **/
+  std::unordered_map<FutureResource *, WaitingUpload> trackedUploads;
+  std::unordered_map<FutureResource *, WaitingUpload> untrackedUploads;
+  std::mutex waitingUploadsMutex;
 
-  bool keepThreadsRunning;
+  std::mutex graphMutex;
+
+  struct TraceEvent {
+
+    std::string name;
+    const char * category;
+    uint64_t start;
+    uint64_t duration;
+    int thread;
+    uint32_t depth;
+    size_t dependencyCount;
+
+  };
+
+  std::chrono::steady_clock::time_point traceStart;
+  std::mutex traceMutex;
+  std::vector<TraceEvent> traceEvents;
+
+  /// Uploads share the command pools of the vulkan state, so only one runs at a time.
+  std::mutex uploadMutex;
+
+  /// Resources being loaded, with the requests for the same resource that wait for them.
+  std::mutex pipelineInfoMutex;
+  std::unordered_map<std::string, std::unordered_map<ResourceLocation, std::vector<LoadingResource>>> pipelineInfo;
 
   vkutil::VulkanState & vulkanState;
 
-  static void threadLoadingFunction(ResourceManager * resourceManager);
-  static void threadUploadingFunction(ResourceManager * resourceManager);
-  LoadingResource getNextResource();
-  LoadingResource getNextUploadingResource();
+  void submitJob(JobSystem::Job job, unsigned int priority);
+  void loadJob(LoadingResource fres);
+  void uploadJob(LoadingResource fres);
+
+  void scheduleLoad(LoadingResource res);
+  void scheduleUpload(LoadingResource res);
+  /// Submits the load or upload job of res with the current depth of res as priority.
+  void scheduleJob(LoadingResource res, bool upload, std::shared_ptr<std::atomic<bool>> claim);
+
+  /// Raises the depth of res and its dependencies, the raised resources are appended to raised. Needs graphMutex.
+  static void raiseDepth(LoadingResource res, uint32_t depth, std::vector<LoadingResource> & raised, std::vector<FutureResource *> & path);
+
+  /// Completes res from the registry, returns false if it is not loaded.
+  bool completeFromRegistry(LoadingResource res);
+  void markUseable(LoadingResource res);
+  void wakeWaitingUploads(const std::vector<LoadingResource> & candidates);
+
+  /// Records that the resource being loaded or uploaded on this thread (if any) needs dependency.
+  void addDependency(LoadingResource dependency);
+  bool hasPendingDependency(LoadingResource res);
+  /// Parks res or schedules its upload, returns true if it was parked.
+  bool parkUpload(LoadingResource res, uint64_t since);
 
-  void rescheduleUpload(LoadingResource res);
-  void rescheduleLoad(LoadingResource res);
+  uint64_t traceTime();
+  void addTraceEvent(LoadingResource res, const char * category, uint64_t start);
 
-  void markResourceInPipeline(LoadingResource res);
-  void unmarkResourceInPipeline(LoadingResource res);
-  bool isResourceInPipeline(LoadingResource res);
+  /// Returns false if res is already being loaded, res is then completed together with it.
+  bool markResourceInPipeline(LoadingResource res);
+  std::vector<LoadingResource> unmarkResourceInPipeline(LoadingResource res);
 
 
 };
@@ -6,6 +6,7 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <mutex>
 
 #include "resource.h"
 #include "resourceloader.h"
@@ -29,14 +30,19 @@ public:
   /// Get a resource by its name
   std::shared_ptr<T> get(ResourceLocation name) {
 
-    if (objects.find(name) == objects.end()) {
+    std::lock_guard<std::mutex> guard(objectsMutex);
+
+    auto it = objects.find(name);
+    if (it == objects.end()) {
       throw dbg::trace_exception(std::string("Unable to find resource '").append(name.filename).append("'"));
     }
-    return objects[name];
+    return it->second;
   }
 
   std::shared_ptr<T> registerObject(ResourceLocation name, std::shared_ptr<T> obj) {
 
+    std::lock_guard<std::mutex> guard(objectsMutex);
+
     this->objects[name] = obj;
     return obj;
 
@@ -71,16 +77,17 @@ public:
   }
 
   bool isLoaded(ResourceLocation name) {
+    std::lock_guard<std::mutex> guard(objectsMutex);
     return objects.find(name) != objects.end();
   }
 
   void drop(ResourceLocation location) {
-    if (this->objects.find(location) == objects.end())
-      return;
+    std::lock_guard<std::mutex> guard(objectsMutex);
     objects.erase(location);
   }
 
   void printSummary() {
+    std::lock_guard<std::mutex> guard(objectsMutex);
     for (auto const & o : objects) {
       lout << "\t" << o.first << std::endl;
     }
@@ -90,6 +97,8 @@ protected:
 
 private:
 
+  /// The load workers look up and register objects concurrently.
+  std::mutex objectsMutex;
   std::unordered_map<ResourceLocation, std::shared_ptr<T>> objects;
   std::vector<ResourceLoader<T> *> loaders;
 
@@ -0,0 +1,100 @@
+#include "glbfile.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include "util/debug/trace_exception.h"
+
+struct glb_header_t {
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t length;
+
+};
+
+struct glb_chunk_header_t {
+
+  uint32_t chunkLength;
+  uint32_t chunkType;
+
+};
+
+GLBFile::GLBFile(std::string fname) : file(fname) {
+
+  const uint8_t * mapping = file.getData();
+  size_t mappingSize = file.getSize();
+
+  if (mappingSize < sizeof(glb_header_t))
+    throw dbg::trace_exception(std::string("File too small for glb: ").append(fname));
+
+  /// Chunks are read front to back once.
+  file.adviseSequential();
+
+  json = {nullptr, 0};
+  binary = {nullptr, 0};
+
+  glb_header_t header;
+  memcpy(&header, mapping, sizeof(glb_header_t));
+
+  if (header.magic != GLB_MAGIC) {
+    throw dbg::trace_exception("Incorrect header for glb file");
+  } else if (header.version != 2) {
+    throw dbg::trace_exception("Incorrect version for glb file");
+  }
+
+  size_t offset = sizeof(glb_header_t);
+  size_t end = std::min((size_t) header.length, mappingSize);
+
+  while (offset + sizeof(glb_chunk_header_t) <= end) {
+
+    glb_chunk_header_t chunk;
+    memcpy(&chunk, mapping + offset, sizeof(glb_chunk_header_t));
+    offset += sizeof(glb_chunk_header_t);
+
+    if (chunk.chunkLength > end - offset)
+      throw dbg::trace_exception("Truncated chunk in glb file");
+
+    if (chunk.chunkType == GLB_CHUNK_JSON && !json.data) {
+      json = {mapping + offset, chunk.chunkLength};
+    } else if (chunk.chunkType == GLB_CHUNK_BIN && !binary.data) {
+      binary = {mapping + offset, chunk.chunkLength};
+    }
+
+    offset += chunk.chunkLength;
+
+  }
+
+  if (!json.data)
+    throw dbg::trace_exception("Missing JSON chunk in glb file");
+
+}
+
+GLBFile::~GLBFile() {
+
+}
+
+GLBFile::Span GLBFile::getFile() {
+  return {file.getData(), file.getSize()};
+}
+
+const char * GLBFile::getJSON() {
+  return (const char *) json.data;
+}
+
+size_t GLBFile::getJSONLength() {
+  return json.length;
+}
+
+GLBFile::Span GLBFile::getBinary() {
+  return binary;
+}
+
+GLBFile::Span GLBFile::getSpan(size_t offset, size_t length) {
+
+  if (offset > binary.length || length > binary.length - offset)
+    throw dbg::trace_exception("Buffer view exceeds the binary chunk of glb file");
+
+  return {binary.data + offset, length};
+
+}
@@ -0,0 +1,53 @@
+#ifndef GLBFILE_H
+#define GLBFILE_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "util/mappedfile.h"
+
+#define GLB_MAGIC 0x46546C67
+#define GLB_CHUNK_JSON 0x4E4F534A
+#define GLB_CHUNK_BIN 0x004E4942
+
+/**
+ * Binary glTF file mapped into memory. The chunks are not copied,
+ * every pointer handed out points into the mapping and stays valid for the
+ * lifetime of the GLBFile.
+ **/
+class GLBFile {
+
+public:
+
+  struct Span {
+
+    const uint8_t * data;
+    size_t length;
+
+  };
+
+  GLBFile(std::string fname);
+  virtual ~GLBFile();
+
+  /// The whole file, header and chunks included.
+  Span getFile();
+
+  const char * getJSON();
+  size_t getJSONLength();
+
+  Span getBinary();
+
+  /// Range of the BIN chunk, checked against the chunk size.
+  Span getSpan(size_t offset, size_t length);
+
+private:
+
+  MappedFile file;
+
+  Span json;
+  Span binary;
+
+};
+
+#endif // GLBFILE_H
@@ -1,6 +1,8 @@
 #include "gltf.h"
 
 #include <string>
+#include <map>
+#include <algorithm>
 #include <nlohmann/json.hpp>
 
 #include "util/mesh.h"
@@ -11,27 +13,12 @@
 #include "util/debug/trace_exception.h"
 #include "util/image/png.h"
 #include "animation/skeletalrig.h"
+#include "glbfile.h"
+#include "util/meshcache.h"
 
 using json = nlohmann::json;
 using namespace Math;
 
-typedef struct glb_header_t {
-
-  uint32_t magic;
-  uint32_t version;
-  uint32_t length;
-
-} glb_header_t;
-
-typedef struct glb_chunk_t {
-
-  uint32_t chunkLength;
-  uint32_t chunkType;
-
-  uint8_t * rawData;
-
-} glb_chunk_t;
-
 struct gltf_asset_t {
 
   std::string version;
@@ -271,6 +258,7 @@ struct gltf_accessor_t {
 
   int bufferView;
   unsigned int count;
+  size_t byteOffset;
 
   size_t dataTypeSize;
   size_t dataElementCount;
@@ -283,6 +271,7 @@ void from_json(const json & j, gltf_accessor_t & acc) {
 
   j.at("bufferView").get_to(acc.bufferView);
   j.at("count").get_to(acc.count);
+  acc.byteOffset = j.value("byteOffset", (size_t) 0);
 
   acc.dataTypeSize = gltfGetDataSize(j.at("componentType").get<int>());
   acc.dataElementCount = gltfGetElementCount(j.at("type").get<std::string>());
@@ -444,16 +433,45 @@ void from_json(const json & j, gltf_skin_t & skin) {
 
 }
 
-template <typename T> T gltfGetBufferData(const gltf_accessor_t & acc, const gltf_buffer_view_t & bufferView, uint8_t * data, int index) {
+/**
+ * Copies the components of an accessor into dst, which has room for
+ * acc.count * acc.dataElementCount values. Tightly packed accessors are
+ * copied in one go, interleaved ones element by element.
+ **/
+template <typename T> void gltfReadAccessor(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer, T * dst) {
+
+  if (acc.dataTypeSize != sizeof(T))
+    throw dbg::trace_exception(std::string("Accessor component size ").append(std::to_string(acc.dataTypeSize)).append(" does not match requested size ").append(std::to_string(sizeof(T))));
+
+  if (!acc.count)
+    return;
+
+  size_t elementSize = acc.dataElementCount * sizeof(T);
+
+  /// A stride of 1 marks an unset stride, see from_json for gltf_buffer_view_t.
+  size_t stride = (view.byteStride > 1) ? view.byteStride : elementSize;
+
+  if (stride < elementSize || acc.byteOffset + (acc.count - 1) * stride + elementSize > (size_t) view.byteLength)
+    throw dbg::trace_exception("Accessor exceeds its buffer view");
+
+  const uint8_t * src = buffer + view.byteOffset + acc.byteOffset;
+
+  if (stride == elementSize) {
+    memcpy(dst, src, elementSize * acc.count);
+    return;
+  }
+
+  for (unsigned int i = 0; i < acc.count; ++i)
+    memcpy(dst + i * acc.dataElementCount, src + i * stride, elementSize);
 
-  /*if (index > acc.count)
-    throw dbg::trace_exception("No enougth elements in buffer view");*/
+}
 
-  uint32_t offset = bufferView.byteOffset;
+template <typename T> std::vector<T> gltfReadAccessor(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer) {
 
-  offset += index * sizeof(T);
+  std::vector<T> data(acc.count * acc.dataElementCount);
+  gltfReadAccessor<T>(acc, view, buffer, data.data());
 
-  return *((T *) (data + offset));
+  return data;
 
 }
 
@@ -479,87 +497,102 @@ VertexAttributeType gltfDecodeAttributeType(const gltf_accessor_t & acc) {
 
 }
 
-void gltfLoadFloatBuffer(gltf_accessor_t & acc, gltf_buffer_view_t & view, uint8_t * buffer, std::vector<VertexAttribute::VertexAttributeData> & value) {
+std::vector<float> gltfLoadFloatBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer) {
 
-  for (unsigned int i = 0; i < acc.count; ++i) {
-
-    value[i].f = gltfGetBufferData<float>(acc, view, buffer, i);
+  return gltfReadAccessor<float>(acc, view, buffer);
+  
+}
 
-  }
+template <unsigned int dim, typename T> std::vector<Math::Vector<dim, T>> gltfLoadVecBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer) {
 
-}
+  if (acc.dataElementCount != dim)
+    throw dbg::trace_exception(std::string("Accessor has ").append(std::to_string(acc.dataElementCount)).append(" components, expected ").append(std::to_string(dim)));
 
-std::vector<float> gltfLoadFloatBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, uint8_t * buffer) {
+  std::vector<T> data = gltfReadAccessor<T>(acc, view, buffer);
+  std::vector<Math::Vector<dim, T>> value(acc.count);
 
-  std::vector<float> data(acc.count);
   for (unsigned int i = 0; i < acc.count; ++i) {
-    data[i] = gltfGetBufferData<float>(acc, view, buffer, i);
+
+    value[i] = Vector<dim, T>(&data[i * dim]);
+
   }
+  return value;
 
-  return data;
-  
 }
 
-void gltfLoadIntBuffer(gltf_accessor_t & acc, gltf_buffer_view_t & view, uint8_t * buffer, std::vector<VertexAttribute::VertexAttributeData> & value) {
+template <typename T> std::vector<Math::Quaternion<T>> gltfLoadQuaternionBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer) {
+
+  if (acc.dataElementCount != 4)
+    throw dbg::trace_exception("Rotation accessor is no VEC4");
+
+  std::vector<T> data = gltfReadAccessor<T>(acc, view, buffer);
+  std::vector<Math::Quaternion<T>> value(acc.count);
 
   for (unsigned int i = 0; i < acc.count; ++i) {
 
-    value[i].i32 = gltfGetBufferData<int32_t>(acc, view, buffer, i);
+    T * tmp = &data[i * 4];
+    value[i] = Quaternion<T>(tmp[3], tmp[0], tmp[1], tmp[2]);
 
   }
+  return value;
 
 }
 
-template <unsigned int dim, typename T> std::vector<Math::Vector<dim, T>> gltfLoadVecBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, uint8_t * buffer) {
+template <unsigned int dim, typename T> std::vector<Math::Matrix<dim,dim,T>> gltfLoadMatrixBuffer(gltf_accessor_t & acc, gltf_buffer_view_t & view, const uint8_t * buffer) {
 
-  std::vector<Math::Vector<dim, T>> value(acc.count);
+  if (acc.dataElementCount != dim * dim)
+    throw dbg::trace_exception("Accessor does not match matrix size");
 
-  for (unsigned int i = 0; i < acc.count; ++i) {
+  std::vector<T> data = gltfReadAccessor<T>(acc, view, buffer);
+  std::vector<Math::Matrix<dim,dim, T>> value(acc.count);
 
-    T tmp[dim];
+  alignas(16) T mData[dim*dim];
 
-    for (unsigned int j = 0; j < dim; ++j)
-      tmp[j] = gltfGetBufferData<T>(acc, view, buffer, i*dim+j);
+  for (unsigned int i = 0; i < acc.count; ++i) {
 
-    value[i] = Vector<dim, T>(tmp);
+    memcpy(mData, &data[(dim * dim) * i], sizeof(T) * dim * dim);
+    value[i] = Matrix<dim,dim,T>(mData);
 
   }
   return value;
 
 }
 
-template <typename T> std::vector<Math::Quaternion<T>> gltfLoadQuaternionBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, uint8_t * buffer) {
-
-  std::vector<Math::Quaternion<T>> value(acc.count);
-
-  for (unsigned int i = 0; i < acc.count; ++i) {
+template <typename T> void gltfWidenIndices(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer, std::vector<uint32_t> & indices) {
 
-    T tmp[4];
+  std::vector<T> data = gltfReadAccessor<T>(acc, view, buffer);
+  std::copy(data.begin(), data.end(), indices.begin());
 
-    for (unsigned int j = 0; j < 4; ++j)
-      tmp[j] = gltfGetBufferData<T>(acc, view, buffer, i*4+j);
+}
 
-    value[i] = Quaternion<T>(tmp[3], tmp[0], tmp[1], tmp[2]);
+/// Indices may be stored as unsigned bytes, shorts or ints, the mesh always keeps 32 bits.
+std::vector<uint32_t> gltfLoadIndexBuffer(const gltf_accessor_t & acc, const gltf_buffer_view_t & view, const uint8_t * buffer) {
 
-  }
-  return value;
+  if (acc.dataElementCount != 1)
+    throw dbg::trace_exception("Index accessor is no SCALAR");
 
-}
+  std::vector<uint32_t> indices(acc.count);
 
-template <unsigned int dim, typename T> std::vector<Math::Matrix<dim,dim,T>> gltfLoadMatrixBuffer(gltf_accessor_t & acc, gltf_buffer_view_t & view, uint8_t * buffer) {
+  switch (acc.rawDataType) {
 
-  std::vector<Math::Matrix<dim,dim, T>> value(acc.count);
+  case GLTF_TYPE_UINT8:
+    gltfWidenIndices<uint8_t>(acc, view, buffer, indices);
+    break;
 
-  T * data = (T*) (buffer + view.byteOffset);
-  alignas(16) T mData[dim*dim];
+  case GLTF_TYPE_UINT16:
+    gltfWidenIndices<uint16_t>(acc, view, buffer, indices);
+    break;
 
-  for (unsigned int i = 0; i < acc.count; ++i) {
+  case GLTF_TYPE_UINT32:
+    gltfReadAccessor<uint32_t>(acc, view, buffer, indices.data());
+    break;
 
-    memcpy(mData, data + (dim * dim) * i, sizeof(T) * dim * dim);
-    value[i] = Matrix<dim,dim,T>(mData);
+  default:
+    throw dbg::trace_exception(std::string("Invalid index component type ").append(std::to_string(acc.rawDataType)));
 
   }
-  return value;
+
+  return indices;
 
 }
 
@@ -588,111 +621,40 @@ void gltfUpdateChildGlobalTransform(gltf_node_t & node, std::vector<gltf_node_t>
 
 }
 
-std::shared_ptr<Mesh> gltfLoadMesh(gltf_mesh_t & mesh, std::vector<gltf_accessor_t> & accessors, std::vector<gltf_buffer_view_t> & bufferViews, uint8_t * buffer) {
+std::shared_ptr<Mesh> gltfLoadMesh(gltf_mesh_t & mesh, std::vector<gltf_accessor_t> & accessors, std::vector<gltf_buffer_view_t> & bufferViews, const uint8_t * buffer) {
 
   gltf_mesh_primitive_t prim = mesh.primitives[0];
 
-  std::unordered_map<std::string, VertexAttribute> attributes;
+  VertexAttributeSet attributes;
 
   for (auto it : mesh.attributes) {
 
-    gltf_accessor_t acc = accessors[it.second];
-
-    VertexAttribute attr;
-    attr.type = gltfDecodeAttributeType(acc);
-    attr.value = std::vector<VertexAttribute::VertexAttributeData>(acc.count);
-
-    lout << "Loading buffer of type " << std::hex << attr.type << std::dec << " for " << it.first << std::endl;
-
-    switch (attr.type) {
-
-    case ATTRIBUTE_F32_SCALAR:
-      gltfLoadFloatBuffer(acc, bufferViews[acc.bufferView], buffer, attr.value);
-      break;
-
-    case ATTRIBUTE_F32_VEC2:
-      {
-	std::vector<Math::Vector<2, float>> data = gltfLoadVecBuffer<2, float>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].vec2 = data[i];
-	}
-      }
-      break;
+    VertexAttributeSlot slot = getAttributeSlot(it.first);
 
-    case ATTRIBUTE_F32_VEC3:
-      {
-	std::vector<Math::Vector<3, float>> data = gltfLoadVecBuffer<3, float>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].vec3 = data[i];
-	}
-      }
-      break;
-
-    case ATTRIBUTE_F32_VEC4:
-      {
-	std::vector<Math::Vector<4, float>> data = gltfLoadVecBuffer<4, float>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].vec4 = data[i];
-	}
-      }
-      break;
+    if (slot == ATTRIBUTE_SLOT_INVALID) {
+      lout << "Skipping unsupported vertex attribute " << it.first << std::endl;
+      continue;
+    }
 
-    case ATTRIBUTE_I32_SCALAR:
-      gltfLoadIntBuffer(acc, bufferViews[acc.bufferView], buffer, attr.value);
-      break;
+    gltf_accessor_t acc = accessors[it.second];
+    gltf_buffer_view_t & view = bufferViews[acc.bufferView];
 
-    case ATTRIBUTE_I32_VEC2:
-      {
-	std::vector<Math::Vector<2, int32_t>> data = gltfLoadVecBuffer<2, int32_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i32_vec2 = data[i];
-	}
-      }
-      break;
+    VertexAttribute attr(gltfDecodeAttributeType(acc), acc.count);
 
-    case ATTRIBUTE_I32_VEC3:
-      {
-	std::vector<Math::Vector<3, int32_t>> data = gltfLoadVecBuffer<3, int32_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i32_vec3 = data[i];
-	}
-      }
-      break;
+    lout << "Loading buffer of type " << std::hex << attr.type << std::dec << " for " << it.first << std::endl;
 
-    case ATTRIBUTE_I32_VEC4:
-      {
-	std::vector<Math::Vector<4, int32_t>> data = gltfLoadVecBuffer<4, int32_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i32_vec4 = data[i];
-	}
-      }
-      break;
+    switch (attr.type >> 4) {
 
-    case ATTRIBUTE_I16_VEC2:
-      {
-	std::vector<Math::Vector<2, int16_t>> data = gltfLoadVecBuffer<2, int16_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i16_vec2 = data[i];
-	}
-      }
+    case 1:
+      gltfReadAccessor<float>(acc, view, buffer, attr.as<float>());
       break;
 
-    case ATTRIBUTE_I16_VEC3:
-      {
-	std::vector<Math::Vector<3, int16_t>> data = gltfLoadVecBuffer<3, int16_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i16_vec3 = data[i];
-	}
-      }
+    case 3:
+      gltfReadAccessor<int16_t>(acc, view, buffer, attr.as<int16_t>());
       break;
 
-    case ATTRIBUTE_I16_VEC4:
-      {
-	std::vector<Math::Vector<4, int16_t>> data = gltfLoadVecBuffer<4, int16_t>(acc, bufferViews[acc.bufferView], buffer);
-	for (unsigned int i = 0; i < data.size(); ++i) {
-	  attr.value[i].i16_vec4 = data[i];
-	}
-      }
+    case 4:
+      gltfReadAccessor<int32_t>(acc, view, buffer, attr.as<int32_t>());
       break;
 
     default:
@@ -700,21 +662,15 @@ std::shared_ptr<Mesh> gltfLoadMesh(gltf_mesh_t & mesh, std::vector<gltf_accessor
 
     }
 
-    attributes[it.first] = attr;
+    attributes[slot] = std::move(attr);
 
   }
 
   gltf_accessor_t & indexAcc = accessors[prim.indices];
 
-  std::vector<uint16_t> indices(indexAcc.count);
+  std::vector<uint32_t> indices = gltfLoadIndexBuffer(indexAcc, bufferViews[indexAcc.bufferView], buffer);
 
-  for (unsigned int i = 0; i < indexAcc.count; ++i) {
-
-    indices[i] = gltfGetBufferData<uint16_t>(indexAcc, bufferViews[indexAcc.bufferView], buffer, i);
-
-  }
-
-  std::shared_ptr<Mesh> mmesh(new Mesh(attributes, indices));
+  std::shared_ptr<Mesh> mmesh(new Mesh(std::move(attributes), std::move(indices)));
 
   mmesh->setMaterialIndex(mesh.primitives[0].material);
 
@@ -728,11 +684,11 @@ std::shared_ptr<Mesh> gltfLoadMesh(gltf_mesh_t & mesh, std::vector<gltf_accessor
 
   mmesh->makeConsistentWithNormals();
   
-  return zupMatrix * mmesh;
+  return zupMatrix * std::move(mmesh);
 
 }
 
-std::shared_ptr<Skin> gltfLoadSkin(gltf_skin_t & skin, std::vector<gltf_accessor_t> & accessors, std::vector<gltf_buffer_view_t> & bufferViews, uint8_t * buffer, std::vector<gltf_node_t> & nodes) {
+std::shared_ptr<Skin> gltfLoadSkin(gltf_skin_t & skin, std::vector<gltf_accessor_t> & accessors, std::vector<gltf_buffer_view_t> & bufferViews, const uint8_t * buffer, std::vector<gltf_node_t> & nodes) {
 
   std::vector<Joint> joints(skin.joints.size());
 
@@ -754,29 +710,25 @@ std::shared_ptr<Skin> gltfLoadSkin(gltf_skin_t & skin, std::vector<gltf_accessor
 
 }
 
-std::vector<uint8_t> gltfLoadPackedImage(uint8_t * buffer, gltf_buffer_view_t & bufferView, uint32_t * width, uint32_t * height) {
+std::vector<uint8_t> gltfLoadPackedImage(const uint8_t * buffer, gltf_buffer_view_t & bufferView, uint32_t * width, uint32_t * height) {
 
-  uint32_t chanelCount;
-  uint8_t * data = pngLoadImageDataMemory(buffer + bufferView.byteOffset, width, height, &chanelCount);
+  const uint8_t * data = buffer + bufferView.byteOffset;
 
-  if (!data)
-    throw dbg::trace_exception("Unable to load PNG");
+  png_image_info_t info;
+  int result = pngReadHeaderMemory(data, bufferView.byteLength, &info);
 
-  std::vector<uint8_t> fData(*width * *height * 4);
+  std::vector<uint8_t> fData;
 
-  for (unsigned int i = 0; i < *height; ++i) {
-    for (unsigned int j = 0; j < *width; ++j) {
-      for (unsigned int c = 0; c < chanelCount; ++c) {
-	fData[(i * *width + j) * 4 + c] = data[(i * *width + j) * chanelCount + c];
-      }
+  if (result == PNG_OK) {
+    fData.resize((size_t) info.width * info.height * 4);
+    result = pngDecodeRGBAMemory(data, bufferView.byteLength, fData.data(), (size_t) info.width * 4);
+  }
 
-      if (chanelCount < 4) {
-	fData[(i * *width + j) * 4 + 3] = 255;
-      }
+  if (result != PNG_OK)
+    throw dbg::trace_exception(std::string("Unable to load PNG: ").append(pngGetErrorString(result)));
 
-    }
-    //fData[i] = (float) data[i] / 255.0;
-  }
+  *width = info.width;
+  *height = info.height;
 
   return fData;
 
@@ -798,7 +750,15 @@ struct gltf_file_data_t {
   std::vector<gltf_animation_t> animations;
   std::vector<gltf_skin_t> skins;
 
-  uint8_t * binaryBuffer;
+  /// Keeps the mapping of binaryBuffer alive.
+  std::shared_ptr<GLBFile> file;
+
+  /// Textures by image and color space, so images shared by several materials are only decoded once per color space.
+  std::map<std::pair<int, mip_color_space>, LoadingResource> textureResources;
+  const uint8_t * binaryBuffer;
+
+  /// Identifies the file content in the mesh cache.
+  std::string cacheKey;
 
 };
 
@@ -814,44 +774,9 @@ void gltfLoadFile(std::string fname, gltf_file_data_t * data) {
   if (fname.substr(fname.length()-3).compare("glb"))
     throw res::wrong_file_exception("Not a glb file");
 
-  FILE * file = fopen(fname.c_str(), "rb");
-  if (!file)
-    throw dbg::trace_exception(std::string("No such file: ").append(fname));
-
-  glb_header_t header;
-  fread(&header, sizeof(glb_header_t), 1, file);
-
-  if (header.magic != 0x46546C67) {
-    throw dbg::trace_exception("Incorrect header for glb file");
-  } else if (header.version != 2) {
-    throw dbg::trace_exception("Incorrect version for glb file");
-  }
-
-  std::vector<glb_chunk_t> chunks;
-
-  while (!feof(file)) {
-
-    glb_chunk_t chunk;
-    fread(&chunk.chunkLength, sizeof(uint32_t), 1, file);
-    fread(&chunk.chunkType, sizeof(uint32_t), 1, file);
-
-    chunk.rawData = new uint8_t[(chunk.chunkType == 0x4E4F534A) ? chunk.chunkLength+1 : chunk.chunkLength];
+  std::shared_ptr<GLBFile> file = std::make_shared<GLBFile>(fname);
 
-    fread(chunk.rawData, sizeof(uint8_t), chunk.chunkLength, file);
-
-    if (chunk.chunkType == 0x4E4F534A) {
-      chunk.rawData[chunk.chunkLength] = 0;
-    }
-
-    chunks.push_back(chunk);
-
-  }
-
-  fclose(file);
-
-  std::string str((char *) chunks[0].rawData);
-
-  json jsonData = json::parse(str);
+  json jsonData = json::parse(file->getJSON(), file->getJSON() + file->getJSONLength());
 
   gltf_asset_t asset = jsonData["asset"].get<gltf_asset_t>();
   std::vector<gltf_scene_t> scenes = jsonData["scenes"].get<std::vector<gltf_scene_t>>();
@@ -896,7 +821,12 @@ void gltfLoadFile(std::string fname, gltf_file_data_t * data) {
   }
 
   int sceneID = jsonData["scene"].get<int>();
-  uint8_t * binaryBuffer = chunks[1].rawData;
+
+  /// Accessors are checked against their view, so checking the views covers all reads.
+  for (gltf_buffer_view_t & view : bufferViews)
+    file->getSpan(view.byteOffset, view.byteLength);
+
+  const uint8_t * binaryBuffer = file->getBinary().data;
 
   if (data) {
 
@@ -908,19 +838,34 @@ void gltfLoadFile(std::string fname, gltf_file_data_t * data) {
     data->nodes = nodes;
     data->scenes = scenes;
     data->textures = textures;
+    data->file = file;
     data->binaryBuffer = binaryBuffer;
+    data->cacheKey = MeshCache::sourceKey(file->getFile().data, file->getFile().length);
 
     data->animations = animations;
     data->skins = skins;
 
     data->rootScene = sceneID;
 
-  } else {
-    delete[] binaryBuffer;
   }
 
 }
 
+std::shared_ptr<Mesh> gltfLoadMeshFile(std::string fname, int meshId) {
+
+  gltf_file_data_t fileData;
+  gltfLoadFile(fname, &fileData);
+
+  if (meshId < 0 || (size_t) meshId >= fileData.meshes.size())
+    throw dbg::trace_exception(std::string("No mesh ").append(std::to_string(meshId)).append(" in ").append(fname));
+
+  std::shared_ptr<Mesh> mesh = gltfLoadMesh(fileData.meshes[meshId], fileData.accessors, fileData.bufferViews, fileData.binaryBuffer);
+  mesh->setCacheKey(MeshCache::subKey(fileData.cacheKey, std::string("m").append(std::to_string(meshId))));
+
+  return mesh;
+
+}
+
 std::shared_ptr<Mesh> gltfBuildMesh(std::shared_ptr<GLTFNode> node) {
 
   if (!node) return nullptr;
@@ -992,20 +937,37 @@ std::string gltfSubresName(const std::string fname, const std::string name) {
   return resName.append(":").append(name);
 }
 
-LoadingResource GLTFNodeLoader::loadTexture(gltf_file_data_t & fileData, const int textureId, const std::string fname) {
+LoadingResource GLTFNodeLoader::loadTexture(gltf_file_data_t & fileData, const int textureId, const std::string fname, mip_color_space colorSpace) {
 
   gltf_texture_t & texture = fileData.textures[textureId];
 
+  std::pair<int, mip_color_space> key(texture.source, colorSpace);
+
+  auto it = fileData.textureResources.find(key);
+  if (it != fileData.textureResources.end())
+    return it->second;
+
   gltf_image_t & image = fileData.images[texture.source];
 
-  uint32_t width, height;
-  std::vector<uint8_t> imageData = gltfLoadPackedImage(fileData.binaryBuffer, fileData.bufferViews[image.bufferView], &width, &height);
+  /// Images are decoded on the loading threads, each texture is uploaded as soon as its image is done.
+  std::shared_ptr<PendingImage> pending = std::make_shared<PendingImage>(1, 1, colorSpace);
+  std::shared_ptr<GLBFile> file = fileData.file;
+  const uint8_t * buffer = fileData.binaryBuffer;
+  gltf_buffer_view_t bufferView = fileData.bufferViews[image.bufferView];
+
+  submitDecode([pending, file, buffer, bufferView] () mutable {
+    pending->decodePart([&] () {pending->data = gltfLoadPackedImage(buffer, bufferView, &pending->width, &pending->height);});
+  });
 
-  std::shared_ptr<ResourceUploader<Resource>> upldr((ResourceUploader<Resource> *) new TextureUploader<uint8_t>(imageData, width, height, 1));
+  std::shared_ptr<ResourceUploader<Resource>> upldr((ResourceUploader<Resource> *) new PendingTextureUploader(pending));
 
-  std::string textureName = gltfSubresName(fname, image.name);
+  std::string name = image.name;
+  name.append(colorSpace == MIP_COLOR_SPACE_SRGB ? ":srgb" : ":linear");
 
-  return uploadResource(ResourceLocation("Texture", fname, image.name), upldr);
+  LoadingResource res = uploadResource(ResourceLocation("Texture", fname, name), upldr);
+  fileData.textureResources[key] = res;
+
+  return res;
 
 }
 
@@ -1017,9 +979,10 @@ LoadingResource GLTFNodeLoader::loadMaterial(gltf_file_data_t & fileData, const
   LoadingResource staticShader = loadDependency(ResourceLocation("Shader", "resources/shaders/gltf_pbrMetallicStatic.shader"));
   LoadingResource skinShader = loadDependency(ResourceLocation("Shader", "resources/shaders/gltf/pbr_skin.shader"));
 
-  LoadingResource colorImg = loadTexture(fileData, material.baseColorTexture.index, fname);
-  LoadingResource normalImg = loadTexture(fileData, material.normalTexture.index, fname);
-  LoadingResource metalImg = loadTexture(fileData, material.metallicRoughnessTexture.index, fname);
+  /// Only the base color is sRGB encoded, see the glTF material definition.
+  LoadingResource colorImg = loadTexture(fileData, material.baseColorTexture.index, fname, MIP_COLOR_SPACE_SRGB);
+  LoadingResource normalImg = loadTexture(fileData, material.normalTexture.index, fname, MIP_COLOR_SPACE_LINEAR);
+  LoadingResource metalImg = loadTexture(fileData, material.metallicRoughnessTexture.index, fname, MIP_COLOR_SPACE_LINEAR);
 
   std::vector<LoadingResource> textures = {colorImg, normalImg, metalImg};
 
@@ -1306,7 +1269,30 @@ std::shared_ptr<NodeUploader> GLTFNodeLoader::loadNodeGLTF(gltf_file_data_t & fi
 
     gltf_mesh_t gltfMesh = fileData.meshes[node.mesh];
 
-    std::shared_ptr<Mesh> mesh = gltfLoadMesh(gltfMesh, fileData.accessors, fileData.bufferViews, fileData.binaryBuffer);
+    std::string meshKey = MeshCache::subKey(fileData.cacheKey, std::string("m").append(std::to_string(node.mesh)));
+    std::shared_ptr<Mesh> mesh;
+
+    if (MeshCache::contains(meshKey)) {
+
+      /// A baked version exists, the mesh is only decoded if it does not fit the shader.
+      const int meshId = node.mesh;
+      const std::string meshName = gltfMesh.name;
+      mesh = std::make_shared<Mesh>(meshKey, [filename, meshId, meshName] () {
+
+        std::shared_ptr<Mesh> sourceMesh = gltfLoadMeshFile(filename, meshId);
+        sourceMesh->setLocation(ResourceLocation("Mesh", filename, meshName));
+
+        return sourceMesh;
+
+      });
+
+    } else {
+
+      mesh = gltfLoadMesh(gltfMesh, fileData.accessors, fileData.bufferViews, fileData.binaryBuffer);
+      mesh->setCacheKey(meshKey);
+
+    }
+
     ResourceLocation meshResourceLocation("Mesh", filename, gltfMesh.name);
     mesh->setLocation(meshResourceLocation);
     LoadingResource meshRes = this->uploadResource(meshResourceLocation, std::shared_ptr<ResourceUploader<Resource>>((ResourceUploader<Resource> *)new MeshUploader(mesh)));
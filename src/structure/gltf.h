@@ -6,6 +6,7 @@
 #include "render/util/vkutil.h"
 #include "util/mesh.h"
 #include "util/meshhelper.h"
+#include "util/image/mipmap.h"
 #include <mathutils/vector.h>
 #include <mathutils/quaternion.h>
 #include "animation/skeletalrig.h"
@@ -75,7 +76,7 @@ public:
   std::shared_ptr<NodeUploader> loadNodeGLTF(gltf_file_data_t & fileData, const int nodeId, const std::string fname, gltf_loading_state_t & state);
 
   LoadingResource loadMaterial(gltf_file_data_t & fileData, const int materialId, const std::string fname);
-  LoadingResource loadTexture(gltf_file_data_t & fileData, const int textureId, const std::string fname);
+  LoadingResource loadTexture(gltf_file_data_t & fileData, const int textureId, const std::string fname, mip_color_space colorSpace);
 
 
   
@@ -84,4 +85,7 @@ public:
 struct gltf_file_data_t;
 void gltfLoadFile(std::string fname, gltf_file_data_t * data = nullptr);
 
+/// Decodes a single mesh of a glb file, without loading any of its other resources.
+std::shared_ptr<Mesh> gltfLoadMeshFile(std::string fname, int meshId);
+
 #endif // GLTF_H
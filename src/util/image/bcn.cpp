@@ -0,0 +1,503 @@
+#include "bcn.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+/// Pixels of one 4x4 block, row by row.
+typedef uint8_t bcn_block_t[16][4];
+
+bool bcnIsValidFormat(uint32_t format) {
+  return format == BCN_FORMAT_BC1 || format == BCN_FORMAT_BC3 || format == BCN_FORMAT_BC5;
+}
+
+size_t bcnBlockSize(bcn_format format) {
+  return format == BCN_FORMAT_BC1 ? 8 : 16;
+}
+
+size_t bcnImageSize(bcn_format format, uint32_t width, uint32_t height) {
+  return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * bcnBlockSize(format);
+}
+
+static void writeLE16(uint8_t * out, uint16_t value) {
+
+  out[0] = value;
+  out[1] = value >> 8;
+
+}
+
+static uint16_t readLE16(const uint8_t * in) {
+  return in[0] | (in[1] << 8);
+}
+
+static uint16_t packColor(const float color[3]) {
+
+  int r = (int) (std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+  int g = (int) (std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+  int b = (int) (std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+
+  return (r << 11) | (g << 5) | b;
+
+}
+
+static void unpackColor(uint16_t c, int color[3]) {
+
+  int r = (c >> 11) & 31;
+  int g = (c >> 5) & 63;
+  int b = c & 31;
+
+  color[0] = (r << 3) | (r >> 2);
+  color[1] = (g << 2) | (g >> 4);
+  color[2] = (b << 3) | (b >> 2);
+
+}
+
+/**
+ * The four colors of a BC1 block. With c0 <= c1 the block has three colors
+ * and a transparent black, unless fourColors is set as for the color part
+ * of BC3 blocks.
+ **/
+static void colorPalette(uint16_t c0, uint16_t c1, bool fourColors, int palette[4][4]) {
+
+  unpackColor(c0, palette[0]);
+  unpackColor(c1, palette[1]);
+  palette[0][3] = 255;
+  palette[1][3] = 255;
+  palette[2][3] = 255;
+
+  if (fourColors || c0 > c1) {
+
+    for (unsigned int c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c] + 1) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c] + 1) / 3;
+    }
+    palette[3][3] = 255;
+
+  } else {
+
+    for (unsigned int c = 0; c < 3; ++c) {
+      palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+      palette[3][c] = 0;
+    }
+    palette[3][3] = 0;
+
+  }
+
+}
+
+/// Chooses the closest palette entry for every pixel, returns the squared error.
+static int selectColorIndices(const bcn_block_t & block, uint16_t transparent, uint16_t c0, uint16_t c1, bool fourColors, uint32_t & indices) {
+
+  int palette[4][4];
+  colorPalette(c0, c1, fourColors, palette);
+
+  unsigned int candidates = (fourColors || c0 > c1) ? 4 : 3;
+  int error = 0;
+  indices = 0;
+
+  for (unsigned int i = 0; i < 16; ++i) {
+
+    if (transparent & (1 << i)) {
+      indices |= 3u << (2 * i);
+      continue;
+    }
+
+    int bestError = 0x7fffffff;
+    uint32_t bestIndex = 0;
+
+    for (unsigned int j = 0; j < candidates; ++j) {
+
+      int dr = palette[j][0] - block[i][0];
+      int dg = palette[j][1] - block[i][1];
+      int db = palette[j][2] - block[i][2];
+      int e = dr * dr + dg * dg + db * db;
+
+      if (e < bestError) {
+        bestError = e;
+        bestIndex = j;
+      }
+
+    }
+
+    indices |= bestIndex << (2 * i);
+    error += bestError;
+
+  }
+
+  return error;
+
+}
+
+/**
+ * Brings the endpoints into the order of the block mode and chooses the
+ * indices. Four color blocks need c0 > c1, blocks with transparent pixels
+ * c0 <= c1.
+ **/
+static int fitColorEndpoints(const bcn_block_t & block, uint16_t transparent, bool fourColors, uint16_t & c0, uint16_t & c1, uint32_t & indices) {
+
+  bool threeColors = transparent && !fourColors;
+
+  if ((threeColors && c0 > c1) || (!threeColors && c0 < c1))
+    std::swap(c0, c1);
+
+  return selectColorIndices(block, transparent, c0, c1, fourColors || !threeColors, indices);
+
+}
+
+/**
+ * Encodes the colors of a block. The endpoints are the extremes along the
+ * principal axis of the colors, refined once by a least squares fit to the
+ * chosen indices. Pixels with alpha below one half become transparent if
+ * punchThrough is set, otherwise alpha is ignored.
+ **/
+static void encodeColorBlock(const bcn_block_t & block, bool punchThrough, uint8_t * out) {
+
+  uint16_t transparent = 0;
+  unsigned int opaqueCount = 0;
+  float mean[3] = {0, 0, 0};
+
+  for (unsigned int i = 0; i < 16; ++i) {
+
+    if (punchThrough && block[i][3] < 128) {
+      transparent |= 1 << i;
+      continue;
+    }
+
+    for (unsigned int c = 0; c < 3; ++c)
+      mean[c] += block[i][c];
+    opaqueCount++;
+
+  }
+
+  if (!opaqueCount) {
+    writeLE16(out, 0);
+    writeLE16(out + 2, 0);
+    memset(out + 4, 0xff, 4);
+    return;
+  }
+
+  for (unsigned int c = 0; c < 3; ++c)
+    mean[c] /= opaqueCount;
+
+  float covariance[6] = {0, 0, 0, 0, 0, 0};
+
+  for (unsigned int i = 0; i < 16; ++i) {
+
+    if (transparent & (1 << i))
+      continue;
+
+    float r = block[i][0] - mean[0];
+    float g = block[i][1] - mean[1];
+    float b = block[i][2] - mean[2];
+
+    covariance[0] += r * r;
+    covariance[1] += r * g;
+    covariance[2] += r * b;
+    covariance[3] += g * g;
+    covariance[4] += g * b;
+    covariance[5] += b * b;
+
+  }
+
+  /// A few power iterations are plenty to find the dominant axis.
+  float axis[3] = {1, 1, 1};
+
+  for (unsigned int k = 0; k < 4; ++k) {
+
+    float next[3] = {
+      covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+      covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+      covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2],
+    };
+
+    float length = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+    if (length < 1e-6f)
+      break;
+
+    for (unsigned int c = 0; c < 3; ++c)
+      axis[c] = next[c] / length;
+
+  }
+
+  float minT = 0, maxT = 0;
+  float norm = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+  for (unsigned int i = 0; i < 16; ++i) {
+
+    if (transparent & (1 << i))
+      continue;
+
+    float t = ((block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1] + (block[i][2] - mean[2]) * axis[2]) / norm;
+    minT = std::min(minT, t);
+    maxT = std::max(maxT, t);
+
+  }
+
+  float e0[3], e1[3];
+  for (unsigned int c = 0; c < 3; ++c) {
+    e0[c] = mean[c] + axis[c] * maxT;
+    e1[c] = mean[c] + axis[c] * minT;
+  }
+
+  uint16_t c0 = packColor(e0);
+  uint16_t c1 = packColor(e1);
+  uint32_t indices;
+  bool fourColors = !punchThrough;
+
+  int error = fitColorEndpoints(block, transparent, fourColors, c0, c1, indices);
+
+  /// Weight of the first endpoint for each index, in both block modes.
+  static const float weights[2][4] = {{1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f}, {1.0f, 0.0f, 0.5f, 0.0f}};
+  const float * weight = weights[(fourColors || c0 > c1) ? 0 : 1];
+
+  if (error) {
+
+    float aa = 0, ab = 0, bb = 0;
+    float ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+
+    for (unsigned int i = 0; i < 16; ++i) {
+
+      if (transparent & (1 << i))
+        continue;
+
+      float w = weight[(indices >> (2 * i)) & 3];
+      aa += w * w;
+      ab += w * (1 - w);
+      bb += (1 - w) * (1 - w);
+
+      for (unsigned int c = 0; c < 3; ++c) {
+        ax[c] += w * block[i][c];
+        bx[c] += (1 - w) * block[i][c];
+      }
+
+    }
+
+    float det = aa * bb - ab * ab;
+
+    if (std::fabs(det) > 1e-6f) {
+
+      for (unsigned int c = 0; c < 3; ++c) {
+        e0[c] = (ax[c] * bb - bx[c] * ab) / det;
+        e1[c] = (bx[c] * aa - ax[c] * ab) / det;
+      }
+
+      uint16_t r0 = packColor(e0);
+      uint16_t r1 = packColor(e1);
+      uint32_t refinedIndices;
+
+      if (fitColorEndpoints(block, transparent, fourColors, r0, r1, refinedIndices) < error) {
+        c0 = r0;
+        c1 = r1;
+        indices = refinedIndices;
+      }
+
+    }
+
+  }
+
+  writeLE16(out, c0);
+  writeLE16(out + 2, c1);
+  out[4] = indices;
+  out[5] = indices >> 8;
+  out[6] = indices >> 16;
+  out[7] = indices >> 24;
+
+}
+
+static void decodeColorBlock(const uint8_t * in, bool fourColors, bcn_block_t & block) {
+
+  int palette[4][4];
+  colorPalette(readLE16(in), readLE16(in + 2), fourColors, palette);
+
+  uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t) in[7] << 24);
+
+  for (unsigned int i = 0; i < 16; ++i) {
+    const int * color = palette[(indices >> (2 * i)) & 3];
+    for (unsigned int c = 0; c < 4; ++c)
+      block[i][c] = color[c];
+  }
+
+}
+
+/// The eight values of an interpolated single channel block (BC4).
+static void channelPalette(uint8_t a0, uint8_t a1, int palette[8]) {
+
+  palette[0] = a0;
+  palette[1] = a1;
+
+  if (a0 > a1) {
+
+    for (unsigned int i = 1; i < 7; ++i)
+      palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+
+  } else {
+
+    for (unsigned int i = 1; i < 5; ++i)
+      palette[i + 1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+    palette[6] = 0;
+    palette[7] = 255;
+
+  }
+
+}
+
+/// Encodes channel c of the block with the range of its values as endpoints.
+static void encodeChannelBlock(const bcn_block_t & block, unsigned int c, uint8_t * out) {
+
+  uint8_t minValue = 255, maxValue = 0;
+
+  for (unsigned int i = 0; i < 16; ++i) {
+    minValue = std::min(minValue, block[i][c]);
+    maxValue = std::max(maxValue, block[i][c]);
+  }
+
+  out[0] = maxValue;
+  out[1] = minValue;
+
+  int palette[8];
+  channelPalette(maxValue, minValue, palette);
+
+  uint64_t indices = 0;
+
+  if (maxValue > minValue) {
+
+    for (unsigned int i = 0; i < 16; ++i) {
+
+      int bestError = 256;
+      uint64_t bestIndex = 0;
+
+      for (unsigned int j = 0; j < 8; ++j) {
+
+        int e = std::abs(palette[j] - block[i][c]);
+        if (e < bestError) {
+          bestError = e;
+          bestIndex = j;
+        }
+
+      }
+
+      indices |= bestIndex << (3 * i);
+
+    }
+
+  }
+
+  for (unsigned int i = 0; i < 6; ++i)
+    out[2 + i] = indices >> (8 * i);
+
+}
+
+static void decodeChannelBlock(const uint8_t * in, unsigned int c, bcn_block_t & block) {
+
+  int palette[8];
+  channelPalette(in[0], in[1], palette);
+
+  uint64_t indices = 0;
+  for (unsigned int i = 0; i < 6; ++i)
+    indices |= (uint64_t) in[2 + i] << (8 * i);
+
+  for (unsigned int i = 0; i < 16; ++i)
+    block[i][c] = palette[(indices >> (3 * i)) & 7];
+
+}
+
+void bcnEncode(bcn_format format, const uint8_t * rgba, uint32_t width, uint32_t height, uint8_t * blocks) {
+
+  int blocksX = (width + 3) / 4;
+  int blocksY = (height + 3) / 4;
+  size_t blockSize = bcnBlockSize(format);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int by = 0; by < blocksY; ++by) {
+
+    bcn_block_t block;
+
+    for (int bx = 0; bx < blocksX; ++bx) {
+
+      /// Partial blocks repeat the last row and column of the image.
+      for (unsigned int y = 0; y < 4; ++y) {
+
+        uint32_t row = std::min((uint32_t) by * 4 + y, height - 1);
+
+        for (unsigned int x = 0; x < 4; ++x) {
+          uint32_t column = std::min((uint32_t) bx * 4 + x, width - 1);
+          memcpy(block[y * 4 + x], rgba + ((size_t) row * width + column) * 4, 4);
+        }
+
+      }
+
+      uint8_t * out = blocks + ((size_t) by * blocksX + bx) * blockSize;
+
+      switch (format) {
+
+        case BCN_FORMAT_BC1:
+          encodeColorBlock(block, true, out);
+          break;
+
+        case BCN_FORMAT_BC3:
+          encodeChannelBlock(block, 3, out);
+          encodeColorBlock(block, false, out + 8);
+          break;
+
+        case BCN_FORMAT_BC5:
+          encodeChannelBlock(block, 0, out);
+          encodeChannelBlock(block, 1, out + 8);
+          break;
+
+      }
+
+    }
+
+  }
+
+}
+
+void bcnDecode(bcn_format format, const uint8_t * blocks, uint32_t width, uint32_t height, uint8_t * rgba) {
+
+  int blocksX = (width + 3) / 4;
+  int blocksY = (height + 3) / 4;
+  size_t blockSize = bcnBlockSize(format);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int by = 0; by < blocksY; ++by) {
+
+    bcn_block_t block;
+
+    for (int bx = 0; bx < blocksX; ++bx) {
+
+      const uint8_t * in = blocks + ((size_t) by * blocksX + bx) * blockSize;
+
+      switch (format) {
+
+        case BCN_FORMAT_BC1:
+          decodeColorBlock(in, false, block);
+          break;
+
+        case BCN_FORMAT_BC3:
+          decodeColorBlock(in + 8, true, block);
+          decodeChannelBlock(in, 3, block);
+          break;
+
+        case BCN_FORMAT_BC5:
+          for (unsigned int i = 0; i < 16; ++i) {
+            block[i][2] = 0;
+            block[i][3] = 255;
+          }
+          decodeChannelBlock(in, 0, block);
+          decodeChannelBlock(in + 8, 1, block);
+          break;
+
+      }
+
+      for (uint32_t y = 0; y < 4 && by * 4 + y < height; ++y) {
+
+        uint32_t count = std::min((uint32_t) 4, width - bx * 4);
+        memcpy(rgba + ((size_t) (by * 4 + y) * width + bx * 4) * 4, block[y * 4], count * 4);
+
+      }
+
+    }
+
+  }
+
+}
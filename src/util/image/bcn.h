@@ -0,0 +1,42 @@
+#ifndef BCN_H
+#define BCN_H
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Block compressed formats, every 4x4 pixel block is stored in 8 (BC1) or
+ * 16 (BC3, BC5) bytes. The values are stored in compressed image files.
+ *
+ * BC1: RGB with one bit alpha, 4 bits per pixel.
+ * BC3: RGB as in BC1 plus interpolated alpha, 8 bits per pixel.
+ * BC5: two interpolated channels (red and green), meant for normal maps.
+ **/
+enum bcn_format {
+
+  BCN_FORMAT_BC1 = 1,
+  BCN_FORMAT_BC3 = 3,
+  BCN_FORMAT_BC5 = 5,
+
+};
+
+bool bcnIsValidFormat(uint32_t format);
+
+size_t bcnBlockSize(bcn_format format);
+
+/// Size of a width x height image, partial blocks at the borders are padded.
+size_t bcnImageSize(bcn_format format, uint32_t width, uint32_t height);
+
+/**
+ * Compresses a width x height RGBA image with tightly packed rows into
+ * bcnImageSize(format, width, height) bytes of blocks.
+ **/
+void bcnEncode(bcn_format format, const uint8_t * rgba, uint32_t width, uint32_t height, uint8_t * blocks);
+
+/**
+ * Expands blocks back to RGBA, for devices without support for the format.
+ * BC5 is decoded into red and green, with blue zero and alpha one.
+ **/
+void bcnDecode(bcn_format format, const uint8_t * blocks, uint32_t width, uint32_t height, uint8_t * rgba);
+
+#endif // BCN_H
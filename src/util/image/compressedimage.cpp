@@ -0,0 +1,147 @@
+#include "compressedimage.h"
+
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+#include "util/debug/trace_exception.h"
+
+struct compressed_image_header_t {
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t levelCount;
+
+};
+
+CompressedImage::CompressedImage(std::string fname) : file(fname) {
+
+  const uint8_t * fileData = file.getData();
+  size_t size = file.getSize();
+
+  if (size < sizeof(compressed_image_header_t))
+    throw dbg::trace_exception(std::string("Compressed image too small: ").append(fname));
+
+  compressed_image_header_t header;
+  memcpy(&header, fileData, sizeof(compressed_image_header_t));
+
+  if (header.magic != COMPRESSED_IMAGE_MAGIC || header.version != COMPRESSED_IMAGE_VERSION || !bcnIsValidFormat(header.format))
+    throw dbg::trace_exception(std::string("Incorrect header for compressed image: ").append(fname));
+
+  format = (bcn_format) header.format;
+  width = header.width;
+  height = header.height;
+
+  size_t offset = sizeof(compressed_image_header_t);
+
+  if (!header.levelCount || header.levelCount > 32 || size < offset + header.levelCount * sizeof(compressed_image_level_t))
+    throw dbg::trace_exception(std::string("Incorrect level count for compressed image: ").append(fname));
+
+  levels = std::vector<compressed_image_level_t>(header.levelCount);
+  memcpy(levels.data(), fileData + offset, header.levelCount * sizeof(compressed_image_level_t));
+  offset += header.levelCount * sizeof(compressed_image_level_t);
+
+  data = fileData + offset;
+  dataSize = size - offset;
+
+  if (!width || !height)
+    throw dbg::trace_exception(std::string("Compressed image has no pixels: ").append(fname));
+
+  for (uint32_t i = 0; i < levels.size(); ++i) {
+
+    const compressed_image_level_t & level = levels[i];
+
+    /// Every level halves the one before, the upload relies on the full chain.
+    if (level.width != std::max(1u, width >> i) || level.height != std::max(1u, height >> i))
+      throw dbg::trace_exception(std::string("Compressed image has a wrong level size: ").append(fname));
+
+    if (level.offset > dataSize || level.size > dataSize - level.offset || level.size != bcnImageSize(format, level.width, level.height))
+      throw dbg::trace_exception(std::string("Compressed image has the wrong size: ").append(fname));
+
+  }
+
+}
+
+CompressedImage::~CompressedImage() {
+
+}
+
+bcn_format CompressedImage::getFormat() {
+  return format;
+}
+
+uint32_t CompressedImage::getWidth() {
+  return width;
+}
+
+uint32_t CompressedImage::getHeight() {
+  return height;
+}
+
+const std::vector<compressed_image_level_t> & CompressedImage::getLevels() {
+  return levels;
+}
+
+const uint8_t * CompressedImage::getData() {
+  return data;
+}
+
+size_t CompressedImage::getDataSize() {
+  return dataSize;
+}
+
+void CompressedImage::write(std::string fname, bcn_format format, const uint8_t * rgba, uint32_t width, uint32_t height, mip_filter filter, mip_color_space colorSpace) {
+
+  MipChain chain = mipGenerateChain(rgba, width, height, 1, filter, colorSpace);
+  const std::vector<mip_level_t> & mips = chain.levels;
+
+  std::vector<compressed_image_level_t> levels(mips.size());
+  size_t dataSize = 0;
+
+  for (unsigned int i = 0; i < mips.size(); ++i) {
+
+    levels[i].offset = dataSize;
+    levels[i].size = bcnImageSize(format, mips[i].width, mips[i].height);
+    levels[i].width = mips[i].width;
+    levels[i].height = mips[i].height;
+
+    dataSize += levels[i].size;
+
+  }
+
+  std::vector<uint8_t> data(dataSize);
+
+  for (unsigned int i = 0; i < mips.size(); ++i)
+    bcnEncode(format, chain.data.data() + mips[i].offset, mips[i].width, mips[i].height, data.data() + levels[i].offset);
+
+  compressed_image_header_t header = {};
+  header.magic = COMPRESSED_IMAGE_MAGIC;
+  header.version = COMPRESSED_IMAGE_VERSION;
+  header.format = format;
+  header.width = width;
+  header.height = height;
+  header.levelCount = levels.size();
+
+  /// Readers never see a partially written file.
+  std::string tmpName = std::string(fname).append(".").append(std::to_string(getpid()));
+
+  std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw dbg::trace_exception(std::string("Unable to write compressed image ").append(fname));
+
+  file.write((const char *) &header, sizeof(header));
+  file.write((const char *) levels.data(), levels.size() * sizeof(compressed_image_level_t));
+  file.write((const char *) data.data(), data.size());
+  file.close();
+
+  if (!file || rename(tmpName.c_str(), fname.c_str())) {
+    remove(tmpName.c_str());
+    throw dbg::trace_exception(std::string("Unable to write compressed image ").append(fname));
+  }
+
+}
@@ -0,0 +1,67 @@
+#ifndef COMPRESSEDIMAGE_H
+#define COMPRESSEDIMAGE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "util/image/bcn.h"
+#include "util/image/mipmap.h"
+#include "util/mappedfile.h"
+
+#define COMPRESSED_IMAGE_EXTENSION ".btex"
+#define COMPRESSED_IMAGE_MAGIC 0x58455442
+#define COMPRESSED_IMAGE_VERSION 1
+
+/**
+ * Position of one mip level, offsets are relative to the start of the level data.
+ **/
+struct compressed_image_level_t {
+
+  uint64_t offset;
+  uint64_t size;
+  uint32_t width;
+  uint32_t height;
+
+};
+
+/**
+ * Block compressed image with its whole mip chain, as baked by the texture
+ * compiler tool. The level data points into the mapped file and is laid out
+ * so it can be copied to the GPU in one go.
+ **/
+class CompressedImage {
+
+public:
+
+  CompressedImage(std::string fname);
+  virtual ~CompressedImage();
+
+  bcn_format getFormat();
+  uint32_t getWidth();
+  uint32_t getHeight();
+
+  const std::vector<compressed_image_level_t> & getLevels();
+
+  const uint8_t * getData();
+  size_t getDataSize();
+
+  /// Builds the mip chain of an RGBA image, compresses every level and writes the file.
+  static void write(std::string fname, bcn_format format, const uint8_t * rgba, uint32_t width, uint32_t height, mip_filter filter, mip_color_space colorSpace);
+
+private:
+
+  MappedFile file;
+
+  bcn_format format;
+  uint32_t width;
+  uint32_t height;
+
+  std::vector<compressed_image_level_t> levels;
+
+  const uint8_t * data;
+  size_t dataSize;
+
+};
+
+#endif // COMPRESSEDIMAGE_H
@@ -0,0 +1,363 @@
+#include "mipmap.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "util/jobsystem.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define MIP_BOX_SSE2
+#endif // __SSE2__
+
+#define MIP_SRGB_TABLE_SIZE 4096
+#define MIP_KAISER_WIDTH 3.0f
+#define MIP_KAISER_ALPHA 4.0f
+
+uint32_t mipLevelCount(uint32_t width, uint32_t height) {
+
+  uint32_t count = 1;
+  uint32_t size = std::max(width, height);
+
+  while (size > 1) {
+    size /= 2;
+    count++;
+  }
+
+  return count;
+
+}
+
+/// Lookup tables between 8 bit sRGB and linear values in [0, 1].
+struct srgb_tables_t {
+
+  float toLinear[256];
+  uint8_t fromLinear[MIP_SRGB_TABLE_SIZE];
+
+  srgb_tables_t() {
+
+    for (unsigned int i = 0; i < 256; ++i) {
+      float c = i / 255.0f;
+      toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    for (unsigned int i = 0; i < MIP_SRGB_TABLE_SIZE; ++i) {
+      float l = i / (float) (MIP_SRGB_TABLE_SIZE - 1);
+      float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+      fromLinear[i] = (uint8_t) (c * 255.0f + 0.5f);
+    }
+
+  }
+
+};
+
+static const srgb_tables_t & srgbTables() {
+
+  static const srgb_tables_t tables;
+  return tables;
+
+}
+
+static inline uint8_t encodeValue(float value, bool srgb) {
+
+  value = std::min(std::max(value, 0.0f), 1.0f);
+
+  if (srgb)
+    return srgbTables().fromLinear[(int) (value * (MIP_SRGB_TABLE_SIZE - 1) + 0.5f)];
+
+  return (uint8_t) (value * 255.0f + 0.5f);
+
+}
+
+/**
+ * Halves src by averaging 2x2 pixels, odd sizes repeat their last row and
+ * column. Linear images are averaged on 16 bit integers, with SSE2 two
+ * output pixels at a time.
+ **/
+static void downsampleBox(const uint8_t * src, uint32_t width, uint32_t height, uint8_t * dst, uint32_t dstWidth, uint32_t dstHeight, bool srgb) {
+
+  const float * toLinear = srgbTables().toLinear;
+
+  bool parallel = !JobSystem::inWorker();
+
+  #pragma omp parallel for schedule(static) if(parallel)
+  for (int y = 0; y < (int) dstHeight; ++y) {
+
+    const uint8_t * row0 = src + (size_t) std::min((uint32_t) y * 2, height - 1) * width * 4;
+    const uint8_t * row1 = src + (size_t) std::min((uint32_t) y * 2 + 1, height - 1) * width * 4;
+    uint8_t * out = dst + (size_t) y * dstWidth * 4;
+
+    uint32_t x = 0;
+
+    if (srgb) {
+
+      for (; x < dstWidth; ++x) {
+
+        uint32_t x0 = std::min(x * 2, width - 1) * 4;
+        uint32_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+
+        for (unsigned int c = 0; c < 3; ++c)
+          out[x * 4 + c] = encodeValue((toLinear[row0[x0 + c]] + toLinear[row0[x1 + c]] + toLinear[row1[x0 + c]] + toLinear[row1[x1 + c]]) * 0.25f, true);
+
+        out[x * 4 + 3] = (row0[x0 + 3] + row0[x1 + 3] + row1[x0 + 3] + row1[x1 + 3] + 2) / 4;
+
+      }
+
+      continue;
+
+    }
+
+#ifdef MIP_BOX_SSE2
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    /// Four source pixels of both rows give two output pixels.
+    for (; x + 2 <= dstWidth && x * 2 + 4 <= width; x += 2) {
+
+      __m128i a = _mm_loadu_si128((const __m128i *) (row0 + x * 8));
+      __m128i b = _mm_loadu_si128((const __m128i *) (row1 + x * 8));
+
+      __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+      __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+      __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+      sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+
+      _mm_storel_epi64((__m128i *) (out + x * 4), _mm_packus_epi16(sum, zero));
+
+    }
+
+#endif // MIP_BOX_SSE2
+
+    for (; x < dstWidth; ++x) {
+
+      uint32_t x0 = std::min(x * 2, width - 1) * 4;
+      uint32_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+
+      for (unsigned int c = 0; c < 4; ++c)
+        out[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4;
+
+    }
+
+  }
+
+}
+
+static float besselI0(float x) {
+
+  float sum = 1.0f;
+  float term = 1.0f;
+
+  for (unsigned int k = 1; k < 32 && term > 1e-8f * sum; ++k) {
+    term *= (x * x * 0.25f) / (k * k);
+    sum += term;
+  }
+
+  return sum;
+
+}
+
+/// Kaiser windowed sinc, t is in pixels of the smaller image.
+static float kaiserFilter(float t) {
+
+  if (std::fabs(t) >= MIP_KAISER_WIDTH)
+    return 0.0f;
+
+  float sinc = t == 0.0f ? 1.0f : std::sin((float) M_PI * t) / ((float) M_PI * t);
+  float r = t / MIP_KAISER_WIDTH;
+
+  return sinc * besselI0(MIP_KAISER_ALPHA * std::sqrt(1.0f - r * r)) / besselI0(MIP_KAISER_ALPHA);
+
+}
+
+/// Source range and normalized weights of one output pixel along one axis.
+struct filter_taps_t {
+
+  int first;
+  std::vector<float> weights;
+
+};
+
+static std::vector<filter_taps_t> computeTaps(uint32_t size, uint32_t dstSize) {
+
+  std::vector<filter_taps_t> taps(dstSize);
+  float scale = (float) size / dstSize;
+  float radius = MIP_KAISER_WIDTH * scale;
+
+  for (uint32_t i = 0; i < dstSize; ++i) {
+
+    float center = (i + 0.5f) * scale;
+    int first = (int) std::floor(center - radius);
+    int last = (int) std::ceil(center + radius);
+
+    std::vector<float> weights(last - first + 1);
+    float sum = 0;
+
+    for (int j = first; j <= last; ++j) {
+      weights[j - first] = kaiserFilter((j + 0.5f - center) / scale);
+      sum += weights[j - first];
+    }
+
+    for (float & w : weights)
+      w /= sum;
+
+    taps[i].first = first;
+    taps[i].weights = weights;
+
+  }
+
+  return taps;
+
+}
+
+/**
+ * Separable Kaiser downsampling in float, the image is extended by clamping
+ * at its borders. Values are converted to linear light first for sRGB.
+ **/
+static void downsampleKaiser(const uint8_t * src, uint32_t width, uint32_t height, uint8_t * dst, uint32_t dstWidth, uint32_t dstHeight, bool srgb) {
+
+  const float * toLinear = srgbTables().toLinear;
+
+  bool parallel = !JobSystem::inWorker();
+
+  std::vector<float> values((size_t) width * height * 4);
+
+  #pragma omp parallel for schedule(static) if(parallel)
+  for (int y = 0; y < (int) height; ++y) {
+
+    const uint8_t * in = src + (size_t) y * width * 4;
+    float * out = values.data() + (size_t) y * width * 4;
+
+    for (uint32_t x = 0; x < width; ++x) {
+      for (unsigned int c = 0; c < 3; ++c)
+        out[x * 4 + c] = srgb ? toLinear[in[x * 4 + c]] : in[x * 4 + c] / 255.0f;
+      out[x * 4 + 3] = in[x * 4 + 3] / 255.0f;
+    }
+
+  }
+
+  std::vector<filter_taps_t> columnTaps = computeTaps(width, dstWidth);
+  std::vector<filter_taps_t> rowTaps = computeTaps(height, dstHeight);
+
+  /// Horizontal pass, every source row is reduced to dstWidth pixels.
+  std::vector<float> rows((size_t) height * dstWidth * 4);
+
+  #pragma omp parallel for schedule(static) if(parallel)
+  for (int y = 0; y < (int) height; ++y) {
+
+    const float * in = values.data() + (size_t) y * width * 4;
+    float * out = rows.data() + (size_t) y * dstWidth * 4;
+
+    for (uint32_t x = 0; x < dstWidth; ++x) {
+
+      const filter_taps_t & taps = columnTaps[x];
+      float sum[4] = {0, 0, 0, 0};
+
+      for (unsigned int k = 0; k < taps.weights.size(); ++k) {
+
+        const float * pixel = in + std::min(std::max(taps.first + (int) k, 0), (int) width - 1) * 4;
+        float w = taps.weights[k];
+
+        #pragma omp simd
+        for (unsigned int c = 0; c < 4; ++c)
+          sum[c] += w * pixel[c];
+
+      }
+
+      memcpy(out + x * 4, sum, sizeof(sum));
+
+    }
+
+  }
+
+  /// Vertical pass over whole rows, every thread reuses one row of sums.
+  #pragma omp parallel if(parallel)
+  {
+
+    std::vector<float> sum((size_t) dstWidth * 4);
+    float * acc = sum.data();
+
+    #pragma omp for schedule(static)
+    for (int y = 0; y < (int) dstHeight; ++y) {
+
+      const filter_taps_t & taps = rowTaps[y];
+      std::fill(sum.begin(), sum.end(), 0.0f);
+
+      for (unsigned int k = 0; k < taps.weights.size(); ++k) {
+
+        const float * in = rows.data() + (size_t) std::min(std::max(taps.first + (int) k, 0), (int) height - 1) * dstWidth * 4;
+        float w = taps.weights[k];
+
+        #pragma omp simd
+        for (uint32_t i = 0; i < dstWidth * 4; ++i)
+          acc[i] += w * in[i];
+
+      }
+
+      uint8_t * out = dst + (size_t) y * dstWidth * 4;
+
+      for (uint32_t x = 0; x < dstWidth; ++x) {
+        for (unsigned int c = 0; c < 3; ++c)
+          out[x * 4 + c] = encodeValue(acc[x * 4 + c], srgb);
+        out[x * 4 + 3] = encodeValue(acc[x * 4 + 3], false);
+      }
+
+    }
+
+  }
+
+}
+
+MipChain mipGenerateChain(const uint8_t * rgba, uint32_t width, uint32_t height, uint32_t layerCount, mip_filter filter, mip_color_space colorSpace) {
+
+  MipChain chain;
+  chain.layerCount = layerCount;
+
+  uint32_t levelCount = mipLevelCount(width, height);
+  chain.levels.resize(levelCount);
+
+  size_t size = 0;
+
+  for (uint32_t i = 0; i < levelCount; ++i) {
+
+    mip_level_t & level = chain.levels[i];
+    level.offset = size;
+    level.width = std::max(width >> i, (uint32_t) 1);
+    level.height = std::max(height >> i, (uint32_t) 1);
+
+    size += (size_t) level.width * level.height * 4 * layerCount;
+
+  }
+
+  chain.data.resize(size);
+  memcpy(chain.data.data(), rgba, (size_t) width * height * 4 * layerCount);
+
+  bool srgb = colorSpace == MIP_COLOR_SPACE_SRGB;
+
+  for (uint32_t i = 1; i < levelCount; ++i) {
+
+    const mip_level_t & src = chain.levels[i - 1];
+    const mip_level_t & dst = chain.levels[i];
+
+    size_t srcLayerSize = (size_t) src.width * src.height * 4;
+    size_t dstLayerSize = (size_t) dst.width * dst.height * 4;
+
+    for (uint32_t layer = 0; layer < layerCount; ++layer) {
+
+      const uint8_t * in = chain.data.data() + src.offset + srcLayerSize * layer;
+      uint8_t * out = chain.data.data() + dst.offset + dstLayerSize * layer;
+
+      if (filter == MIP_FILTER_KAISER)
+        downsampleKaiser(in, src.width, src.height, out, dst.width, dst.height, srgb);
+      else
+        downsampleBox(in, src.width, src.height, out, dst.width, dst.height, srgb);
+
+    }
+
+  }
+
+  return chain;
+
+}
@@ -0,0 +1,64 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Box averages 2x2 pixels and is fast enough to run for every texture at
+ * load time, Kaiser is a windowed sinc that keeps small mips sharper and is
+ * meant for offline baking.
+ **/
+enum mip_filter {
+
+  MIP_FILTER_BOX,
+  MIP_FILTER_KAISER,
+
+};
+
+/**
+ * Color textures are filtered in linear light, their RGB values are
+ * converted from and back to sRGB. Alpha and data textures like normal maps
+ * are always filtered as they are.
+ **/
+enum mip_color_space {
+
+  MIP_COLOR_SPACE_LINEAR,
+  MIP_COLOR_SPACE_SRGB,
+
+};
+
+/**
+ * One level of a mip chain, offset is the position of its first layer.
+ **/
+struct mip_level_t {
+
+  size_t offset;
+  uint32_t width;
+  uint32_t height;
+
+};
+
+/**
+ * Mip chain of an RGBA image in one buffer. Each level holds all of its
+ * layers back to back, so every level can be copied to an image with a
+ * single region.
+ **/
+struct MipChain {
+
+  std::vector<uint8_t> data;
+  std::vector<mip_level_t> levels;
+  uint32_t layerCount;
+
+};
+
+uint32_t mipLevelCount(uint32_t width, uint32_t height);
+
+/**
+ * Builds the full mip chain of layerCount width x height RGBA images stored
+ * one after another in rgba, level 0 is a copy of the images.
+ **/
+MipChain mipGenerateChain(const uint8_t * rgba, uint32_t width, uint32_t height, uint32_t layerCount = 1, mip_filter filter = MIP_FILTER_BOX, mip_color_space colorSpace = MIP_COLOR_SPACE_LINEAR);
+
+#endif // MIPMAP_H
@@ -7,76 +7,293 @@
 
 #include <zlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PNG_FILTER_SSE2
+#endif
+
 /**
- Structure for PNG IHDR section (3 bytes longer than in file due to padding)
+ Enum for usefull chunk types, all other will be ignored
 */
-typedef struct png_hdr_t {
+enum png_chunk_types {
+
+    CHUNK_IHDR = 1380206665,
+    CHUNK_PLTE = 1163152464,
+    CHUNK_tRNS = 1397641844,
+    CHUNK_IDAT = 1413563465,
+    CHUNK_IEND = 1145980233,
 
-    uint32_t width;
-    uint32_t height;
-    uint8_t bitDepth;
-    uint8_t colorType;
-    uint8_t compression;
-    uint8_t filterMethod;
-    uint8_t interlace;
+};
+
+enum png_color_types {
+
+    PNG_COLOR_GRAY = 0,
+    PNG_COLOR_RGB = 2,
+    PNG_COLOR_PALETTE = 3,
+    PNG_COLOR_GRAY_ALPHA = 4,
+    PNG_COLOR_RGBA = 6,
+
+};
 
-} png_hdr_t;
+static const uint8_t pngSignature[8] = {0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a};
 
 /**
- Enum for usefull chunk types, all other will be ignored (except IHDR)
+ Start and step of the Adam7 passes in x and y.
 */
-enum png_chunk_types {
+static const uint8_t adam7Passes[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
 
-    CHUNK_IEND = 1145980233,
-    CHUNK_IDAT = 1413563465,
+static const uint8_t noInterlacePass[4] = {0, 0, 1, 1};
 
-};
+/// Space in front of each scanline, the filter byte is stored right before the row.
+#define PNG_ROW_PADDING 16
+
+/// Output size of a single inflate call, zlib is a lot slower when it only gets a few kilobytes.
+#define PNG_INFLATE_WINDOW (64 * 1024)
 
 /**
- Function for decompressing image data
+ Chunks are read either from a file or from memory, file data is read into buffer.
 */
+typedef struct png_source_t {
+
+    FILE * file;
+
+    const uint8_t * data;
+    size_t size;
+    size_t offset;
+
+    uint8_t * buffer;
+    size_t bufferSize;
+
+} png_source_t;
+
+typedef struct png_decoder_t {
+
+    png_image_info_t info;
+
+    uint32_t channels;
+    /// Distance to the corresponding byte of the previous pixel, used by the filters.
+    uint32_t bpp;
+
+    uint8_t palette[256 * 4];
+    uint32_t paletteSize;
+
+    uint16_t colorKey[3];
+    int hasColorKey;
+
+    z_stream stream;
+    int streamEnd;
+    uint8_t * window;
+
+    uint8_t * rowMemory;
+    uint8_t * row;
+    uint8_t * prior;
+    size_t rowBytes;
+    size_t rowFill;
+
+    uint32_t passCount;
+    uint32_t pass;
+    uint32_t passWidth;
+    uint32_t passHeight;
+    uint32_t passRow;
+
+    uint8_t * rgba;
+    size_t rowPitch;
+
+} png_decoder_t;
+
+static uint32_t readBE32(const uint8_t * data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+static uint16_t readBE16(const uint8_t * data) {
+    return ((uint16_t) data[0] << 8) | data[1];
+}
+
+static int pngReadBytes(png_source_t * src, size_t length, const uint8_t ** out) {
+
+    if (!src->file) {
+
+        if (length > src->size - src->offset)
+            return PNG_ERROR_TRUNCATED;
+
+        *out = src->data + src->offset;
+        src->offset += length;
 
-uint8_t * inflateData(uint8_t * compData, uint32_t dataSize, uint32_t outDataSize) {
+        return PNG_OK;
 
-    uint8_t * outData = malloc(outDataSize * sizeof(uint8_t));
+    }
+
+    if (length > src->bufferSize) {
+
+        uint8_t * buffer = realloc(src->buffer, length);
+        if (!buffer)
+            return PNG_ERROR_MEMORY;
+
+        src->buffer = buffer;
+        src->bufferSize = length;
+
+    }
+
+    if (fread(src->buffer, 1, length, src->file) != length)
+        return PNG_ERROR_TRUNCATED;
+
+    *out = src->buffer;
+
+    return PNG_OK;
+
+}
+
+static int pngSkipBytes(png_source_t * src, size_t length) {
+
+    if (!src->file) {
+
+        if (length > src->size - src->offset)
+            return PNG_ERROR_TRUNCATED;
+
+        src->offset += length;
+        return PNG_OK;
+
+    }
+
+    return fseek(src->file, length, SEEK_CUR) ? PNG_ERROR_TRUNCATED : PNG_OK;
+
+}
+
+static int pngReadChunkHeader(png_source_t * src, uint32_t * length, uint32_t * type) {
 
-    z_stream infstream;
-    infstream.zalloc = Z_NULL;
-    infstream.zfree = Z_NULL;
-    infstream.opaque = Z_NULL;
-    infstream.avail_in = dataSize;
-    infstream.next_in = compData;
-    infstream.avail_out = outDataSize;
-    infstream.next_out = outData;
+    const uint8_t * data;
+    int result = pngReadBytes(src, 8, &data);
+    if (result)
+        return result;
 
-    inflateInit(&infstream);
-    inflate(&infstream, Z_NO_FLUSH);
-    inflateEnd(&infstream);
+    *length = readBE32(data);
+    memcpy(type, data + 4, sizeof(uint32_t));
 
-    return outData;
+    return PNG_OK;
 
 }
 
-uint32_t getInflateIndex(unsigned int i, unsigned int j, unsigned int c, unsigned int chanelCount, unsigned int width) {
+/**
+ Reads the data of the current chunk and skips its CRC.
+*/
+static int pngReadChunkData(png_source_t * src, uint32_t length, const uint8_t ** data) {
+
+    int result = pngReadBytes(src, length, data);
+    if (result)
+        return result;
 
-    return (i * width + j) * chanelCount + c + i + 1;
+    return pngSkipBytes(src, sizeof(uint32_t));
 
 }
 
-uint32_t getImageIndex(unsigned int i, unsigned int j, unsigned int c, unsigned int chanelCount, unsigned int width) {
+static int pngIsValidFormat(uint8_t colorType, uint8_t bitDepth) {
 
-    return (i * width + j) * chanelCount + c;
+    switch (colorType) {
+
+        case PNG_COLOR_GRAY:
+            return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16;
+
+        case PNG_COLOR_PALETTE:
+            return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8;
+
+        case PNG_COLOR_RGB:
+        case PNG_COLOR_GRAY_ALPHA:
+        case PNG_COLOR_RGBA:
+            return bitDepth == 8 || bitDepth == 16;
+
+    }
+
+    return 0;
 
 }
 
-#define abs(x) ((x) >= 0 ? (x) : -(x))
+static int pngReadHeaderSource(png_source_t * src, png_image_info_t * info) {
+
+    const uint8_t * data;
+    int result = pngReadBytes(src, sizeof(pngSignature), &data);
+    if (result)
+        return result;
+
+    if (memcmp(data, pngSignature, sizeof(pngSignature)))
+        return PNG_ERROR_SIGNATURE;
+
+    uint32_t length, type;
+    if ((result = pngReadChunkHeader(src, &length, &type)))
+        return result;
+
+    if (type != CHUNK_IHDR || length != 13)
+        return PNG_ERROR_HEADER;
 
-int32_t paethPredict(int a, int b, int c) {
+    if ((result = pngReadChunkData(src, length, &data)))
+        return result;
 
-    int32_t p = a + b - c;
-    int32_t pa = abs(p - a);
-    int32_t pb = abs(p - b);
-    int32_t pc = abs(p - c);
+    info->width = readBE32(data);
+    info->height = readBE32(data + 4);
+    info->bitDepth = data[8];
+    info->colorType = data[9];
+    info->interlace = data[12];
+
+    /// Compression and filter method 0 are the only ones defined.
+    if (!info->width || !info->height || data[10] || data[11] || info->interlace > 1)
+        return PNG_ERROR_HEADER;
+
+    if (!pngIsValidFormat(info->colorType, info->bitDepth))
+        return PNG_ERROR_UNSUPPORTED;
+
+    return PNG_OK;
+
+}
+
+/**
+ Scanline filters, all of them are undone in place on row with the already
+ decoded prior row, which is all zero for the first row of a pass.
+*/
+
+static void unfilterSub(uint8_t * row, size_t length, uint32_t bpp) {
+
+    for (size_t i = bpp; i < length; ++i)
+        row[i] += row[i - bpp];
+
+}
+
+static void unfilterUp(uint8_t * row, const uint8_t * prior, size_t length) {
+
+    size_t i = 0;
+
+#ifdef PNG_FILTER_SSE2
+    for (; i + 16 <= length; i += 16) {
+
+        __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prior + i));
+        _mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(x, b));
+
+    }
+#endif
+
+    for (; i < length; ++i)
+        row[i] += prior[i];
+
+}
+
+static void unfilterAverage(uint8_t * row, const uint8_t * prior, size_t length, uint32_t bpp) {
+
+    for (size_t i = 0; i < bpp && i < length; ++i)
+        row[i] += prior[i] >> 1;
+
+    for (size_t i = bpp; i < length; ++i)
+        row[i] += (row[i - bpp] + prior[i]) >> 1;
+
+}
+
+static uint8_t paethPredict(int a, int b, int c) {
+
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
 
     if (pa <= pb && pa <= pc) return a;
     else if (pb <= pc) return b;
@@ -84,271 +301,627 @@ int32_t paethPredict(int a, int b, int c) {
 
 }
 
-uint8_t applyFilters(uint8_t filter, uint8_t * imageData, uint8_t * infData, unsigned int i, unsigned int j, unsigned int c, unsigned int chanelCount, unsigned int width) {
+static void unfilterPaeth(uint8_t * row, const uint8_t * prior, size_t length, uint32_t bpp) {
+
+    for (size_t i = 0; i < bpp && i < length; ++i)
+        row[i] += prior[i];
+
+    for (size_t i = bpp; i < length; ++i)
+        row[i] += paethPredict(row[i - bpp], prior[i], prior[i - bpp]);
+
+}
+
+#ifdef PNG_FILTER_SSE2
+
+/**
+ Sub, Average and Paeth depend on the pixel to the left, so the SSE2 versions
+ work on one whole 3 or 4 byte pixel at a time instead of single bytes.
+*/
+
+static inline __m128i loadPixel(const uint8_t * data, uint32_t bpp) {
+
+    uint32_t value = 0;
+    memcpy(&value, data, bpp);
+    return _mm_cvtsi32_si128(value);
+
+}
+
+static inline void storePixel(uint8_t * data, __m128i pixel, uint32_t bpp) {
+
+    uint32_t value = _mm_cvtsi128_si32(pixel);
+    memcpy(data, &value, bpp);
+
+}
+
+static void unfilterSubSSE2(uint8_t * row, size_t length, uint32_t bpp) {
+
+    __m128i a = _mm_setzero_si128();
+
+    for (size_t i = 0; i + bpp <= length; i += bpp) {
+
+        a = _mm_add_epi8(a, loadPixel(row + i, bpp));
+        storePixel(row + i, a, bpp);
+
+    }
+
+}
+
+static void unfilterAverageSSE2(uint8_t * row, const uint8_t * prior, size_t length, uint32_t bpp) {
+
+    __m128i a = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi8(1);
+
+    for (size_t i = 0; i + bpp <= length; i += bpp) {
+
+        __m128i b = loadPixel(prior + i, bpp);
+
+        /// _mm_avg_epu8 rounds up, the filter rounds down.
+        __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+
+        a = _mm_add_epi8(loadPixel(row + i, bpp), average);
+        storePixel(row + i, a, bpp);
+
+    }
+
+}
+
+static inline __m128i abs16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i select16(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void unfilterPaethSSE2(uint8_t * row, const uint8_t * prior, size_t length, uint32_t bpp) {
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for (size_t i = 0; i + bpp <= length; i += bpp) {
+
+        __m128i b = _mm_unpacklo_epi8(loadPixel(prior + i, bpp), zero);
+
+        /// With p = a + b - c the distances are |b - c|, |a - c| and |a + b - 2c|.
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = abs16(_mm_add_epi16(pa, pb));
+        pa = abs16(pa);
+        pb = abs16(pb);
+
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i nearest = select16(_mm_cmpeq_epi16(smallest, pa), a, select16(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+        __m128i x = _mm_add_epi8(loadPixel(row + i, bpp), _mm_packus_epi16(nearest, nearest));
+        storePixel(row + i, x, bpp);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+
+    }
+
+}
+
+#endif
 
-    uint8_t val = infData[getInflateIndex(i, j, c, chanelCount, width)];
+static int unfilterRow(uint8_t filter, uint8_t * row, const uint8_t * prior, size_t length, uint32_t bpp) {
+
+#ifdef PNG_FILTER_SSE2
+    int vector = bpp == 3 || bpp == 4;
+#endif
 
     switch (filter) {
 
         case 0:
-            return val;
+            return PNG_OK;
 
         case 1:
-            if (j >= 1)
-                return imageData[getImageIndex(i, j-1, c, chanelCount, width)] + val;
-            else
-                return val;
+#ifdef PNG_FILTER_SSE2
+            if (vector) {
+                unfilterSubSSE2(row, length, bpp);
+                return PNG_OK;
+            }
+#endif
+            unfilterSub(row, length, bpp);
+            return PNG_OK;
 
         case 2:
-            return imageData[getImageIndex(i - 1, j, c, chanelCount, width)] + val;
+            unfilterUp(row, prior, length);
+            return PNG_OK;
 
         case 3:
-            if (j >= 1)
-                return val + (imageData[getImageIndex(i - 1, j, c, chanelCount, width)] + imageData[getImageIndex(i, j - 1, c, chanelCount, width)]) / 2;
-            else
-                return val + (imageData[getImageIndex(i - 1, j, c, chanelCount, width)]) / 2;
+#ifdef PNG_FILTER_SSE2
+            if (vector) {
+                unfilterAverageSSE2(row, prior, length, bpp);
+                return PNG_OK;
+            }
+#endif
+            unfilterAverage(row, prior, length, bpp);
+            return PNG_OK;
 
         case 4:
-            if (j >= 1)
-                return ((uint32_t) val + paethPredict(imageData[getImageIndex(i, j-1, c, chanelCount, width)],
-                                                 imageData[getImageIndex(i-1, j, c, chanelCount, width)],
-                                                 imageData[getImageIndex(i-1, j-1, c, chanelCount, width)])) % 256;
-            else
-                return ((uint32_t) val + paethPredict(0, imageData[getImageIndex(i-1, j, c, chanelCount, width)], 0)) % 256;
+#ifdef PNG_FILTER_SSE2
+            if (vector) {
+                unfilterPaethSSE2(row, prior, length, bpp);
+                return PNG_OK;
+            }
+#endif
+            unfilterPaeth(row, prior, length, bpp);
+            return PNG_OK;
 
     }
 
-    return val;
+    return PNG_ERROR_FILTER;
 
 }
 
-uint8_t * pngLoadImageData(FILE * file, uint32_t * width, uint32_t * height, uint32_t * cCount) {
+static uint32_t readSample(const uint8_t * row, size_t index, uint32_t bitDepth) {
+
+    switch (bitDepth) {
 
-    uint64_t hdr;
-    fread(&hdr, sizeof(uint64_t), 1, file);
+        case 8:
+            return row[index];
+
+        case 16:
+            return readBE16(row + index * 2);
 
-    if (hdr != 0x0a1a0a0d474e5089) {
-        fprintf(stderr, "No PNG Header found!\n");
-        return NULL;
     }
 
-    uint32_t hdrLength;
-    fread(&hdrLength, sizeof(uint32_t), 1, file);
-    hdrLength = __builtin_bswap32(hdrLength);
+    size_t bit = index * bitDepth;
+    return (row[bit >> 3] >> (8 - bitDepth - (bit & 7))) & ((1 << bitDepth) - 1);
 
-    uint32_t hdrType;
-    fread(&hdrType, sizeof(uint32_t), 1, file);
+}
 
-    png_hdr_t header;
-    fread(&header, sizeof(png_hdr_t), 1, file);
-    fseek(file, -3, SEEK_CUR);
+/**
+ Expands the current row to RGBA and writes it to the pixels of its pass.
+*/
+static void pngEmitRow(png_decoder_t * dec) {
 
-    header.width = __builtin_bswap32(header.width);
-    header.height = __builtin_bswap32(header.height);
+    const uint8_t * pass = dec->info.interlace ? adam7Passes[dec->pass] : noInterlacePass;
+    const uint8_t * row = dec->row;
 
-    if (header.interlace != 0) {
-        return NULL;
-    }
+    uint8_t * out = dec->rgba + (size_t) (pass[1] + dec->passRow * pass[3]) * dec->rowPitch + (size_t) pass[0] * 4;
+    size_t step = (size_t) pass[2] * 4;
 
-    uint32_t crc;
-    fread(&crc, sizeof(uint32_t), 1, file);
+    uint32_t depth = dec->info.bitDepth;
+    uint32_t width = dec->passWidth;
 
-    uint32_t dataSize = 0;
-    uint32_t dataIndex = 0;
+    switch (dec->info.colorType) {
 
-    uint32_t chunkSize;
-    uint32_t chunkType;
+        case PNG_COLOR_GRAY: {
 
-    uint8_t * iData = NULL;
+            /// Scales 1, 2 and 4 bit samples to the full 8 bit range.
+            uint32_t scale = depth < 8 ? 255 / ((1 << depth) - 1) : 1;
 
-    while (1) {
+            for (uint32_t j = 0; j < width; ++j, out += step) {
+
+                uint32_t value = readSample(row, j, depth);
+                uint8_t gray = depth == 16 ? value >> 8 : value * scale;
 
-        fread(&chunkSize, sizeof(uint32_t), 1, file);
-        chunkSize = __builtin_bswap32(chunkSize);
-        fread(&chunkType, sizeof(uint32_t), 1, file);
+                out[0] = out[1] = out[2] = gray;
+                out[3] = dec->hasColorKey && value == dec->colorKey[0] ? 0 : 255;
+
+            }
 
-        if (chunkType == CHUNK_IEND) {
             break;
-        } else if (chunkType == CHUNK_IDAT) {
 
-            /// Load idat data
+        }
+
+        case PNG_COLOR_RGB:
+
+            if (depth == 8) {
+
+                for (uint32_t j = 0; j < width; ++j, row += 3, out += step) {
+
+                    out[0] = row[0];
+                    out[1] = row[1];
+                    out[2] = row[2];
+                    out[3] = dec->hasColorKey && row[0] == dec->colorKey[0] && row[1] == dec->colorKey[1] && row[2] == dec->colorKey[2] ? 0 : 255;
+
+                }
 
-            if (!iData) {
-                iData = (uint8_t *) malloc(sizeof(uint8_t) * chunkSize);
             } else {
-                iData = realloc(iData, (dataSize + chunkSize) * sizeof(uint8_t));
+
+                for (uint32_t j = 0; j < width; ++j, row += 6, out += step) {
+
+                    out[0] = row[0];
+                    out[1] = row[2];
+                    out[2] = row[4];
+                    out[3] = dec->hasColorKey && readBE16(row) == dec->colorKey[0] && readBE16(row + 2) == dec->colorKey[1] && readBE16(row + 4) == dec->colorKey[2] ? 0 : 255;
+
+                }
+
             }
 
-            fread(iData + dataIndex, sizeof(uint8_t), chunkSize, file);
+            break;
+
+        case PNG_COLOR_PALETTE:
+
+            for (uint32_t j = 0; j < width; ++j, out += step)
+                memcpy(out, dec->palette + readSample(row, j, depth) * 4, 4);
+
+            break;
 
-            dataIndex += chunkSize;
-            dataSize += chunkSize;
+        case PNG_COLOR_GRAY_ALPHA: {
 
+            uint32_t size = depth / 4;
 
-        } else {
+            for (uint32_t j = 0; j < width; ++j, row += size, out += step) {
 
-            fseek(file, chunkSize, SEEK_CUR);
+                out[0] = out[1] = out[2] = row[0];
+                out[3] = row[size / 2];
+
+            }
+
+            break;
 
         }
 
-        fread(&crc, sizeof(uint32_t), 1, file);
+        case PNG_COLOR_RGBA:
 
-    }
+            if (depth == 8 && step == 4) {
 
-    uint32_t chanelCount = 3;
-    if (header.colorType == 6) chanelCount = 4;
-    uint32_t outDataSize = (header.bitDepth / 8) * chanelCount * (header.width+1) * header.height;
-    uint8_t * inflatedData = inflateData(iData, dataSize, outDataSize);
+                memcpy(out, row, (size_t) width * 4);
 
-    *height = header.height;
-    *width  = header.width;
-    *cCount = chanelCount;
+            } else {
+
+                uint32_t size = depth / 2;
+                uint32_t sampleSize = depth / 8;
 
-    free(iData);
+                for (uint32_t j = 0; j < width; ++j, row += size, out += step) {
 
-    uint8_t * imageData = (uint8_t *) malloc(chanelCount * header.width * header.height * sizeof(uint8_t));
-    for (unsigned int i = 0; i < header.height; ++i) {
-        uint8_t filterType = inflatedData[(i * header.width) * chanelCount + i];
-        for (unsigned int j = 0; j < header.width; ++j) {
-            for (unsigned int c = 0; c < chanelCount; ++c) {
+                    out[0] = row[0];
+                    out[1] = row[sampleSize];
+                    out[2] = row[sampleSize * 2];
+                    out[3] = row[sampleSize * 3];
 
-                imageData[(i * header.width + j) * chanelCount + c] = applyFilters(filterType, imageData, inflatedData, i, j, c, chanelCount, header.width);
+                }
 
             }
-        }
+
+            break;
+
     }
 
-    free(inflatedData);
+}
+
+/**
+ Moves to the next pass that contains any pixels, interlaced images can have empty passes.
+*/
+static void pngStartPass(png_decoder_t * dec) {
+
+    for (; dec->pass < dec->passCount; ++dec->pass) {
+
+        const uint8_t * pass = dec->info.interlace ? adam7Passes[dec->pass] : noInterlacePass;
 
-    return imageData;
+        dec->passWidth = dec->info.width > pass[0] ? (dec->info.width - pass[0] + pass[2] - 1) / pass[2] : 0;
+        dec->passHeight = dec->info.height > pass[1] ? (dec->info.height - pass[1] + pass[3] - 1) / pass[3] : 0;
+
+        if (dec->passWidth && dec->passHeight)
+            break;
+
+    }
+
+    dec->passRow = 0;
+    dec->rowFill = 0;
+    dec->rowBytes = ((size_t) dec->passWidth * dec->channels * dec->info.bitDepth + 7) / 8;
+
+    memset(dec->prior, 0, dec->rowBytes);
 
 }
 
-uint8_t * pngLoadImageDataMemory(uint8_t * file, uint32_t * width, uint32_t * height, uint32_t * cCount) {
+static int pngFinishRow(png_decoder_t * dec) {
+
+    int result = unfilterRow(dec->row[-1], dec->row, dec->prior, dec->rowBytes, dec->bpp);
+    if (result)
+        return result;
 
-    uint32_t fOffset = 0;
+    pngEmitRow(dec);
 
-    uint64_t hdr;
-    //fread(&hdr, sizeof(uint64_t), 1, file);
-    hdr = *((uint64_t *) (file + fOffset));
-    fOffset += sizeof(uint64_t);
+    uint8_t * tmp = dec->prior;
+    dec->prior = dec->row;
+    dec->row = tmp;
 
-    if (hdr != 0x0a1a0a0d474e5089) {
-        fprintf(stderr, "No PNG Header found!\n");
-        return NULL;
+    dec->rowFill = 0;
+
+    if (++dec->passRow == dec->passHeight) {
+        dec->pass++;
+        pngStartPass(dec);
     }
 
-    uint32_t hdrLength;
-    //fread(&hdrLength, sizeof(uint32_t), 1, file);
-    hdrLength = *((uint32_t *) (file + fOffset));
-    fOffset += sizeof(uint32_t);
-    hdrLength = __builtin_bswap32(hdrLength);
+    return PNG_OK;
+
+}
+
+/**
+ Inflates the data of one IDAT chunk into a small window, from which the
+ scanlines are collected. Every complete row is unfiltered and written out
+ right away, so the whole image is never held in memory uncompressed.
+*/
+static int pngDecodeData(png_decoder_t * dec, const uint8_t * data, uint32_t length) {
+
+    dec->stream.next_in = (Bytef *) data;
+    dec->stream.avail_in = length;
+
+    /// zlib can still hold output after all input is consumed, if the window was filled.
+    int windowFull = 0;
+
+    while ((dec->stream.avail_in || windowFull) && !dec->streamEnd && dec->pass < dec->passCount) {
+
+        dec->stream.next_out = dec->window;
+        dec->stream.avail_out = PNG_INFLATE_WINDOW;
+
+        int ret = inflate(&dec->stream, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return PNG_ERROR_INFLATE;
+
+        windowFull = !dec->stream.avail_out;
+
+        const uint8_t * out = dec->window;
+        size_t produced = PNG_INFLATE_WINDOW - dec->stream.avail_out;
+
+        while (produced && dec->pass < dec->passCount) {
+
+            size_t size = dec->rowBytes + 1 - dec->rowFill;
+            if (size > produced)
+                size = produced;
+
+            memcpy(dec->row - 1 + dec->rowFill, out, size);
+
+            dec->rowFill += size;
+            out += size;
+            produced -= size;
+
+            if (dec->rowFill == dec->rowBytes + 1) {
+                int result = pngFinishRow(dec);
+                if (result)
+                    return result;
+            }
+
+        }
 
-    uint32_t hdrType;
-    //fread(&hdrType, sizeof(uint32_t), 1, file);
-    hdrType = *((uint32_t *) (file + fOffset));
-    fOffset += sizeof(uint32_t);
+        if (ret == Z_STREAM_END)
+            dec->streamEnd = 1;
+        else if (ret == Z_BUF_ERROR)
+            break;
 
-    if (!hdrType) {
-        return NULL;
     }
 
-    png_hdr_t header;
-    //fread(&header, sizeof(png_hdr_t), 1, file);
-    //fseek(file, -3, SEEK_CUR);
-    header = *((png_hdr_t *) (file + fOffset));
-    fOffset += hdrLength;
+    return PNG_OK;
+
+}
+
+static int pngReadPalette(png_decoder_t * dec, const uint8_t * data, uint32_t length) {
+
+    if (length % 3 || length > 256 * 3)
+        return PNG_ERROR_PALETTE;
 
-    header.width = __builtin_bswap32(header.width);
-    header.height = __builtin_bswap32(header.height);
+    dec->paletteSize = length / 3;
+
+    for (uint32_t i = 0; i < dec->paletteSize; ++i) {
+
+        dec->palette[i * 4] = data[i * 3];
+        dec->palette[i * 4 + 1] = data[i * 3 + 1];
+        dec->palette[i * 4 + 2] = data[i * 3 + 2];
 
-    if (header.interlace != 0) {
-        printf("Header Interlace = %d\n", header.interlace);
-        return NULL;
     }
 
-    //uint32_t crc;
-    //fread(&crc, sizeof(uint32_t), 1, file);
-    //crc = *((uint32_t *) file + fOffset);
-    fOffset += sizeof(uint32_t);
+    return PNG_OK;
 
-    uint32_t dataSize = 0;
-    uint32_t dataIndex = 0;
+}
 
-    uint32_t chunkSize;
-    uint32_t chunkType;
+static int pngReadTransparency(png_decoder_t * dec, const uint8_t * data, uint32_t length) {
 
-    uint8_t * iData = NULL;
+    switch (dec->info.colorType) {
 
-    while (1) {
+        case PNG_COLOR_PALETTE:
+
+            if (length > dec->paletteSize)
+                return PNG_ERROR_PALETTE;
 
-        //fread(&chunkSize, sizeof(uint32_t), 1, file);
-        chunkSize = *((uint32_t *) (file + fOffset));
-        fOffset += sizeof(uint32_t);
-        chunkSize = __builtin_bswap32(chunkSize);
-        //fread(&chunkType, sizeof(uint32_t), 1, file);
-        chunkType = *((uint32_t *) (file + fOffset));
-        fOffset += sizeof(uint32_t);
+            for (uint32_t i = 0; i < length; ++i)
+                dec->palette[i * 4 + 3] = data[i];
 
-        if (chunkType == CHUNK_IEND) {
             break;
-        } else if (chunkType == CHUNK_IDAT) {
 
-            /// Load idat data
+        case PNG_COLOR_GRAY:
 
-            if (!iData) {
-                iData = (uint8_t *) malloc(sizeof(uint8_t) * chunkSize);
-            } else {
-                iData = realloc(iData, (dataSize + chunkSize) * sizeof(uint8_t));
-            }
+            if (length < 2)
+                return PNG_ERROR_TRUNCATED;
+
+            dec->colorKey[0] = readBE16(data);
+            dec->hasColorKey = 1;
+
+            break;
+
+        case PNG_COLOR_RGB:
+
+            if (length < 6)
+                return PNG_ERROR_TRUNCATED;
+
+            for (unsigned int c = 0; c < 3; ++c)
+                dec->colorKey[c] = readBE16(data + c * 2);
+            dec->hasColorKey = 1;
+
+            break;
+
+    }
+
+    return PNG_OK;
+
+}
+
+static int pngDecodeChunks(png_source_t * src, png_decoder_t * dec) {
+
+    int result;
+
+    while (1) {
 
-            //fread(iData + dataIndex, sizeof(uint8_t), chunkSize, file);
-            memcpy(iData + dataIndex, file + fOffset, sizeof(uint8_t) * chunkSize);
-            fOffset += sizeof(uint8_t) * chunkSize;
+        uint32_t length, type;
+        const uint8_t * data;
 
-            dataIndex += chunkSize;
-            dataSize += chunkSize;
+        if ((result = pngReadChunkHeader(src, &length, &type)))
+            return result;
 
+        switch (type) {
 
-        } else {
+            case CHUNK_PLTE:
+                if ((result = pngReadChunkData(src, length, &data)) || (result = pngReadPalette(dec, data, length)))
+                    return result;
+                break;
 
-            //fseek(file, chunkSize, SEEK_CUR);
-            fOffset += chunkSize;
+            case CHUNK_tRNS:
+                if ((result = pngReadChunkData(src, length, &data)) || (result = pngReadTransparency(dec, data, length)))
+                    return result;
+                break;
+
+            case CHUNK_IDAT:
+                if (dec->info.colorType == PNG_COLOR_PALETTE && !dec->paletteSize)
+                    return PNG_ERROR_PALETTE;
+                if ((result = pngReadChunkData(src, length, &data)) || (result = pngDecodeData(dec, data, length)))
+                    return result;
+                break;
+
+            case CHUNK_IEND:
+                return dec->pass < dec->passCount ? PNG_ERROR_TRUNCATED : PNG_OK;
+
+            default:
+                if ((result = pngSkipBytes(src, (size_t) length + sizeof(uint32_t))))
+                    return result;
+                break;
 
         }
 
-        //fread(&crc, sizeof(uint32_t), 1, file);
-        //crc = *((uint32_t *) (file + fOffset));
-        fOffset += sizeof(uint32_t);
+    }
+
+}
+
+static int pngDecodeSource(png_source_t * src, const png_image_info_t * info, uint8_t * rgba, size_t rowPitch) {
+
+    if (rowPitch < (size_t) info->width * 4)
+        return PNG_ERROR_HEADER;
+
+    png_decoder_t dec;
+    memset(&dec, 0, sizeof(png_decoder_t));
 
+    dec.info = *info;
+    dec.rgba = rgba;
+    dec.rowPitch = rowPitch;
+    dec.passCount = info->interlace ? 7 : 1;
+
+    switch (info->colorType) {
+        case PNG_COLOR_GRAY: dec.channels = 1; break;
+        case PNG_COLOR_RGB: dec.channels = 3; break;
+        case PNG_COLOR_PALETTE: dec.channels = 1; break;
+        case PNG_COLOR_GRAY_ALPHA: dec.channels = 2; break;
+        case PNG_COLOR_RGBA: dec.channels = 4; break;
     }
 
-    uint32_t chanelCount = 3;
-    if (header.colorType == 6) chanelCount = 4;
-    uint32_t outDataSize = (header.bitDepth / 8) * chanelCount * (header.width+1) * header.height;
-    uint8_t * inflatedData = inflateData(iData, dataSize, outDataSize);
+    dec.bpp = (dec.channels * info->bitDepth + 7) / 8;
 
-    *height = header.height;
-    *width  = header.width;
-    *cCount = chanelCount;
+    /// Missing palette entries are opaque black.
+    for (unsigned int i = 0; i < 256; ++i)
+        dec.palette[i * 4 + 3] = 255;
 
-    free(iData);
+    size_t maxRowBytes = ((size_t) info->width * dec.channels * info->bitDepth + 7) / 8;
 
-    uint8_t * imageData = (uint8_t *) malloc(chanelCount * header.width * header.height * sizeof(uint8_t));
-    for (unsigned int i = 0; i < header.height; ++i) {
-        uint8_t filterType = inflatedData[(i * header.width) * chanelCount + i];
-        for (unsigned int j = 0; j < header.width; ++j) {
-            for (unsigned int c = 0; c < chanelCount; ++c) {
+    dec.rowMemory = malloc(2 * (maxRowBytes + PNG_ROW_PADDING) + PNG_INFLATE_WINDOW);
+    if (!dec.rowMemory)
+        return PNG_ERROR_MEMORY;
 
-                imageData[(i * header.width + j) * chanelCount + c] = applyFilters(filterType, imageData, inflatedData, i, j, c, chanelCount, header.width);
+    dec.row = dec.rowMemory + PNG_ROW_PADDING;
+    dec.prior = dec.row + maxRowBytes + PNG_ROW_PADDING;
+    dec.window = dec.prior + maxRowBytes;
 
-            }
-        }
+    if (inflateInit(&dec.stream) != Z_OK) {
+        free(dec.rowMemory);
+        return PNG_ERROR_MEMORY;
     }
 
-    free(inflatedData);
+    pngStartPass(&dec);
+
+    int result = pngDecodeChunks(src, &dec);
+
+    inflateEnd(&dec.stream);
+    free(dec.rowMemory);
+
+    return result;
+
+}
+
+int pngReadHeader(FILE * file, png_image_info_t * info) {
+
+    png_source_t src;
+    memset(&src, 0, sizeof(png_source_t));
+    src.file = file;
+
+    int result = pngReadHeaderSource(&src, info);
+
+    free(src.buffer);
+
+    return result;
+
+}
+
+int pngDecodeRGBA(FILE * file, const png_image_info_t * info, uint8_t * rgba, size_t rowPitch) {
+
+    png_source_t src;
+    memset(&src, 0, sizeof(png_source_t));
+    src.file = file;
+
+    int result = pngDecodeSource(&src, info, rgba, rowPitch);
+
+    free(src.buffer);
 
-    return imageData;
+    return result;
 
 }
 
+int pngReadHeaderMemory(const uint8_t * data, size_t size, png_image_info_t * info) {
+
+    png_source_t src;
+    memset(&src, 0, sizeof(png_source_t));
+    src.data = data;
+    src.size = size;
+
+    return pngReadHeaderSource(&src, info);
+
+}
+
+int pngDecodeRGBAMemory(const uint8_t * data, size_t size, uint8_t * rgba, size_t rowPitch) {
+
+    png_source_t src;
+    memset(&src, 0, sizeof(png_source_t));
+    src.data = data;
+    src.size = size;
+
+    png_image_info_t info;
+    int result = pngReadHeaderSource(&src, &info);
+    if (result)
+        return result;
+
+    return pngDecodeSource(&src, &info, rgba, rowPitch);
+
+}
+
+const char * pngGetErrorString(int result) {
+
+    switch (result) {
+
+        case PNG_OK: return "no error";
+        case PNG_ERROR_SIGNATURE: return "no PNG signature";
+        case PNG_ERROR_TRUNCATED: return "file is truncated";
+        case PNG_ERROR_HEADER: return "invalid header";
+        case PNG_ERROR_UNSUPPORTED: return "unsupported color type or bit depth";
+        case PNG_ERROR_PALETTE: return "invalid palette";
+        case PNG_ERROR_INFLATE: return "corrupt image data";
+        case PNG_ERROR_FILTER: return "invalid scanline filter";
+        case PNG_ERROR_MEMORY: return "out of memory";
+
+    }
+
+    return "unknown error";
+
+}
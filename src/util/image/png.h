@@ -2,20 +2,67 @@
 #define PNG_H_INCLUDED
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
+
+/**
+ Result codes of the PNG functions, PNG_OK is zero and all errors are negative.
+*/
+enum png_result {
+
+    PNG_OK = 0,
+    PNG_ERROR_SIGNATURE = -1,
+    PNG_ERROR_TRUNCATED = -2,
+    PNG_ERROR_HEADER = -3,
+    PNG_ERROR_UNSUPPORTED = -4,
+    PNG_ERROR_PALETTE = -5,
+    PNG_ERROR_INFLATE = -6,
+    PNG_ERROR_FILTER = -7,
+    PNG_ERROR_MEMORY = -8,
+
+};
+
+/**
+ Image properties from the IHDR chunk.
+*/
+typedef struct png_image_info_t {
+
+    uint32_t width;
+    uint32_t height;
+    uint8_t bitDepth;
+    uint8_t colorType;
+    uint8_t interlace;
+
+} png_image_info_t;
+
+/**
+ Reads the signature and IHDR chunk, leaves the file at the chunk after it.
+*/
+int pngReadHeader(FILE * file, png_image_info_t * info);
+
 /**
- Load PNG image data from file, still very experimental.
+ Decodes the rest of a file opened with pngReadHeader. The image is written as
+ 8 bit RGBA rows of rowPitch bytes into rgba, which has to hold height rows.
+ All color types, bit depths and Adam7 interlacing are supported, 16 bit
+ samples are reduced to their high byte.
 */
-uint8_t * pngLoadImageData(FILE * file, uint32_t * width, uint32_t * height, uint32_t * chanelCount);
+int pngDecodeRGBA(FILE * file, const png_image_info_t * info, uint8_t * rgba, size_t rowPitch);
 
 /**
- Load PNG image from memory buffer.
+ Same as pngReadHeader for a PNG file of size bytes in memory.
 */
-uint8_t * pngLoadImageDataMemory(uint8_t * file, uint32_t * width, uint32_t * height, uint32_t * chanelCount);
+int pngReadHeaderMemory(const uint8_t * data, size_t size, png_image_info_t * info);
+
+/**
+ Same as pngDecodeRGBA for a PNG file of size bytes in memory.
+*/
+int pngDecodeRGBAMemory(const uint8_t * data, size_t size, uint8_t * rgba, size_t rowPitch);
+
+const char * pngGetErrorString(int result);
 
 #ifdef __cplusplus
 }
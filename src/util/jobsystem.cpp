@@ -0,0 +1,170 @@
+#include "jobsystem.h"
+
+#include <algorithm>
+
+#include "util/debug/logger.h"
+
+/// The pool and index of the worker running on this thread.
+static thread_local JobSystem * currentSystem = nullptr;
+static thread_local unsigned int currentIndex = 0;
+
+JobSystem::JobSystem(unsigned int threadCount) {
+
+  if (!threadCount)
+    threadCount = 1;
+
+  this->queuedJobs = 0;
+  this->running = true;
+  this->nextWorker = 0;
+  this->stolenJobs = 0;
+
+  for (unsigned int i = 0; i < threadCount; ++i)
+    workers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+  for (unsigned int i = 0; i < threadCount; ++i)
+    threads.push_back(std::thread(&JobSystem::workerLoop, this, i));
+
+}
+
+JobSystem::~JobSystem() {
+
+  stop();
+
+}
+
+void JobSystem::submit(Job job, unsigned int priority) {
+
+  unsigned int index;
+  if (currentSystem == this)
+    index = currentIndex;
+  else
+    index = nextWorker++ % workers.size();
+
+  {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    queuedJobs++;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(workers[index]->lock);
+    workers[index]->jobs[std::min(priority, (unsigned int) JOB_PRIORITY_LEVELS - 1)].push_back(job);
+  }
+
+  sleepVar.notify_one();
+
+}
+
+void JobSystem::stop() {
+
+  {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    running = false;
+  }
+
+  sleepVar.notify_all();
+
+  for (std::thread & th : threads)
+    if (th.joinable())
+      th.join();
+
+}
+
+unsigned int JobSystem::getThreadCount() {
+  return workers.size();
+}
+
+uint64_t JobSystem::getStolenCount() {
+  return stolenJobs;
+}
+
+int JobSystem::getCurrentWorker() {
+  return currentSystem ? (int) currentIndex : -1;
+}
+
+bool JobSystem::inWorker() {
+  return getCurrentWorker() >= 0;
+}
+
+bool JobSystem::popJob(unsigned int index, Job & job) {
+
+  Worker & w = *workers[index];
+  std::lock_guard<std::mutex> guard(w.lock);
+
+  for (int p = JOB_PRIORITY_LEVELS - 1; p >= 0; --p) {
+
+    if (w.jobs[p].empty())
+      continue;
+
+    job = std::move(w.jobs[p].back());
+    w.jobs[p].pop_back();
+
+    return true;
+
+  }
+
+  return false;
+
+}
+
+bool JobSystem::stealJob(unsigned int index, Job & job) {
+
+  for (unsigned int i = 1; i < workers.size(); ++i) {
+
+    Worker & w = *workers[(index + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(w.lock);
+
+    for (int p = JOB_PRIORITY_LEVELS - 1; p >= 0; --p) {
+
+      if (w.jobs[p].empty())
+        continue;
+
+      job = std::move(w.jobs[p].front());
+      w.jobs[p].pop_front();
+
+      stolenJobs++;
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+void JobSystem::workerLoop(unsigned int index) {
+
+  currentSystem = this;
+  currentIndex = index;
+
+  while (true) {
+
+    Job job;
+
+    if (popJob(index, job) || stealJob(index, job)) {
+
+      queuedJobs--;
+
+      try {
+        job();
+      } catch (std::exception & e) {
+        lerr << "Exception in job: " << e.what() << std::endl;
+      }
+
+      continue;
+
+    }
+
+    std::unique_lock<std::mutex> guard(sleepLock);
+    sleepVar.wait(guard, [&] {return queuedJobs > 0 || !running;});
+
+    /// Jobs submitted by a running job go to the deque of its own worker, which is still running.
+    if (!running && queuedJobs <= 0)
+      break;
+
+  }
+
+  /// Wake the other workers, so they can see that all work is done.
+  sleepVar.notify_all();
+
+}
@@ -0,0 +1,71 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+/// Number of priority levels, higher priorities are clamped to the highest level.
+#define JOB_PRIORITY_LEVELS 8
+
+/**
+ * Work-stealing thread pool. Every worker owns a deque: jobs submitted by a
+ * worker go to its own deque and are run newest first, while idle workers
+ * steal the oldest jobs from the others. Jobs submitted by other threads are
+ * spread over the workers. Jobs of a higher priority are always taken first.
+ **/
+class JobSystem {
+
+public:
+
+  typedef std::function<void()> Job;
+
+  JobSystem(unsigned int threadCount);
+  virtual ~JobSystem();
+
+  void submit(Job job, unsigned int priority = 0);
+
+  /// Runs all queued jobs, including the ones they submit, and joins the workers.
+  void stop();
+
+  unsigned int getThreadCount();
+  uint64_t getStolenCount();
+
+  /// Index of the worker running the calling thread, -1 if it is no worker.
+  static int getCurrentWorker();
+  /// Jobs already run in parallel with each other, so code called from a worker should not start threads of its own.
+  static bool inWorker();
+
+private:
+
+  struct Worker {
+
+    std::mutex lock;
+    std::deque<Job> jobs[JOB_PRIORITY_LEVELS];
+
+  };
+
+  void workerLoop(unsigned int index);
+  bool popJob(unsigned int index, Job & job);
+  bool stealJob(unsigned int index, Job & job);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+
+  std::mutex sleepLock;
+  std::condition_variable sleepVar;
+  /// Counted before the job is pushed, so a worker never sleeps while a job is on its way.
+  std::atomic<int64_t> queuedJobs;
+  bool running;
+
+  std::atomic<unsigned int> nextWorker;
+  std::atomic<uint64_t> stolenJobs;
+
+};
+
+#endif // JOBSYSTEM_H
@@ -0,0 +1,57 @@
+#include "mappedfile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/debug/trace_exception.h"
+
+MappedFile::MappedFile(std::string fname) {
+
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw dbg::trace_exception(std::string("No such file: ").append(fname));
+
+  struct stat info;
+  if (fstat(fd, &info)) {
+    close(fd);
+    throw dbg::trace_exception(std::string("Unable to stat file: ").append(fname));
+  }
+
+  mappingSize = info.st_size;
+
+  if (!mappingSize) {
+    close(fd);
+    throw dbg::trace_exception(std::string("Unable to map empty file: ").append(fname));
+  }
+
+  void * ptr = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  /// The mapping keeps its own reference to the file.
+  close(fd);
+
+  if (ptr == MAP_FAILED)
+    throw dbg::trace_exception(std::string("Unable to map file: ").append(fname));
+
+  mapping = (uint8_t *) ptr;
+
+}
+
+MappedFile::~MappedFile() {
+
+  munmap(mapping, mappingSize);
+
+}
+
+const uint8_t * MappedFile::getData() {
+  return mapping;
+}
+
+size_t MappedFile::getSize() {
+  return mappingSize;
+}
+
+void MappedFile::adviseSequential() {
+  madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+}
@@ -0,0 +1,35 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Read-only memory mapping of a whole file. The mapping is released when
+ * the object is destroyed, so pointers into it must not outlive it.
+ **/
+class MappedFile {
+
+public:
+
+  MappedFile(std::string fname);
+  virtual ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile & operator=(const MappedFile &) = delete;
+
+  const uint8_t * getData();
+  size_t getSize();
+
+  /// Tells the kernel the file is read front to back once.
+  void adviseSequential();
+
+private:
+
+  uint8_t * mapping;
+  size_t mappingSize;
+
+};
+
+#endif // MAPPEDFILE_H
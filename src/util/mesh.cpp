@@ -1,458 +1,520 @@
 #include "mesh.h"
 
-#include <unordered_set>
+#include <algorithm>
+#include <limits>
 
 #include <ply.hpp>
 
 #include "meshhelper.h"
+#include "meshcache.h"
+#include "mesh/transformkernels.h"
 
 using namespace Math;
 
-Mesh::Mesh(std::vector<Model::Vertex> verts, std::vector<uint16_t> indices) : Resource("Mesh") {
-
-  this->verts = verts;
-  this->indices = std::vector<uint32_t>(indices.size());
-  for (unsigned int i = 0; i < indices.size(); ++i) {
-    this->indices[i] = indices[i];
-  }
-
+static const char * attributeNames[ATTRIBUTE_SLOT_COUNT] = {
+  "POSITION",
+  "NORMAL",
+  "TANGENT",
+  "TEXCOORD_0",
+  "COLOR_0",
+  "JOINTS_0",
+  "WEIGHTS_0",
+  "MATERIAL_INDEX"
+};
 
-  VertexAttribute positionAttr;
-  positionAttr.type = ATTRIBUTE_F32_VEC3;
-  positionAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+VertexAttributeSlot getAttributeSlot(const std::string & name) {
 
-  VertexAttribute normalAttr;
-  normalAttr.type = ATTRIBUTE_F32_VEC3;
-  normalAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+  for (int i = 0; i < ATTRIBUTE_SLOT_COUNT; ++i)
+    if (!name.compare(attributeNames[i]))
+      return (VertexAttributeSlot) i;
 
-  VertexAttribute uvAttr;
-  uvAttr.type = ATTRIBUTE_F32_VEC2;
-  uvAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+  return ATTRIBUTE_SLOT_INVALID;
 
-  VertexAttribute tangentAttr;
-  tangentAttr.type = ATTRIBUTE_F32_VEC3;
-  tangentAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
-
-  VertexAttribute matAttr;
-  matAttr.type = ATTRIBUTE_I32_SCALAR;
-  matAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+}
 
-  for (unsigned int i = 0; i < verts.size(); ++i) {
+const char * getAttributeName(VertexAttributeSlot slot) {
 
-    float tmp[3] = {verts[i].pos.x, verts[i].pos.y, verts[i].pos.z};
-    positionAttr.value[i].vec3 = Vector<3, float>(tmp);
+  if (slot < 0 || slot >= ATTRIBUTE_SLOT_COUNT)
+    throw dbg::trace_exception("Invalid attribute slot");
 
-    tmp[0] = verts[i].normal.x;
-    tmp[1] = verts[i].normal.y;
-    tmp[2] = verts[i].normal.z;
-    normalAttr.value[i].vec3 = Vector<3, float>(tmp);
+  return attributeNames[slot];
 
-    tmp[0] = verts[i].tangent.x;
-    tmp[1] = verts[i].tangent.y;
-    tmp[2] = verts[i].tangent.z;
-    tangentAttr.value[i].vec3 = Vector<3, float>(tmp);
+}
 
-    tmp[0] = verts[i].uv.x;
-    tmp[1] = verts[i].uv.y;
-    uvAttr.value[i].vec2 = Vector<2, float>(tmp);
+VertexAttribute::VertexAttribute() {
 
-    matAttr.value[i].i32 = verts[i].matIndex;
+  this->type = ATTRIBUTE_NONE;
+  this->count = 0;
 
-  }
+}
 
-  this->attributes["POSITION"] = positionAttr;
-  this->attributes["NORMAL"] = normalAttr;
-  this->attributes["TEXCOORD_0"] = uvAttr;
-  this->attributes["TANGENT"] = tangentAttr;
-  this->attributes["MATERIAL_INDEX"] = matAttr;
+VertexAttribute::VertexAttribute(VertexAttributeType type, size_t count) : data(getAttributeSize(type) * count) {
 
-  for (auto it : attributes) {
+  this->type = type;
+  this->count = count;
 
-    lout << it.first << " -> " << it.second.type << std::endl;
+}
 
-  }
+bool VertexAttribute::empty() const {
+  return !count || type == ATTRIBUTE_NONE;
+}
 
+size_t VertexAttribute::getElementSize() const {
+  return getAttributeSize(type);
 }
 
-const VertexAttributeType Mesh::getAttributeType(std::string name) {
+static VertexAttributeSet attributesFromVerts(const std::vector<Model::Vertex> & verts) {
 
-  if (this->attributes.find(name) == this->attributes.end())
-    throw dbg::trace_exception("No such attribute");
+  VertexAttributeSet attributes;
 
-  return attributes[name].type;
+  VertexAttribute positionAttr(ATTRIBUTE_F32_VEC3, verts.size());
+  VertexAttribute normalAttr(ATTRIBUTE_F32_VEC3, verts.size());
+  VertexAttribute uvAttr(ATTRIBUTE_F32_VEC2, verts.size());
+  VertexAttribute tangentAttr(ATTRIBUTE_F32_VEC3, verts.size());
+  VertexAttribute matAttr(ATTRIBUTE_I32_SCALAR, verts.size());
 
-}
+  float * pos = positionAttr.as<float>();
+  float * normal = normalAttr.as<float>();
+  float * uv = uvAttr.as<float>();
+  float * tangent = tangentAttr.as<float>();
+  int32_t * mat = matAttr.as<int32_t>();
 
-Mesh::Mesh(std::unordered_map<std::string, VertexAttribute> attributes, std::vector<uint16_t> indices) : Resource("Mesh") {
+  for (size_t i = 0; i < verts.size(); ++i) {
 
-  this->attributes = attributes;
-  this->indices = std::vector<uint32_t>(indices.size());
-  for (unsigned int i = 0; i < indices.size(); ++i) {
-    this->indices[i] = indices[i];
-  }
+    pos[i*3]   = verts[i].pos.x;
+    pos[i*3+1] = verts[i].pos.y;
+    pos[i*3+2] = verts[i].pos.z;
 
-  if (this->attributes.find("MATERIAL_INDEX") == this->attributes.end()) {
+    normal[i*3]   = verts[i].normal.x;
+    normal[i*3+1] = verts[i].normal.y;
+    normal[i*3+2] = verts[i].normal.z;
 
-    VertexAttribute matAttr;
-    matAttr.type = ATTRIBUTE_I32_SCALAR;
-    matAttr.value = std::vector<VertexAttribute::VertexAttributeData>(this->attributes["POSITION"].value.size());
+    tangent[i*3]   = verts[i].tangent.x;
+    tangent[i*3+1] = verts[i].tangent.y;
+    tangent[i*3+2] = verts[i].tangent.z;
 
-    for (unsigned int i = 0; i < this->attributes["POSITION"].value.size(); ++i) {
-      matAttr.value[i].i32 = 0;
-    }
+    uv[i*2]   = verts[i].uv.x;
+    uv[i*2+1] = verts[i].uv.y;
 
-    this->attributes["MATERIAL_INDEX"] = matAttr;
+    mat[i] = verts[i].matIndex;
 
   }
 
-  if (this->attributes.find("TANGENT") == this->attributes.end()) {
-
-    computeTangents();
+  attributes[ATTRIBUTE_SLOT_POSITION] = std::move(positionAttr);
+  attributes[ATTRIBUTE_SLOT_NORMAL] = std::move(normalAttr);
+  attributes[ATTRIBUTE_SLOT_TEXCOORD_0] = std::move(uvAttr);
+  attributes[ATTRIBUTE_SLOT_TANGENT] = std::move(tangentAttr);
+  attributes[ATTRIBUTE_SLOT_MATERIAL_INDEX] = std::move(matAttr);
 
-  }
+  return attributes;
 
 }
 
-Mesh::Mesh(std::vector<Model::Vertex> verts, std::vector<uint32_t> indices) : Resource("Mesh") {
+Mesh::Mesh(std::vector<Model::Vertex> verts, std::vector<uint16_t> indices) : Resource("Mesh") {
 
-  this->verts = verts;
-  this->indices = indices;
+  this->attributes = attributesFromVerts(verts);
+  this->indices = std::vector<uint32_t>(indices.begin(), indices.end());
 
+}
+
+Mesh::Mesh(VertexAttributeSet attributes, std::vector<uint16_t> indices) : Resource("Mesh") {
 
-  VertexAttribute positionAttr;
-  positionAttr.type = ATTRIBUTE_F32_VEC3;
-  positionAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+  this->attributes = std::move(attributes);
+  this->indices = std::vector<uint32_t>(indices.begin(), indices.end());
 
-  VertexAttribute normalAttr;
-  normalAttr.type = ATTRIBUTE_F32_VEC3;
-  normalAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+  addDefaultAttributes();
 
-  VertexAttribute uvAttr;
-  uvAttr.type = ATTRIBUTE_F32_VEC2;
-  uvAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+}
 
-  VertexAttribute tangentAttr;
-  tangentAttr.type = ATTRIBUTE_F32_VEC3;
-  tangentAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+Mesh::Mesh(std::vector<Model::Vertex> verts, std::vector<uint32_t> indices) : Resource("Mesh") {
 
-  VertexAttribute matAttr;
-  matAttr.type = ATTRIBUTE_I32_SCALAR;
-  matAttr.value = std::vector<VertexAttribute::VertexAttributeData>(verts.size());
+  this->attributes = attributesFromVerts(verts);
+  this->indices = std::move(indices);
 
-  for (unsigned int i = 0; i < verts.size(); ++i) {
+}
 
-    float tmp[3] = {verts[i].pos.x, verts[i].pos.y, verts[i].pos.z};
-    positionAttr.value[i].vec3 = Vector<3, float>(tmp);
+Mesh::Mesh(VertexAttributeSet attributes, std::vector<uint32_t> indices) : Resource("Mesh") {
 
-    tmp[0] = verts[i].normal.x;
-    tmp[1] = verts[i].normal.y;
-    tmp[2] = verts[i].normal.z;
-    normalAttr.value[i].vec3 = Vector<3, float>(tmp);
+  this->attributes = std::move(attributes);
+  this->indices = std::move(indices);
 
-    tmp[0] = verts[i].tangent.x;
-    tmp[1] = verts[i].tangent.y;
-    tmp[2] = verts[i].tangent.z;
-    tangentAttr.value[i].vec3 = Vector<3, float>(tmp);
+  addDefaultAttributes();
 
-    tmp[0] = verts[i].uv.x;
-    tmp[1] = verts[i].uv.y;
-    uvAttr.value[i].vec2 = Vector<2, float>(tmp);
+}
 
-    matAttr.value[i].i32 = verts[i].matIndex;
+Mesh::Mesh(std::string cacheKey, Source source) : Resource("Mesh") {
 
-  }
+  this->cacheKey = cacheKey;
+  this->source = source;
 
-  this->attributes["POSITION"] = positionAttr;
-  this->attributes["NORMAL"] = normalAttr;
-  this->attributes["TEXCOORD_0"] = uvAttr;
-  this->attributes["TANGENT"] = tangentAttr;
-  this->attributes["MATERIAL_INDEX"] = matAttr;
+}
 
-  for (auto it : attributes) {
+Mesh::~Mesh() {
 
-    lout << it.first << " -> " << it.second.type << std::endl;
 
-  }
 
 }
 
-Mesh::Mesh(std::unordered_map<std::string, VertexAttribute> attributes, std::vector<uint32_t> indices) : Resource("Mesh") {
+void Mesh::addDefaultAttributes() {
 
-  this->attributes = attributes;
-  this->indices = indices;
+  if (attributes[ATTRIBUTE_SLOT_POSITION].empty())
+    throw dbg::trace_exception("Mesh has no positions");
 
-  if (this->attributes.find("MATERIAL_INDEX") == this->attributes.end()) {
+  if (attributes[ATTRIBUTE_SLOT_MATERIAL_INDEX].empty())
+    setMaterialIndex(0);
 
-    VertexAttribute matAttr;
-    matAttr.type = ATTRIBUTE_I32_SCALAR;
-    matAttr.value = std::vector<VertexAttribute::VertexAttributeData>(this->attributes["POSITION"].value.size());
-
-    for (unsigned int i = 0; i < this->attributes["POSITION"].value.size(); ++i) {
-      matAttr.value[i].i32 = 0;
-    }
+  if (attributes[ATTRIBUTE_SLOT_TANGENT].empty())
+    computeTangents();
 
-    this->attributes["MATERIAL_INDEX"] = matAttr;
+}
 
-  }
+std::shared_ptr<Mesh> Mesh::resolve(std::shared_ptr<Mesh> mesh) {
 
-  if (this->attributes.find("TANGENT") == this->attributes.end()) {
+  if (!mesh || !mesh->source)
+    return mesh;
 
-    computeTangents();
+  std::lock_guard<std::mutex> guard(mesh->resolveLock);
 
+  if (!mesh->resolved) {
+    lout << "Decoding deferred mesh " << mesh->getLocation() << std::endl;
+    mesh->resolved = mesh->source();
   }
 
-}
+  return mesh->resolved;
 
-Mesh::~Mesh() {
+}
 
+bool Mesh::isDeferred() {
+  return (bool) source;
+}
 
+std::string Mesh::getCacheKey() {
+  return cacheKey;
+}
 
+void Mesh::setCacheKey(std::string key) {
+  this->cacheKey = key;
 }
 
 void Mesh::computeTangents() {
 
-  std::vector<Model::Vertex> verts = getVerts();
-  MeshHelper::computeTangents(verts, indices);
-
-  VertexAttribute tangentAttr;
-  tangentAttr.type = ATTRIBUTE_F32_VEC3;
-  tangentAttr.value = std::vector<VertexAttribute::VertexAttributeData>(this->attributes["POSITION"].value.size());
+  const VertexAttribute & positions = attributes[ATTRIBUTE_SLOT_POSITION];
+  const VertexAttribute & normals = attributes[ATTRIBUTE_SLOT_NORMAL];
+  const VertexAttribute & uvs = attributes[ATTRIBUTE_SLOT_TEXCOORD_0];
 
-  for (unsigned int i = 0; i < this->attributes["POSITION"].value.size(); ++i) {
+  bool hasNormals = normals.type == ATTRIBUTE_F32_VEC3 && normals.count == positions.count;
+  bool hasUVs = uvs.type == ATTRIBUTE_F32_VEC2 && uvs.count == positions.count;
 
-    float tmp[3] = {verts[i].tangent.x, verts[i].tangent.y, verts[i].tangent.z};
+  VertexAttribute tangentAttr(ATTRIBUTE_F32_VEC4, positions.count);
 
-    tangentAttr.value[i].vec3 = Vector<3, float>(tmp);
-  }
+  MeshHelper::computeTangents(positions.as<float>(), hasUVs ? uvs.as<float>() : nullptr, hasNormals ? normals.as<float>() : nullptr,
+			      positions.count, indices.data(), indices.size(), tangentAttr.as<float>());
 
-  this->attributes["TANGENT"] = tangentAttr;
+  attributes[ATTRIBUTE_SLOT_TANGENT] = std::move(tangentAttr);
 
 }
 
-unsigned int Mesh::getVertexCount() {
+static bool withinEpsilon(const float * a, const float * b, unsigned int dim, float epsilon) {
+
+  float d = 0;
+  for (unsigned int k = 0; k < dim; ++k)
+    d += (a[k] - b[k]) * (a[k] - b[k]);
 
-  return this->attributes["POSITION"].value.size();
+  return d <= epsilon * epsilon;
 
 }
 
-std::vector<Model::Vertex> Mesh::getVerts() {
+size_t Mesh::weld(float epsilon, bool matchNormals, bool matchUVs) {
 
-  std::vector<Model::Vertex> verts(this->attributes["POSITION"].value.size());
+  const VertexAttribute & positions = attributes[ATTRIBUTE_SLOT_POSITION];
+  const VertexAttribute & normals = attributes[ATTRIBUTE_SLOT_NORMAL];
+  const VertexAttribute & uvs = attributes[ATTRIBUTE_SLOT_TEXCOORD_0];
 
-  bool hasTangents = attributes.find("TANGENT") != attributes.end();
+  size_t vertexCount = positions.count;
 
-  for (unsigned int i = 0; i < this->attributes["POSITION"].value.size(); ++i) {
+  matchNormals = matchNormals && normals.type == ATTRIBUTE_F32_VEC3;
+  matchUVs = matchUVs && uvs.type == ATTRIBUTE_F32_VEC2;
 
-    verts[i].pos = glm::vec3(attributes["POSITION"].value[i].vec3[0], attributes["POSITION"].value[i].vec3[1], attributes["POSITION"].value[i].vec3[2]);
-    verts[i].normal = glm::vec3(attributes["NORMAL"].value[i].vec3[0], attributes["NORMAL"].value[i].vec3[1], attributes["NORMAL"].value[i].vec3[2]);
-    if (hasTangents)
-      verts[i].tangent = glm::vec3(attributes["TANGENT"].value[i].vec3[0], attributes["TANGENT"].value[i].vec3[1], attributes["TANGENT"].value[i].vec3[2]);
-    verts[i].uv = glm::vec2(attributes["TEXCOORD_0"].value[i].vec2[0], attributes["TEXCOORD_0"].value[i].vec2[1]);
-    verts[i].matIndex = attributes["MATERIAL_INDEX"].value[i].i32;
+  const float * normalData = normals.as<float>();
+  const float * uvData = uvs.as<float>();
 
-  }
+  auto sameVertex = [&] (uint32_t a, uint32_t b) {
 
-  if (!hasTangents)
-    MeshHelper::computeTangents(verts, indices);
+    if (matchNormals && !withinEpsilon(normalData + a * 3, normalData + b * 3, 3, epsilon))
+      return false;
 
-  return verts;
+    if (matchUVs && !withinEpsilon(uvData + a * 2, uvData + b * 2, 2, epsilon))
+      return false;
 
-}
+    for (int slot = ATTRIBUTE_SLOT_COLOR_0; slot < ATTRIBUTE_SLOT_COUNT; ++slot) {
 
-std::vector<uint32_t> & Mesh::getIndices() {
-  return indices;
-}
+      const VertexAttribute & attr = attributes[slot];
+      if (attr.empty())
+	continue;
 
-std::shared_ptr<Mesh> Mesh::withTransform(std::shared_ptr<Mesh> mesh, Math::Matrix<4,4,float> m) {
+      size_t size = attr.getElementSize();
+      if (memcmp(attr.data.data() + a * size, attr.data.data() + b * size, size))
+	return false;
 
-  using namespace Math;
-
-  //std::vector<Model::Vertex> newVerts;
-  std::unordered_map<std::string, VertexAttribute> newAttributes;
+    }
 
-  for (auto it : mesh->attributes) {
+    return true;
 
-    std::vector<VertexAttribute::VertexAttributeData> data(it.second.value.size());
-    for (unsigned int i = 0; i < it.second.value.size(); ++i) {
-      data[i] = it.second.value[i];
-    }
+  };
 
-    VertexAttribute attr;
-    attr.type = it.second.type;
-    attr.value = data;
+  std::vector<uint32_t> remap(vertexCount);
+  size_t uniqueCount = MeshHelper::weldVertices(positions.as<float>(), vertexCount, epsilon, remap.data(), sameVertex);
 
-    newAttributes[it.first] = attr;
+  if (uniqueCount == vertexCount)
+    return 0;
 
-  }
+  /// Kept vertices are numbered in order of appearance, so every attribute is compacted in place.
+  for (VertexAttribute & attr : attributes) {
 
-  for (unsigned int i = 0; i < mesh->attributes["POSITION"].value.size(); ++i) {
+    if (attr.empty())
+      continue;
 
-    Vector<3, float> pos = mesh->attributes["POSITION"].value[i].vec3;
+    size_t size = attr.getElementSize();
+    uint8_t * data = attr.data.data();
+    size_t kept = 0;
 
-    Vector<4, float> p(pos[0], pos[1], pos[2], 1);
-    Vector<4, float> n(mesh->attributes["NORMAL"].value[i].vec3);
+    for (size_t i = 0; i < vertexCount; ++i)
+      if (remap[i] == kept)
+	memmove(data + size * kept++, data + size * i, size);
 
-    Vector<4,float> p2 = m * p;
-    n = m * n;
+    attr.count = uniqueCount;
+    attr.data.resize(size * uniqueCount);
 
-    //Model::Vertex nVert;
+  }
 
-    //nVert.pos = glm::vec3(p[0] / p[3], p[1] / p[3], p[2] / p[3]);
-    newAttributes["POSITION"].value[i].vec3 = Vector<3, float>(p2) / p2[3];
-    newAttributes["NORMAL"].value[i].vec3 = Vector<3, float>(n);
+  size_t triangleCount = 0;
 
-    if (mesh->attributes.find("TANGENT") != mesh->attributes.end()) {
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
 
-      Vector<4, float> t(mesh->attributes["TANGENT"].value[i].vec3);
-      t = m * t;
-      newAttributes["TANGENT"].value[i].vec3 = Vector<3, float>(t);
+    uint32_t i0 = remap[indices[i]];
+    uint32_t i1 = remap[indices[i+1]];
+    uint32_t i2 = remap[indices[i+2]];
 
-    }
-    //nVert.normal = glm::vec3(n[0], n[1], n[2]);
-    //nVert.tangent = glm::vec3(t[0], t[1], t[2]);
-    //nVert.uv = v.uv;
-    //nVert.matIndex = v.matIndex;
+    if (i0 == i1 || i1 == i2 || i2 == i0)
+      continue;
 
-    //newVerts.push_back(nVert);
+    indices[triangleCount * 3] = i0;
+    indices[triangleCount * 3 + 1] = i1;
+    indices[triangleCount * 3 + 2] = i2;
+    triangleCount++;
 
   }
 
-  std::shared_ptr<Mesh> resMesh = std::shared_ptr<Mesh>(new Mesh(newAttributes, mesh->indices));
-  resMesh->setLocation(mesh->getLocation());
-  
-  return resMesh;
+  indices.resize(triangleCount * 3);
+
+  return vertexCount - uniqueCount;
 
 }
 
-void Mesh::setMaterialIndex(int32_t index) {
-  /*for (unsigned int i = 0; i < verts.size(); ++i) {
-    verts[i].matIndex = index;
-    }*/
+unsigned int Mesh::getVertexCount() {
 
-  if (attributes.find("MATERIAL_INDEX") == attributes.end()) {
+  return attributes[ATTRIBUTE_SLOT_POSITION].count;
 
-    VertexAttribute matAttr;
-    matAttr.type = ATTRIBUTE_I32_SCALAR;
-    matAttr.value = std::vector<VertexAttribute::VertexAttributeData>(attributes["POSITION"].value.size());
-    attributes["MATERIAL_INDEX"] = matAttr;
+}
 
-  }
+std::vector<Model::Vertex> Mesh::getVerts() {
 
-  for (unsigned int i = 0; i < attributes["MATERIAL_INDEX"].value.size(); ++i) {
+  const VertexAttribute & positionAttr = attributes[ATTRIBUTE_SLOT_POSITION];
+  const VertexAttribute & normalAttr = attributes[ATTRIBUTE_SLOT_NORMAL];
+  const VertexAttribute & tangentAttr = attributes[ATTRIBUTE_SLOT_TANGENT];
+  const VertexAttribute & uvAttr = attributes[ATTRIBUTE_SLOT_TEXCOORD_0];
+  const VertexAttribute & matAttr = attributes[ATTRIBUTE_SLOT_MATERIAL_INDEX];
 
-    attributes["MATERIAL_INDEX"].value[i].i32 = index;
+  std::vector<Model::Vertex> verts(positionAttr.count);
 
-  }
+  bool hasTangents = !tangentAttr.empty();
+  /// Tangents read from glTF or computed by computeTangents carry the handedness in a fourth component.
+  unsigned int tangentDim = tangentAttr.type & 0xf;
 
-}
+  const float * pos = positionAttr.as<float>();
+  const float * normal = normalAttr.as<float>();
+  const float * tangent = tangentAttr.as<float>();
+  const float * uv = uvAttr.as<float>();
+  const int32_t * mat = matAttr.as<int32_t>();
 
-std::shared_ptr<Mesh> operator*(Math::Matrix<4,4,float> m, std::shared_ptr<Mesh> mesh) {
+  for (size_t i = 0; i < verts.size(); ++i) {
+
+    verts[i].pos = glm::vec3(pos[i*3], pos[i*3+1], pos[i*3+2]);
+    verts[i].normal = glm::vec3(normal[i*3], normal[i*3+1], normal[i*3+2]);
+    if (hasTangents)
+      verts[i].tangent = glm::vec3(tangent[i*tangentDim], tangent[i*tangentDim+1], tangent[i*tangentDim+2]);
+    verts[i].uv = glm::vec2(uv[i*2], uv[i*2+1]);
+    verts[i].matIndex = mat ? mat[i] : 0;
+
+  }
 
-  return Mesh::withTransform(mesh, m);
+  return verts;
 
 }
 
-const VertexAttribute & Mesh::getAttribute(std::string name) {
+std::vector<uint32_t> & Mesh::getIndices() {
+  return indices;
+}
 
-  if (this->attributes.find(name) == this->attributes.end())
-    throw dbg::trace_exception("No such attribute");
+static void checkTransformable(const VertexAttribute & attr) {
 
-  return attributes[name];
+  if (attr.type != ATTRIBUTE_F32_VEC3 && attr.type != ATTRIBUTE_F32_VEC4)
+    throw dbg::trace_exception(std::string("Unable to transform vertex attribute of type ").append(std::to_string(attr.type)));
 
 }
 
-void insertFloatInBuffer(std::vector<VertexAttribute::VertexAttributeData> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+std::shared_ptr<Mesh> Mesh::withTransform(std::shared_ptr<Mesh> mesh, Math::Matrix<4,4,float> m) {
+
+  using namespace Math;
 
-  uint8_t * data = buffer.data();
+  /// Deferred meshes stay deferred, the transform is applied once they are decoded.
+  if (mesh->isDeferred()) {
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+    Source source = [mesh, m] () {
+      return Mesh::withTransform(Mesh::resolve(mesh), m);
+    };
 
-    *((float *) (data + (i * stride + offset))) = fData[i].f;
+    std::shared_ptr<Mesh> resMesh = std::make_shared<Mesh>(MeshCache::transformKey(mesh->cacheKey, m), source);
+    resMesh->setLocation(mesh->getLocation());
+
+    return resMesh;
 
   }
 
-}
+  /// Column major copy of the matrix, column i is the image of the i-th unit vector.
+  float matrix[16];
+  for (unsigned int i = 0; i < 4; ++i) {
+
+    float unit[4] = {0, 0, 0, 0};
+    unit[i] = 1;
 
-void insertIntInBuffer(std::vector<VertexAttribute::VertexAttributeData> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+    Vector<4, float> column = m * Vector<4, float>(unit);
+    for (unsigned int j = 0; j < 4; ++j)
+      matrix[i * 4 + j] = column[j];
 
-  uint8_t * data = buffer.data();
+  }
+
+  VertexAttribute & positions = mesh->attributes[ATTRIBUTE_SLOT_POSITION];
+  VertexAttribute & normals = mesh->attributes[ATTRIBUTE_SLOT_NORMAL];
+  VertexAttribute & tangents = mesh->attributes[ATTRIBUTE_SLOT_TANGENT];
+
+  if (positions.type != ATTRIBUTE_F32_VEC3)
+    throw dbg::trace_exception("Mesh positions have to be 3 component float vectors");
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+  if (!normals.empty())
+    checkTransformable(normals);
+  if (!tangents.empty())
+    checkTransformable(tangents);
 
-    *((int32_t *) (data + (i * stride + offset))) = fData[i].i32;
+  std::string key = MeshCache::transformKey(mesh->cacheKey, m);
 
+  /// Nobody else can see a mesh we hold the only reference to, so it is transformed in place.
+  std::shared_ptr<Mesh> resMesh;
+  if (mesh.use_count() == 1) {
+    resMesh = std::move(mesh);
+  } else {
+    resMesh = std::shared_ptr<Mesh>(new Mesh(mesh->attributes, mesh->indices));
+    resMesh->setLocation(mesh->getLocation());
   }
 
+  VertexAttributeSet & attributes = resMesh->attributes;
+
+  if (isAffineTransform(matrix))
+    transformPoints(matrix, attributes[ATTRIBUTE_SLOT_POSITION].as<float>(), positions.count);
+  else
+    transformPointsProjective(matrix, attributes[ATTRIBUTE_SLOT_POSITION].as<float>(), positions.count);
+
+  if (!normals.empty())
+    transformDirections(matrix, attributes[ATTRIBUTE_SLOT_NORMAL].as<float>(), normals.count, normals.type & 0xf);
+
+  if (!tangents.empty())
+    transformDirections(matrix, attributes[ATTRIBUTE_SLOT_TANGENT].as<float>(), tangents.count, tangents.type & 0xf);
+
+  resMesh->setCacheKey(key);
+  
+  return resMesh;
+
 }
 
-void insertVec2InBuffer(std::vector<VertexAttribute::VertexAttributeData> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+void Mesh::setMaterialIndex(int32_t index) {
 
-  uint8_t * data = buffer.data();
+  VertexAttribute & matAttr = attributes[ATTRIBUTE_SLOT_MATERIAL_INDEX];
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+  if (matAttr.type != ATTRIBUTE_I32_SCALAR || matAttr.count != getVertexCount())
+    matAttr = VertexAttribute(ATTRIBUTE_I32_SCALAR, getVertexCount());
 
-    *((float *) (data + (i * stride + offset))) = fData[i].vec2[0];
-    *((float *) (data + (i * stride + offset+1*sizeof(float)))) = fData[i].vec2[1];
+  int32_t * data = matAttr.as<int32_t>();
+  std::fill(data, data + matAttr.count, index);
 
-  }
+}
+
+std::shared_ptr<Mesh> operator*(Math::Matrix<4,4,float> m, std::shared_ptr<Mesh> mesh) {
+
+  return Mesh::withTransform(std::move(mesh), m);
 
 }
 
-void insertVec3InBuffer(std::vector<VertexAttribute::VertexAttributeData> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+bool Mesh::hasAttribute(VertexAttributeSlot slot) {
 
-  uint8_t * data = buffer.data();
+  return slot >= 0 && slot < ATTRIBUTE_SLOT_COUNT && !attributes[slot].empty();
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+}
 
-    *((float *) (data + (i * stride + offset)))   = fData[i].vec3[0];
-    *((float *) (data + (i * stride + offset+1*sizeof(float)))) = fData[i].vec3[1];
-    *((float *) (data + (i * stride + offset+2*sizeof(float)))) = fData[i].vec3[2];
+const VertexAttribute & Mesh::getAttribute(VertexAttributeSlot slot) {
 
-  }
+  if (!hasAttribute(slot))
+    throw dbg::trace_exception("No such attribute");
+
+  return attributes[slot];
 
 }
 
-void insertVec4InBuffer(std::vector<VertexAttribute::VertexAttributeData> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+const VertexAttribute & Mesh::getAttribute(std::string name) {
 
-  uint8_t * data = buffer.data();
+  return getAttribute(getAttributeSlot(name));
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+}
 
-    *((float *) (data + (i * stride + offset)))   = fData[i].vec4[0];
-    *((float *) (data + (i * stride + offset+1*sizeof(float)))) = fData[i].vec4[1];
-    *((float *) (data + (i * stride + offset+2*sizeof(float)))) = fData[i].vec4[2];
-    *((float *) (data + (i * stride + offset+3*sizeof(float)))) = fData[i].vec4[3];
+const VertexAttributeType Mesh::getAttributeType(std::string name) {
 
-  }
+  return getAttribute(getAttributeSlot(name)).type;
 
 }
 
-template <unsigned int dim, typename T> void insertVecInBuffer(std::vector<Vector<dim, T>> & fData, std::vector<uint8_t> & buffer, uint32_t offset, uint32_t stride) {
+void Mesh::setAttribute(VertexAttributeSlot slot, VertexAttribute value) {
+
+  if (slot < 0 || slot >= ATTRIBUTE_SLOT_COUNT)
+    throw dbg::trace_exception("Invalid attribute slot");
 
-  uint8_t * data = buffer.data();
+  this->attributes[slot] = std::move(value);
 
-  for (unsigned int i = 0; i < fData.size(); ++i) {
+}
 
-    for (unsigned int j = 0; j < dim; ++j)
-      *((T *) (data + (i * stride + offset+j*sizeof(T)))) = fData[i][j];
+void Mesh::setAttribute(std::string name, VertexAttribute value) {
 
-  }
+  VertexAttributeSlot slot = getAttributeSlot(name);
+  if (slot == ATTRIBUTE_SLOT_INVALID)
+    throw dbg::trace_exception(std::string("Unknown vertex attribute ").append(name));
+
+  setAttribute(slot, std::move(value));
 
 }
 
 std::vector<uint8_t> Mesh::getCompactIndices(uint32_t * indexSizeBytes, uint32_t * indexCount) {
 
-  uint64_t vertexCount = this->attributes["POSITION"].value.size();
+  uint64_t vertexCount = getVertexCount();
+
+  *indexCount = indices.size();
 
-  if (vertexCount <= std::numeric_limits<uint16_t>::max()) {
+  /// Primitive restart is disabled, so every 16 bit value is a valid index.
+  if (vertexCount <= (uint64_t) std::numeric_limits<uint16_t>::max() + 1) {
 
     *indexSizeBytes = sizeof(uint16_t);
-    *indexCount = indices.size();
-    
+
     std::vector<uint8_t> indexData(sizeof(uint16_t) * indices.size());
     uint16_t * data = (uint16_t *) indexData.data();
 
-    for (unsigned int i = 0; i < indices.size(); ++i) {
+    for (size_t i = 0; i < indices.size(); ++i) {
 
       data[i] = indices[i];
 
@@ -463,16 +525,9 @@ std::vector<uint8_t> Mesh::getCompactIndices(uint32_t * indexSizeBytes, uint32_t
   }
 
   *indexSizeBytes = sizeof(uint32_t);
-  *indexCount = indices.size();
-
-  std::vector<uint8_t> indexData((sizeof(uint32_t) / sizeof(uint8_t)) * indices.size());
-  uint32_t * data = (uint32_t *) indexData.data();
 
-  for (unsigned int i = 0; i < indices.size(); ++i) {
-
-    data[i] = indices[i];
-
-  }
+  std::vector<uint8_t> indexData(sizeof(uint32_t) * indices.size());
+  memcpy(indexData.data(), indices.data(), indexData.size());
 
   return indexData;
 
@@ -526,7 +581,8 @@ std::vector<InterleaveElement> Mesh::compactStorage(const std::vector<InputDescr
   for (const InputDescription & id : iData) {
 
     std::string name = id.attributeName;
-    VertexAttributeType type = this->attributes[name].type;
+    VertexAttributeSlot slot = getAttributeSlot(name);
+    VertexAttributeType type = hasAttribute(slot) ? attributes[slot].type : ATTRIBUTE_NONE;
 
     size_t s = getAttributeSize(type);
 
@@ -546,153 +602,89 @@ std::vector<InterleaveElement> Mesh::compactStorage(const std::vector<InputDescr
 
 }
 
+/// Copies count elements of size bytes from a packed array into every stride bytes of dst.
+template <size_t size> static void interleaveAttribute(const uint8_t * src, uint8_t * dst, size_t count, uint32_t stride) {
+
+  for (size_t i = 0; i < count; ++i)
+    memcpy(dst + i * stride, src + i * size, size);
+
+}
+
+static void interleaveAttribute(const uint8_t * src, uint8_t * dst, size_t count, uint32_t stride, size_t size) {
+
+  switch (size) {
+
+  case 4:
+    interleaveAttribute<4>(src, dst, count, stride);
+    break;
+
+  case 8:
+    interleaveAttribute<8>(src, dst, count, stride);
+    break;
+
+  case 12:
+    interleaveAttribute<12>(src, dst, count, stride);
+    break;
+
+  case 16:
+    interleaveAttribute<16>(src, dst, count, stride);
+    break;
+
+  default:
+    for (size_t i = 0; i < count; ++i)
+      memcpy(dst + i * stride, src + i * size, size);
+    break;
+
+  }
+
+}
+
 std::vector<uint8_t> Mesh::getInterleavedData(std::vector<InterleaveElement> elements, uint32_t stride) {
 
-  //lout << stride << " " << attributes["POSITION"].value.size() << std::endl;
-  if (!attributes["POSITION"].value.size()) {
+  size_t vertexCount = getVertexCount();
+
+  if (!vertexCount) {
     throw dbg::trace_exception("Creating mesh with no data");
   }
 
-  std::vector<uint8_t> data(stride * attributes["POSITION"].value.size());
+  std::vector<uint8_t> data(stride * vertexCount);
 
   for (InterleaveElement e : elements) {
 
-    if (e.offset >= stride) {
-      throw dbg::trace_exception("Offset >= stride, would override next vertex in buffer...");
-    }
+    VertexAttributeSlot slot = getAttributeSlot(e.attributeName);
 
-    if (attributes.find(e.attributeName) == attributes.end()) {
+    if (!hasAttribute(slot)) {
       throw dbg::trace_exception(std::string("No Such attribute name ").append(e.attributeName));
     }
 
-    VertexAttribute attr = attributes[e.attributeName];
-
-    //lout << "Writing to buffer: " << e.attributeName << " : " << e.offset << " type = " << std::hex << attr.type << std::dec << std::endl;
-
-    switch (attr.type) {
-
-    case ATTRIBUTE_F32_SCALAR:
-      insertFloatInBuffer(attr.value, data, e.offset, stride);
-      break;
-
-    case ATTRIBUTE_F32_VEC2:
-      {
-	std::vector<Vector<2,float>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].vec2;
-	}
-	insertVecInBuffer<2, float>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_F32_VEC3:
-      {
-	std::vector<Vector<3,float>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].vec3;
-	}
-	insertVecInBuffer<3, float>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_F32_VEC4:
-      {
-	std::vector<Vector<4,float>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].vec4;
-	}
-	insertVecInBuffer<4, float>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I32_SCALAR:
-      insertIntInBuffer(attr.value, data, e.offset, stride);
-      break;
-
-    case ATTRIBUTE_I32_VEC2:
-      {
-	std::vector<Vector<2,int32_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i32_vec2;
-	}
-	insertVecInBuffer<2, int32_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I32_VEC3:
-      {
-	std::vector<Vector<3,int32_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i32_vec3;
-	}
-	insertVecInBuffer<3, int32_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I32_VEC4:
-      {
-	std::vector<Vector<4,int32_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i32_vec4;
-	}
-	insertVecInBuffer<4, int32_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I16_VEC2:
-      {
-	std::vector<Vector<2,int16_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i16_vec2;
-	}
-	insertVecInBuffer<2, int16_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I16_VEC3:
-      {
-	std::vector<Vector<3,int16_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i16_vec3;
-	}
-	insertVecInBuffer<3, int16_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    case ATTRIBUTE_I16_VEC4:
-      {
-	std::vector<Vector<4,int16_t>> tmpData(attr.value.size());
-	for (unsigned int i = 0; i < attr.value.size(); ++i) {
-	  tmpData[i] = attr.value[i].i16_vec4;
-	}
-	insertVecInBuffer<4, int16_t>(tmpData, data, e.offset, stride);
-      }
-      break;
-
-    default:
-      throw dbg::trace_exception("Unknown attribute type");
+    const VertexAttribute & attr = attributes[slot];
+    size_t size = attr.getElementSize();
 
+    if (e.offset + size > stride) {
+      throw dbg::trace_exception("Offset >= stride, would override next vertex in buffer...");
     }
 
-  }
+    if (attr.count != vertexCount) {
+      throw dbg::trace_exception(std::string("Attribute ").append(e.attributeName).append(" does not match the vertex count"));
+    }
 
-  //lout << "dataSize: " << data.size() << " bytes" << std::endl;
+    interleaveAttribute(attr.data.data(), data.data() + e.offset, vertexCount, stride, size);
 
-  return data;
+  }
 
-}
+  return data;
 
-void Mesh::setAttribute(std::string name, VertexAttribute value) {
-  this->attributes[name] = value;
 }
 
 void Mesh::saveAsPLY(std::string fname) {
 
   FILE * f = fopen(fname.c_str(), "w");
 
+  size_t vertexCount = getVertexCount();
+
   fprintf(f, "ply\nformat ascii 1.0\n");
 
-  fprintf(f, "element vertex %ld\n", attributes["POSITION"].value.size());
+  fprintf(f, "element vertex %ld\n", vertexCount);
   fprintf(f, "property float x\n");
   fprintf(f, "property float y\n");
   fprintf(f, "property float z\n");
@@ -707,11 +699,15 @@ void Mesh::saveAsPLY(std::string fname) {
   fprintf(f, "element face %ld\n", indices.size()/3);
   fprintf(f, "property list uchar uint vertex_indices\nend_header\n");
 
-  for (unsigned int i = 0; i < attributes["POSITION"].value.size(); ++i) {
+  const float * pos = attributes[ATTRIBUTE_SLOT_POSITION].as<float>();
+  const float * normal = attributes[ATTRIBUTE_SLOT_NORMAL].as<float>();
+  const float * uv = attributes[ATTRIBUTE_SLOT_TEXCOORD_0].as<float>();
 
-    fprintf(f, "%f %f %f %f %f %f %f %f\n", attributes["POSITION"].value[i].vec3[0], attributes["POSITION"].value[i].vec3[1], attributes["POSITION"].value[i].vec3[2],
-	    attributes["NORMAL"].value[i].vec3[0], attributes["NORMAL"].value[i].vec3[1], attributes["NORMAL"].value[i].vec3[2],
-	    attributes["TEXCOORD_0"].value[i].vec2[0], attributes["TEXCOORD_0"].value[i].vec2[1]);
+  for (size_t i = 0; i < vertexCount; ++i) {
+
+    fprintf(f, "%f %f %f %f %f %f %f %f\n", pos[i*3], pos[i*3+1], pos[i*3+2],
+	    normal[i*3], normal[i*3+1], normal[i*3+2],
+	    uv[i*2], uv[i*2+1]);
 
   }
 
@@ -746,14 +742,22 @@ std::shared_ptr<Mesh> Mesh::loadFromFile(std::string fname) {
 
   }
 
-  std::vector<uint16_t> indices(indexCount);
+  std::vector<uint32_t> indices(indexCount);
 
   for (int i = 0; i < indexCount; ++i)
     indices[i] = indexData[i];
 
-  lout << "Loaded mesh has " << vertexCount << " vertices" << std::endl;;
+  std::shared_ptr<Mesh> mesh(new Mesh(vertices, indices));
+
+  /// PLY exporters tend to write every corner of a face as its own vertex.
+  size_t welded = mesh->weld(MESH_WELD_EPSILON);
+
+  /// The file has no tangents, so they are computed once the vertices are final.
+  mesh->computeTangents();
 
-  return std::shared_ptr<Mesh>(new Mesh(vertices, indices));
+  lout << "Loaded mesh has " << mesh->getVertexCount() << " vertices (" << welded << " welded)" << std::endl;
+
+  return mesh;
 
 }
 
@@ -765,64 +769,43 @@ std::shared_ptr<Mesh> Mesh::merge(std::shared_ptr<Mesh> m1, std::shared_ptr<Mesh
   if (!m1) return m2;
   if (!m2) return m1;
 
-  std::unordered_map<std::string, VertexAttribute> attributes;
-  std::unordered_set<std::string> attributeNames;
-  for (auto it : m1->attributes) {
-    attributeNames.insert(attributeNames.begin(), it.first);
-  }
+  m1 = resolve(m1);
+  m2 = resolve(m2);
 
-  for (auto it : m2->attributes) {
-    attributeNames.insert(attributeNames.begin(), it.first);
-  }
+  VertexAttributeSet attributes;
 
-  uint16_t m1Count;
+  uint32_t m1Count = m1->getVertexCount();
 
-  for (std::string name : attributeNames) {
+  for (int slot = 0; slot < ATTRIBUTE_SLOT_COUNT; ++slot) {
 
-    if (m1->attributes.find(name) == m1->attributes.end()) {
-      continue;
-    } else if (m2->attributes.find(name) == m2->attributes.end()) {
-      continue;
-    }
+    const VertexAttribute & a1 = m1->attributes[slot];
+    const VertexAttribute & a2 = m2->attributes[slot];
 
-    if (m1->attributes[name].type != m2->attributes[name].type) {
+    if (a1.empty() || a2.empty() || a1.type != a2.type)
       continue;
-    }
-
-    VertexAttribute attr;
-    attr.type = m1->attributes[name].type;
-    attr.value = std::vector<VertexAttribute::VertexAttributeData>(m1->attributes[name].value.size() + m2->attributes[name].value.size());
-
-    for (unsigned int i = 0; i < m1->attributes[name].value.size(); ++i) {
-
-      attr.value[i] = m1->attributes[name].value[i];
-
-    }
-
-    m1Count = m1->attributes[name].value.size();
-
-    for (unsigned int i = 0; i < m2->attributes[name].value.size(); ++i) {
 
-      attr.value[i + m1Count] = m2->attributes[name].value[i];
+    VertexAttribute attr(a1.type, a1.count + a2.count);
 
-    }
+    memcpy(attr.data.data(), a1.data.data(), a1.data.size());
+    memcpy(attr.data.data() + a1.data.size(), a2.data.data(), a2.data.size());
 
-    attributes[name] = attr;
+    attributes[slot] = std::move(attr);
 
   }
 
-  //std::vector<Model::Vertex> verts;
-  std::vector<uint16_t> indices;
+  std::vector<uint32_t> indices(m1->indices.size() + m2->indices.size());
 
-  for (uint16_t i : m1->indices) {
-    indices.push_back(i);
-  }
+  memcpy(indices.data(), m1->indices.data(), m1->indices.size() * sizeof(uint32_t));
 
-  for (uint16_t i : m2->indices) {
-    indices.push_back(i+m1Count);
-  }
+  uint32_t * dst = indices.data() + m1->indices.size();
+  const uint32_t * src = m2->indices.data();
+  size_t count = m2->indices.size();
 
-  return std::shared_ptr<Mesh>(new Mesh(attributes, indices));
+  #pragma omp simd
+  for (size_t i = 0; i < count; ++i)
+    dst[i] = src[i] + m1Count;
+
+  return std::shared_ptr<Mesh>(new Mesh(std::move(attributes), std::move(indices)));
 
 }
 
@@ -840,8 +823,32 @@ std::shared_ptr<Mesh> MeshUploader::uploadResource(vkutil::VulkanState & state,
 
 
 std::shared_ptr<ResourceUploader<Mesh>> MeshLoader::loadResource(std::string fname) {
-  std::shared_ptr<Mesh> mesh = Mesh::loadFromFile(fname);
+
+  std::string key;
+  {
+    MappedFile file(fname);
+    key = MeshCache::sourceKey(file.getData(), file.getSize());
+  }
+
+  std::shared_ptr<Mesh> mesh;
+
+  if (MeshCache::contains(key)) {
+
+    mesh = std::make_shared<Mesh>(key, [fname, key] () {
+      std::shared_ptr<Mesh> sourceMesh = Mesh::loadFromFile(fname);
+      sourceMesh->setCacheKey(key);
+      return sourceMesh;
+    });
+
+  } else {
+
+    mesh = Mesh::loadFromFile(fname);
+    mesh->setCacheKey(key);
+
+  }
+
   return std::shared_ptr<ResourceUploader<Mesh>>(new MeshUploader(mesh));
+
 }
 
 void Mesh::makeConsistentWithNormals() {
@@ -852,13 +859,13 @@ void Mesh::makeConsistentWithNormals() {
     unsigned int i1 = 3 * i + 1;
     unsigned int i2 = 3 * i + 2;
 
-    Vector<3, float> v0 = attributes["POSITION"].value[indices[i0]].vec3;
-    Vector<3, float> v1 = attributes["POSITION"].value[indices[i1]].vec3;
-    Vector<3, float> v2 = attributes["POSITION"].value[indices[i2]].vec3;
+    Vector<3, float> v0 = attributes[ATTRIBUTE_SLOT_POSITION].getVector<3>(indices[i0]);
+    Vector<3, float> v1 = attributes[ATTRIBUTE_SLOT_POSITION].getVector<3>(indices[i1]);
+    Vector<3, float> v2 = attributes[ATTRIBUTE_SLOT_POSITION].getVector<3>(indices[i2]);
 
-    Vector<3, float> n0 = attributes["NORMAL"].value[indices[i0]].vec3;
-    Vector<3, float> n1 = attributes["NORMAL"].value[indices[i1]].vec3;
-    Vector<3, float> n2 = attributes["NORMAL"].value[indices[i2]].vec3;
+    Vector<3, float> n0 = attributes[ATTRIBUTE_SLOT_NORMAL].getVector<3>(indices[i0]);
+    Vector<3, float> n1 = attributes[ATTRIBUTE_SLOT_NORMAL].getVector<3>(indices[i1]);
+    Vector<3, float> n2 = attributes[ATTRIBUTE_SLOT_NORMAL].getVector<3>(indices[i2]);
 
     Vector<3, float> faceNormal = (n0 + n1 + n2) / 3.0f;
 
@@ -4,6 +4,10 @@
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <array>
+#include <cstring>
 
 #include "render/model.h"
 #include <mathutils/matrix.h>
@@ -11,6 +15,9 @@
 #include "resources/resource.h"
 #include "resources/resourceuploader.h"
 
+/// Welding tolerance for meshes loaded from files, only merges vertices that are the same up to rounding.
+#define MESH_WELD_EPSILON 1e-6f
+
 typedef enum VertexAttributeType {
 
 				  ATTRIBUTE_NONE,
@@ -38,56 +45,79 @@ typedef enum VertexAttributeType {
 
 } VertexAttributeType ;
 
+/// Attributes a mesh can hold, named like the glTF attributes they are read from.
+typedef enum VertexAttributeSlot {
+
+				  ATTRIBUTE_SLOT_INVALID = -1,
+
+				  ATTRIBUTE_SLOT_POSITION,
+				  ATTRIBUTE_SLOT_NORMAL,
+				  ATTRIBUTE_SLOT_TANGENT,
+				  ATTRIBUTE_SLOT_TEXCOORD_0,
+				  ATTRIBUTE_SLOT_COLOR_0,
+				  ATTRIBUTE_SLOT_JOINTS_0,
+				  ATTRIBUTE_SLOT_WEIGHTS_0,
+				  ATTRIBUTE_SLOT_MATERIAL_INDEX,
+
+				  ATTRIBUTE_SLOT_COUNT
+
+} VertexAttributeSlot;
+
+VertexAttributeSlot getAttributeSlot(const std::string & name);
+const char * getAttributeName(VertexAttributeSlot slot);
+
+/// Size of one element in bytes, 0 for ATTRIBUTE_NONE.
+size_t getAttributeSize(VertexAttributeType type);
+
+/**
+ * Tightly packed array of one vertex attribute. Every element takes
+ * getAttributeSize(type) bytes, the components of all elements follow each
+ * other without padding.
+ **/
 class VertexAttribute {
 
 public:
 
-  union VertexAttributeData {
+  VertexAttribute();
+  VertexAttribute(VertexAttributeType type, size_t count);
 
-    float f;
-    Math::Vector<2, float> vec2;
-    Math::Vector<3, float> vec3;
-    Math::Vector<4, float> vec4;
+  VertexAttributeType type;
+  size_t count;
 
-    int8_t i8;
-    Math::Vector<2, int8_t> i8_vec2;
-    Math::Vector<3, int8_t> i8_vec3;
-    Math::Vector<4, int8_t> i8_vec4;
+  std::vector<uint8_t> data;
 
-    int8_t i16;
-    Math::Vector<2, int16_t> i16_vec2;
-    Math::Vector<3, int16_t> i16_vec3;
-    Math::Vector<4, int16_t> i16_vec4;
+  bool empty() const;
+  size_t getElementSize() const;
 
-    int32_t i32;
-    Math::Vector<2, int32_t> i32_vec2;
-    Math::Vector<3, int32_t> i32_vec3;
-    Math::Vector<4, int32_t> i32_vec4;
+  template <typename T> T * as() {
+    return (T *) data.data();
+  }
 
-    VertexAttributeData() {
-    }
+  template <typename T> const T * as() const {
+    return (const T *) data.data();
+  }
 
-    ~VertexAttributeData(){
-    }
+  template <unsigned int dim, typename T = float> Math::Vector<dim, T> getVector(size_t index) const {
 
-    VertexAttributeData(const VertexAttributeData & d) {
-      memcpy(this, &d, sizeof(VertexAttributeData));
-    }
+    T tmp[dim];
+    memcpy(tmp, as<T>() + index * dim, sizeof(tmp));
 
-    VertexAttributeData & operator=(const VertexAttributeData & d) {
+    return Math::Vector<dim, T>(tmp);
 
-      memcpy(this, &d, sizeof(VertexAttributeData));
-      return *this;
+  }
 
-    }
+  template <unsigned int dim, typename T = float> void setVector(size_t index, Math::Vector<dim, T> value) {
 
-  };
+    T * dst = as<T>() + index * dim;
+    for (unsigned int i = 0; i < dim; ++i)
+      dst[i] = value[i];
 
-  VertexAttributeType type;
-  std::vector<VertexAttributeData> value;
+  }
 
 };
 
+typedef std::array<VertexAttribute, ATTRIBUTE_SLOT_COUNT> VertexAttributeSet;
+
 struct InterleaveElement {
 
   std::string attributeName;
@@ -107,23 +137,50 @@ class Mesh : public Resource {
 public:
 
   Mesh(std::vector<Model::Vertex> verts, std::vector<uint32_t> indices);
-  Mesh(std::unordered_map<std::string, VertexAttribute> attributes, std::vector<uint32_t> indices);
+  Mesh(VertexAttributeSet attributes, std::vector<uint32_t> indices);
   Mesh(std::vector<Model::Vertex> verts, std::vector<uint16_t> indices);
-  Mesh(std::unordered_map<std::string, VertexAttribute> attributes, std::vector<uint16_t> indices);
+  Mesh(VertexAttributeSet attributes, std::vector<uint16_t> indices);
+
+  typedef std::function<std::shared_ptr<Mesh>()> Source;
+
+  /**
+   * Mesh that is only decoded when its data is needed, used when a baked
+   * version is expected in the mesh cache. Use resolve to get the data.
+   **/
+  Mesh(std::string cacheKey, Source source);
   virtual ~Mesh();
 
+  /// Returns the mesh itself, or the decoded mesh for a deferred one.
+  static std::shared_ptr<Mesh> resolve(std::shared_ptr<Mesh> mesh);
+  bool isDeferred();
+
+  /// Names the source content of the mesh, empty for meshes that are not cached.
+  std::string getCacheKey();
+  void setCacheKey(std::string key);
+
   std::vector<Model::Vertex> getVerts();
   std::vector<uint32_t> & getIndices();
 
   std::vector<uint8_t> getCompactIndices(uint32_t * indexSizeBytes, uint32_t * indexCount);
 
+  bool hasAttribute(VertexAttributeSlot slot);
+  const VertexAttribute & getAttribute(VertexAttributeSlot slot);
   const VertexAttribute & getAttribute(std::string name);
   const VertexAttributeType getAttributeType(std::string name);
 
+  void setAttribute(VertexAttributeSlot slot, VertexAttribute value);
   void setAttribute(std::string name, VertexAttribute value);
 
   void computeTangents();
 
+  /**
+   * Merges vertices within epsilon of each other, which optionally also have
+   * to agree on normal and uv within epsilon. All other attributes, apart
+   * from tangents, have to be equal. Triangles that collapse are removed.
+   * Returns the number of removed vertices.
+   **/
+  size_t weld(float epsilon, bool matchNormals = true, bool matchUVs = true);
+
   unsigned int getVertexCount();
 
   std::vector<uint8_t> getInterleavedData(std::vector<InterleaveElement> elements, uint32_t stride);
@@ -133,6 +190,7 @@ public:
   void saveAsPLY(std::string fname);
 
   static std::shared_ptr<Mesh> loadFromFile(std::string fname);
+  /// Transforms positions, normals and tangents. A mesh passed in as the only reference is modified in place.
   static std::shared_ptr<Mesh> withTransform(std::shared_ptr<Mesh> mesh, Math::Matrix<4,4,float> m);
 
   static std::shared_ptr<Mesh> merge(std::shared_ptr<Mesh> m1, std::shared_ptr<Mesh> m2);
@@ -145,10 +203,16 @@ protected:
 
 private:
 
-  std::vector<Model::Vertex> verts;
   std::vector<uint32_t> indices;
 
-  std::unordered_map<std::string, VertexAttribute> attributes;
+  VertexAttributeSet attributes;
+
+  void addDefaultAttributes();
+
+  std::string cacheKey;
+  Source source;
+  std::mutex resolveLock;
+  std::shared_ptr<Mesh> resolved;
 
 };
 
@@ -1,8 +1,12 @@
 #include "marchingcubes.h"
 
-#include <optional>
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <thread>
 
 #include "util/mesh.h"
+#include "util/debug/trace_exception.h"
 
 #include <mathutils/vector.h>
 
@@ -305,475 +309,377 @@ int triTable[256][16] = {
     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}
 };
 
-struct MCVertex {
-
-    Vector<3, float> position;
-    Vector<3, float> normal;
-    Vector<3, float> uv;
-
-    unsigned int index;
-
-};
-
-struct GridCell {
-
-    Vector<3, float> p[8];
-    double val[8];
-};
-
-struct Triangle {
-
-    MCVertex p[3];
-
-};
-
-struct octree_node_t {
-
-    Vector<3, float> position;
-
-    octree_node_t * children;
-    std::vector<MCVertex> verts;
+Vector<3, float> gradient(std::function<double(double,double,double)> f, Vector<3, float> pos) {
 
-};
+    double h = 0.01;
 
-class Octree {
+    float dfdx = (f(pos[0] + h, pos[1], pos[2]) - f(pos[0] - h, pos[1], pos[2])) / (2 * h);
+    float dfdy = (f(pos[0], pos[1] + h, pos[2]) - f(pos[0], pos[1] - h, pos[2])) / (2 * h);
+    float dfdz = (f(pos[0], pos[1], pos[2] + h) - f(pos[0], pos[1], pos[2] - h)) / (2 * h);
 
-    public:
-        Octree(Vector<3, float> center, Vector<3, float> extend, unsigned int levels = 4) {
+    return Vector<3, float>({dfdx, dfdy, dfdz});
 
-            for (unsigned int i = 0; i < 8; ++i) {
+}
 
-                float tmpPos[3] = {
-				   (float) (center[0] + (i & 0x1 ? extend[0] / 4.0 : -extend[0] / 4.0)),
-				   (float) (center[1] + (i & 0x2 ? extend[1] / 4.0 : -extend[1] / 4.0)),
-				   (float) (center[2] + (i & 0x4 ? extend[2] / 4.0 : -extend[2] / 4.0)),
-                };
+void computeNormalsFromFunction(std::function<double(double,double,double)> f, std::shared_ptr<Mesh> mesh) {
 
-                Vector<3, float> pos(tmpPos);
+    const VertexAttribute & position = mesh->getAttribute(ATTRIBUTE_SLOT_POSITION);
 
-                buildChildren(levels, &this->children[i], center, extend);
+    VertexAttribute normals(ATTRIBUTE_F32_VEC3, position.count);
+    VertexAttribute uvs(ATTRIBUTE_F32_VEC2, position.count);
 
-                this->children[i].position = pos;
+    for (unsigned int i = 0; i < position.count; ++i) {
 
-            }
+        Vector<3, float> pos = position.getVector<3>(i);
 
-        }
+        Vector<3, float> n = gradient(f, pos);
+        n.normalize();
+        normals.setVector<3>(i, n);
 
-        virtual ~Octree() {
+        float sx = n * Vector<3, float>({1,0,0});
+        float sy = n * Vector<3, float>({0,1,0});
+        float sz = n * Vector<3, float>({0,0,1});
 
-            for (unsigned int i = 0; i < 8; ++i) {
+        if (abs(sx) >= abs(sy) && abs(sx) >= abs(sz)) {
 
-                destroyChildren(&this->children[i]);
+            uvs.setVector<2>(i, Vector<2, float>({pos[1], pos[2]}));
 
-            }
+        } else if (abs(sy) >= abs(sx) && abs(sy) >= abs(sz)) {
 
-        }
+            uvs.setVector<2>(i, Vector<2, float>({pos[0], pos[2]}));
 
-        void insert(MCVertex & vert) {
+        } else {
 
-            unsigned int childIndex = computeChildIndex(center, vert.position);
-            insertInNode(children[childIndex], vert);
+            uvs.setVector<2>(i, Vector<2, float>({pos[0], pos[1]}));
 
         }
 
-        std::optional<MCVertex> getFromPosition(Vector<3,float> position, Vector<2, float> uv, float maxDist=1e-8) {
+    }
 
-            unsigned int childIndex = computeChildIndex(center, position);
-            return getVertexFromNode(children[childIndex], position, maxDist, uv);
+    mesh->setAttribute(ATTRIBUTE_SLOT_NORMAL, std::move(normals));
+    mesh->setAttribute(ATTRIBUTE_SLOT_TEXCOORD_0, std::move(uvs));
 
-        }
+    mesh->computeTangents();
 
-    private:
+}
 
-        Vector<3, float> center;
-        Vector<3, float> extend;
+/// Corners of a cell as offsets from its lowest corner, in the order the tables above use.
+static const int cornerOffset[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+    {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+};
 
-        unsigned int computeChildIndex(Vector<3, float> nodePos, Vector<3, float> vertexPos) {
+/// Lattice edge of each cell edge, as the offset of its lower end and its axis.
+static const int edgeBase[12][4] = {
+    {0, 0, 0, 0}, {1, 0, 0, 1}, {0, 1, 0, 0}, {0, 0, 0, 1},
+    {0, 0, 1, 0}, {1, 0, 1, 1}, {0, 1, 1, 0}, {0, 0, 1, 1},
+    {0, 0, 0, 2}, {1, 0, 0, 2}, {1, 1, 0, 2}, {0, 1, 0, 2}
+};
 
-            return (vertexPos[0] >= nodePos[0] ? 0x1 : 0x0) | (vertexPos[1] >= nodePos[1] ? 0x2 : 0x0) | (vertexPos[2] >= nodePos[2] ? 0x4 : 0x0);
+#define MC_NO_VERTEX 0xffffffff
 
-        }
+/**
+ * Samples of the density function at the corners of all cells, each one is
+ * only evaluated once.
+ **/
+struct MCLattice {
 
-        void buildChildren(unsigned int levels, octree_node_t * node, Vector<3, float> center, Vector<3, float> extend) {
+    int size;
+    float origin[3];
+    float step[3];
+    std::vector<float> values;
 
-            if (!levels) {
-
-                node->children = nullptr;
-                return;
+    size_t index(int x, int y, int z) const {
+        return ((size_t) z * size + y) * size + x;
+    }
 
-            }
+    float value(int x, int y, int z) const {
+        return values[index(x, y, z)];
+    }
 
-            node->children = new octree_node_t[8];
-            for (unsigned int i = 0; i < 8; ++i) {
+    /// Central differences, one sided at the border of the lattice.
+    void gradient(int x, int y, int z, float * g) const {
 
-                float tmpPos[3] = {
-				   (float) (center[0] + (i & 0x1 ? extend[0] / 4.0 : -extend[0] / 4.0)),
-				   (float) (center[1] + (i & 0x2 ? extend[1] / 4.0 : -extend[1] / 4.0)),
-				   (float) (center[2] + (i & 0x4 ? extend[2] / 4.0 : -extend[2] / 4.0)),
-                };
+        int p[3] = {x, y, z};
 
-                Vector<3, float> pos(tmpPos);
+        for (unsigned int a = 0; a < 3; ++a) {
 
-                buildChildren(levels-1, node->children + i, pos, extend / 2);
-                node->children[i].position = pos;
+            int lo[3] = {x, y, z};
+            int hi[3] = {x, y, z};
 
-            }
+            lo[a] = std::max(p[a] - 1, 0);
+            hi[a] = std::min(p[a] + 1, size - 1);
 
+            g[a] = (value(hi[0], hi[1], hi[2]) - value(lo[0], lo[1], lo[2])) / ((hi[a] - lo[a]) * step[a]);
 
         }
 
-        void destroyChildren(octree_node_t * node) {
-
-            if (!node->children) return;
-
-            for (unsigned int i = 0; i < 8; ++i) {
-
-                destroyChildren(node->children + i);
-
-            }
-
-            delete[] node->children;
+    }
 
+};
 
-        }
+/**
+ * Part of the grid that is meshed by one thread. A chunk owns the vertices
+ * on the lattice edges starting at its own lattice points, so the vertex on
+ * an edge shared by cells of several chunks exists only once.
+ **/
+struct MCChunk {
 
-        void insertInNode(octree_node_t & node, MCVertex & vert) {
+    int cellStart[3];
+    int cellEnd[3];
 
-            if (!node.children) {
-                node.verts.push_back(vert);
-                return;
-            }
+    int pointStart[3];
+    int pointCount[3];
 
-            unsigned int childIndex = computeChildIndex(node.position, vert.position);
-            insertInNode(node.children[childIndex], vert);
+    /// Local vertex index for each owned point and axis, MC_NO_VERTEX if the edge does not cross the surface.
+    std::vector<uint32_t> edgeVertex;
 
-        }
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<float> uvs;
 
-        std::optional<MCVertex> getVertexFromNode(octree_node_t & node, Vector<3,float> pos, float maxDist, Vector<2, float> uv) {
+    std::vector<uint32_t> indices;
 
-            if (!node.children) {
+    uint32_t vertexOffset;
+    size_t indexOffset;
 
-                for (MCVertex & v : node.verts) {
+    uint32_t & vertexOnEdge(int x, int y, int z, int axis) {
+        return edgeVertex[(((size_t) (z - pointStart[2]) * pointCount[1] + (y - pointStart[1])) * pointCount[0] + (x - pointStart[0])) * 3 + axis];
+    }
 
-                    if ((pos - v.position).length() < maxDist && (uv - v.uv).length() < maxDist)
-                        return std::make_optional<MCVertex>(v);
+};
 
-                }
+/// Creates the vertex on a lattice edge that is known to cross the surface.
+static void createEdgeVertex(const MCLattice & lattice, MCChunk & chunk, int x, int y, int z, int axis, float isoValue) {
 
-                return {};
+    int q[3] = {x, y, z};
+    q[axis]++;
 
-            }
+    float v1 = lattice.value(x, y, z);
+    float v2 = lattice.value(q[0], q[1], q[2]);
 
-            unsigned int childIndex = computeChildIndex(node.position, pos);
-            return getVertexFromNode(node.children[childIndex], pos, maxDist, uv);
+    float mu = (isoValue - v1) / (v2 - v1);
 
-        }
+    float g1[3], g2[3];
+    lattice.gradient(x, y, z, g1);
+    lattice.gradient(q[0], q[1], q[2], g2);
 
-        struct octree_node_t children[8];
+    int p[3] = {x, y, z};
+    float pos[3];
+    float n[3];
 
-};
+    for (unsigned int k = 0; k < 3; ++k) {
+        pos[k] = lattice.origin[k] + (p[k] + (k == (unsigned int) axis ? mu : 0)) * lattice.step[k];
+        n[k] = -(g1[k] + mu * (g2[k] - g1[k]));
+    }
 
-uint32_t getEdgeTableIndex(GridCell gridValues, double isoValue) {
+    float l = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (l > 0)
+        for (unsigned int k = 0; k < 3; ++k)
+            n[k] /= l;
 
-    uint32_t index = 0;
+    chunk.vertexOnEdge(x, y, z, axis) = chunk.positions.size() / 3;
 
-    for (unsigned int i = 0; i < 8; ++i) {
+    chunk.positions.insert(chunk.positions.end(), pos, pos + 3);
+    chunk.normals.insert(chunk.normals.end(), n, n + 3);
 
-        index |= (gridValues.val[i] < isoValue) ? (0x1 << i) : 0x0;
+    /// Planar projection along the axis the normal points to most.
+    float ax = std::fabs(n[0]), ay = std::fabs(n[1]), az = std::fabs(n[2]);
 
+    if (ax >= ay && ax >= az) {
+        chunk.uvs.push_back(pos[1]);
+        chunk.uvs.push_back(pos[2]);
+    } else if (ay >= ax && ay >= az) {
+        chunk.uvs.push_back(pos[0]);
+        chunk.uvs.push_back(pos[2]);
+    } else {
+        chunk.uvs.push_back(pos[0]);
+        chunk.uvs.push_back(pos[1]);
     }
 
-    return index;
-
 }
 
-Vector<3, float> vertexInterpolate(double isoValue, Vector<3, float> p1, Vector<3, float> p2, double v1, double v2) {
-
-    double mu = (isoValue - v1) / (v2 - v1);
-    Vector<3, float> p;
-    p[0] = p1[0] + mu * (p2[0] - p1[0]);
-    p[1] = p1[1] + mu * (p2[1] - p1[1]);
-    p[2] = p1[2] + mu * (p2[2] - p1[2]);
+std::shared_ptr<Mesh> buildMeshFromFunction(std::function<double(double, double, double)> f, Vector<3, float> center, Vector<3, float> extend, double isoValue, int divCount) {
 
-    return p;
+    if (divCount < 1)
+        throw dbg::trace_exception("Marching cubes needs at least one cell");
 
-}
+    MCLattice lattice;
+    lattice.size = divCount + 1;
 
-Vector<3, float> gradient(std::function<double(double,double,double)> f, Vector<3, float> pos) {
+    for (unsigned int k = 0; k < 3; ++k) {
+        lattice.step[k] = extend[k] / divCount;
+        lattice.origin[k] = center[k] - extend[k] / 2;
+    }
 
-    double h = 0.01;
+    lattice.values.resize((size_t) lattice.size * lattice.size * lattice.size);
 
-    float dfdx = (f(pos[0] + h, pos[1], pos[2]) - f(pos[0] - h, pos[1], pos[2])) / (2 * h);
-    float dfdy = (f(pos[0], pos[1] + h, pos[2]) - f(pos[0], pos[1] - h, pos[2])) / (2 * h);
-    float dfdz = (f(pos[0], pos[1], pos[2] + h) - f(pos[0], pos[1], pos[2] - h)) / (2 * h);
+    #pragma omp parallel for schedule(dynamic)
+    for (int z = 0; z < lattice.size; ++z) {
+        for (int y = 0; y < lattice.size; ++y) {
+            for (int x = 0; x < lattice.size; ++x) {
 
-    return Vector<3, float>({dfdx, dfdy, dfdz});
+                lattice.values[lattice.index(x, y, z)] = f(lattice.origin[0] + x * lattice.step[0],
+                                                           lattice.origin[1] + y * lattice.step[1],
+                                                           lattice.origin[2] + z * lattice.step[2]);
 
-}
+            }
+        }
+    }
 
-int polygonizeCell(GridCell grid, double isoValue, std::vector<Triangle> & triangles, std::function<double(double,double,double)> f, std::mutex & triangleMutex) {
-
-    uint32_t cubeindex = getEdgeTableIndex(grid, isoValue);
-
-    std::vector<Vector<3, float>> vertlist(12);
-
-    if (edgeTable[cubeindex] == 0)
-      return(0);
-
-   /* Find the vertices where the surface intersects the cube */
-    if (edgeTable[cubeindex] & 1)
-        vertlist[0] = vertexInterpolate(isoValue,grid.p[0],grid.p[1],grid.val[0],grid.val[1]);
-    if (edgeTable[cubeindex] & 2)
-        vertlist[1] = vertexInterpolate(isoValue,grid.p[1],grid.p[2],grid.val[1],grid.val[2]);
-    if (edgeTable[cubeindex] & 4)
-        vertlist[2] = vertexInterpolate(isoValue,grid.p[2],grid.p[3],grid.val[2],grid.val[3]);
-    if (edgeTable[cubeindex] & 8)
-        vertlist[3] = vertexInterpolate(isoValue,grid.p[3],grid.p[0],grid.val[3],grid.val[0]);
-    if (edgeTable[cubeindex] & 16)
-          vertlist[4] = vertexInterpolate(isoValue,grid.p[4],grid.p[5],grid.val[4],grid.val[5]);
-    if (edgeTable[cubeindex] & 32)
-          vertlist[5] = vertexInterpolate(isoValue,grid.p[5],grid.p[6],grid.val[5],grid.val[6]);
-    if (edgeTable[cubeindex] & 64)
-          vertlist[6] = vertexInterpolate(isoValue,grid.p[6],grid.p[7],grid.val[6],grid.val[7]);
-    if (edgeTable[cubeindex] & 128)
-          vertlist[7] = vertexInterpolate(isoValue,grid.p[7],grid.p[4],grid.val[7],grid.val[4]);
-    if (edgeTable[cubeindex] & 256)
-          vertlist[8] = vertexInterpolate(isoValue,grid.p[0],grid.p[4],grid.val[0],grid.val[4]);
-    if (edgeTable[cubeindex] & 512)
-          vertlist[9] = vertexInterpolate(isoValue,grid.p[1],grid.p[5],grid.val[1],grid.val[5]);
-    if (edgeTable[cubeindex] & 1024)
-          vertlist[10] = vertexInterpolate(isoValue,grid.p[2],grid.p[6],grid.val[2],grid.val[6]);
-    if (edgeTable[cubeindex] & 2048)
-          vertlist[11] = vertexInterpolate(isoValue,grid.p[3],grid.p[7],grid.val[3],grid.val[7]);
-
-       /* Create the triangle */
-    int ntriang = 0;
-    for (int i = 0; triTable[cubeindex][i] != -1; i += 3) {
-
-        Triangle t;
-        t.p[0].position = vertlist[triTable[cubeindex][i  ]];
-        t.p[0].normal = gradient(f, t.p[0].position) * -1.0;
-        t.p[1].position = vertlist[triTable[cubeindex][i+1]];
-        t.p[1].normal = gradient(f, t.p[1].position) * -1.0;
-        t.p[2].position = vertlist[triTable[cubeindex][i+2]];
-        t.p[2].normal = gradient(f, t.p[2].position) * -1.0;
-
-        Vector<3, float> surfaceNormal = (t.p[0].normal + t.p[1].normal + t.p[2].normal) / 3.0;
-
-        float sx = surfaceNormal * Vector<3, float>({1,0,0});
-        float sy = surfaceNormal * Vector<3, float>({0,1,0});
-        float sz = surfaceNormal * Vector<3, float>({0,0,1});
+    int chunksPerAxis = (divCount + MC_CHUNK_SIZE - 1) / MC_CHUNK_SIZE;
+    std::vector<MCChunk> chunks((size_t) chunksPerAxis * chunksPerAxis * chunksPerAxis);
 
-        if (abs(sx) >= abs(sy) && abs(sx) >= abs(sz)) {
+    for (int cz = 0; cz < chunksPerAxis; ++cz) {
+        for (int cy = 0; cy < chunksPerAxis; ++cy) {
+            for (int cx = 0; cx < chunksPerAxis; ++cx) {
 
-            t.p[0].uv = Vector<2, float>({t.p[0].position[1], t.p[0].position[2]});
-            t.p[1].uv = Vector<2, float>({t.p[1].position[1], t.p[1].position[2]});
-            t.p[2].uv = Vector<2, float>({t.p[2].position[1], t.p[2].position[2]});
+                MCChunk & chunk = chunks[((size_t) cz * chunksPerAxis + cy) * chunksPerAxis + cx];
+                int c[3] = {cx, cy, cz};
 
-        } else if (abs(sy) >= abs(sx) && abs(sy) >= abs(sz)) {
+                for (unsigned int k = 0; k < 3; ++k) {
 
-            t.p[0].uv = Vector<2, float>({t.p[0].position[0], t.p[0].position[2]});
-            t.p[1].uv = Vector<2, float>({t.p[1].position[0], t.p[1].position[2]});
-            t.p[2].uv = Vector<2, float>({t.p[2].position[0], t.p[2].position[2]});
+                    chunk.cellStart[k] = c[k] * MC_CHUNK_SIZE;
+                    chunk.cellEnd[k] = std::min(chunk.cellStart[k] + MC_CHUNK_SIZE, divCount);
 
-        } else {
+                    /// The last chunk on an axis also owns the points on the far side of the grid.
+                    chunk.pointStart[k] = chunk.cellStart[k];
+                    chunk.pointCount[k] = chunk.cellEnd[k] - chunk.cellStart[k] + (c[k] == chunksPerAxis - 1 ? 1 : 0);
 
-            t.p[0].uv = Vector<2, float>({t.p[0].position[0], t.p[0].position[1]});
-            t.p[1].uv = Vector<2, float>({t.p[1].position[0], t.p[1].position[1]});
-            t.p[2].uv = Vector<2, float>({t.p[2].position[0], t.p[2].position[1]});
+                }
 
+            }
         }
-
-        triangleMutex.lock();
-        triangles.push_back(t);
-        triangleMutex.unlock();
-        ntriang++;
-
     }
 
-    return(ntriang);
+    float iso = isoValue;
+    size_t stride[3] = {1, (size_t) lattice.size, (size_t) lattice.size * lattice.size};
 
-}
+    /// Every chunk creates the vertices on its own edges.
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunks.size(); ++i) {
 
-std::shared_ptr<Mesh> mergeTrianglesToMesh(std::vector<Triangle> & triangles) {
+        MCChunk & chunk = chunks[i];
+        chunk.edgeVertex.assign((size_t) chunk.pointCount[0] * chunk.pointCount[1] * chunk.pointCount[2] * 3, MC_NO_VERTEX);
 
-    std::vector<uint16_t> indices;
-    VertexAttribute positions;
-    positions.type = ATTRIBUTE_F32_VEC3;
+        for (int z = chunk.pointStart[2]; z < chunk.pointStart[2] + chunk.pointCount[2]; ++z) {
+            for (int y = chunk.pointStart[1]; y < chunk.pointStart[1] + chunk.pointCount[1]; ++y) {
+                for (int x = chunk.pointStart[0]; x < chunk.pointStart[0] + chunk.pointCount[0]; ++x) {
 
-    VertexAttribute normals;
-    normals.type = ATTRIBUTE_F32_VEC3;
+                    size_t point = lattice.index(x, y, z);
+                    bool inside = lattice.values[point] < iso;
 
-    VertexAttribute uvs;
-    uvs.type = ATTRIBUTE_F32_VEC2;
+                    /// Most edges do not cross the surface, so only the sign is tested here.
+                    if (x < divCount && (lattice.values[point + 1] < iso) != inside)
+                        createEdgeVertex(lattice, chunk, x, y, z, 0, iso);
 
-    float vecData[3] = {0,0,0};
-    Vector<3,float> center(vecData);
+                    if (y < divCount && (lattice.values[point + stride[1]] < iso) != inside)
+                        createEdgeVertex(lattice, chunk, x, y, z, 1, iso);
 
-    vecData[0] = 2;
-    vecData[1] = 2;
-    vecData[2] = 2;
+                    if (z < divCount && (lattice.values[point + stride[2]] < iso) != inside)
+                        createEdgeVertex(lattice, chunk, x, y, z, 2, iso);
 
-    Vector<3, float> extend(vecData);
-    Octree octree(center, extend);
-
-    for (const Triangle & t : triangles) {
-
-        for (unsigned int i = 0; i < 3; ++i) {
-
-            std::optional<MCVertex> octreeVert = octree.getFromPosition(t.p[i].position, t.p[i].uv);
-            if (octreeVert.has_value()) {
-                indices.push_back(octreeVert.value().index);
-                continue;
+                }
             }
-
-            MCVertex v = t.p[i];
-            v.index = positions.value.size();
-
-            VertexAttribute::VertexAttributeData pData;
-            pData.vec3 = v.position;
-            positions.value.push_back(pData);
-
-            pData.vec3 = v.normal;
-            normals.value.push_back(pData);
-
-            pData.vec2 = v.uv;
-            uvs.value.push_back(pData);
-
-            octree.insert(v);
-            indices.push_back(v.index);
-
         }
 
     }
 
-    std::unordered_map<std::string, VertexAttribute> attributes;
-
-    attributes["POSITION"] = positions;
-    attributes["NORMAL"] = normals;
-    attributes["TEXCOORD_0"] = uvs;
-
-    return std::shared_ptr<Mesh>(new Mesh(attributes, indices));
-
-}
+    uint32_t vertexCount = 0;
+    for (MCChunk & chunk : chunks) {
+        chunk.vertexOffset = vertexCount;
+        vertexCount += chunk.positions.size() / 3;
+    }
 
-Vector<3, float> compMult(Vector<3, float> a, Vector<3, float> b) {
-    float data[3] = {
-        a[0] * b[0],
-        a[1] * b[1],
-        a[2] * b[2]
+    auto chunkOf = [&] (int x, int y, int z) -> MCChunk & {
+        int cx = std::min(x / MC_CHUNK_SIZE, chunksPerAxis - 1);
+        int cy = std::min(y / MC_CHUNK_SIZE, chunksPerAxis - 1);
+        int cz = std::min(z / MC_CHUNK_SIZE, chunksPerAxis - 1);
+        return chunks[((size_t) cz * chunksPerAxis + cy) * chunksPerAxis + cx];
     };
-    return Vector<3, float>(data);
-}
 
-void computeNormalsFromFunction(std::function<double(double,double,double)> f, std::shared_ptr<Mesh> mesh) {
+    size_t cornerIndex[8];
+    for (unsigned int c = 0; c < 8; ++c)
+        cornerIndex[c] = cornerOffset[c][0] * stride[0] + cornerOffset[c][1] * stride[1] + cornerOffset[c][2] * stride[2];
 
-    const VertexAttribute & position = mesh->getAttribute("POSITION");
+    /// Triangles only read the vertex tables, which are complete by now, so no locking is needed.
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunks.size(); ++i) {
 
-    VertexAttribute normals;
-    normals.type = ATTRIBUTE_F32_VEC3;
-    normals.value = std::vector<VertexAttribute::VertexAttributeData>(position.value.size());
+        MCChunk & chunk = chunks[i];
 
-    VertexAttribute uvs;
-    uvs.type = ATTRIBUTE_F32_VEC2;
-    uvs.value = std::vector<VertexAttribute::VertexAttributeData>(position.value.size());
+        for (int z = chunk.cellStart[2]; z < chunk.cellEnd[2]; ++z) {
+            for (int y = chunk.cellStart[1]; y < chunk.cellEnd[1]; ++y) {
+                for (int x = chunk.cellStart[0]; x < chunk.cellEnd[0]; ++x) {
 
-    for (unsigned int i = 0; i < position.value.size(); ++i) {
+                    size_t base = lattice.index(x, y, z);
 
-        Vector<3, float> pos = position.value[i].vec3;
+                    uint32_t cubeindex = 0;
+                    for (unsigned int c = 0; c < 8; ++c)
+                        if (lattice.values[base + cornerIndex[c]] < iso)
+                            cubeindex |= 1 << c;
 
-        Vector<3, float> n = gradient(f, pos);
-        n.normalize();
-        normals.value[i].vec3 = n;
+                    if (!edgeTable[cubeindex])
+                        continue;
 
-        float sx = n * Vector<3, float>({1,0,0});
-        float sy = n * Vector<3, float>({0,1,0});
-        float sz = n * Vector<3, float>({0,0,1});
+                    for (int t = 0; triTable[cubeindex][t] != -1; ++t) {
 
-        if (abs(sx) >= abs(sy) && abs(sx) >= abs(sz)) {
-
-            uvs.value[i].vec2 = Vector<2, float>({pos[1], pos[2]});
+                        const int * e = edgeBase[triTable[cubeindex][t]];
+                        int ex = x + e[0], ey = y + e[1], ez = z + e[2];
 
-        } else if (abs(sy) >= abs(sx) && abs(sy) >= abs(sz)) {
+                        MCChunk & owner = chunkOf(ex, ey, ez);
+                        chunk.indices.push_back(owner.vertexOffset + owner.vertexOnEdge(ex, ey, ez, e[3]));
 
-            uvs.value[i].vec2 = Vector<2, float>({pos[0], pos[2]});
-
-        } else {
-
-            uvs.value[i].vec2 = Vector<2, float>({pos[0], pos[1]});
+                    }
 
+                }
+            }
         }
 
     }
 
-    mesh->setAttribute("NORMAL", normals);
-    mesh->setAttribute("TEXCOORD_0", uvs);
-
-    mesh->computeTangents();
-
-}
-
-#include <omp.h>
-
-std::shared_ptr<Mesh> buildMeshFromFunction(std::function<double(double, double, double)> f, Vector<3, float> center, Vector<3, float> extend, double isoValue, int divCount) {
-
-    Vector<3, float> blockSize = extend / divCount;
-    Vector<3, float> baseCorner = center - extend / 2;
-
-    std::vector<Triangle> tris;
-    std::mutex triangleMutex;
-
-    #pragma omp paralell for schedule(dynamic)
-    for (unsigned int x = 0; x < divCount; ++x) {
-
-        std::vector<Triangle> localTris;
-
-        for (unsigned int y = 0; y < divCount; ++y) {
-
-            for (unsigned int z = 0; z < divCount; ++z) {
-
-                GridCell cell;
-                float baseOffsetData[3] = {x * blockSize[0], y * blockSize[1], z * blockSize[2]};
-                cell.p[0] = baseCorner + Vector<3, float>(baseOffsetData);
-
-                cell.p[1] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({1.0, 0.0, 0.0}));
-                cell.p[2] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({1.0, 1.0, 0.0}));
-                cell.p[3] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({0.0, 1.0, 0.0}));
-
-                cell.p[4] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({0.0, 0.0, 1.0}));
-                cell.p[5] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({1.0, 0.0, 1.0}));
-                cell.p[6] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({1.0, 1.0, 1.0}));
-                cell.p[7] = baseCorner + Vector<3, float>(baseOffsetData) + compMult(blockSize, Vector<3, float>({0.0, 1.0, 1.0}));
-
-                for (unsigned int i = 0; i < 8; ++i) {
+    size_t indexCount = 0;
+    for (MCChunk & chunk : chunks) {
+        chunk.indexOffset = indexCount;
+        indexCount += chunk.indices.size();
+    }
 
-                    cell.val[i] = f(cell.p[i][0], cell.p[i][1], cell.p[i][2]);
+    VertexAttributeSet attributes;
+    attributes[ATTRIBUTE_SLOT_POSITION] = VertexAttribute(ATTRIBUTE_F32_VEC3, vertexCount);
+    attributes[ATTRIBUTE_SLOT_NORMAL] = VertexAttribute(ATTRIBUTE_F32_VEC3, vertexCount);
+    attributes[ATTRIBUTE_SLOT_TEXCOORD_0] = VertexAttribute(ATTRIBUTE_F32_VEC2, vertexCount);
 
-                }
+    float * positions = attributes[ATTRIBUTE_SLOT_POSITION].as<float>();
+    float * normals = attributes[ATTRIBUTE_SLOT_NORMAL].as<float>();
+    float * uvs = attributes[ATTRIBUTE_SLOT_TEXCOORD_0].as<float>();
 
-                polygonizeCell(cell, isoValue, localTris, f, triangleMutex);
+    std::vector<uint32_t> indices(indexCount);
 
-            }
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunks.size(); ++i) {
 
-        }
+        MCChunk & chunk = chunks[i];
 
-        triangleMutex.lock();
-        tris.insert(tris.end(), localTris.begin(), localTris.end());
-        triangleMutex.unlock();
+        std::copy(chunk.positions.begin(), chunk.positions.end(), positions + (size_t) chunk.vertexOffset * 3);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), normals + (size_t) chunk.vertexOffset * 3);
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs + (size_t) chunk.vertexOffset * 2);
+        std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + chunk.indexOffset);
 
     }
 
-    std::shared_ptr<Mesh> mesh = mergeTrianglesToMesh(tris);
-    mesh->computeTangents();
+    lout << "Marching cubes: " << vertexCount << " vertices, " << indexCount / 3 << " triangles in " << chunks.size() << " chunks" << std::endl;
 
-    return mesh;
+    return std::shared_ptr<Mesh>(new Mesh(std::move(attributes), std::move(indices)));
 
 }
 
 void backgroundGeneration(std::function<double(double, double, double)> f, Vector<3, float> center, Vector<3, float> extend, double isoValue, int divCount, std::promise<std::shared_ptr<Mesh>> promise) {
 
-    std::shared_ptr<Mesh> mesh = buildMeshFromFunction(f, center, extend, isoValue, divCount);
-    promise.set_value(mesh);
+    try {
+        promise.set_value(buildMeshFromFunction(f, center, extend, isoValue, divCount));
+    } catch (std::exception & e) {
+        promise.set_exception(std::current_exception());
+    }
 
 }
 
@@ -788,10 +694,4 @@ std::future<std::shared_ptr<Mesh>> generateBackground(std::function<double(doubl
 
     return fut;
 
-}
-
-void testOctree() {
-
-
-
 }
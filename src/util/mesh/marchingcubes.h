@@ -8,8 +8,16 @@
 
 #include <mathutils/vector.h>
 
+/// Cells per chunk along each axis, chunks are meshed in parallel.
+#define MC_CHUNK_SIZE 16
+
+/**
+ * Meshes the surface where f equals isoValue inside of the box around center.
+ * f is sampled from several threads at once, so it must be safe to call
+ * concurrently (no unguarded shared state).
+ **/
 std::shared_ptr<Mesh> buildMeshFromFunction(std::function<double(double, double, double)> f, Math::Vector<3, float> center, Math::Vector<3, float> extend, double isoValue, int divCount);
+/// Runs buildMeshFromFunction on another thread, the same requirements for f apply.
 std::future<std::shared_ptr<Mesh>> generateBackground(std::function<double(double, double, double)> f, Math::Vector<3, float> center, Math::Vector<3, float> extend, double isoValue, int divCount);
-void testOctree();
 
 #endif // MARCHINGCUBES_H
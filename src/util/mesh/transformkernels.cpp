@@ -0,0 +1,319 @@
+#include "transformkernels.h"
+
+#include <string>
+
+#include "util/debug/trace_exception.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TRANSFORM_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+/// Reference implementation, also handles the vectors left over by the SIMD kernels.
+static void transformScalar(const float * m, float * data, size_t count, unsigned int dim, float w) {
+
+  #pragma omp simd
+  for (size_t i = 0; i < count; ++i) {
+
+    float * v = data + i * dim;
+
+    float x = v[0];
+    float y = v[1];
+    float z = v[2];
+
+    v[0] = m[0] * x + m[4] * y + m[8]  * z + m[12] * w;
+    v[1] = m[1] * x + m[5] * y + m[9]  * z + m[13] * w;
+    v[2] = m[2] * x + m[6] * y + m[10] * z + m[14] * w;
+
+  }
+
+}
+
+#ifdef TRANSFORM_KERNEL_X86
+
+/**
+ * The SSE and AVX kernels for packed xyz data load 4 vectors as 3 registers
+ * (x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3), shuffle them into one register
+ * per component, transform and shuffle back. The AVX kernels do the same for
+ * two groups of 4 vectors, one per 128 bit lane.
+ **/
+
+static void transformPackedSSE(const float * m, float * data, size_t count, float w) {
+
+  const __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]);
+  const __m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6 = _mm_set1_ps(m[6]);
+  const __m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]);
+  const __m128 tx = _mm_set1_ps(m[12] * w), ty = _mm_set1_ps(m[13] * w), tz = _mm_set1_ps(m[14] * w);
+
+  size_t blocks = count / 4;
+
+  for (size_t i = 0; i < blocks; ++i) {
+
+    float * p = data + i * 12;
+
+    __m128 a = _mm_loadu_ps(p);
+    __m128 b = _mm_loadu_ps(p + 4);
+    __m128 c = _mm_loadu_ps(p + 8);
+
+    __m128 x = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3,3,0,0)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,2,0));
+    __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+    __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+
+    __m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m4, y)), _mm_add_ps(_mm_mul_ps(m8, z), tx));
+    __m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, x), _mm_mul_ps(m5, y)), _mm_add_ps(_mm_mul_ps(m9, z), ty));
+    __m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, x), _mm_mul_ps(m6, y)), _mm_add_ps(_mm_mul_ps(m10, z), tz));
+
+    _mm_storeu_ps(p,     _mm_shuffle_ps(_mm_shuffle_ps(rx, ry, _MM_SHUFFLE(0,0,0,0)), _mm_shuffle_ps(rz, rx, _MM_SHUFFLE(1,1,0,0)), _MM_SHUFFLE(2,0,2,0)));
+    _mm_storeu_ps(p + 4, _mm_shuffle_ps(_mm_shuffle_ps(ry, rz, _MM_SHUFFLE(1,1,1,1)), _mm_shuffle_ps(rx, ry, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,0,2,0)));
+    _mm_storeu_ps(p + 8, _mm_shuffle_ps(_mm_shuffle_ps(rz, rx, _MM_SHUFFLE(3,3,2,2)), _mm_shuffle_ps(ry, rz, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(2,0,2,0)));
+
+  }
+
+  transformScalar(m, data + blocks * 12, count - blocks * 4, 3, w);
+
+}
+
+/// Vectors of 4 floats, the fourth component is kept.
+static void transformDirections4SSE(const float * m, float * data, size_t count) {
+
+  const __m128 c0 = _mm_setr_ps(m[0], m[1], m[2], 0);
+  const __m128 c1 = _mm_setr_ps(m[4], m[5], m[6], 0);
+  const __m128 c2 = _mm_setr_ps(m[8], m[9], m[10], 0);
+  const __m128 c3 = _mm_setr_ps(0, 0, 0, 1);
+
+  for (size_t i = 0; i < count; ++i) {
+
+    float * p = data + i * 4;
+    __m128 v = _mm_loadu_ps(p);
+
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_shuffle_ps(v, v, 0x00)), _mm_mul_ps(c1, _mm_shuffle_ps(v, v, 0x55))),
+			  _mm_add_ps(_mm_mul_ps(c2, _mm_shuffle_ps(v, v, 0xAA)), _mm_mul_ps(c3, v)));
+
+    _mm_storeu_ps(p, r);
+
+  }
+
+}
+
+__attribute__((target("avx"))) static inline __m256 loadLanes(const float * lo, const float * hi) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo)), _mm_loadu_ps(hi), 1);
+}
+
+__attribute__((target("avx"))) static inline void storeLanes(float * lo, float * hi, __m256 v) {
+  _mm_storeu_ps(lo, _mm256_castps256_ps128(v));
+  _mm_storeu_ps(hi, _mm256_extractf128_ps(v, 1));
+}
+
+__attribute__((target("avx"))) static void transformPackedAVX(const float * m, float * data, size_t count, float w) {
+
+  const __m256 m0 = _mm256_set1_ps(m[0]), m1 = _mm256_set1_ps(m[1]), m2 = _mm256_set1_ps(m[2]);
+  const __m256 m4 = _mm256_set1_ps(m[4]), m5 = _mm256_set1_ps(m[5]), m6 = _mm256_set1_ps(m[6]);
+  const __m256 m8 = _mm256_set1_ps(m[8]), m9 = _mm256_set1_ps(m[9]), m10 = _mm256_set1_ps(m[10]);
+  const __m256 tx = _mm256_set1_ps(m[12] * w), ty = _mm256_set1_ps(m[13] * w), tz = _mm256_set1_ps(m[14] * w);
+
+  size_t blocks = count / 8;
+
+  for (size_t i = 0; i < blocks; ++i) {
+
+    float * p = data + i * 24;
+
+    __m256 a = loadLanes(p, p + 12);
+    __m256 b = loadLanes(p + 4, p + 16);
+    __m256 c = loadLanes(p + 8, p + 20);
+
+    __m256 x = _mm256_shuffle_ps(_mm256_shuffle_ps(a, a, _MM_SHUFFLE(3,3,0,0)), _mm256_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,2,0));
+    __m256 y = _mm256_shuffle_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)), _mm256_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+    __m256 z = _mm256_shuffle_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)), _mm256_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+
+    __m256 rx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, x), _mm256_mul_ps(m4, y)), _mm256_add_ps(_mm256_mul_ps(m8, z), tx));
+    __m256 ry = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m1, x), _mm256_mul_ps(m5, y)), _mm256_add_ps(_mm256_mul_ps(m9, z), ty));
+    __m256 rz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m2, x), _mm256_mul_ps(m6, y)), _mm256_add_ps(_mm256_mul_ps(m10, z), tz));
+
+    storeLanes(p, p + 12,    _mm256_shuffle_ps(_mm256_shuffle_ps(rx, ry, _MM_SHUFFLE(0,0,0,0)), _mm256_shuffle_ps(rz, rx, _MM_SHUFFLE(1,1,0,0)), _MM_SHUFFLE(2,0,2,0)));
+    storeLanes(p + 4, p + 16, _mm256_shuffle_ps(_mm256_shuffle_ps(ry, rz, _MM_SHUFFLE(1,1,1,1)), _mm256_shuffle_ps(rx, ry, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,0,2,0)));
+    storeLanes(p + 8, p + 20, _mm256_shuffle_ps(_mm256_shuffle_ps(rz, rx, _MM_SHUFFLE(3,3,2,2)), _mm256_shuffle_ps(ry, rz, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(2,0,2,0)));
+
+  }
+
+  transformPackedSSE(m, data + blocks * 24, count - blocks * 8, w);
+
+}
+
+__attribute__((target("avx"))) static void transformDirections4AVX(const float * m, float * data, size_t count) {
+
+  const __m256 c0 = _mm256_setr_ps(m[0], m[1], m[2], 0, m[0], m[1], m[2], 0);
+  const __m256 c1 = _mm256_setr_ps(m[4], m[5], m[6], 0, m[4], m[5], m[6], 0);
+  const __m256 c2 = _mm256_setr_ps(m[8], m[9], m[10], 0, m[8], m[9], m[10], 0);
+  const __m256 c3 = _mm256_setr_ps(0, 0, 0, 1, 0, 0, 0, 1);
+
+  size_t blocks = count / 2;
+
+  for (size_t i = 0; i < blocks; ++i) {
+
+    float * p = data + i * 8;
+    __m256 v = _mm256_loadu_ps(p);
+
+    __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c0, _mm256_permute_ps(v, 0x00)), _mm256_mul_ps(c1, _mm256_permute_ps(v, 0x55))),
+			     _mm256_add_ps(_mm256_mul_ps(c2, _mm256_permute_ps(v, 0xAA)), _mm256_mul_ps(c3, v)));
+
+    _mm256_storeu_ps(p, r);
+
+  }
+
+  transformDirections4SSE(m, data + blocks * 8, count - blocks * 2);
+
+}
+
+#endif
+
+bool isTransformKernelSupported(TransformKernel kernel) {
+
+  switch (kernel) {
+
+  case TRANSFORM_KERNEL_AUTO:
+  case TRANSFORM_KERNEL_SCALAR:
+    return true;
+
+#ifdef TRANSFORM_KERNEL_X86
+  case TRANSFORM_KERNEL_SSE:
+    return true;
+
+  case TRANSFORM_KERNEL_AVX:
+    return __builtin_cpu_supports("avx");
+#endif
+
+  default:
+    return false;
+
+  }
+
+}
+
+TransformKernel getBestTransformKernel() {
+
+  static const TransformKernel best = isTransformKernelSupported(TRANSFORM_KERNEL_AVX) ? TRANSFORM_KERNEL_AVX :
+    (isTransformKernelSupported(TRANSFORM_KERNEL_SSE) ? TRANSFORM_KERNEL_SSE : TRANSFORM_KERNEL_SCALAR);
+
+  return best;
+
+}
+
+const char * getTransformKernelName(TransformKernel kernel) {
+
+  switch (kernel) {
+
+  case TRANSFORM_KERNEL_AUTO:
+    return "auto";
+
+  case TRANSFORM_KERNEL_SCALAR:
+    return "scalar";
+
+  case TRANSFORM_KERNEL_SSE:
+    return "sse";
+
+  case TRANSFORM_KERNEL_AVX:
+    return "avx";
+
+  default:
+    return "unknown";
+
+  }
+
+}
+
+static TransformKernel selectKernel(TransformKernel kernel) {
+
+  if (kernel == TRANSFORM_KERNEL_AUTO)
+    return getBestTransformKernel();
+
+  if (!isTransformKernelSupported(kernel))
+    throw dbg::trace_exception(std::string("Transform kernel not supported on this CPU: ").append(getTransformKernelName(kernel)));
+
+  return kernel;
+
+}
+
+bool isAffineTransform(const float * m) {
+  return m[3] == 0 && m[7] == 0 && m[11] == 0 && m[15] == 1;
+}
+
+static void transformPacked(const float * m, float * data, size_t count, float w, TransformKernel kernel) {
+
+  switch (selectKernel(kernel)) {
+
+#ifdef TRANSFORM_KERNEL_X86
+  case TRANSFORM_KERNEL_AVX:
+    transformPackedAVX(m, data, count, w);
+    break;
+
+  case TRANSFORM_KERNEL_SSE:
+    transformPackedSSE(m, data, count, w);
+    break;
+#endif
+
+  default:
+    transformScalar(m, data, count, 3, w);
+    break;
+
+  }
+
+}
+
+void transformPoints(const float * m, float * data, size_t count, TransformKernel kernel) {
+
+  if (!isAffineTransform(m))
+    throw dbg::trace_exception("transformPoints needs an affine matrix");
+
+  transformPacked(m, data, count, 1, kernel);
+
+}
+
+void transformPointsProjective(const float * m, float * data, size_t count) {
+
+  for (size_t i = 0; i < count; ++i) {
+
+    float * v = data + i * 3;
+
+    float x = v[0];
+    float y = v[1];
+    float z = v[2];
+
+    float rw = 1.0f / (m[3] * x + m[7] * y + m[11] * z + m[15]);
+
+    v[0] = (m[0] * x + m[4] * y + m[8]  * z + m[12]) * rw;
+    v[1] = (m[1] * x + m[5] * y + m[9]  * z + m[13]) * rw;
+    v[2] = (m[2] * x + m[6] * y + m[10] * z + m[14]) * rw;
+
+  }
+
+}
+
+void transformDirections(const float * m, float * data, size_t count, unsigned int dim, TransformKernel kernel) {
+
+  if (dim == 3) {
+    transformPacked(m, data, count, 0, kernel);
+    return;
+  }
+
+  if (dim != 4)
+    throw dbg::trace_exception(std::string("Unable to transform directions of dimension ").append(std::to_string(dim)));
+
+  switch (selectKernel(kernel)) {
+
+#ifdef TRANSFORM_KERNEL_X86
+  case TRANSFORM_KERNEL_AVX:
+    transformDirections4AVX(m, data, count);
+    break;
+
+  case TRANSFORM_KERNEL_SSE:
+    transformDirections4SSE(m, data, count);
+    break;
+#endif
+
+  default:
+    transformScalar(m, data, count, 4, 0);
+    break;
+
+  }
+
+}
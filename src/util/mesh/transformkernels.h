@@ -0,0 +1,43 @@
+#ifndef TRANSFORMKERNELS_H
+#define TRANSFORMKERNELS_H
+
+#include <stddef.h>
+
+/**
+ * Batched transforms of packed float vectors by a column major 4x4 matrix,
+ * as used for the vertex attributes of a Mesh. All kernels work in place.
+ **/
+
+typedef enum TransformKernel {
+
+			      TRANSFORM_KERNEL_AUTO,
+			      TRANSFORM_KERNEL_SCALAR,
+			      TRANSFORM_KERNEL_SSE,
+			      TRANSFORM_KERNEL_AVX
+
+} TransformKernel;
+
+/// Fastest kernel the running CPU supports.
+TransformKernel getBestTransformKernel();
+bool isTransformKernelSupported(TransformKernel kernel);
+const char * getTransformKernelName(TransformKernel kernel);
+
+/// True if the last row of the matrix is (0, 0, 0, 1).
+bool isAffineTransform(const float * m);
+
+/**
+ * Transforms count points of 3 floats by the affine matrix m, including
+ * its translation.
+ **/
+void transformPoints(const float * m, float * data, size_t count, TransformKernel kernel = TRANSFORM_KERNEL_AUTO);
+
+/// Like transformPoints, but divides by w afterwards. Used for matrices that are not affine.
+void transformPointsProjective(const float * m, float * data, size_t count);
+
+/**
+ * Transforms count directions of dim floats (3 or 4) by the upper left 3x3
+ * part of m. A fourth component, like the handedness of a tangent, is left untouched.
+ **/
+void transformDirections(const float * m, float * data, size_t count, unsigned int dim, TransformKernel kernel = TRANSFORM_KERNEL_AUTO);
+
+#endif // TRANSFORMKERNELS_H
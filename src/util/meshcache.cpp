@@ -0,0 +1,307 @@
+#include "meshcache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <atomic>
+
+#include "util/debug/trace_exception.h"
+#include "util/debug/logger.h"
+
+struct baked_mesh_header_t {
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t layout;
+
+  uint32_t vertexCount;
+  uint32_t stride;
+  uint32_t indexCount;
+  uint32_t indexSize;
+
+  uint32_t elementCount;
+  uint32_t padding;
+
+};
+
+struct baked_mesh_element_t {
+
+  char name[BAKED_MESH_NAME_LENGTH];
+  uint32_t offset;
+  uint32_t type;
+
+};
+
+BakedMesh::BakedMesh(std::string fname) : file(fname) {
+
+  const uint8_t * data = file.getData();
+  size_t size = file.getSize();
+
+  if (size < sizeof(baked_mesh_header_t))
+    throw dbg::trace_exception(std::string("Baked mesh too small: ").append(fname));
+
+  baked_mesh_header_t header;
+  memcpy(&header, data, sizeof(baked_mesh_header_t));
+
+  if (header.magic != BAKED_MESH_MAGIC || header.version != BAKED_MESH_VERSION)
+    throw dbg::trace_exception(std::string("Incorrect header for baked mesh: ").append(fname));
+
+  size_t offset = sizeof(baked_mesh_header_t);
+  size_t expected = offset + header.elementCount * sizeof(baked_mesh_element_t) + (size_t) header.vertexCount * header.stride + (size_t) header.indexCount * header.indexSize;
+
+  if (size != expected)
+    throw dbg::trace_exception(std::string("Baked mesh has the wrong size: ").append(fname));
+
+  elements = std::vector<InterleaveElement>(header.elementCount);
+  types = std::vector<VertexAttributeType>(header.elementCount);
+
+  for (unsigned int i = 0; i < header.elementCount; ++i) {
+
+    baked_mesh_element_t element;
+    memcpy(&element, data + offset, sizeof(baked_mesh_element_t));
+    offset += sizeof(baked_mesh_element_t);
+
+    element.name[BAKED_MESH_NAME_LENGTH-1] = 0;
+
+    elements[i].attributeName = element.name;
+    elements[i].offset = element.offset;
+    types[i] = (VertexAttributeType) element.type;
+
+  }
+
+  vertexCount = header.vertexCount;
+  stride = header.stride;
+  indexCount = header.indexCount;
+  indexSize = header.indexSize;
+
+  vertexData = data + offset;
+  indexData = vertexData + (size_t) vertexCount * stride;
+
+}
+
+BakedMesh::~BakedMesh() {
+
+}
+
+const uint8_t * BakedMesh::getVertexData() {
+  return vertexData;
+}
+
+size_t BakedMesh::getVertexDataSize() {
+  return (size_t) vertexCount * stride;
+}
+
+uint32_t BakedMesh::getVertexCount() {
+  return vertexCount;
+}
+
+uint32_t BakedMesh::getStride() {
+  return stride;
+}
+
+const uint8_t * BakedMesh::getIndexData() {
+  return indexData;
+}
+
+size_t BakedMesh::getIndexDataSize() {
+  return (size_t) indexCount * indexSize;
+}
+
+uint32_t BakedMesh::getIndexCount() {
+  return indexCount;
+}
+
+uint32_t BakedMesh::getIndexSize() {
+  return indexSize;
+}
+
+const std::vector<InterleaveElement> & BakedMesh::getElements() {
+  return elements;
+}
+
+const std::vector<VertexAttributeType> & BakedMesh::getTypes() {
+  return types;
+}
+
+uint64_t MeshCache::hash(const void * data, size_t length, uint64_t seed) {
+
+  const uint64_t prime = 0x100000001b3;
+  const uint8_t * bytes = (const uint8_t *) data;
+
+  uint64_t h = seed;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(uint64_t));
+    h = (h ^ word) * prime;
+  }
+
+  for (; i < length; ++i)
+    h = (h ^ bytes[i]) * prime;
+
+  /// Word-wise FNV mixes the high bits poorly, finish with a full avalanche.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccd;
+  h ^= h >> 33;
+
+  return h;
+
+}
+
+static std::string toHex(uint64_t value) {
+
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%016lx", (unsigned long) value);
+  return std::string(buffer);
+
+}
+
+std::string MeshCache::sourceKey(const void * data, size_t length) {
+  return toHex(hash(data, length)).append("-").append(toHex(length));
+}
+
+std::string MeshCache::subKey(std::string key, std::string name) {
+
+  if (key.empty())
+    return key;
+
+  return key.append("-").append(name);
+
+}
+
+std::string MeshCache::transformKey(std::string key, Math::Matrix<4,4,float> m) {
+
+  if (key.empty())
+    return key;
+
+  /// The columns of the matrix are its images of the unit vectors.
+  float data[16];
+  for (unsigned int i = 0; i < 4; ++i) {
+
+    float unit[4] = {0, 0, 0, 0};
+    unit[i] = 1;
+
+    Math::Vector<4, float> column = m * Math::Vector<4, float>(unit);
+
+    for (unsigned int j = 0; j < 4; ++j)
+      data[i * 4 + j] = column[j];
+
+  }
+
+  return key.append("-t").append(toHex(hash(data, sizeof(data))));
+
+}
+
+uint64_t MeshCache::layoutHash(const std::vector<InputDescription> & inputs) {
+
+  uint64_t h = hash(nullptr, 0, BAKED_MESH_VERSION);
+
+  for (const InputDescription & input : inputs) {
+    h = hash(input.attributeName.c_str(), input.attributeName.length() + 1, h);
+    h = hash(&input.location, sizeof(input.location), h);
+  }
+
+  return h;
+
+}
+
+std::string MeshCache::getFileName(std::string key, uint64_t layout) {
+  return std::string(MESH_CACHE_DIR).append("/").append(key).append("-").append(toHex(layout)).append(".bmesh");
+}
+
+std::string MeshCache::getMarkerName(std::string key) {
+  return std::string(MESH_CACHE_DIR).append("/").append(key).append("-v").append(std::to_string(BAKED_MESH_VERSION)).append(".baked");
+}
+
+bool MeshCache::contains(std::string key) {
+
+  if (key.empty())
+    return false;
+
+  struct stat info;
+  return !stat(getMarkerName(key).c_str(), &info);
+
+}
+
+std::shared_ptr<BakedMesh> MeshCache::find(std::string key, uint64_t layout) {
+
+  if (key.empty())
+    return nullptr;
+
+  std::string fname = getFileName(key, layout);
+
+  if (access(fname.c_str(), R_OK))
+    return nullptr;
+
+  try {
+    return std::make_shared<BakedMesh>(fname);
+  } catch (std::exception & e) {
+    lerr << "Discarding baked mesh " << fname << ": " << e.what() << std::endl;
+    remove(fname.c_str());
+    return nullptr;
+  }
+
+}
+
+void MeshCache::store(std::string key, uint64_t layout, const std::vector<InterleaveElement> & elements, const std::vector<VertexAttributeType> & types, uint32_t stride, uint32_t vertexCount,
+		      const std::vector<uint8_t> & vertexData, const std::vector<uint8_t> & indexData, uint32_t indexSize, uint32_t indexCount) {
+
+  if (key.empty())
+    return;
+
+  /// Both levels are created, existing directories are no error.
+  mkdir("cache", 0755);
+  mkdir(MESH_CACHE_DIR, 0755);
+
+  baked_mesh_header_t header = {};
+  header.magic = BAKED_MESH_MAGIC;
+  header.version = BAKED_MESH_VERSION;
+  header.layout = layout;
+  header.vertexCount = vertexCount;
+  header.stride = stride;
+  header.indexCount = indexCount;
+  header.indexSize = indexSize;
+  header.elementCount = elements.size();
+
+  std::string fname = getFileName(key, layout);
+
+  /// Loaders may bake the same entry at once, each writes its own temporary file.
+  static std::atomic<uint32_t> tmpCounter(0);
+  std::string tmpName = std::string(fname).append(".").append(std::to_string(getpid())).append(".").append(std::to_string(tmpCounter++));
+
+  std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    lerr << "Unable to write baked mesh " << fname << std::endl;
+    return;
+  }
+
+  file.write((const char *) &header, sizeof(header));
+
+  for (unsigned int i = 0; i < elements.size(); ++i) {
+
+    baked_mesh_element_t element = {};
+    strncpy(element.name, elements[i].attributeName.c_str(), BAKED_MESH_NAME_LENGTH-1);
+    element.offset = elements[i].offset;
+    element.type = types[i];
+
+    file.write((const char *) &element, sizeof(element));
+
+  }
+
+  file.write((const char *) vertexData.data(), vertexData.size());
+  file.write((const char *) indexData.data(), indexData.size());
+  file.close();
+
+  if (!file || rename(tmpName.c_str(), fname.c_str())) {
+    lerr << "Unable to write baked mesh " << fname << std::endl;
+    remove(tmpName.c_str());
+    return;
+  }
+
+  /// The marker is empty, concurrent writers just truncate it again.
+  std::ofstream marker(getMarkerName(key), std::ios::binary | std::ios::trunc);
+
+}
@@ -0,0 +1,101 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "util/mesh.h"
+#include "util/mappedfile.h"
+
+#define MESH_CACHE_DIR "cache/meshes"
+#define BAKED_MESH_MAGIC 0x48534D42
+/**
+ * Raised with every change of the baked content, including the mesh
+ * processing before baking: 2 for 32 bit indices, 3 for packed attributes,
+ * 4 for the new tangents, 5 for welding.
+ **/
+#define BAKED_MESH_VERSION 5
+#define BAKED_MESH_NAME_LENGTH 48
+
+/**
+ * GPU-ready vertex and index data of a mesh for one shader input layout,
+ * read from the mesh cache. The data points into the mapped cache file.
+ **/
+class BakedMesh {
+
+public:
+
+  BakedMesh(std::string fname);
+  virtual ~BakedMesh();
+
+  const uint8_t * getVertexData();
+  size_t getVertexDataSize();
+  uint32_t getVertexCount();
+  uint32_t getStride();
+
+  const uint8_t * getIndexData();
+  size_t getIndexDataSize();
+  uint32_t getIndexCount();
+  uint32_t getIndexSize();
+
+  const std::vector<InterleaveElement> & getElements();
+  const std::vector<VertexAttributeType> & getTypes();
+
+private:
+
+  MappedFile file;
+
+  uint32_t vertexCount;
+  uint32_t stride;
+  uint32_t indexCount;
+  uint32_t indexSize;
+
+  const uint8_t * vertexData;
+  const uint8_t * indexData;
+
+  std::vector<InterleaveElement> elements;
+  std::vector<VertexAttributeType> types;
+
+};
+
+/**
+ * On-disk cache of baked meshes. Entries are keyed by a string naming the
+ * source content (see Mesh::getCacheKey) and a hash of the shader input
+ * layout, so a changed source file or shader never hits a stale entry.
+ * The layout hash is seeded with BAKED_MESH_VERSION, entries of older
+ * versions are never found.
+ **/
+class MeshCache {
+
+public:
+
+  /// FNV-1a over 64 bit words, fast enough to hash whole source files.
+  static uint64_t hash(const void * data, size_t length, uint64_t seed = 0xcbf29ce484222325);
+
+  static std::string sourceKey(const void * data, size_t length);
+  static std::string subKey(std::string key, std::string name);
+  /// Empty keys stay empty, meshes without a source are never cached.
+  static std::string transformKey(std::string key, Math::Matrix<4,4,float> m);
+
+  static uint64_t layoutHash(const std::vector<InputDescription> & inputs);
+
+  /// True if any layout of the key has been baked with the current version.
+  static bool contains(std::string key);
+
+  /// Returns nullptr if the entry is missing or unreadable.
+  static std::shared_ptr<BakedMesh> find(std::string key, uint64_t layout);
+
+  static void store(std::string key, uint64_t layout, const std::vector<InterleaveElement> & elements, const std::vector<VertexAttributeType> & types, uint32_t stride, uint32_t vertexCount,
+		    const std::vector<uint8_t> & vertexData, const std::vector<uint8_t> & indexData, uint32_t indexSize, uint32_t indexCount);
+
+private:
+
+  static std::string getFileName(std::string key, uint64_t layout);
+  /// Written next to the first entry of a key, so contains only has to check a single file.
+  static std::string getMarkerName(std::string key);
+
+};
+
+#endif // MESHCACHE_H
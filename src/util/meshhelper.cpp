@@ -3,7 +3,15 @@
 #include <mathutils/vector.h>
 #include <mathutils/quaternion.h>
 
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+#include <limits>
+#include <cstring>
+
 #include "simplexnoise.h"
+#include "jobsystem.h"
+#include "util/debug/trace_exception.h"
 
 void printIndexVector(std::vector<uint16_t> & indices) {
 
@@ -15,24 +23,10 @@ void printIndexVector(std::vector<uint16_t> & indices) {
 
 }
 
-void MeshHelper::computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint16_t> & indices) {
-
-    std::vector<uint32_t> tmp(indices.size());
-
-    for (unsigned int i = 0; i < indices.size(); ++i)
-        tmp[i] = indices[i];
-
-    computeTangents(verts, tmp);
-
-}
-
-void MeshHelper::computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint32_t> & indices) {
-
-    std::vector<bool> hasValue(verts.size());
+template <typename I> static void computeVertexTangents(std::vector<Model::Vertex> & verts, const std::vector<I> & indices) {
 
     for (unsigned int i = 0; i < verts.size(); ++i) {
         verts[i].tangent = glm::vec3(0,0,0);
-        hasValue[i] = false;
     }
 
     for (unsigned int i = 0; i < indices.size() / 3; ++i) {
@@ -64,6 +58,167 @@ void MeshHelper::computeTangents(std::vector<Model::Vertex> & verts, std::vector
 
 }
 
+void MeshHelper::computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint16_t> & indices) {
+
+    computeVertexTangents(verts, indices);
+
+}
+
+void MeshHelper::computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint32_t> & indices) {
+
+    computeVertexTangents(verts, indices);
+
+}
+
+/**
+ * Adds the tangent and bitangent direction of the triangles [begin, end) to
+ * the 6 floats of sum belonging to each of their vertices. The directions
+ * are not normalized, so larger triangles weigh more.
+ **/
+static void accumulateTangents(const float * positions, const float * uvs, const uint32_t * indices, size_t begin, size_t end, size_t vertexCount, float * sum) {
+
+    for (size_t i = begin; i < end; ++i) {
+
+        uint32_t i0 = indices[i*3];
+        uint32_t i1 = indices[i*3+1];
+        uint32_t i2 = indices[i*3+2];
+
+        if (i0 >= vertexCount || i1 >= vertexCount || i2 >= vertexCount)
+            continue;
+
+        const float * p0 = positions + i0 * 3;
+        const float * p1 = positions + i1 * 3;
+        const float * p2 = positions + i2 * 3;
+
+        float du1 = uvs[i1*2]   - uvs[i0*2];
+        float dv1 = uvs[i1*2+1] - uvs[i0*2+1];
+        float du2 = uvs[i2*2]   - uvs[i0*2];
+        float dv2 = uvs[i2*2+1] - uvs[i0*2+1];
+
+        float det = du1 * dv2 - du2 * dv1;
+
+        /// Triangles without an uv area give no direction.
+        if (!std::isnormal(det))
+            continue;
+
+        float r = 1.0f / det;
+
+        float dir[6];
+        for (unsigned int k = 0; k < 3; ++k) {
+
+            float e1 = p1[k] - p0[k];
+            float e2 = p2[k] - p0[k];
+
+            dir[k]     = (dv2 * e1 - dv1 * e2) * r;
+            dir[k + 3] = (du1 * e2 - du2 * e1) * r;
+
+        }
+
+        for (uint32_t v : {i0, i1, i2}) {
+            float * s = sum + (size_t) v * 6;
+            for (unsigned int k = 0; k < 6; ++k)
+                s[k] += dir[k];
+        }
+
+    }
+
+}
+
+/// Makes the tangent t orthogonal to n and writes it with the handedness of the bitangent b.
+static void finishTangent(const float * n, float * t, const float * b, float * dst) {
+
+    if (n) {
+        float nt = n[0] * t[0] + n[1] * t[1] + n[2] * t[2];
+        for (unsigned int k = 0; k < 3; ++k)
+            t[k] -= n[k] * nt;
+    }
+
+    float l = std::sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+
+    if (l > 1e-12f) {
+
+        dst[0] = t[0] / l;
+        dst[1] = t[1] / l;
+        dst[2] = t[2] / l;
+
+    } else if (n) {
+
+        /// Any direction orthogonal to the normal, for vertices without usable uvs.
+        float a[3] = {0, 0, 0};
+        a[std::fabs(n[0]) < 0.9f ? 0 : 1] = 1;
+
+        float c[3] = {n[1] * a[2] - n[2] * a[1], n[2] * a[0] - n[0] * a[2], n[0] * a[1] - n[1] * a[0]};
+        l = std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+
+        dst[0] = c[0] / l;
+        dst[1] = c[1] / l;
+        dst[2] = c[2] / l;
+
+    } else {
+
+        dst[0] = 1;
+        dst[1] = 0;
+        dst[2] = 0;
+
+    }
+
+    dst[3] = 1;
+
+    if (n) {
+        float c[3] = {n[1] * dst[2] - n[2] * dst[1], n[2] * dst[0] - n[0] * dst[2], n[0] * dst[1] - n[1] * dst[0]};
+        if (c[0] * b[0] + c[1] * b[1] + c[2] * b[2] < 0)
+            dst[3] = -1;
+    }
+
+}
+
+void MeshHelper::computeTangents(const float * positions, const float * uvs, const float * normals, size_t vertexCount, const uint32_t * indices, size_t indexCount, float * tangents) {
+
+    size_t triangleCount = uvs ? indexCount / 3 : 0;
+    size_t sliceSize = vertexCount * 6;
+
+    int threadCount = 1;
+
+    if (triangleCount >= TANGENT_PARALLEL_TRIANGLES && !JobSystem::inWorker())
+        threadCount = std::max(1, std::min({omp_get_max_threads(), (int) (triangleCount / TANGENT_PARALLEL_TRIANGLES),
+                                             (int) (TANGENT_SCRATCH_BYTES / (sliceSize * sizeof(float)))}));
+
+    /// One slice of sums per thread, freed with the call so a single large mesh does not keep it.
+    std::vector<float> scratch(sliceSize * threadCount);
+    float * sums = scratch.data();
+
+    #pragma omp parallel num_threads(threadCount) if(threadCount > 1)
+    {
+
+        int thread = omp_get_thread_num();
+        int threads = omp_get_num_threads();
+
+        float * sum = sums + thread * sliceSize;
+
+        if (triangleCount)
+            accumulateTangents(positions, uvs, indices, triangleCount * thread / threads, triangleCount * (thread + 1) / threads, vertexCount, sum);
+
+        #pragma omp barrier
+
+        #pragma omp for schedule(static)
+        for (size_t v = 0; v < vertexCount; ++v) {
+
+            float total[6] = {0, 0, 0, 0, 0, 0};
+
+            for (int j = 0; j < threads; ++j) {
+                const float * s = sums + j * sliceSize + v * 6;
+                for (unsigned int k = 0; k < 6; ++k)
+                    total[k] += s[k];
+            }
+
+            finishTangent(normals ? normals + v * 3 : nullptr, total, total + 3, tangents + v * 4);
+
+        }
+
+    }
+
+}
+
 using namespace Math;
 
 MeshHelper::ModelInfo MeshHelper::createHexagonFromCenter(Math::Vector<3, float> center, Math::Vector<3, float> normal, float radius) {
@@ -123,60 +278,149 @@ MeshHelper::ModelInfo MeshHelper::createHexagonFromCenter(Math::Vector<3, float>
 
 }
 
-void removeDoubles(MeshHelper::ModelInfo & info, float precision) {
+/// Cell coordinates of a position in a grid of the given cell size, a size of 0 uses the bit pattern.
+static inline void weldCell(const float * p, float cellSize, int64_t * cell) {
 
-    unsigned int movedVerts = 0;
+    for (unsigned int k = 0; k < 3; ++k) {
+        if (cellSize > 0) {
+            cell[k] = (int64_t) std::floor((double) p[k] / cellSize);
+        } else {
+            uint32_t bits;
+            memcpy(&bits, p + k, sizeof(bits));
+            cell[k] = bits;
+        }
+    }
 
-    for (unsigned int i = 0; i < info.verts.size() - movedVerts; ++i) {
+}
 
-        for (unsigned int j = i+1; j < info.verts.size() - movedVerts; ++j) {
+static inline size_t weldBucket(const int64_t * cell, size_t mask) {
 
-            glm::vec3 delta = info.verts[i].pos - info.verts[j].pos;
-            float dist = sqrt(delta.x * delta.x + delta.y * delta.y + delta.z * delta.z);
-            if (dist < precision) {
+    uint64_t h = (uint64_t) cell[0] * 0x9E3779B185EBCA87ull;
+    h ^= (uint64_t) cell[1] * 0xC2B2AE3D27D4EB4Full;
+    h ^= (uint64_t) cell[2] * 0x165667B19E3779F9ull;
+    h ^= h >> 29;
 
-                unsigned int toReplace = j;
-                unsigned int lastVert = info.verts.size() - movedVerts - 1;
+    return h & mask;
 
-                unsigned int replaceBy = i;
+}
 
-                info.verts[j] = info.verts[lastVert];
+size_t MeshHelper::weldVertices(const float * positions, size_t vertexCount, float epsilon, uint32_t * remap, std::function<bool(uint32_t, uint32_t)> sameVertex) {
 
-                for (unsigned int k = 0; k < info.indices.size(); ++k) {
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
 
-                    if (info.indices[k] == toReplace) {
+    size_t bucketCount = 1;
+    while (bucketCount < vertexCount * 2)
+        bucketCount <<= 1;
 
-                        info.indices[k] = replaceBy;
+    /// Every bucket holds a list of the kept vertices whose cell hashes to it, linked through next.
+    std::vector<uint32_t> buckets(bucketCount, none);
+    std::vector<uint32_t> next(vertexCount, none);
 
-                    } else if (info.indices[k] == lastVert) {
+    /// Cells are several epsilon wide, so only positions near a cell border need to look at the neighbouring cells.
+    float cellSize = std::max(epsilon, 0.0f) * WELD_CELL_SCALE;
+    float eps2 = epsilon * epsilon;
 
-                        info.indices[k] = toReplace;
+    size_t uniqueCount = 0;
 
-                    }
+    for (size_t i = 0; i < vertexCount; ++i) {
 
-                }
+        const float * p = positions + i * 3;
 
-                //printIndexVector(info.indices);
+        int64_t cell[3];
+        weldCell(p, cellSize, cell);
 
-                movedVerts++;
+        int64_t side[3] = {0, 0, 0};
+        if (cellSize > 0) {
+            for (unsigned int k = 0; k < 3; ++k) {
+                double offset = p[k] - cell[k] * (double) cellSize;
+                if (offset <= epsilon)
+                    side[k] = -1;
+                else if (cellSize - offset <= epsilon)
+                    side[k] = 1;
+            }
+        }
+
+        uint32_t match = none;
+
+        for (unsigned int c = 0; c < 8 && match == none; ++c) {
+
+            if ((c & 1 && !side[0]) || (c & 2 && !side[1]) || (c & 4 && !side[2]))
+                continue;
+
+            int64_t candidate[3] = {cell[0] + ((c & 1) ? side[0] : 0), cell[1] + ((c & 2) ? side[1] : 0), cell[2] + ((c & 4) ? side[2] : 0)};
+
+            for (uint32_t j = buckets[weldBucket(candidate, bucketCount - 1)]; j != none; j = next[j]) {
+
+                const float * q = positions + (size_t) j * 3;
+
+                float dx = p[0] - q[0];
+                float dy = p[1] - q[1];
+                float dz = p[2] - q[2];
+
+                bool close = (cellSize > 0) ? (dx * dx + dy * dy + dz * dz <= eps2) : (p[0] == q[0] && p[1] == q[1] && p[2] == q[2]);
+
+                if (close && (!sameVertex || sameVertex(j, i))) {
+                    match = j;
+                    break;
+                }
 
             }
 
         }
 
+        if (match != none) {
+            remap[i] = remap[match];
+            continue;
+        }
+
+        remap[i] = uniqueCount++;
+
+        size_t bucket = weldBucket(cell, bucketCount - 1);
+        next[i] = buckets[bucket];
+        buckets[bucket] = i;
+
+    }
+
+    return uniqueCount;
+
+}
+
+void removeDoubles(MeshHelper::ModelInfo & info, float precision) {
+
+    std::vector<float> positions(info.verts.size() * 3);
+    for (unsigned int i = 0; i < info.verts.size(); ++i) {
+        positions[i*3]   = info.verts[i].pos.x;
+        positions[i*3+1] = info.verts[i].pos.y;
+        positions[i*3+2] = info.verts[i].pos.z;
     }
 
-    info.verts.resize(info.verts.size() - movedVerts + 1);
+    std::vector<uint32_t> remap(info.verts.size());
+    size_t uniqueCount = MeshHelper::weldVertices(positions.data(), info.verts.size(), precision, remap.data());
+
+    /// Kept vertices are numbered in order, so they can be moved to the front in place.
+    size_t kept = 0;
+    for (unsigned int i = 0; i < info.verts.size(); ++i)
+        if (remap[i] == kept)
+            info.verts[kept++] = info.verts[i];
+
+    info.verts.resize(uniqueCount);
+
+    for (uint16_t & index : info.indices)
+        index = remap[index];
 
 }
 
 /**
 Adds data2 into data1
 
-Verts with distance smaller than precision will be merged into one.
+The shared vertices are not welded, call removeDoubles once after all
+pieces are merged. Throws if the vertices no longer fit 16 bit indices.
 
 **/
-void MeshHelper::mergeMeshData(MeshHelper::ModelInfo & data1, MeshHelper::ModelInfo & data2, float precision) {
+void MeshHelper::mergeMeshData(MeshHelper::ModelInfo & data1, MeshHelper::ModelInfo & data2) {
+
+    if (data1.verts.size() + data2.verts.size() > (size_t) std::numeric_limits<uint16_t>::max() + 1)
+        throw dbg::trace_exception(std::string("Merged mesh exceeds 16 bit indices with ").append(std::to_string(data1.verts.size() + data2.verts.size())).append(" vertices"));
 
     uint16_t index = data1.verts.size();
     for (const Model::Vertex & v : data2.verts) {
@@ -187,8 +431,6 @@ void MeshHelper::mergeMeshData(MeshHelper::ModelInfo & data1, MeshHelper::ModelI
         data1.indices.push_back(i + index);
     }
 
-    //removeDoubles(data1, precision);
-
 }
 
 void applyNoise(MeshHelper::ModelInfo & model, std::function<float(float, float)> func) {
@@ -279,13 +521,13 @@ MeshHelper::ModelInfo MeshHelper::createHexagonPlane(int amount, float radius) {
             lout << hexPos << " -> " << cartPos << std::endl;
 
             ModelInfo tmp = createHexagonFromCenter(cartPos, Vector<3, float>(normal.data()), radius);
-            mergeMeshData(data, tmp, 0.01);
+            mergeMeshData(data, tmp);
 
         }
 
     }
 
-    removeDoubles(data, 0.001);
+    removeDoubles(data, 0.01);
 
     printIndexVector(data.indices);
     lout << data.verts.size() <<  " verts for " << (data.indices.size() / 18) << " hexagons (" << ((double)data.verts.size() / (double) (data.indices.size() / 18)) << " verts / hexagon)" << std::endl;
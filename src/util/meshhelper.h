@@ -4,6 +4,15 @@
 #include "../render/model.h"
 #include <mathutils/vector.h>
 
+#include <functional>
+
+/// Meshes with fewer triangles get their tangents computed on one thread.
+#define TANGENT_PARALLEL_TRIANGLES 16384
+/// Upper bound for the per thread sums, larger meshes use fewer threads.
+#define TANGENT_SCRATCH_BYTES (64 << 20)
+/// Width of the hash grid cells used for welding, in multiples of the epsilon. Has to be at least 2.
+#define WELD_CELL_SCALE 8
+
 class MeshHelper
 {
     public:
@@ -18,9 +27,29 @@ class MeshHelper
 
         static void computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint32_t> & indices);
         static void computeTangents(std::vector<Model::Vertex> & verts, std::vector<uint16_t> & indices);
+
+        /**
+         * Computes tangents from packed positions, uvs and normals (3, 2 and 3
+         * floats per vertex) by summing the directions of all adjacent
+         * triangles. Writes 4 floats per vertex, w is the handedness of the
+         * bitangent. uvs and normals may be null. Large meshes are split into
+         * triangle ranges with per thread sums, which are added up afterwards.
+         * Only callers outside of the job system (tools, the main thread) get
+         * the threads, meshes loaded by a job run on that job's thread.
+         **/
+        static void computeTangents(const float * positions, const float * uvs, const float * normals, size_t vertexCount, const uint32_t * indices, size_t indexCount, float * tangents);
+        /**
+         * Finds vertices whose positions (3 floats each) lie within epsilon
+         * of an earlier kept vertex, using a hash grid. If given, sameVertex(kept, i)
+         * has to agree as well. remap[i] receives the new index of every vertex;
+         * kept vertices are numbered in order of appearance. An epsilon of 0 only
+         * merges identical positions. Returns the number of kept vertices.
+         **/
+        static size_t weldVertices(const float * positions, size_t vertexCount, float epsilon, uint32_t * remap, std::function<bool(uint32_t, uint32_t)> sameVertex = nullptr);
+
         static ModelInfo createHexagonPlane(int amount, float radius);
         static ModelInfo createHexagonFromCenter(Math::Vector<3, float> center, Math::Vector<3, float> normal, float radius);
-        static void mergeMeshData(ModelInfo & data1, ModelInfo & data2, float precision);
+        static void mergeMeshData(ModelInfo & data1, ModelInfo & data2);
         static float noise(float x, float y);
 
     protected:
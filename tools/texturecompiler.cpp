@@ -0,0 +1,177 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <tga.h>
+
+#include "util/image/png.h"
+#include "util/image/compressedimage.h"
+
+/**
+ * Bakes PNG and TGA textures into block compressed images with their full
+ * mip chain. The texture loader picks up the baked file next to the source
+ * (name.png.btex) as long as it is newer than the source.
+ *
+ * Without a format, images with transparent pixels become BC3 and opaque
+ * ones BC1. BC5 keeps only red and green and is meant for normal maps.
+ *
+ * Mips are filtered with a Kaiser window, BC1 and BC3 images in linear
+ * light as sRGB colors. Pass -linear for data textures like roughness maps
+ * and -box for the filter used at load time.
+ *
+ * Usage: texturecompiler [-linear] [-box] <image.png|image.tga> [bc1|bc3|bc5] [output]
+ **/
+
+static bool hasSuffix(const std::string & str, const std::string & suffix) {
+  return str.length() >= suffix.length() && !str.compare(str.length() - suffix.length(), suffix.length(), suffix);
+}
+
+static bool loadPNG(std::string fname, std::vector<uint8_t> & rgba, uint32_t & width, uint32_t & height) {
+
+  FILE * file = fopen(fname.c_str(), "rb");
+  if (!file) {
+    fprintf(stderr, "Unable to open %s\n", fname.c_str());
+    return false;
+  }
+
+  png_image_info_t info;
+  int result = pngReadHeader(file, &info);
+
+  if (result == PNG_OK) {
+    rgba.resize((size_t) info.width * info.height * 4);
+    result = pngDecodeRGBA(file, &info, rgba.data(), (size_t) info.width * 4);
+  }
+
+  fclose(file);
+
+  if (result != PNG_OK) {
+    fprintf(stderr, "Unable to load PNG %s: %s\n", fname.c_str(), pngGetErrorString(result));
+    return false;
+  }
+
+  width = info.width;
+  height = info.height;
+
+  return true;
+
+}
+
+static bool loadTGA(std::string fname, std::vector<uint8_t> & rgba, uint32_t & width, uint32_t & height) {
+
+  TGA_FILE * tgaImage = tgaOpen(fname.c_str());
+  if (!tgaImage) {
+    fprintf(stderr, "Unable to open %s\n", fname.c_str());
+    return false;
+  }
+
+  int w, h;
+  tgaGetSize(tgaImage, &w, &h);
+  uint8_t * rawData = tgaGetColorDataRGBA(tgaImage);
+
+  rgba = std::vector<uint8_t>(rawData, rawData + (size_t) w * h * 4);
+
+  free(rawData);
+  tgaClose(tgaImage);
+
+  width = w;
+  height = h;
+
+  return true;
+
+}
+
+int main(int argc, char ** argv) {
+
+  bool linear = false;
+  mip_filter filter = MIP_FILTER_KAISER;
+  std::vector<std::string> args;
+
+  for (int i = 1; i < argc; ++i) {
+
+    std::string arg = argv[i];
+
+    if (arg == "-linear")
+      linear = true;
+    else if (arg == "-box")
+      filter = MIP_FILTER_BOX;
+    else
+      args.push_back(arg);
+
+  }
+
+  if (args.empty() || args.size() > 3) {
+    fprintf(stderr, "Usage: texturecompiler [-linear] [-box] <image.png|image.tga> [bc1|bc3|bc5] [output]\n");
+    return 1;
+  }
+
+  std::string fname = args[0];
+  std::string formatName = args.size() >= 2 ? args[1] : "";
+  std::string output = args.size() >= 3 ? args[2] : fname + COMPRESSED_IMAGE_EXTENSION;
+
+  std::vector<uint8_t> rgba;
+  uint32_t width, height;
+  bool loaded;
+
+  if (hasSuffix(fname, ".png"))
+    loaded = loadPNG(fname, rgba, width, height);
+  else if (hasSuffix(fname, ".tga"))
+    loaded = loadTGA(fname, rgba, width, height);
+  else {
+    fprintf(stderr, "Unknown image type: %s\n", fname.c_str());
+    return 1;
+  }
+
+  if (!loaded)
+    return 1;
+
+  if (!width || !height) {
+    fprintf(stderr, "Empty image: %s\n", fname.c_str());
+    return 1;
+  }
+
+  bcn_format format;
+
+  if (formatName == "bc1")
+    format = BCN_FORMAT_BC1;
+  else if (formatName == "bc3")
+    format = BCN_FORMAT_BC3;
+  else if (formatName == "bc5")
+    format = BCN_FORMAT_BC5;
+  else if (formatName.empty()) {
+
+    format = BCN_FORMAT_BC1;
+    for (size_t i = 3; i < rgba.size(); i += 4) {
+      if (rgba[i] != 255) {
+        format = BCN_FORMAT_BC3;
+        break;
+      }
+    }
+
+  } else {
+    fprintf(stderr, "Unknown format %s, expected bc1, bc3 or bc5\n", formatName.c_str());
+    return 1;
+  }
+
+  /// Normal maps are never colors.
+  mip_color_space colorSpace = (linear || format == BCN_FORMAT_BC5) ? MIP_COLOR_SPACE_LINEAR : MIP_COLOR_SPACE_SRGB;
+
+  try {
+    CompressedImage::write(output, format, rgba.data(), width, height, filter, colorSpace);
+  } catch (std::exception & e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  CompressedImage image(output);
+  size_t sourceSize = 0;
+  for (const compressed_image_level_t & level : image.getLevels())
+    sourceSize += (size_t) level.width * level.height * 4;
+
+  printf("%s: %u x %u, BC%d, %zu levels, %.1f kB (%.1f kB as RGBA)\n", output.c_str(), width, height, (int) format,
+	 image.getLevels().size(), image.getDataSize() / 1024.0, sourceSize / 1024.0);
+
+  return 0;
+
+}